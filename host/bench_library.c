@@ -0,0 +1,111 @@
+/*
+ *	Cost of the image library operations as the number of images grows.
+ *
+ *	usage: bench_library <image.mcr> [image counts...]
+ *
+ *	For each count the FatFs root is filled with that many images spread over
+ *	the MCRnnn folders used by memcard_manager_create() (sparse files, only the
+ *	directory entries matter), then the index is built by walking the folders,
+ *	reloaded from the catalog and used for create/next/prev. SD opens per create
+ *	are counted as well: each one is a linear search of a FAT directory on hardware.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "host_sim.h"
+#include "ff.h"
+#include "memcard_manager.h"
+
+#define CREATES		20
+#define STEPS		1000
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static int populate(uint32_t count) {
+	char path[256];
+	for(uint32_t i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/MCR%03u", host_ff_get_root(), (unsigned) (i / MC_SHARD_SIZE));
+		if(i % MC_SHARD_SIZE == 0 && mkdir(path, 0777))
+			return -1;
+		snprintf(path, sizeof(path), "%s/MCR%03u/%u.MCR", host_ff_get_root(), (unsigned) (i / MC_SHARD_SIZE), (unsigned) i);
+		FILE* f = fopen(path, "wb");
+		if(!f || ftruncate(fileno(f), MC_SIZE)) {
+			if(f)
+				fclose(f);
+			return -1;
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+/* Average time of one next (or prev) switch over STEPS images, wrapping at the ends of the list */
+static double walk_us(bool forward) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1], other[MAX_MC_FILENAME_LEN + 1];
+	memcard_manager_get(forward ? 0 : memcard_manager_count() - 1, name);
+	uint64_t start = now_ns();
+	for(uint32_t i = 0; i < STEPS; i++) {
+		uint32_t status = forward ? memcard_manager_get_next(name, other) : memcard_manager_get_prev(name, other);
+		if(status != MM_OK)
+			memcard_manager_get(forward ? 0 : memcard_manager_count() - 1, other);
+		strcpy(name, other);
+	}
+	return (double) (now_ns() - start) / STEPS / 1000;
+}
+
+static int bench(const char* image_path, uint32_t count) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	if(host_sim_init(image_path) != MC_OK || populate(count))
+		return -1;
+	f_unlink("MemcardCatalog.dat");
+
+	uint64_t start = now_ns();
+	if(memcard_manager_init() != MM_OK)
+		return -1;
+	double scan_ms = (double) (now_ns() - start) / 1000000;
+
+	uint32_t readdirs = host_ff_stats.readdirs;
+	start = now_ns();
+	if(memcard_manager_init() != MM_OK || host_ff_stats.readdirs != readdirs)
+		return -1;
+	double catalog_ms = (double) (now_ns() - start) / 1000000;
+
+	uint32_t opens = host_ff_stats.opens;
+	start = now_ns();
+	for(uint32_t i = 0; i < CREATES; i++)
+		if(memcard_manager_create(name) != MM_OK)
+			return -1;
+	double create_us = (double) (now_ns() - start) / CREATES / 1000;
+	double create_opens = (double) (host_ff_stats.opens - opens) / CREATES;
+
+	printf("%8u %10.2f %10.2f %10.1f %8.1f %10.2f %10.2f\n", (unsigned) memcard_manager_count(), scan_ms, catalog_ms,
+		create_us, create_opens, walk_us(true), walk_us(false));
+	host_sim_cleanup();
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	static const uint32_t default_counts[] = { 100, 1000, 5000 };
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s <image.mcr> [image counts...]\n", argv[0]);
+		return 2;
+	}
+	printf("%8s %10s %10s %10s %8s %10s %10s\n", "images", "scan ms", "catalog ms", "create us", "opens", "next us", "prev us");
+	uint32_t runs = argc > 2 ? (uint32_t) argc - 2 : sizeof(default_counts) / sizeof(default_counts[0]);
+	for(uint32_t i = 0; i < runs; i++) {
+		uint32_t count = argc > 2 ? (uint32_t) strtoul(argv[i + 2], NULL, 10) : default_counts[i];
+		if(bench(argv[1], count)) {
+			fprintf(stderr, "benchmark with %u images failed\n", (unsigned) count);
+			host_sim_cleanup();
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ *	Per-transaction cost of the memory card protocol engine on the host.
+ *
+ *	usage: bench_protocol <image.mcr> [iterations]
+ *
+ *	Each transaction goes through the same path as on hardware (SEL reset, core1
+ *	relaunch, process_memcard_cmd()), with the PIO FIFOs replaced by the mock bus.
+ *	The figures are host CPU time, useful to compare revisions of the hot path
+ *	rather than as absolute RP2040 timings. +T rows run with the protocol trace on.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "host_sim.h"
+#include "mock_bus.h"
+#include "trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES	1
+static inline uint64_t cycles(void) { return __rdtsc(); }
+#else
+#define HAVE_CYCLES	0
+static inline uint64_t cycles(void) { return 0; }
+#endif
+
+typedef size_t (*build_fn_t)(uint8_t* cmd, uint32_t i);
+
+static uint8_t write_data[MC_SEC_SIZE];
+
+static size_t build_read(uint8_t* cmd, uint32_t i) {
+	return host_sim_build_read(cmd, (uint16_t) (i % MC_SEC_COUNT));
+}
+
+static size_t build_write(uint8_t* cmd, uint32_t i) {
+	uint16_t sector = (uint16_t) (64 + i % (MC_SEC_COUNT - 64));	// keep clear of block 0
+	write_data[0] = (uint8_t) i;
+	return host_sim_build_write(cmd, sector, write_data, true);
+}
+
+static size_t build_id(uint8_t* cmd, uint32_t i) {
+	(void) i;
+	return host_sim_build_id(cmd);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void bench(const char* name, build_fn_t build, uint32_t iterations) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	uint64_t total_ns = 0, total_cycles = 0, min_ns = UINT64_MAX;
+	size_t len = 0;
+	trace_record_t record;
+	for(uint32_t i = 0; i < iterations; i++) {
+		len = build(cmd, i);
+		uint64_t t0 = now_ns();
+		uint64_t c0 = cycles();
+		host_sim_transfer(cmd, NULL, len, out);
+		uint64_t c1 = cycles();
+		uint64_t t1 = now_ns();
+		while(trace_pop(&record, 1))	// drained outside the timed section, as core0 does
+			;
+		total_ns += t1 - t0;
+		total_cycles += c1 - c0;
+		if(t1 - t0 < min_ns)
+			min_ns = t1 - t0;
+	}
+	printf("%-8s %8u %6zu %10.1f %10llu %10.2f", name, iterations, len,
+		(double) total_ns / iterations, (unsigned long long) min_ns, (double) total_ns / iterations / len);
+	if(HAVE_CYCLES)
+		printf(" %12.1f\n", (double) total_cycles / iterations);
+	else
+		printf(" %12s\n", "n/a");
+}
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s <image.mcr> [iterations]\n", argv[0]);
+		return 2;
+	}
+	uint32_t iterations = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10) : 20000;
+	if(host_sim_init(argv[1]) != MC_OK) {
+		fprintf(stderr, "cannot import %s\n", argv[1]);
+		return 2;
+	}
+	printf("%-8s %8s %6s %10s %10s %10s %12s\n", "cmd", "iter", "bytes", "ns/xfer", "min ns", "ns/byte", "cycles/xfer");
+	bench("READ", build_read, iterations);
+	bench("WRITE", build_write, iterations);
+	bench("ID", build_id, iterations);
+	trace_set_output(TRACE_UART);
+	bench("READ+T", build_read, iterations);
+	bench("WRITE+T", build_write, iterations);
+	trace_set_output(TRACE_OFF);
+	host_sim_cleanup();
+	return 0;
+}
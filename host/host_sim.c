@@ -0,0 +1,138 @@
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_sim.h"
+#include "ff.h"
+#include "mock_bus.h"
+#include "trace.h"
+
+static char sim_root[64];
+static bool sim_started;
+
+static int copy_file(const char* from, const char* to) {
+	FILE* in = fopen(from, "rb");
+	FILE* out = in ? fopen(to, "wb") : NULL;
+	char buf[4096];
+	size_t n;
+	int status = (in && out) ? 0 : -1;
+	while(!status && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+		if(fwrite(buf, 1, n, out) != n)
+			status = -1;
+	if(in)
+		fclose(in);
+	if(out)
+		fclose(out);
+	return status;
+}
+
+uint32_t host_sim_init(const char* image_path) {
+	char path[128];
+	if(!sim_root[0]) {
+		snprintf(sim_root, sizeof(sim_root), "/tmp/picomemcard-XXXXXX");
+		if(!mkdtemp(sim_root))
+			return MC_NO_INIT;
+		host_ff_set_root(sim_root);
+	}
+	snprintf(path, sizeof(path), "%s/%s", sim_root, HOST_SIM_IMAGE);
+	if(copy_file(image_path, path))
+		return MC_FILE_OPEN_ERR;
+
+	/* hardware and core0 side state is set up once, like simulate_memory_card() does */
+	if(!sim_started) {
+		uint32_t status = memory_card_init(&mc);
+		if(status != MC_OK)
+			return status;
+		init_pio();
+		init_dma();
+		sim_started = true;
+	}
+	mutex_init(&write_transaction);
+	write_transaction_held = false;
+	request_next_mc = request_prev_mc = request_new_mc = request_game_mc = false;
+	request_next_chan = request_prev_chan = false;
+	first_read_armed = false;
+	trace_set_output(TRACE_OFF);
+	update_mc_name((const uint8_t*) HOST_SIM_IMAGE, 0);
+	return memory_card_import(&mc, (uint8_t*) HOST_SIM_IMAGE);
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+	(void) st; (void) flag; (void) ftw;
+	return remove(path);
+}
+
+void host_sim_cleanup(void) {
+	if(sim_root[0])
+		nftw(sim_root, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+	sim_root[0] = 0;
+}
+
+bool host_sim_read_image(sector_t sector, uint8_t* out, uint32_t count) {
+	char path[128];
+	snprintf(path, sizeof(path), "%s/%s", sim_root, HOST_SIM_IMAGE);
+	FILE* f = fopen(path, "rb");
+	if(!f)
+		return false;
+	bool ok = !fseek(f, (long) sector * MC_SEC_SIZE, SEEK_SET) && fread(out, MC_SEC_SIZE, count, f) == count;
+	fclose(f);
+	return ok;
+}
+
+bool host_sim_write_image(sector_t sector, const uint8_t* data, uint32_t count) {
+	char path[128];
+	snprintf(path, sizeof(path), "%s/%s", sim_root, HOST_SIM_IMAGE);
+	FILE* f = fopen(path, "r+b");
+	if(!f)
+		return false;
+	bool ok = !fseek(f, (long) sector * MC_SEC_SIZE, SEEK_SET) && fwrite(data, MC_SEC_SIZE, count, f) == count;
+	return !fclose(f) && ok;
+}
+
+size_t host_sim_transfer(const uint8_t* cmd, const uint8_t* dat_in, size_t len, uint8_t* dat_out) {
+	sel_isr_callback();		// SEL edge restarts the state machines and core1
+	return mock_bus_transfer(cmd, dat_in, len, dat_out);
+}
+
+size_t host_sim_build_read(uint8_t* cmd, uint16_t sector) {
+	size_t n = 0;
+	cmd[n++] = 0x81;
+	cmd[n++] = 0x52;
+	cmd[n++] = 0x00;
+	cmd[n++] = 0x00;
+	cmd[n++] = sector >> 8;
+	cmd[n++] = sector & 0xff;
+	while(n < 10 + MC_SEC_SIZE + 2)
+		cmd[n++] = 0x00;
+	return n;
+}
+
+size_t host_sim_build_write(uint8_t* cmd, uint16_t sector, const uint8_t* data, bool good_checksum) {
+	size_t n = 0;
+	uint8_t checksum = (sector >> 8) ^ (sector & 0xff);
+	cmd[n++] = 0x81;
+	cmd[n++] = 0x57;
+	cmd[n++] = 0x00;
+	cmd[n++] = 0x00;
+	cmd[n++] = sector >> 8;
+	cmd[n++] = sector & 0xff;
+	for(int i = 0; i < MC_SEC_SIZE; i++) {
+		cmd[n++] = data[i];
+		checksum ^= data[i];
+	}
+	cmd[n++] = good_checksum ? checksum : (uint8_t) ~checksum;
+	cmd[n++] = 0x00;
+	cmd[n++] = 0x00;
+	cmd[n++] = 0x00;
+	return n;
+}
+
+size_t host_sim_build_id(uint8_t* cmd) {
+	size_t n = 0;
+	cmd[n++] = 0x81;
+	cmd[n++] = 0x53;
+	while(n < 10)
+		cmd[n++] = 0x00;
+	return n;
+}
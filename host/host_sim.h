@@ -0,0 +1,59 @@
+/*
+ *	Host harness around memcard_simulator.c: sets up a memory card image in a
+ *	temporary FatFs root and runs core1 over mock bus transactions.
+ */
+#ifndef __HOST_SIM_H__
+#define __HOST_SIM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "pico/mutex.h"
+#include "memory_card.h"
+
+/* memcard_simulator.c internals driven by the harness */
+extern memory_card_t mc;
+extern mutex_t write_transaction;
+extern volatile bool write_transaction_held;
+extern bool request_next_mc;
+extern bool request_prev_mc;
+extern bool request_new_mc;
+extern bool request_game_mc;
+extern uint8_t requested_game_id[];
+extern bool request_next_chan;
+extern bool request_prev_chan;
+extern volatile uint32_t switch_request_time;
+extern volatile bool first_read_armed;
+extern volatile uint32_t first_read_time;
+extern volatile uint32_t first_ack_time;
+void init_pio();
+void init_dma();
+void sel_isr_callback();
+extern void (*host_core1_entry)(void);	// NULL while core1 is held in reset
+uint32_t sync_step();
+void flush_step();
+void journal_step(uint64_t now);
+void update_mc_name(const uint8_t* file_name, uint32_t channel);
+uint32_t load_mc(uint8_t* file_name);
+
+#define HOST_SIM_IMAGE	"0.MCR"
+
+/* (Re)import image_path as HOST_SIM_IMAGE with fresh protocol state, returns MC_OK on success */
+uint32_t host_sim_init(const char* image_path);
+void host_sim_cleanup(void);
+
+/* Read back sectors of HOST_SIM_IMAGE as stored in the FatFs root, returns false on I/O error */
+bool host_sim_read_image(sector_t sector, uint8_t* out, uint32_t count);
+
+/* Overwrite sectors of HOST_SIM_IMAGE behind the firmware's back, returns false on I/O error */
+bool host_sim_write_image(sector_t sector, const uint8_t* data, uint32_t count);
+
+/* SEL falls, the PSX clocks len bytes, SEL rises. Returns the number of bytes the card sent */
+size_t host_sim_transfer(const uint8_t* cmd, const uint8_t* dat_in, size_t len, uint8_t* dat_out);
+
+/* Build the CMD stream of a memory card command */
+size_t host_sim_build_read(uint8_t* cmd, uint16_t sector);
+size_t host_sim_build_write(uint8_t* cmd, uint16_t sector, const uint8_t* data, bool good_checksum);
+size_t host_sim_build_id(uint8_t* cmd);
+
+#endif
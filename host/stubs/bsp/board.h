@@ -0,0 +1,6 @@
+#ifndef __HOST_BSP_BOARD_H__
+#define __HOST_BSP_BOARD_H__
+
+static inline void board_init(void) {}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef __HOST_DISKIO_H__
+#define __HOST_DISKIO_H__
+
+#define STA_NOINIT		0x01
+#define STA_NODISK		0x02
+#define STA_PROTECT		0x04
+
+#endif
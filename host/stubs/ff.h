@@ -0,0 +1,133 @@
+/*
+ *	Host replacement for FatFs. The API subset used by the firmware is implemented
+ *	on top of POSIX files below a root directory chosen with host_ff_set_root(),
+ *	with FatFs' case insensitive name lookup. Every call is counted in host_ff_stats
+ *	so benchmarks can report filesystem traffic alongside wall clock time.
+ */
+#ifndef __HOST_FF_H__
+#define __HOST_FF_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t QWORD;
+typedef char TCHAR;
+typedef QWORD FSIZE_t;
+
+typedef enum {
+	FR_OK = 0,
+	FR_DISK_ERR,
+	FR_INT_ERR,
+	FR_NOT_READY,
+	FR_NO_FILE,
+	FR_NO_PATH,
+	FR_INVALID_NAME,
+	FR_DENIED,
+	FR_EXIST,
+	FR_INVALID_OBJECT,
+	FR_WRITE_PROTECTED,
+	FR_INVALID_DRIVE,
+	FR_NOT_ENABLED,
+	FR_NO_FILESYSTEM,
+	FR_MKFS_ABORTED,
+	FR_TIMEOUT,
+	FR_LOCKED,
+	FR_NOT_ENOUGH_CORE,
+	FR_TOO_MANY_OPEN_FILES,
+	FR_INVALID_PARAMETER
+} FRESULT;
+
+#define FA_READ				0x01
+#define FA_WRITE			0x02
+#define FA_OPEN_EXISTING	0x00
+#define FA_CREATE_NEW		0x04
+#define FA_CREATE_ALWAYS	0x08
+#define FA_OPEN_ALWAYS		0x10
+#define FA_OPEN_APPEND		0x30
+
+#define AM_RDO	0x01
+#define AM_HID	0x02
+#define AM_SYS	0x04
+#define AM_DIR	0x10
+#define AM_ARC	0x20
+
+#define FF_MAX_LFN	255
+
+typedef struct {
+	int mounted;
+} FATFS;
+
+typedef struct {
+	FSIZE_t objsize;
+} FFOBJID;
+
+typedef struct {
+	FFOBJID obj;
+	FILE* fp;
+	BYTE flag;
+	FSIZE_t fptr;
+} FIL;
+
+/* FF_DIR keeps the host stub clear of <dirent.h>'s DIR */
+typedef struct {
+	void* handle;
+	char path[2 * FF_MAX_LFN];
+} FF_DIR;
+#define DIR	FF_DIR
+
+typedef struct {
+	FSIZE_t fsize;
+	WORD fdate;
+	WORD ftime;
+	BYTE fattrib;
+	TCHAR altname[13];
+	TCHAR fname[FF_MAX_LFN + 1];
+} FILINFO;
+
+#define f_size(fp)	((fp)->obj.objsize)
+#define f_tell(fp)	((fp)->fptr)
+#define f_eof(fp)	((int) ((fp)->fptr == (fp)->obj.objsize))
+
+FRESULT f_mount(FATFS* fs, const TCHAR* path, BYTE opt);
+FRESULT f_open(FIL* fp, const TCHAR* path, BYTE mode);
+FRESULT f_close(FIL* fp);
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br);
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw);
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs);
+FRESULT f_sync(FIL* fp);
+FRESULT f_truncate(FIL* fp);
+FRESULT f_opendir(DIR* dp, const TCHAR* path);
+FRESULT f_closedir(DIR* dp);
+FRESULT f_readdir(DIR* dp, FILINFO* fno);
+FRESULT f_stat(const TCHAR* path, FILINFO* fno);
+FRESULT f_mkdir(const TCHAR* path);
+FRESULT f_unlink(const TCHAR* path);
+FRESULT f_rename(const TCHAR* path_old, const TCHAR* path_new);
+TCHAR* f_gets(TCHAR* buff, int len, FIL* fp);
+
+/* Host only */
+typedef struct {
+	uint32_t opens;
+	uint32_t closes;
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t seeks;
+	uint32_t syncs;
+	uint32_t stats;
+	uint32_t readdirs;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+} host_ff_stats_t;
+
+extern host_ff_stats_t host_ff_stats;
+extern bool host_ff_fail_writes;	// f_write() fails with FR_DISK_ERR and writes nothing
+
+void host_ff_set_root(const char* path);
+const char* host_ff_get_root(void);
+
+#endif
@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "ff.h"
+#undef DIR
+#include <dirent.h>
+
+host_ff_stats_t host_ff_stats;
+bool host_ff_fail_writes = false;
+
+bool host_sd_clock_too_fast(void);	// on the target FatFs goes through the SD driver, which fails above host_sd_max_baud
+static char ff_root[FF_MAX_LFN + 1] = ".";
+
+void host_ff_set_root(const char* path) {
+	snprintf(ff_root, sizeof(ff_root), "%s", path);
+}
+
+const char* host_ff_get_root(void) {
+	return ff_root;
+}
+
+/*
+ *	Map a FatFs path onto the host filesystem. Every existing component is matched
+ *	case insensitively like FAT does; a missing last component keeps its spelling.
+ */
+static void resolve_path(const TCHAR* path, char* out, size_t out_len) {
+	char tmp[FF_MAX_LFN + 1];
+	snprintf(out, out_len, "%s", ff_root);
+	while(*path == '/' || *path == '\\')
+		++path;
+	snprintf(tmp, sizeof(tmp), "%s", path);
+	for(char* comp = strtok(tmp, "/\\"); comp; comp = strtok(NULL, "/\\")) {
+		const char* name = comp;
+		void* dir = opendir(out);
+		if(dir) {
+			struct dirent* ent;
+			while((ent = readdir(dir))) {
+				if(!strcasecmp(ent->d_name, comp)) {
+					name = ent->d_name;
+					break;
+				}
+			}
+		}
+		size_t len = strlen(out);
+		snprintf(out + len, out_len - len, "/%s", name);
+		if(dir)
+			closedir(dir);
+	}
+}
+
+static FRESULT errno_to_fresult(int err) {
+	switch(err) {
+		case ENOENT: return FR_NO_FILE;
+		case EEXIST: return FR_EXIST;
+		case EACCES: return FR_DENIED;
+		case ENOTDIR: return FR_NO_PATH;
+		default: return FR_DISK_ERR;
+	}
+}
+
+FRESULT f_mount(FATFS* fs, const TCHAR* path, BYTE opt) {
+	(void) path; (void) opt;
+	if(fs)
+		fs->mounted = 1;
+	return FR_OK;
+}
+
+FRESULT f_open(FIL* fp, const TCHAR* path, BYTE mode) {
+	char host_path[2 * FF_MAX_LFN];
+	struct stat st;
+	resolve_path(path, host_path, sizeof(host_path));
+	++host_ff_stats.opens;
+	memset(fp, 0, sizeof(*fp));
+	bool exists = stat(host_path, &st) == 0;
+	if(exists && S_ISDIR(st.st_mode))
+		return FR_DENIED;
+	if((mode & FA_CREATE_NEW) && exists)
+		return FR_EXIST;
+	if(!exists && !(mode & (FA_CREATE_NEW | FA_CREATE_ALWAYS | FA_OPEN_ALWAYS)))
+		return FR_NO_FILE;
+	const char* fmode;
+	if(mode & FA_CREATE_ALWAYS)
+		fmode = (mode & FA_READ) ? "w+b" : "wb";
+	else if(!exists)
+		fmode = "w+b";
+	else
+		fmode = (mode & FA_WRITE) ? "r+b" : "rb";
+	fp->fp = fopen(host_path, fmode);
+	if(!fp->fp)
+		return errno_to_fresult(errno);
+	fseek(fp->fp, 0, SEEK_END);
+	fp->obj.objsize = (FSIZE_t) ftell(fp->fp);
+	fp->flag = mode;
+	fp->fptr = 0;
+	if((mode & FA_OPEN_APPEND) == FA_OPEN_APPEND)
+		fp->fptr = fp->obj.objsize;
+	fseek(fp->fp, (long) fp->fptr, SEEK_SET);
+	return FR_OK;
+}
+
+FRESULT f_close(FIL* fp) {
+	if(!fp->fp)
+		return FR_INVALID_OBJECT;
+	++host_ff_stats.closes;
+	fclose(fp->fp);
+	fp->fp = NULL;
+	return FR_OK;
+}
+
+FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br) {
+	if(!fp->fp)
+		return FR_INVALID_OBJECT;
+	if(!(fp->flag & FA_READ))
+		return FR_DENIED;
+	++host_ff_stats.reads;
+	fseek(fp->fp, (long) fp->fptr, SEEK_SET);
+	*br = (UINT) fread(buff, 1, btr, fp->fp);
+	fp->fptr += *br;
+	host_ff_stats.bytes_read += *br;
+	return ferror(fp->fp) ? FR_DISK_ERR : FR_OK;
+}
+
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw) {
+	if(!fp->fp)
+		return FR_INVALID_OBJECT;
+	if(!(fp->flag & FA_WRITE))
+		return FR_DENIED;
+	++host_ff_stats.writes;
+	if(host_ff_fail_writes || host_sd_clock_too_fast()) {
+		*bw = 0;
+		return FR_DISK_ERR;
+	}
+	fseek(fp->fp, (long) fp->fptr, SEEK_SET);
+	*bw = (UINT) fwrite(buff, 1, btw, fp->fp);
+	fp->fptr += *bw;
+	if(fp->fptr > fp->obj.objsize)
+		fp->obj.objsize = fp->fptr;
+	host_ff_stats.bytes_written += *bw;
+	return ferror(fp->fp) ? FR_DISK_ERR : FR_OK;
+}
+
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs) {
+	if(!fp->fp)
+		return FR_INVALID_OBJECT;
+	++host_ff_stats.seeks;
+	if(ofs > fp->obj.objsize && !(fp->flag & FA_WRITE))
+		ofs = fp->obj.objsize;	// read-only files cannot be expanded
+	fp->fptr = ofs;
+	return FR_OK;
+}
+
+FRESULT f_sync(FIL* fp) {
+	if(!fp->fp)
+		return FR_INVALID_OBJECT;
+	++host_ff_stats.syncs;
+	fflush(fp->fp);
+	return FR_OK;
+}
+
+FRESULT f_truncate(FIL* fp) {
+	if(!fp->fp)
+		return FR_INVALID_OBJECT;
+	fflush(fp->fp);
+	if(ftruncate(fileno(fp->fp), (off_t) fp->fptr))
+		return FR_DISK_ERR;
+	fp->obj.objsize = fp->fptr;
+	return FR_OK;
+}
+
+FRESULT f_opendir(FF_DIR* dp, const TCHAR* path) {
+	char host_path[2 * FF_MAX_LFN];
+	resolve_path(path, host_path, sizeof(host_path));
+	dp->handle = opendir(host_path);
+	if(!dp->handle)
+		return errno == ENOENT ? FR_NO_PATH : errno_to_fresult(errno);
+	snprintf(dp->path, sizeof(dp->path), "%s", host_path);
+	return FR_OK;
+}
+
+FRESULT f_closedir(FF_DIR* dp) {
+	if(dp->handle)
+		closedir(dp->handle);
+	dp->handle = NULL;
+	return FR_OK;
+}
+
+static void fill_info(const char* host_path, const char* name, FILINFO* fno) {
+	struct stat st;
+	memset(fno, 0, sizeof(*fno));
+	snprintf(fno->fname, sizeof(fno->fname), "%s", name);
+	if(stat(host_path, &st) == 0) {
+		fno->fsize = S_ISDIR(st.st_mode) ? 0 : (FSIZE_t) st.st_size;
+		fno->fattrib = S_ISDIR(st.st_mode) ? AM_DIR : AM_ARC;
+		struct tm tm;
+		localtime_r(&st.st_mtime, &tm);
+		fno->fdate = (WORD) (((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+		fno->ftime = (WORD) ((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+	}
+}
+
+FRESULT f_readdir(FF_DIR* dp, FILINFO* fno) {
+	if(!dp->handle)
+		return FR_INVALID_OBJECT;
+	++host_ff_stats.readdirs;
+	struct dirent* ent;
+	do {
+		ent = readdir(dp->handle);
+	} while(ent && (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")));
+	if(!ent) {
+		fno->fname[0] = 0;	// end of directory
+		return FR_OK;
+	}
+	char host_path[sizeof(dp->path) + sizeof(ent->d_name)];
+	snprintf(host_path, sizeof(host_path), "%s/%s", dp->path, ent->d_name);
+	fill_info(host_path, ent->d_name, fno);
+	return FR_OK;
+}
+
+FRESULT f_stat(const TCHAR* path, FILINFO* fno) {
+	char host_path[2 * FF_MAX_LFN];
+	struct stat st;
+	resolve_path(path, host_path, sizeof(host_path));
+	++host_ff_stats.stats;
+	if(stat(host_path, &st))
+		return errno_to_fresult(errno);
+	const char* name = strrchr(host_path, '/');
+	if(fno)
+		fill_info(host_path, name ? name + 1 : host_path, fno);
+	return FR_OK;
+}
+
+FRESULT f_mkdir(const TCHAR* path) {
+	char host_path[2 * FF_MAX_LFN];
+	resolve_path(path, host_path, sizeof(host_path));
+	if(mkdir(host_path, 0777))
+		return errno_to_fresult(errno);
+	return FR_OK;
+}
+
+FRESULT f_unlink(const TCHAR* path) {
+	char host_path[2 * FF_MAX_LFN];
+	struct stat st;
+	resolve_path(path, host_path, sizeof(host_path));
+	if(stat(host_path, &st))
+		return errno_to_fresult(errno);
+	if(S_ISDIR(st.st_mode) ? rmdir(host_path) : unlink(host_path))
+		return FR_DENIED;
+	return FR_OK;
+}
+
+FRESULT f_rename(const TCHAR* path_old, const TCHAR* path_new) {
+	char host_old[2 * FF_MAX_LFN];
+	char host_new[2 * FF_MAX_LFN];
+	struct stat st;
+	resolve_path(path_old, host_old, sizeof(host_old));
+	resolve_path(path_new, host_new, sizeof(host_new));
+	if(stat(host_old, &st))
+		return errno_to_fresult(errno);
+	if(stat(host_new, &st) == 0)
+		return FR_EXIST;
+	if(rename(host_old, host_new))
+		return errno_to_fresult(errno);
+	return FR_OK;
+}
+
+TCHAR* f_gets(TCHAR* buff, int len, FIL* fp) {
+	int n = 0;
+	UINT br;
+	char c;
+	while(n < len - 1) {
+		if(f_read(fp, &c, 1, &br) != FR_OK || br != 1)
+			break;
+		buff[n++] = c;
+		if(c == '\n')
+			break;
+	}
+	buff[n] = 0;
+	return n ? buff : NULL;
+}
@@ -0,0 +1,65 @@
+/*
+ *	Host replacement for hardware/dma.h.
+ *	Channels are run in software when the firmware polls them: transfers paced by a
+ *	PIO FIFO DREQ go through the mock bus (see mock_bus.h), one byte per DREQ, so a
+ *	DMA-fed transaction is captured exactly like one made of SEND/RECV_CMD calls.
+ */
+#ifndef __HOST_HARDWARE_DMA_H__
+#define __HOST_HARDWARE_DMA_H__
+
+#include "pico/types.h"
+
+enum dma_channel_transfer_size {
+	DMA_SIZE_8 = 0,
+	DMA_SIZE_16 = 1,
+	DMA_SIZE_32 = 2
+};
+
+#define DREQ_FORCE	0x3f
+
+typedef struct {
+	uint32_t ctrl;
+} dma_channel_config;
+
+/* ctrl layout used by the stub only */
+#define HOST_DMA_SIZE_SHIFT		0
+#define HOST_DMA_INCR_READ		(1u << 2)
+#define HOST_DMA_INCR_WRITE		(1u << 3)
+#define HOST_DMA_DREQ_SHIFT		4
+#define HOST_DMA_CHAIN_SHIFT	10
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_unclaim(uint channel);
+dma_channel_config dma_channel_get_default_config(uint channel);
+
+static inline void channel_config_set_transfer_data_size(dma_channel_config* c, enum dma_channel_transfer_size size) {
+	c->ctrl = (c->ctrl & ~(3u << HOST_DMA_SIZE_SHIFT)) | ((uint32_t) size << HOST_DMA_SIZE_SHIFT);
+}
+
+static inline void channel_config_set_read_increment(dma_channel_config* c, bool incr) {
+	c->ctrl = incr ? (c->ctrl | HOST_DMA_INCR_READ) : (c->ctrl & ~HOST_DMA_INCR_READ);
+}
+
+static inline void channel_config_set_write_increment(dma_channel_config* c, bool incr) {
+	c->ctrl = incr ? (c->ctrl | HOST_DMA_INCR_WRITE) : (c->ctrl & ~HOST_DMA_INCR_WRITE);
+}
+
+static inline void channel_config_set_dreq(dma_channel_config* c, uint dreq) {
+	c->ctrl = (c->ctrl & ~(0x3fu << HOST_DMA_DREQ_SHIFT)) | ((dreq & 0x3f) << HOST_DMA_DREQ_SHIFT);
+}
+
+static inline void channel_config_set_chain_to(dma_channel_config* c, uint chain_to) {
+	c->ctrl = (c->ctrl & ~(0xfu << HOST_DMA_CHAIN_SHIFT)) | ((chain_to & 0xf) << HOST_DMA_CHAIN_SHIFT);
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_addr,
+	const volatile void* read_addr, uint transfer_count, bool trigger);
+void dma_channel_set_read_addr(uint channel, const volatile void* read_addr, bool trigger);
+void dma_channel_set_write_addr(uint channel, volatile void* write_addr, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger);
+void dma_channel_start(uint channel);
+void dma_channel_abort(uint channel);
+bool dma_channel_is_busy(uint channel);
+void dma_channel_wait_for_finish_blocking(uint channel);
+
+#endif
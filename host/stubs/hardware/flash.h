@@ -0,0 +1,19 @@
+#ifndef __HOST_HARDWARE_FLASH_H__
+#define __HOST_HARDWARE_FLASH_H__
+
+#include <stddef.h>
+#include "pico/types.h"
+
+#define FLASH_PAGE_SIZE			(1u << 8)
+#define FLASH_SECTOR_SIZE		(1u << 12)
+#define PICO_FLASH_SIZE_BYTES	(2 * 1024 * 1024)
+
+/* The QSPI flash is a RAM array seen at XIP_BASE, programming can only clear bits like NOR flash */
+extern uint8_t host_flash[PICO_FLASH_SIZE_BYTES];
+extern uint32_t host_flash_erases;
+#define XIP_BASE	((uintptr_t) host_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count);
+
+#endif
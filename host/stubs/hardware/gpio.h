@@ -0,0 +1,46 @@
+#ifndef __HOST_HARDWARE_GPIO_H__
+#define __HOST_HARDWARE_GPIO_H__
+
+#include "pico/types.h"
+
+enum gpio_irq_level {
+	GPIO_IRQ_LEVEL_LOW = 0x1u,
+	GPIO_IRQ_LEVEL_HIGH = 0x2u,
+	GPIO_IRQ_EDGE_FALL = 0x4u,
+	GPIO_IRQ_EDGE_RISE = 0x8u,
+};
+
+enum gpio_slew_rate {
+	GPIO_SLEW_RATE_SLOW = 0,
+	GPIO_SLEW_RATE_FAST = 1
+};
+
+enum gpio_drive_strength {
+	GPIO_DRIVE_STRENGTH_2MA = 0,
+	GPIO_DRIVE_STRENGTH_4MA = 1,
+	GPIO_DRIVE_STRENGTH_8MA = 2,
+	GPIO_DRIVE_STRENGTH_12MA = 3
+};
+
+typedef struct {
+	volatile uint32_t intr[4];
+} iobank0_hw_t;
+
+extern iobank0_hw_t host_iobank0_hw;
+#define iobank0_hw	(&host_iobank0_hw)
+
+#define GPIO_OUT	1
+#define GPIO_IN		0
+
+static inline void check_gpio_param(uint gpio) { (void) gpio; }
+static inline void gpio_init(uint gpio) { (void) gpio; }
+static inline void gpio_set_dir(uint gpio, bool out) { (void) gpio; (void) out; }
+static inline void gpio_put(uint gpio, bool value) { (void) gpio; (void) value; }
+static inline bool gpio_get(uint gpio) { (void) gpio; return true; }
+static inline void gpio_pull_up(uint gpio) { (void) gpio; }
+static inline void gpio_disable_pulls(uint gpio) { (void) gpio; }
+static inline void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled) { (void) gpio; (void) events; (void) enabled; }
+static inline void gpio_set_slew_rate(uint gpio, enum gpio_slew_rate slew) { (void) gpio; (void) slew; }
+static inline void gpio_set_drive_strength(uint gpio, enum gpio_drive_strength drive) { (void) gpio; (void) drive; }
+
+#endif
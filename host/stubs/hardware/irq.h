@@ -0,0 +1,15 @@
+#ifndef __HOST_HARDWARE_IRQ_H__
+#define __HOST_HARDWARE_IRQ_H__
+
+#include "pico/types.h"
+
+#define IO_IRQ_BANK0	13
+#define PICO_HIGHEST_IRQ_PRIORITY	0x00
+
+typedef void (*irq_handler_t)(void);
+
+static inline void irq_set_enabled(uint num, bool enabled) { (void) num; (void) enabled; }
+static inline void irq_set_exclusive_handler(uint num, irq_handler_t handler) { (void) num; (void) handler; }
+static inline void irq_set_priority(uint num, uint8_t hardware_priority) { (void) num; (void) hardware_priority; }
+
+#endif
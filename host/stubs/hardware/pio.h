@@ -0,0 +1,47 @@
+#ifndef __HOST_HARDWARE_PIO_H__
+#define __HOST_HARDWARE_PIO_H__
+
+#include "pico/types.h"
+
+/* Only the FIFO registers are modelled, so that their addresses can be handed to DMA */
+typedef struct {
+	volatile uint32_t txf[4];
+	volatile uint32_t rxf[4];
+} pio_hw_t;
+
+typedef pio_hw_t* PIO;
+
+extern pio_hw_t host_pio0_hw;
+extern pio_hw_t host_pio1_hw;
+#define pio0	(&host_pio0_hw)
+#define pio1	(&host_pio1_hw)
+
+typedef struct {
+	const uint16_t* instructions;
+	uint8_t length;
+	int8_t origin;
+} pio_program_t;
+
+typedef struct {
+	uint32_t clkdiv;
+	uint32_t execctrl;
+	uint32_t shiftctrl;
+	uint32_t pinctrl;
+} pio_sm_config;
+
+int pio_claim_unused_sm(PIO pio, bool required);
+static inline uint pio_add_program(PIO pio, const pio_program_t* program) { (void) pio; (void) program; return 0; }
+static inline uint pio_encode_jmp(uint addr) { return addr; }
+static inline void pio_sm_exec(PIO pio, uint sm, uint instr) { (void) pio; (void) sm; (void) instr; }
+static inline void pio_restart_sm_mask(PIO pio, uint32_t mask) { (void) pio; (void) mask; }
+static inline void pio_set_sm_mask_enabled(PIO pio, uint32_t mask, bool enabled) { (void) pio; (void) mask; (void) enabled; }
+static inline void pio_enable_sm_mask_in_sync(PIO pio, uint32_t mask) { (void) pio; (void) mask; }
+static inline void pio_sm_drain_tx_fifo(PIO pio, uint sm) { (void) pio; (void) sm; }
+void pio_sm_clear_fifos(PIO pio, uint sm);
+
+/* DREQ numbering of the RP2040: PIO0 TX0-3, PIO0 RX0-3, PIO1 TX0-3, PIO1 RX0-3 */
+static inline uint pio_get_dreq(PIO pio, uint sm, bool is_tx) {
+	return (pio == pio1 ? 8 : 0) + (is_tx ? 0 : 4) + sm;
+}
+
+#endif
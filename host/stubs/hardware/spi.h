@@ -0,0 +1,16 @@
+#ifndef __HOST_HARDWARE_SPI_H__
+#define __HOST_HARDWARE_SPI_H__
+
+#include "pico/types.h"
+
+/* Only the clock is modelled, the SD card stub fails transfers above what it tolerates */
+typedef struct {
+	uint baud_rate;
+} spi_inst_t;
+
+extern spi_inst_t host_spi0_hw;
+#define spi0	(&host_spi0_hw)
+
+uint spi_set_baudrate(spi_inst_t* spi, uint baudrate);
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ *	Force-included into every translation unit of the host build.
+ *	Provides the few newlib extensions the firmware relies on that glibc lacks.
+ */
+#ifndef __HOST_COMPAT_H__
+#define __HOST_COMPAT_H__
+
+#include <ctype.h>
+
+static inline char* strupr(char* s) {
+	for(char* p = s; *p; ++p)
+		*p = (char) toupper((unsigned char) *p);
+	return s;
+}
+
+#endif
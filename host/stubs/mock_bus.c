@@ -0,0 +1,76 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "mock_bus.h"
+
+#define MOCK_MAX_SM	4
+
+extern void (*host_core1_entry)(void);
+extern bool host_dma_any_busy(void);
+
+static mock_sm_role_t sm_role[MOCK_MAX_SM];
+
+static const uint8_t* bus_cmd;
+static const uint8_t* bus_dat_in;
+static size_t bus_len;
+static size_t cmd_pos;		// CMD bytes handed to core1 so far
+static size_t dat_pos;		// DAT bytes handed to core1 so far
+static uint8_t* bus_dat_out;
+static size_t dat_out_len;
+static jmp_buf sel_high;
+
+void mock_bus_bind(uint sm, mock_sm_role_t role) {
+	if(sm < MOCK_MAX_SM)
+		sm_role[sm] = role;
+}
+
+uint8_t mock_bus_read_byte(uint sm) {
+	switch(sm_role[sm]) {
+		case MOCK_SM_CMD_READER:
+			if(cmd_pos >= bus_len)
+				longjmp(sel_high, 1);	// PSX stopped clocking: SEL goes high
+			return bus_cmd[cmd_pos++];
+		case MOCK_SM_DAT_READER:
+			if(dat_pos >= bus_len)
+				longjmp(sel_high, 1);
+			return bus_dat_in ? bus_dat_in[dat_pos++] : 0xff;
+		default:
+			fprintf(stderr, "mock_bus: read from SM %u which is not a reader\n", sm);
+			abort();
+	}
+}
+
+void mock_bus_write_byte(uint sm, uint8_t byte) {
+	if(sm_role[sm] != MOCK_SM_DAT_WRITER) {
+		fprintf(stderr, "mock_bus: write to SM %u which is not the DAT writer\n", sm);
+		abort();
+	}
+	if(dat_out_len < MOCK_BUS_MAX_LEN)
+		bus_dat_out[dat_out_len] = byte;
+	++dat_out_len;
+}
+
+void mock_bus_clear_fifo(uint sm) {
+	/* anything clocked in so far is discarded, the reader resumes at the current byte */
+	if(sm < MOCK_MAX_SM && sm_role[sm] == MOCK_SM_DAT_READER)
+		dat_pos = cmd_pos;
+}
+
+size_t mock_bus_transfer(const uint8_t* cmd, const uint8_t* dat_in, size_t len, uint8_t* dat_out) {
+	if(!host_core1_entry) {
+		fprintf(stderr, "mock_bus: core1 has not been launched\n");
+		abort();
+	}
+	if(host_dma_any_busy()) {
+		fprintf(stderr, "mock_bus: DMA from the previous transaction is still running\n");
+		abort();
+	}
+	bus_cmd = cmd;
+	bus_dat_in = dat_in;
+	bus_len = len;
+	bus_dat_out = dat_out;
+	cmd_pos = dat_pos = dat_out_len = 0;
+	if(!setjmp(sel_high))
+		host_core1_entry();		// only returns through longjmp
+	return dat_out_len < MOCK_BUS_MAX_LEN ? dat_out_len : MOCK_BUS_MAX_LEN;
+}
@@ -0,0 +1,37 @@
+/*
+ *	Mock of the three psxSPI.pio state machines.
+ *
+ *	A transaction is one SEL-low period: the PSX clocks len bytes out on CMD while
+ *	the DAT line carries dat_in (the controller's reply for pad traffic). Bytes read
+ *	through the CMD reader are consumed from cmd[], bytes pushed to the DAT writer are
+ *	captured as the memory card reply. When the CMD stream runs out the transaction
+ *	ends exactly like SEL going high on hardware: core1 is abandoned (longjmp) and
+ *	restarted on the next transaction.
+ */
+#ifndef __MOCK_BUS_H__
+#define __MOCK_BUS_H__
+
+#include <stddef.h>
+#include "pico/types.h"
+
+typedef enum {
+	MOCK_SM_UNUSED = 0,
+	MOCK_SM_CMD_READER,
+	MOCK_SM_DAT_READER,
+	MOCK_SM_DAT_WRITER
+} mock_sm_role_t;
+
+#define MOCK_BUS_MAX_LEN	1024
+
+void mock_bus_bind(uint sm, mock_sm_role_t role);
+uint8_t mock_bus_read_byte(uint sm);
+void mock_bus_write_byte(uint sm, uint8_t byte);
+void mock_bus_clear_fifo(uint sm);
+
+/*
+ *	Run core1 over one transaction. dat_out receives the bytes sent by the card in
+ *	bus order, the return value is how many were sent (0 if the card stayed silent).
+ */
+size_t mock_bus_transfer(const uint8_t* cmd, const uint8_t* dat_in, size_t len, uint8_t* dat_out);
+
+#endif
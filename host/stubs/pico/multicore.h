@@ -0,0 +1,10 @@
+#ifndef __HOST_PICO_MULTICORE_H__
+#define __HOST_PICO_MULTICORE_H__
+
+#include "pico/types.h"
+
+/* Core1 is not a thread on the host: the entry point is recorded and run by the mock bus */
+void multicore_launch_core1(void (*entry)(void));
+void multicore_reset_core1(void);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef __HOST_PICO_MUTEX_H__
+#define __HOST_PICO_MUTEX_H__
+
+#include "pico/types.h"
+
+/* The host harness is single threaded: taking a held mutex is reported as a deadlock */
+typedef struct {
+	bool locked;
+} mutex_t;
+
+void mutex_init(mutex_t* mtx);
+void mutex_enter_blocking(mutex_t* mtx);
+bool mutex_try_enter(mutex_t* mtx, uint32_t* owner_out);
+void mutex_exit(mutex_t* mtx);
+
+#endif
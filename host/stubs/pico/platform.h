@@ -0,0 +1,17 @@
+#ifndef __HOST_PICO_PLATFORM_H__
+#define __HOST_PICO_PLATFORM_H__
+
+#include "pico/types.h"
+
+#define __time_critical_func(func_name)	func_name
+#define __not_in_flash_func(func_name)	func_name
+#define __not_in_flash(group)
+#define __scratch_x(group)
+#define __scratch_y(group)
+
+#define count_of(a)	(sizeof(a) / sizeof((a)[0]))
+
+static inline void tight_loop_contents(void) {}
+static inline void __compiler_memory_barrier(void) { __asm__ volatile ("" : : : "memory"); }
+
+#endif
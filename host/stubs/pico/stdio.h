@@ -0,0 +1,14 @@
+#ifndef __HOST_PICO_STDIO_H__
+#define __HOST_PICO_STDIO_H__
+
+#include <stdio.h>
+#include "pico/types.h"
+
+static inline bool stdio_init_all(void) { return true; }
+
+#define PICO_ERROR_TIMEOUT	-1
+
+/* No console input on the host */
+static inline int getchar_timeout_us(uint32_t timeout_us) { (void) timeout_us; return PICO_ERROR_TIMEOUT; }
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __HOST_PICO_STDLIB_H__
+#define __HOST_PICO_STDLIB_H__
+
+#include <stdio.h>
+#include "pico/types.h"
+#include "pico/platform.h"
+#include "pico/stdio.h"
+#include "pico/time.h"
+#include "pico/mutex.h"
+#include "hardware/gpio.h"
+
+#endif
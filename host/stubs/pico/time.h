@@ -0,0 +1,24 @@
+#ifndef __HOST_PICO_TIME_H__
+#define __HOST_PICO_TIME_H__
+
+#include "pico/types.h"
+
+/*
+ *	Host time is the monotonic clock plus a virtual offset: sleep_ms()/sleep_us()
+ *	advance the offset instead of blocking, so timeouts can be exercised instantly.
+ */
+uint64_t time_us_64(void);
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+
+static inline uint32_t time_us_32(void) { return (uint32_t) time_us_64(); }
+static inline absolute_time_t get_absolute_time(void) { return time_us_64(); }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t) (t / 1000); }
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return (int64_t) (to - from); }
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) { return time_us_64() + (uint64_t) ms * 1000; }
+static inline absolute_time_t delayed_by_ms(absolute_time_t t, uint32_t ms) { return t + (uint64_t) ms * 1000; }
+static inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) { return t + us; }
+static inline bool time_reached(absolute_time_t t) { return time_us_64() >= t; }
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef __HOST_PICO_TYPES_H__
+#define __HOST_PICO_TYPES_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+#endif
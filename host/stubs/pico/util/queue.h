@@ -0,0 +1,26 @@
+#ifndef __HOST_PICO_UTIL_QUEUE_H__
+#define __HOST_PICO_UTIL_QUEUE_H__
+
+#include "pico/types.h"
+
+typedef struct {
+	uint8_t* data;
+	uint element_size;
+	uint element_count;
+	uint rptr;
+	uint wptr;
+	uint level;
+} queue_t;
+
+void queue_init(queue_t* q, uint element_size, uint element_count);
+void queue_free(queue_t* q);
+bool queue_try_add(queue_t* q, const void* data);
+bool queue_try_remove(queue_t* q, void* data);
+void queue_add_blocking(queue_t* q, const void* data);
+void queue_remove_blocking(queue_t* q, void* data);
+
+static inline uint queue_get_level(queue_t* q) { return q->level; }
+static inline bool queue_is_empty(queue_t* q) { return q->level == 0; }
+static inline bool queue_is_full(queue_t* q) { return q->level == q->element_count; }
+
+#endif
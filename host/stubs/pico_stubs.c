@@ -0,0 +1,413 @@
+/*
+ *	Host implementations of the Pico SDK pieces used by the firmware:
+ *	time, mutex, queue, multicore, DMA and the parts of PIO/GPIO that keep state.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/util/queue.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/spi.h"
+#include "hardware/flash.h"
+#include "sd_card.h"
+#include "led.h"
+#include "console.h"
+#include "tusb.h"
+#include "mock_bus.h"
+
+pio_hw_t host_pio0_hw;
+pio_hw_t host_pio1_hw;
+iobank0_hw_t host_iobank0_hw;
+
+/* Time */
+static uint64_t time_origin_us;
+static uint64_t time_virtual_us;
+
+static uint64_t monotonic_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+uint64_t time_us_64(void) {
+	if(!time_origin_us)
+		time_origin_us = monotonic_us();
+	return monotonic_us() - time_origin_us + time_virtual_us;
+}
+
+void sleep_ms(uint32_t ms) {
+	time_virtual_us += (uint64_t) ms * 1000;
+}
+
+void sleep_us(uint64_t us) {
+	time_virtual_us += us;
+}
+
+/* Mutex */
+void mutex_init(mutex_t* mtx) {
+	mtx->locked = false;
+}
+
+void mutex_enter_blocking(mutex_t* mtx) {
+	if(mtx->locked) {
+		fprintf(stderr, "host: mutex_enter_blocking() on a held mutex would never return\n");
+		abort();
+	}
+	mtx->locked = true;
+}
+
+bool mutex_try_enter(mutex_t* mtx, uint32_t* owner_out) {
+	if(owner_out)
+		*owner_out = 0;
+	if(mtx->locked)
+		return false;
+	mtx->locked = true;
+	return true;
+}
+
+void mutex_exit(mutex_t* mtx) {
+	mtx->locked = false;
+}
+
+/* Queue */
+void queue_init(queue_t* q, uint element_size, uint element_count) {
+	q->data = calloc(element_count, element_size);
+	q->element_size = element_size;
+	q->element_count = element_count;
+	q->rptr = q->wptr = q->level = 0;
+}
+
+void queue_free(queue_t* q) {
+	free(q->data);
+	q->data = NULL;
+}
+
+bool queue_try_add(queue_t* q, const void* data) {
+	if(q->level == q->element_count)
+		return false;
+	memcpy(&q->data[q->wptr * q->element_size], data, q->element_size);
+	q->wptr = (q->wptr + 1) % q->element_count;
+	++q->level;
+	return true;
+}
+
+bool queue_try_remove(queue_t* q, void* data) {
+	if(q->level == 0)
+		return false;
+	memcpy(data, &q->data[q->rptr * q->element_size], q->element_size);
+	q->rptr = (q->rptr + 1) % q->element_count;
+	--q->level;
+	return true;
+}
+
+void queue_add_blocking(queue_t* q, const void* data) {
+	if(!queue_try_add(q, data)) {
+		fprintf(stderr, "host: queue_add_blocking() on a full queue would never return\n");
+		abort();
+	}
+}
+
+void queue_remove_blocking(queue_t* q, void* data) {
+	if(!queue_try_remove(q, data)) {
+		fprintf(stderr, "host: queue_remove_blocking() on an empty queue would never return\n");
+		abort();
+	}
+}
+
+/* Multicore */
+void (*host_core1_entry)(void);
+
+void multicore_launch_core1(void (*entry)(void)) {
+	host_core1_entry = entry;
+}
+
+void multicore_reset_core1(void) {
+	host_core1_entry = NULL;
+}
+
+/* PIO */
+int pio_claim_unused_sm(PIO pio, bool required) {
+	static uint claimed[2];
+	uint* next = (pio == pio0) ? &claimed[0] : &claimed[1];
+	if(*next >= 4) {
+		if(required) {
+			fprintf(stderr, "host: no free PIO state machine\n");
+			abort();
+		}
+		return -1;
+	}
+	return (int) (*next)++;
+}
+
+void pio_sm_clear_fifos(PIO pio, uint sm) {
+	if(pio == pio0)
+		mock_bus_clear_fifo(sm);
+}
+
+/* DMA */
+#define HOST_DMA_CHANNELS	12
+
+typedef struct {
+	bool claimed;
+	bool busy;
+	uint32_t ctrl;
+	uintptr_t read_addr;
+	uintptr_t write_addr;
+	uint32_t reload;		// TRANS_COUNT as written, copied to remaining on every trigger
+	uint32_t remaining;
+} host_dma_channel_t;
+
+static host_dma_channel_t dma_ch[HOST_DMA_CHANNELS];
+static uint32_t dma_busy_mask;
+
+int dma_claim_unused_channel(bool required) {
+	for(uint i = 0; i < HOST_DMA_CHANNELS; i++) {
+		if(!dma_ch[i].claimed) {
+			dma_ch[i].claimed = true;
+			return (int) i;
+		}
+	}
+	if(required) {
+		fprintf(stderr, "host: no free DMA channel\n");
+		abort();
+	}
+	return -1;
+}
+
+void dma_channel_unclaim(uint channel) {
+	dma_ch[channel].claimed = false;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel) {
+	dma_channel_config c = { 0 };
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, DREQ_FORCE);
+	channel_config_set_chain_to(&c, channel);
+	return c;
+}
+
+void dma_channel_start(uint channel) {
+	dma_ch[channel].remaining = dma_ch[channel].reload;
+	dma_ch[channel].busy = dma_ch[channel].remaining != 0;
+	if(dma_ch[channel].busy)
+		dma_busy_mask |= 1u << channel;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_addr,
+	const volatile void* read_addr, uint transfer_count, bool trigger) {
+	dma_ch[channel].ctrl = config->ctrl;
+	dma_ch[channel].write_addr = (uintptr_t) write_addr;
+	dma_ch[channel].read_addr = (uintptr_t) read_addr;
+	dma_ch[channel].reload = transfer_count;
+	if(trigger)
+		dma_channel_start(channel);
+}
+
+void dma_channel_set_read_addr(uint channel, const volatile void* read_addr, bool trigger) {
+	dma_ch[channel].read_addr = (uintptr_t) read_addr;
+	if(trigger)
+		dma_channel_start(channel);
+}
+
+void dma_channel_set_write_addr(uint channel, volatile void* write_addr, bool trigger) {
+	dma_ch[channel].write_addr = (uintptr_t) write_addr;
+	if(trigger)
+		dma_channel_start(channel);
+}
+
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger) {
+	dma_ch[channel].reload = trans_count;
+	if(trigger)
+		dma_channel_start(channel);
+}
+
+void dma_channel_abort(uint channel) {
+	dma_ch[channel].busy = false;
+	dma_busy_mask &= ~(1u << channel);
+}
+
+/* FIFO register accessed by the channel, sm is set when it belongs to PIO0 */
+static bool dma_pio0_fifo(uintptr_t addr, volatile uint32_t* fifo, uint* sm) {
+	uintptr_t base = (uintptr_t) fifo;
+	if(addr < base || addr >= base + 4 * sizeof(uint32_t))
+		return false;
+	*sm = (uint) ((addr - base) / sizeof(uint32_t));
+	return true;
+}
+
+static void dma_transfer_one(uint channel) {
+	host_dma_channel_t* ch = &dma_ch[channel];
+	uint size = 1u << ((ch->ctrl >> HOST_DMA_SIZE_SHIFT) & 3);
+	uint32_t value = 0;
+	uint sm;
+	if(dma_pio0_fifo(ch->read_addr, host_pio0_hw.rxf, &sm))
+		value = (uint32_t) mock_bus_read_byte(sm) << 24;	// ISR shifts right, the byte sits at the top
+	else
+		memcpy(&value, (const void*) ch->read_addr, size);
+	if(dma_pio0_fifo(ch->write_addr, host_pio0_hw.txf, &sm))
+		mock_bus_write_byte(sm, (uint8_t) value);
+	else
+		memcpy((void*) ch->write_addr, &value, size);
+	if(ch->ctrl & HOST_DMA_INCR_READ)
+		ch->read_addr += size;
+	if(ch->ctrl & HOST_DMA_INCR_WRITE)
+		ch->write_addr += size;
+	if(--ch->remaining == 0) {
+		ch->busy = false;
+		dma_busy_mask &= ~(1u << channel);
+		uint chain_to = (ch->ctrl >> HOST_DMA_CHAIN_SHIFT) & 0xf;
+		if(chain_to != channel)
+			dma_channel_start(chain_to);
+	}
+}
+
+/*
+ *	Let every busy channel make progress. Each round serves the TX DREQs first, then
+ *	the RX ones: the DAT writer is fed a byte before the CMD byte clocked with it is
+ *	read, like SEND() followed by RECV_CMD(). Reading past the end of the recorded
+ *	CMD stream leaves through the mock bus, i.e. SEL went high mid-transfer.
+ */
+static void dma_run(void) {
+	while(dma_busy_mask) {
+		for(int rx = 0; rx < 2; rx++) {
+			for(uint32_t pending = dma_busy_mask; pending; pending &= pending - 1) {
+				uint i = (uint) __builtin_ctz(pending);
+				uint dreq = (dma_ch[i].ctrl >> HOST_DMA_DREQ_SHIFT) & 0x3f;
+				bool paced_by_rx = dreq != DREQ_FORCE && (dreq & 4);
+				if(dma_ch[i].busy && paced_by_rx == (bool) rx)
+					dma_transfer_one(i);
+			}
+		}
+	}
+}
+
+bool host_dma_any_busy(void) {
+	return dma_busy_mask != 0;
+}
+
+bool dma_channel_is_busy(uint channel) {
+	dma_run();
+	return dma_ch[channel].busy;
+}
+
+void dma_channel_wait_for_finish_blocking(uint channel) {
+	dma_run();
+	if(dma_ch[channel].busy) {
+		fprintf(stderr, "host: DMA channel %u can never finish\n", channel);
+		abort();
+	}
+}
+
+/* SD card, raw blocks are a small RAM disk (FatFs itself works on the host file system) */
+spi_inst_t host_spi0_hw = { .baud_rate = 5000 * 1000 };
+static uint8_t host_sd_data[HOST_SD_BLOCKS][512];
+uint32_t host_sd_read_calls;
+uint32_t host_sd_write_calls;
+bool host_sd_fail_writes;
+uint host_sd_max_baud;
+uint32_t host_sd_corrupt_reads;
+
+/* Same divider search as the SDK, from a 125MHz peripheral clock */
+uint spi_set_baudrate(spi_inst_t* spi, uint baudrate) {
+	const uint64_t freq_in = 125000000;
+	uint prescale, postdiv;
+	for(prescale = 2; prescale <= 254; prescale += 2)
+		if(freq_in < (uint64_t) (prescale + 2) * 256 * baudrate)
+			break;
+	for(postdiv = 256; postdiv > 1; --postdiv)
+		if(freq_in / (prescale * (postdiv - 1)) > baudrate)
+			break;
+	spi->baud_rate = (uint) (freq_in / (prescale * postdiv));
+	return spi->baud_rate;
+}
+
+void spi_irq_handler(spi_t* spi) { (void) spi; }
+
+bool host_sd_clock_too_fast(void) {
+	return host_sd_max_baud && host_spi0_hw.baud_rate > host_sd_max_baud;
+}
+
+int sd_init_card(sd_card_t* p_sd) {
+	p_sd->m_Status = 0;
+	p_sd->sectors = HOST_SD_BLOCKS;
+	spi_set_baudrate(p_sd->spi->hw_inst, p_sd->spi->baud_rate);
+	return 0;
+}
+int sd_read_blocks(sd_card_t* p_sd, uint8_t* buffer, uint64_t lba, uint32_t count) {
+	(void) p_sd;
+	if(lba + count > HOST_SD_BLOCKS)
+		return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+	host_sd_read_calls++;
+	if(host_sd_clock_too_fast())
+		return SD_BLOCK_DEVICE_ERROR_CRC;
+	memcpy(buffer, host_sd_data[lba], (size_t) count * 512);
+	if(host_sd_corrupt_reads) {
+		host_sd_corrupt_reads--;
+		buffer[0] ^= 0xff;
+	}
+	return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+int sd_write_blocks(sd_card_t* p_sd, const uint8_t* buffer, uint64_t lba, uint32_t count) {
+	(void) p_sd;
+	if(lba + count > HOST_SD_BLOCKS)
+		return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+	host_sd_write_calls++;
+	if(host_sd_clock_too_fast())
+		return SD_BLOCK_DEVICE_ERROR_WRITE;
+	if(host_sd_fail_writes)
+		return SD_BLOCK_DEVICE_ERROR_WRITE;
+	memcpy(host_sd_data[lba], buffer, (size_t) count * 512);
+	return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+/* Flash, starts zeroed so that it holds no valid slot */
+uint8_t host_flash[PICO_FLASH_SIZE_BYTES];
+uint32_t host_flash_erases;
+
+static void host_flash_check(uint32_t offset, size_t count, size_t align) {
+	if(offset % align || count % align || offset + count > PICO_FLASH_SIZE_BYTES) {
+		fprintf(stderr, "host: flash access at 0x%x (%zu bytes) not aligned or out of range\n", (unsigned) offset, count);
+		abort();
+	}
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+	host_flash_check(flash_offs, count, FLASH_SECTOR_SIZE);
+	memset(&host_flash[flash_offs], 0xFF, count);
+	host_flash_erases += count / FLASH_SECTOR_SIZE;
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count) {
+	host_flash_check(flash_offs, count, FLASH_PAGE_SIZE);
+	for(size_t i = 0; i < count; i++)
+		host_flash[flash_offs + i] &= data[i];
+}
+
+/* USB */
+uint8_t host_msc_sense_key;
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier) {
+	(void) lun; (void) add_sense_code; (void) add_sense_qualifier;
+	host_msc_sense_key = sense_key;
+	return true;
+}
+
+/* Console */
+uint32_t console_free_heap() { return 0; }
+
+/* LED */
+void led_init() {}
+void led_output_sync_status(bool out_of_sync) { (void) out_of_sync; }
+void led_blink_error(int amount) { fprintf(stderr, "host: led_blink_error(%d)\n", amount); }
+void led_output_mc_change() {}
+void led_output_end_mc_list() {}
+void led_output_new_mc() {}
+int32_t is_pico_w() { return 0; }
+void init_led(uint32_t pin) { (void) pin; }
+void set_led(uint32_t pin, uint32_t level) { (void) pin; (void) level; }
@@ -0,0 +1,48 @@
+/*
+ *	Host replacement for the header generated from psxSPI.pio.
+ *	The state machines are replaced by the mock bus (see mock_bus.h): each SM is bound
+ *	to its role when its init function runs, and the blocking FIFO accessors replay
+ *	recorded CMD/DAT traffic and capture the bytes sent by the memory card.
+ */
+#ifndef __HOST_PSXSPI_PIO_H__
+#define __HOST_PSXSPI_PIO_H__
+
+#include "hardware/pio.h"
+#include "mock_bus.h"
+
+#define PIN_DAT 5
+#define PIN_CMD 6
+#define PIN_SEL 7
+#define PIN_CLK 8
+#define PIN_ACK 9
+
+static const pio_program_t cmd_reader_program = { 0 };
+static const pio_program_t dat_reader_program = { 0 };
+static const pio_program_t dat_writer_program = { 0 };
+
+static inline void cmd_reader_program_init(PIO pio, uint sm, uint offset) {
+	(void) pio; (void) offset;
+	mock_bus_bind(sm, MOCK_SM_CMD_READER);
+}
+
+static inline void dat_reader_program_init(PIO pio, uint sm, uint offset) {
+	(void) pio; (void) offset;
+	mock_bus_bind(sm, MOCK_SM_DAT_READER);
+}
+
+static inline void dat_writer_program_init(PIO pio, uint sm, uint offset) {
+	(void) pio; (void) offset;
+	mock_bus_bind(sm, MOCK_SM_DAT_WRITER);
+}
+
+static inline uint8_t read_byte_blocking(PIO pio, uint sm) {
+	(void) pio;
+	return mock_bus_read_byte(sm);
+}
+
+static inline void write_byte_blocking(PIO pio, uint sm, uint32_t byte) {
+	(void) pio;
+	mock_bus_write_byte(sm, (uint8_t) byte);
+}
+
+#endif
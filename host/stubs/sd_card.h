@@ -0,0 +1,57 @@
+#ifndef __HOST_SD_CARD_H__
+#define __HOST_SD_CARD_H__
+
+#include "pico/types.h"
+#include "pico/mutex.h"
+#include "ff.h"
+
+enum {
+	SD_BLOCK_DEVICE_ERROR_NONE = 0,
+	SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK = 1 << 0,
+	SD_BLOCK_DEVICE_ERROR_UNSUPPORTED = 1 << 1,
+	SD_BLOCK_DEVICE_ERROR_PARAMETER = 1 << 2,
+	SD_BLOCK_DEVICE_ERROR_NO_INIT = 1 << 3,
+	SD_BLOCK_DEVICE_ERROR_NO_DEVICE = 1 << 4,
+	SD_BLOCK_DEVICE_ERROR_WRITE_PROTECTED = 1 << 5,
+	SD_BLOCK_DEVICE_ERROR_UNUSABLE = 1 << 6,
+	SD_BLOCK_DEVICE_ERROR_NO_RESPONSE = 1 << 7,
+	SD_BLOCK_DEVICE_ERROR_CRC = 1 << 8,
+	SD_BLOCK_DEVICE_ERROR_ERASE = 1 << 9,
+	SD_BLOCK_DEVICE_ERROR_WRITE = 1 << 10
+};
+
+typedef struct {
+	void* hw_inst;
+	uint miso_gpio;
+	uint mosi_gpio;
+	uint sck_gpio;
+	uint baud_rate;
+	void (*dma_isr)(void);
+} spi_t;
+
+typedef struct {
+	const char* pcName;
+	spi_t* spi;
+	uint ss_gpio;
+	bool use_card_detect;
+	int m_Status;
+	uint64_t sectors;
+	FATFS fatfs;
+	bool mounted;
+} sd_card_t;
+
+/* Raw blocks of the host SD card and counters of the driver calls, for the tests */
+#define HOST_SD_BLOCKS	256
+extern uint32_t host_sd_read_calls;
+extern uint32_t host_sd_write_calls;
+extern bool host_sd_fail_writes;
+extern uint host_sd_max_baud;		// transfers above this SPI clock fail with a CRC error, 0 for none
+extern uint32_t host_sd_corrupt_reads;	// reads left that return wrong data without an error
+
+void spi_irq_handler(spi_t* spi);
+
+int sd_init_card(sd_card_t* p_sd);
+int sd_read_blocks(sd_card_t* p_sd, uint8_t* buffer, uint64_t lba, uint32_t count);
+int sd_write_blocks(sd_card_t* p_sd, const uint8_t* buffer, uint64_t lba, uint32_t count);
+
+#endif
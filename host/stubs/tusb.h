@@ -0,0 +1,27 @@
+#ifndef __HOST_TUSB_H__
+#define __HOST_TUSB_H__
+
+/* The parts of TinyUSB used by msc_handler.c, with the firmware's tusb_config.h */
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CFG_TUSB_MCU			0
+#define OPT_MODE_DEVICE			0x01
+#define OPT_MODE_FULL_SPEED		0x00
+#define OPT_OS_NONE				1
+#define TUD_OPT_HIGH_SPEED		0
+#include "tusb_config.h"
+
+#define SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL	0x1e
+
+#define SCSI_SENSE_NOT_READY		0x02
+#define SCSI_SENSE_MEDIUM_ERROR		0x03
+#define SCSI_SENSE_ILLEGAL_REQUEST	0x05
+#define SCSI_SENSE_UNIT_ATTENTION	0x06
+
+/* Last sense set by the firmware, for the tests */
+extern uint8_t host_msc_sense_key;
+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
+
+#endif
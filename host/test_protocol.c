@@ -0,0 +1,1527 @@
+/*
+ *	Replays PSX bus traffic against the memory card protocol engine.
+ *
+ *	usage: test_protocol <image.mcr> <trace dir>
+ *
+ *	Every *.txt file in the trace directory is replayed on a freshly imported copy
+ *	of the image. Trace lines hold one bus byte each ("CMD DAT" in hex, the
+ *	memcard_sniffer output format), blank lines end a transaction and '#' starts a
+ *	comment. For memory card transactions the DAT column is the expected reply of
+ *	the card, for pad transactions it is the controller reply and the card must
+ *	stay silent. Programmatic checks of the same engine follow the replay.
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "console.h"
+#include "crc32.h"
+#include "flash_journal.h"
+#include "flash_tier.h"
+#include "game_map.h"
+#include "memcard_cache.h"
+#include "memcard_manager.h"
+#include "memcard_simulator.h"
+#include "host_sim.h"
+#include "mock_bus.h"
+#include "msc_cache.h"
+#include "msc_handler.h"
+#include "sd_config.h"
+#include "snapshot.h"
+#include "tusb.h"
+#include "pad.h"
+#include "pico/time.h"
+#include "hardware/flash.h"
+#include "switch_stats.h"
+#include "trace.h"
+#include "transfer.h"
+#include "ff.h"
+
+#undef DIR	// FatFs DIR from ff.h, traces are listed with <dirent.h>
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if(!(cond)) { \
+		++failures; \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while(0)
+
+static const char* image_path;
+
+static bool replay_transaction(const char* name, int index, const uint8_t* cmd, const uint8_t* dat, size_t len) {
+	uint8_t out[MOCK_BUS_MAX_LEN];
+	size_t sent = host_sim_transfer(cmd, dat, len, out);
+	if(cmd[0] != 0x81) {
+		if(sent) {
+			printf("FAIL %s: transaction %d: card replied to address 0x%02x\n", name, index, cmd[0]);
+			return false;
+		}
+		return true;
+	}
+	/* DAT of byte 0 is Hi-Z, byte n carries the n-th byte queued by the card */
+	for(size_t i = 1; i < len; i++) {
+		if(i - 1 >= sent || out[i - 1] != dat[i]) {
+			printf("FAIL %s: transaction %d byte %zu (CMD %02x): expected DAT %02x, got ", name, index, i, cmd[i], dat[i]);
+			if(i - 1 >= sent)
+				printf("nothing\n");
+			else
+				printf("%02x\n", out[i - 1]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static int replay_file(const char* path, const char* name) {
+	FILE* f = fopen(path, "r");
+	char line[128];
+	uint8_t cmd[MOCK_BUS_MAX_LEN], dat[MOCK_BUS_MAX_LEN];
+	size_t len = 0;
+	int transactions = 0;
+	bool ok = true;
+	if(!f) {
+		printf("FAIL %s: cannot open\n", name);
+		return 1;
+	}
+	if(host_sim_init(image_path) != MC_OK) {
+		printf("FAIL %s: cannot import %s\n", name, image_path);
+		fclose(f);
+		return 1;
+	}
+	while(ok) {
+		bool eof = !fgets(line, sizeof(line), f);
+		char* comment = eof ? NULL : strchr(line, '#');
+		unsigned int c, d;
+		if(comment)
+			*comment = 0;
+		if(!eof && sscanf(line, "%x %x", &c, &d) == 2) {
+			if(len < MOCK_BUS_MAX_LEN) {
+				cmd[len] = (uint8_t) c;
+				dat[len] = (uint8_t) d;
+				++len;
+			}
+			continue;
+		}
+		if(!eof && !comment && strspn(line, " \t\r\n") != strlen(line)) {
+			printf("FAIL %s: malformed line: %s", name, line);
+			ok = false;
+			break;
+		}
+		if(len && (eof || !comment)) {	// blank line or end of file closes the transaction
+			ok = replay_transaction(name, transactions++, cmd, dat, len);
+			len = 0;
+		}
+		if(eof)
+			break;
+	}
+	fclose(f);
+	if(ok)
+		printf("ok   %s (%d transactions)\n", name, transactions);
+	return ok ? 0 : 1;
+}
+
+static int name_cmp(const void* a, const void* b) {
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static void replay_traces(const char* dir_path) {
+	DIR* dir = opendir(dir_path);
+	char* names[256];
+	int count = 0;
+	if(!dir) {
+		printf("FAIL cannot open trace directory %s\n", dir_path);
+		++failures;
+		return;
+	}
+	struct dirent* ent;
+	while((ent = readdir(dir)) && count < 256) {
+		size_t n = strlen(ent->d_name);
+		if(n > 4 && !strcmp(ent->d_name + n - 4, ".txt"))
+			names[count++] = strdup(ent->d_name);
+	}
+	closedir(dir);
+	qsort(names, count, sizeof(char*), name_cmp);
+	for(int i = 0; i < count; i++) {
+		char path[512];
+		snprintf(path, sizeof(path), "%s/%s", dir_path, names[i]);
+		failures += replay_file(path, names[i]);
+		free(names[i]);
+	}
+	CHECK(count > 0, "no traces found in %s", dir_path);
+}
+
+static void test_read_all_sectors(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	host_sim_init(image_path);
+	for(uint16_t sector = 0; sector < MC_SEC_COUNT; sector++) {
+		size_t len = host_sim_build_read(cmd, sector);
+		size_t sent = host_sim_transfer(cmd, NULL, len, out);
+		const uint8_t* expected = memory_card_get_sector_ptr(&mc, sector);
+		uint8_t checksum = (sector >> 8) ^ (sector & 0xff);
+		for(int i = 0; i < MC_SEC_SIZE; i++)
+			checksum ^= expected[i];
+		CHECK(sent >= len - 1, "READ %03x: only %zu bytes sent", sector, sent);
+		CHECK(!memcmp(&out[9], expected, MC_SEC_SIZE), "READ %03x: data mismatch", sector);
+		CHECK(out[9 + MC_SEC_SIZE] == checksum, "READ %03x: checksum %02x != %02x", sector, out[9 + MC_SEC_SIZE], checksum);
+		CHECK(out[10 + MC_SEC_SIZE] == MC_GOOD, "READ %03x: end status %02x", sector, out[10 + MC_SEC_SIZE]);
+	}
+	printf("ok   read of all %d sectors\n", MC_SEC_COUNT);
+}
+
+static void test_first_ack(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	memcard_telemetry_t telemetry;
+	host_sim_init(image_path);
+	first_ack_time = 0;
+	const uint8_t pad_cmd[] = { 0x01, 0x42, 0x00, 0x00, 0x00 };
+	host_sim_transfer(pad_cmd, NULL, sizeof(pad_cmd), out);
+	CHECK(!first_ack_time, "pad command taken as the first ACK");
+	host_sim_transfer(cmd, NULL, host_sim_build_id(cmd), out);
+	uint32_t stamp = first_ack_time;
+	host_sim_transfer(cmd, NULL, host_sim_build_read(cmd, 0), out);
+	memcard_simulator_get_telemetry(&telemetry);
+	CHECK(stamp && first_ack_time == stamp && telemetry.first_ack_us == stamp, "first ACK not stamped once");
+	printf("ok   boot to first ACK\n");
+}
+
+static void test_read_interrupted(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	host_sim_init(image_path);
+	size_t len = host_sim_build_read(cmd, 0x0010);
+	host_sim_transfer(cmd, NULL, 40, out);	// SEL goes high while the frame is streamed
+	len = host_sim_build_read(cmd, 0x0020);
+	size_t sent = host_sim_transfer(cmd, NULL, len, out);
+	CHECK(sent >= len - 1, "READ after abort: only %zu bytes sent", sent);
+	CHECK(!memcmp(&out[9], memory_card_get_sector_ptr(&mc, 0x0020), MC_SEC_SIZE), "READ after abort: data mismatch");
+	printf("ok   read interrupted by SEL\n");
+}
+
+static void test_write_updates_card(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE];
+	host_sim_init(image_path);
+	for(int i = 0; i < MC_SEC_SIZE; i++)
+		data[i] = (uint8_t) (0xa5 ^ i);
+	size_t len = host_sim_build_write(cmd, 0x0123, data, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(!memcmp(memory_card_get_sector_ptr(&mc, 0x0123), data, MC_SEC_SIZE), "WRITE did not reach the RAM copy");
+	CHECK(out[len - 2] == MC_GOOD, "WRITE end status %02x", out[len - 2]);
+	CHECK(mc.flag_byte == 0x00, "FLAG not reset after write: %02x", mc.flag_byte);
+	CHECK(memory_card_pending_count(&mc) == 1 && (mc.dirty_set[0x0123 / 32] ^ mc.dirty_ack[0x0123 / 32]) == 1u << (0x0123 % 32),
+		"written sector not scheduled for sync");
+	memory_card_sync(&mc);
+	CHECK(!memory_card_has_pending(&mc), "sector still dirty after sync");
+
+	/* the write test sector is accepted but never synced */
+	len = host_sim_build_write(cmd, MC_TEST_SEC, data, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(!memory_card_has_pending(&mc), "write test sector scheduled for sync");
+	printf("ok   write path\n");
+}
+
+static void test_rewrites_coalesce(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	memory_card_stats_t before, after;
+	host_sim_init(image_path);
+	memory_card_get_stats(&mc, &before);
+	for(int i = 0; i < 5; i++) {	// directory frame updated several times during one save
+		memset(data, i, sizeof(data));
+		size_t len = host_sim_build_write(cmd, 0x0001, data, true);
+		host_sim_transfer(cmd, NULL, len, out);
+	}
+	CHECK(memory_card_pending_count(&mc) == 1, "%u sectors pending", memory_card_pending_count(&mc));
+	memory_card_sync(&mc);
+	memory_card_flush(&mc);
+	memory_card_get_stats(&mc, &after);
+	CHECK(after.sector_writes - before.sector_writes == 5, "%u writes counted", after.sector_writes - before.sector_writes);
+	CHECK(after.sector_syncs - before.sector_syncs == 1, "%u syncs for 5 rewrites", after.sector_syncs - before.sector_syncs);
+	CHECK(host_sim_read_image(0x0001, stored, 1) && !memcmp(stored, data, MC_SEC_SIZE), "last rewrite not on SD");
+
+	/* a write landing after the snapshot keeps the sector dirty */
+	memset(data, 0x55, sizeof(data));
+	size_t len = host_sim_build_write(cmd, 0x0002, data, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	uint32_t word = 0x0002 / 32;
+	uint32_t dirty = mc.dirty_set[word] ^ mc.dirty_ack[word];
+	mc.dirty_ack[word] ^= dirty;		// core0 snapshot...
+	host_sim_transfer(cmd, NULL, len, out);	// ...core1 rewrites before the data is read
+	CHECK(memory_card_pending_count(&mc) == 1, "rewrite after snapshot lost");
+	printf("ok   rewrites coalesce\n");
+}
+
+static void test_sync_uses_open_image(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	host_sim_init(image_path);
+	uint32_t opens = host_ff_stats.opens;
+	uint32_t syncs = host_ff_stats.syncs;
+	uint32_t writes = host_ff_stats.writes;
+	memory_card_stats_t before, after;
+	memory_card_get_stats(&mc, &before);
+	for(uint16_t sector = 0x0200; sector < 0x0240; sector++) {	// one 8KB save block
+		memset(data, sector & 0xff, sizeof(data));
+		size_t len = host_sim_build_write(cmd, sector, data, true);
+		host_sim_transfer(cmd, NULL, len, out);
+	}
+	sync_step();
+	CHECK(memory_card_is_dirty(&mc), "synced image not marked dirty");
+	CHECK(memory_card_flush(&mc) == MC_OK, "flush failed");
+	CHECK(!memory_card_is_dirty(&mc), "image still dirty after flush");
+	CHECK(host_ff_stats.opens == opens, "sync reopened the image %u times", host_ff_stats.opens - opens);
+	CHECK(host_ff_stats.syncs == syncs + 1, "%u flushes for one save", host_ff_stats.syncs - syncs);
+	memory_card_get_stats(&mc, &after);
+	CHECK(host_ff_stats.writes == writes + 1, "%u file writes for one contiguous save", host_ff_stats.writes - writes);
+	CHECK(after.block_writes - before.block_writes == 16, "%u SD blocks for 64 sectors", after.block_writes - before.block_writes);
+	for(uint16_t sector = 0x0200; sector < 0x0240; sector++) {
+		memset(data, sector & 0xff, sizeof(data));
+		CHECK(host_sim_read_image(sector, stored, 1) && !memcmp(stored, data, MC_SEC_SIZE), "sector %03x not on SD", sector);
+	}
+	printf("ok   sync through the open image\n");
+}
+
+static void test_sync_skips_test_sector(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE], original[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	host_sim_init(image_path);
+	CHECK(host_sim_read_image(MC_TEST_SEC, original, 1), "cannot read test sector");
+	for(uint16_t sector = MC_TEST_SEC - MC_SEC_PER_BLOCK + 1; sector <= MC_TEST_SEC - 1; sector++) {
+		memset(data, 0xa0 | (sector & 0x0f), sizeof(data));
+		size_t len = host_sim_build_write(cmd, sector, data, true);
+		host_sim_transfer(cmd, NULL, len, out);
+	}
+	sync_step();
+	memory_card_flush(&mc);
+	for(uint16_t sector = MC_TEST_SEC - MC_SEC_PER_BLOCK + 1; sector <= MC_TEST_SEC - 1; sector++) {
+		memset(data, 0xa0 | (sector & 0x0f), sizeof(data));
+		CHECK(host_sim_read_image(sector, stored, 1), "cannot read sector %03x", sector);
+		if(sector == MC_TEST_SEC)
+			CHECK(!memcmp(stored, original, MC_SEC_SIZE), "write test data reached the SD card");
+		else
+			CHECK(!memcmp(stored, data, MC_SEC_SIZE), "sector %03x not on SD", sector);
+	}
+	printf("ok   write test sector kept off the SD card\n");
+}
+
+static void test_unchanged_sector_skipped(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE];
+	memory_card_stats_t before, after;
+	host_sim_init(image_path);
+	memcpy(data, memory_card_get_sector_ptr(&mc, 0x0001), MC_SEC_SIZE);	// games rewrite directory frames as is
+	uint32_t writes = host_ff_stats.writes;
+	memory_card_get_stats(&mc, &before);
+	size_t len = host_sim_build_write(cmd, 0x0001, data, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	sync_step();
+	memory_card_get_stats(&mc, &after);
+	CHECK(after.sector_skips - before.sector_skips == 1, "unchanged sector not recognised");
+	CHECK(host_ff_stats.writes == writes, "unchanged sector written to SD");
+	printf("ok   unchanged sector skipped\n");
+}
+
+static void test_sync_failure_retried(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	host_sim_init(image_path);
+	memset(data, 0x6c, sizeof(data));
+	size_t len = host_sim_build_write(cmd, 0x0140, data, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	len = host_sim_build_write(cmd, MC_TEST_SEC - 1, data, true);	// written alone, next to the test sector
+	host_sim_transfer(cmd, NULL, len, out);
+
+	/* the SD card never got them: still dirty, and not known to be on SD */
+	host_ff_fail_writes = true;
+	CHECK(memory_card_sync(&mc) != MC_OK, "failed sync reported as done");
+	host_ff_fail_writes = false;
+	CHECK(memory_card_pending_count(&mc) == 2 && !mc.meta[0x0140].crc_valid && !mc.meta[MC_TEST_SEC - 1].crc_valid,
+		"%u sectors pending after a failed sync", (unsigned) memory_card_pending_count(&mc));
+
+	/* rewritten as is, they are still written back by the next sync */
+	len = host_sim_build_write(cmd, 0x0140, data, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(memory_card_sync(&mc) == MC_OK && !memory_card_has_pending(&mc), "failed sectors not synced again");
+	memory_card_flush(&mc);
+	CHECK(host_sim_read_image(0x0140, stored, 1) && !memcmp(stored, data, MC_SEC_SIZE) &&
+		host_sim_read_image(MC_TEST_SEC - 1, stored, 1) && !memcmp(stored, data, MC_SEC_SIZE), "failed sectors never reached SD");
+	printf("ok   failed sync retried\n");
+}
+
+static void test_crc_and_checksum(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE];
+	CHECK(crc32((const uint8_t*) "123456789", 9) == 0xCBF43926, "crc32 check value %08x", crc32((const uint8_t*) "123456789", 9));
+	host_sim_init(image_path);
+	for(int i = 0; i < MC_SEC_SIZE; i++)
+		data[i] = (uint8_t) (i * 7);
+	size_t len = host_sim_build_write(cmd, 0x0155, data, false);	// stored even with a bad checksum
+	host_sim_transfer(cmd, NULL, len, out);
+	len = host_sim_build_read(cmd, 0x0155);
+	host_sim_transfer(cmd, NULL, len, out);
+	uint8_t checksum = 0x01 ^ 0x55;
+	for(int i = 0; i < MC_SEC_SIZE; i++)
+		checksum ^= data[i];
+	CHECK(out[9 + MC_SEC_SIZE] == checksum, "READ after WRITE: checksum %02x != %02x", out[9 + MC_SEC_SIZE], checksum);
+	CHECK(!(mc.meta[0x0155].generation & 1), "generation left odd after WRITE");
+
+	/* SEL rising in the middle of the data leaves a partly written sector behind */
+	memset(data, 0x3c, sizeof(data));
+	len = host_sim_build_write(cmd, 0x0156, data, true);
+	host_sim_transfer(cmd, NULL, 40, out);
+	host_sim_transfer(cmd, NULL, 1, out);		// core1 restarts on the next transaction
+	const uint8_t* sec_ptr = memory_card_get_sector_ptr(&mc, 0x0156);
+	checksum = 0;
+	for(int i = 0; i < MC_SEC_SIZE; i++)
+		checksum ^= sec_ptr[i];
+	CHECK(mc.meta[0x0156].checksum == checksum, "checksum of interrupted WRITE not recomputed");
+	CHECK(!(mc.meta[0x0156].generation & 1), "generation left odd after interrupted WRITE");
+	CHECK(memory_card_pending_count(&mc) == 2, "interrupted WRITE not scheduled for sync");
+	CHECK(!write_transaction.locked, "interrupted WRITE kept write_transaction locked");
+	printf("ok   cached checksums\n");
+}
+
+static void test_scrub_repairs_sd(void) {
+	uint8_t junk[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	memory_card_stats_t stats;
+	host_sim_init(image_path);
+	memset(junk, 0xee, sizeof(junk));
+	CHECK(host_sim_write_image(0x0081, junk, 1), "cannot corrupt image");
+	uint32_t status = MC_OK;
+	for(uint32_t block = 0; block < MC_BLOCK_COUNT; block++)
+		if(memory_card_scrub_step(&mc) != MC_OK)
+			status = MC_SCRUB_MISMATCH;
+	memory_card_flush(&mc);
+	memory_card_get_stats(&mc, &stats);
+	CHECK(status == MC_SCRUB_MISMATCH && stats.scrub_errors == 1, "%u scrub errors", stats.scrub_errors);
+	CHECK(host_sim_read_image(0x0081, stored, 1) && !memcmp(stored, memory_card_get_sector_ptr(&mc, 0x0081), MC_SEC_SIZE),
+		"corrupted sector not rewritten");
+	for(uint32_t block = 0; block < MC_BLOCK_COUNT; block++)
+		CHECK(memory_card_scrub_step(&mc) == MC_OK, "mismatch left in block %u", block);
+	printf("ok   scrub repairs SD copy\n");
+}
+
+static void test_image_cache(void) {
+	static uint8_t image[MC_SIZE], restored[MC_SIZE];
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	memcard_cache_stats_t stats;
+	uint8_t new_name[MAX_MC_FILENAME_LEN + 1];
+	host_sim_init(image_path);
+	memcard_cache_init();
+	memcpy(image, mc.data, MC_SIZE);
+
+	/* image left behind on a switch */
+	CHECK(memcard_cache_store(HOST_SIM_IMAGE, mc.data) == MCC_OK, "store failed");
+	CHECK(!memcard_cache_load("9.MCR", restored), "hit on an image never cached");
+	memset(restored, 0x5a, MC_SIZE);
+	CHECK(memcard_cache_load(HOST_SIM_IMAGE, restored) && !memcmp(restored, image, MC_SIZE), "cached image differs");
+	memcard_cache_get_stats(&stats);
+	CHECK(stats.hits == 1 && stats.misses == 1, "%u hits %u misses", stats.hits, stats.misses);
+	CHECK(stats.used_bytes < MC_SIZE / 2, "sample image compressed to %u bytes", stats.used_bytes);
+	printf("     sample image: %u bytes cached, %u us to decompress\n", stats.used_bytes, stats.last_decompress_us);
+
+	/* neighbour prefetched a block at a time */
+	CHECK(memcard_manager_create(new_name) == MM_OK, "cannot create image");
+	memcard_cache_set_prefetch(HOST_SIM_IMAGE, new_name);
+	uint32_t steps = 0;
+	while(memcard_cache_prefetch_step())
+		steps++;
+	memcard_cache_get_stats(&stats);
+	CHECK(stats.prefetched == 1 && steps == MC_BLOCK_COUNT + 1, "prefetch took %u steps", steps);
+	uint32_t reads = host_ff_stats.reads;
+	memory_card_withdraw(&mc);	// the PSX keeps reading while the cached copy is restored
+	size_t len = host_sim_build_read(cmd, 0x0010);
+	CHECK(host_sim_transfer(cmd, NULL, len, out) == 0, "card answered while it is restored");
+	CHECK(memcard_cache_load(new_name, mc.data), "prefetched image missing");
+	CHECK(memory_card_import_cached(&mc, new_name) == MC_OK, "cached import failed");
+	CHECK(host_ff_stats.reads == reads, "cached import read from SD");
+	CHECK(memory_card_import(&mc, new_name) == MC_OK, "import failed");
+	CHECK(memcard_cache_load(new_name, restored) && !memcmp(restored, mc.data, MC_SIZE), "prefetched image differs");
+
+	/* least recently used images are dropped first */
+	memcard_cache_init();
+	for(uint32_t i = 0; i <= MC_CACHE_ENTRIES; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "%u.MCR", 10 + i);
+		memcard_cache_store(name, image);
+	}
+	memcard_cache_get_stats(&stats);
+	CHECK(stats.entries <= MC_CACHE_ENTRIES && stats.used_bytes <= MC_CACHE_BUDGET, "%u entries %u bytes", stats.entries, stats.used_bytes);
+	CHECK(!memcard_cache_load("10.MCR", restored), "oldest image not evicted");
+	CHECK(memcard_cache_load("14.MCR", restored), "newest image evicted");
+	memcard_cache_init();
+	printf("ok   image cache\n");
+}
+
+static void test_streaming_import(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE], expected[MC_SEC_SIZE];
+	host_sim_init(image_path);
+	CHECK(memory_card_import_begin(&mc, HOST_SIM_IMAGE) == MC_OK, "import begin failed");
+	CHECK(!memory_card_import_done(&mc), "whole image loaded up front");
+
+	/* the card stays disconnected, no ACK at all, until the whole image is loaded */
+	size_t len = host_sim_build_read(cmd, 0x0001);
+	CHECK(host_sim_transfer(cmd, NULL, len, out) == 0, "READ answered during the import");
+	memset(data, 0x11, sizeof(data));
+	len = host_sim_build_write(cmd, 0x0310, data, true);
+	CHECK(host_sim_transfer(cmd, NULL, len, out) == 0, "WRITE answered during the import");
+	CHECK(!write_transaction.locked, "unanswered WRITE kept write_transaction locked");
+	CHECK(memory_card_request_sector(&mc, 0x0001) && host_sim_read_image(0x0001, expected, 1)
+		&& !memcmp(memory_card_get_sector_ptr(&mc, 0x0001), expected, MC_SEC_SIZE), "block 0 not resident");
+
+	/* a sector found not resident is loaded next */
+	CHECK(memory_card_import_step(&mc) == MC_OK, "import step failed");
+	CHECK(!memory_card_request_sector(&mc, 0x0310), "sector loaded out of order");
+	CHECK(memory_card_import_step(&mc) == MC_OK, "import step failed");
+	CHECK(memory_card_request_sector(&mc, 0x0310) && !memory_card_request_sector(&mc, 0x0100), "requested sector not loaded first");
+
+	uint32_t steps = 0;
+	while(!memory_card_import_done(&mc) && memory_card_import_step(&mc) == MC_OK)
+		steps++;
+	CHECK(steps == MC_DIRTY_WORDS - 4, "%u steps to finish the import", steps);
+	len = host_sim_build_read(cmd, 0x0300);
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(host_sim_read_image(0x0300, expected, 1) && !memcmp(&out[9], expected, MC_SEC_SIZE), "READ after the import");
+	for(uint16_t sector = 0; sector < MC_SEC_COUNT; sector++) {
+		CHECK(host_sim_read_image(sector, expected, 1) && !memcmp(memory_card_get_sector_ptr(&mc, sector), expected, MC_SEC_SIZE),
+			"sector %03x differs after streaming import", sector);
+	}
+	printf("ok   streaming import\n");
+}
+
+static void test_image_index(void) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1], prev[MAX_MC_FILENAME_LEN + 1], next[MAX_MC_FILENAME_LEN + 1];
+	host_sim_init(image_path);
+	CHECK(memcard_manager_init() == MM_OK, "index build failed");
+	uint32_t count = memcard_manager_count();
+	for(int i = 0; i < 3; i++)
+		CHECK(memcard_manager_create(name) == MM_OK, "create failed");
+	CHECK(memcard_manager_count() == count + 3, "created images not indexed");
+
+	/* a failed blank write leaves neither a partial file nor an index entry */
+	char partial[MAX_MC_FILENAME_LEN + 1];
+	snprintf(partial, sizeof(partial), "%.*s%u.MCR", (int) (strrchr(name, '/') + 1 - (char*) name), name,
+		(unsigned) atoi(strrchr(name, '/') + 1) + 1);
+	host_ff_fail_writes = true;
+	CHECK(memcard_manager_create(next) == MM_FILE_WRITE_ERR && memcard_manager_count() == count + 3, "failed create indexed");
+	host_ff_fail_writes = false;
+	CHECK(f_stat(partial, NULL) != FR_OK, "partial image %s left behind", partial);
+
+	uint32_t readdirs = host_ff_stats.readdirs;
+	uint32_t stats = host_ff_stats.stats;
+	CHECK(memcard_manager_get(0, name) == MM_OK && !strcmp(name, HOST_SIM_IMAGE), "first image %s", name);
+	for(uint32_t i = 1; i < memcard_manager_count(); i++) {
+		uint8_t expected[MAX_MC_FILENAME_LEN + 1];
+		memcard_manager_get(i, expected);
+		CHECK(memcard_manager_get_next(name, next) == MM_OK && !strcmp(next, expected), "next of %s is %s", name, next);
+		CHECK(strcmp(name, next) < 0, "index not sorted");
+		uint8_t after[MAX_MC_FILENAME_LEN + 1];
+		CHECK(memcard_manager_get_neighbours(next, prev, after) == MM_OK && !strcmp(prev, name) && memcard_manager_exist(next),
+			"neighbours of %s", next);
+		strcpy(name, next);
+	}
+	CHECK(memcard_manager_get_next(name, next) == MM_NO_ENTRY, "next past the last image");
+	CHECK(memcard_manager_get_prev(name, prev) == MM_OK, "prev of the last image");
+	CHECK(host_ff_stats.readdirs == readdirs && host_ff_stats.stats == stats, "lookups went to the SD card");
+
+	/* the last card is stored by path, a position stored by older firmware (strcmp order of the root) is converted */
+	FIL file;
+	UINT written;
+	const char* root_images[] = { "2.MCR", "10.MCR" };
+	for(int i = 0; i < 2; i++) {
+		CHECK(f_open(&file, root_images[i], FA_CREATE_NEW | FA_WRITE) == FR_OK && memory_card_write_blank(&file) == MC_OK &&
+			f_close(&file) == FR_OK, "cannot create %s", root_images[i]);
+	}
+	f_unlink("MemcardCatalog.dat");
+	CHECK(memcard_manager_init() == MM_OK, "index rebuild failed");
+	CHECK(f_open(&file, "LastMemcardIndex.dat", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK &&
+		f_write(&file, "1", 1, &written) == FR_OK && f_close(&file) == FR_OK, "cannot write old index");
+	CHECK(memcard_manager_get_initial(name) == MM_OK && !strcmp(name, "10.MCR"), "old index 1 loads %s", name);
+	CHECK(f_open(&file, "LastMemcardIndex.dat", FA_READ) == FR_OK && f_gets((TCHAR*) name, sizeof(name), &file) &&
+		f_close(&file) == FR_OK && !strcmp(name, "10.MCR"), "old index converted to %s", name);
+	CHECK(memcard_manager_get_prev((uint8_t*) "10.MCR", prev) == MM_OK && !strcmp(prev, "2.MCR") &&
+		memcard_manager_get_initial(name) == MM_OK && !strcmp(name, "2.MCR"), "last card %s", name);
+	for(int i = 0; i < 2; i++)
+		f_unlink(root_images[i]);
+	f_unlink("MemcardCatalog.dat");
+	f_unlink("LastMemcardIndex.dat");
+	memcard_manager_init();
+	printf("ok   image index\n");
+}
+
+static void test_image_catalog(void) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1], renamed[] = "900.MCR";
+	host_sim_init(image_path);
+	f_unlink("MemcardCatalog.dat");
+	uint32_t readdirs = host_ff_stats.readdirs;
+	CHECK(memcard_manager_init() == MM_OK && host_ff_stats.readdirs > readdirs, "no catalog, directory not scanned");
+	CHECK(f_stat("MemcardCatalog.dat", NULL) == FR_OK, "catalog not written");
+	uint32_t count = memcard_manager_count();
+
+	/* second boot is served from the catalog and the background check finds nothing to change */
+	readdirs = host_ff_stats.readdirs;
+	CHECK(memcard_manager_init() == MM_OK && memcard_manager_count() == count, "catalog load failed");
+	CHECK(host_ff_stats.readdirs == readdirs, "directory scanned despite a valid catalog");
+	uint32_t writes = host_ff_stats.writes;
+	while(memcard_manager_verify_step());
+	CHECK(host_ff_stats.writes == writes, "up to date catalog rewritten");
+
+	/* image renamed from a PC: stale until verified, then fixed for the next boot too */
+	CHECK(count >= 2 && memcard_manager_get(1, name) == MM_OK && f_rename(name, renamed) == FR_OK, "rename failed");
+	memcard_manager_init();
+	CHECK(!memcard_manager_exist(renamed), "catalog not used");
+	while(memcard_manager_verify_step());
+	CHECK(memcard_manager_exist(renamed) && !memcard_manager_exist(name) && memcard_manager_count() == count,
+		"stale catalog not rebuilt");
+	readdirs = host_ff_stats.readdirs;
+	memcard_manager_init();
+	CHECK(memcard_manager_exist(renamed) && host_ff_stats.readdirs == readdirs, "rebuilt catalog not saved");
+	printf("ok   image catalog\n");
+}
+
+static void test_image_shards(void) {
+	uint8_t first[MAX_MC_FILENAME_LEN + 1], second[MAX_MC_FILENAME_LEN + 1], third[MAX_MC_FILENAME_LEN + 1];
+	host_sim_init(image_path);
+	CHECK(memcard_manager_init() == MM_OK && memcard_manager_create(first) == MM_OK, "create failed");
+	CHECK(!strncmp(first, "MCR", 3) && strchr(first, '/'), "image %s not created in a shard folder", first);
+
+	/* the catalog grows by one entry instead of being rewritten */
+	uint64_t written = host_ff_stats.bytes_written;
+	uint32_t opens = host_ff_stats.opens;
+	CHECK(memcard_manager_create(second) == MM_OK, "create failed");
+	CHECK(host_ff_stats.bytes_written - written < MC_SIZE + 128, "catalog rewritten on create");
+	CHECK(host_ff_stats.opens - opens == 3, "create took %u opens", (unsigned) (host_ff_stats.opens - opens));
+
+	/* ids are not reused once their image is deleted */
+	CHECK(f_unlink(second) == FR_OK, "unlink failed");
+	memcard_manager_init();
+	while(memcard_manager_verify_step());
+	CHECK(!memcard_manager_exist(second) && memcard_manager_create(third) == MM_OK, "create after delete failed");
+	CHECK(atoi(strchr(third, '/') + 1) > atoi(strchr(second, '/') + 1), "id of %s reused by %s", second, third);
+	printf("ok   image shards\n");
+}
+
+static void write_game_map(const char* text) {
+	FIL file;
+	UINT written;
+	CHECK(f_open(&file, "GameMap.txt", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK &&
+		f_write(&file, text, strlen(text), &written) == FR_OK && f_close(&file) == FR_OK, "cannot write GameMap.txt");
+}
+
+static void test_game_id(void) {
+	const char id[] = "SLUS-00892";
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], name[MAX_MC_FILENAME_LEN + 1];
+	size_t len = 0;
+	host_sim_init(image_path);
+	cmd[len++] = 0x81;
+	cmd[len++] = 0x21;
+	cmd[len++] = sizeof(id) - 1;
+	memcpy(&cmd[len], id, sizeof(id) - 1);
+	len += sizeof(id) - 1;
+	cmd[len++] = 0x00;
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(request_game_mc && !strcmp(requested_game_id, id), "game id %s not handed to core0", requested_game_id);
+	/* a game id is not overwritten until core0 copied it */
+	memcpy(&cmd[3], "SCUS-94163", sizeof(id) - 1);
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(!strcmp(requested_game_id, id), "pending game id overwritten by %s", requested_game_id);
+	request_game_mc = false;
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(request_game_mc && !strcmp(requested_game_id, "SCUS-94163"), "next game id %s", requested_game_id);
+
+	write_game_map("# game id -> image or folder\nslus-00892 FF7\nSCUS-94163\t" HOST_SIM_IMAGE "\n");
+	CHECK(memcard_manager_init() == MM_OK && game_map_load() == GM_OK && game_map_count() == 2, "map not loaded");
+	CHECK(memcard_manager_get_game("SCUS-94163", name) == MM_OK && !strcmp(name, HOST_SIM_IMAGE), "mapped image %s", name);
+	CHECK(memcard_manager_get_game(id, name) == MM_OK && !strcmp(name, "FF7/0.MCR"), "mapped folder gave %s", name);
+	uint32_t opens = host_ff_stats.opens;
+	CHECK(memcard_manager_get_game(id, name) == MM_OK && !strcmp(name, "FF7/0.MCR"), "second lookup gave %s", name);
+	CHECK(host_ff_stats.opens - opens == 1, "lookup opened %u files", (unsigned) (host_ff_stats.opens - opens));	// LastMemcardIndex.dat
+	CHECK(memcard_manager_get_game("sles_123.45 ", name) == MM_OK && !strcmp(name, "SLES_123.45/0.MCR"), "per-game folder %s", name);
+
+	/* thousands of titles */
+	char* text = malloc(3000 * 32);
+	size_t text_len = 0;
+	for(int i = 0; i < 3000; i++)
+		text_len += sprintf(&text[text_len], "SLPS-%05d G%d\n", i, i % 7);
+	write_game_map(text);
+	free(text);
+	CHECK(game_map_load() == GM_OK && game_map_count() == 3000, "%u titles loaded", (unsigned) game_map_count());
+	CHECK(game_map_find("SLPS-02999") && !strcmp(game_map_find("SLPS-02999"), "G3") && !game_map_find("SLPS-03000"), "large map lookup");
+	f_unlink("GameMap.txt");
+	game_map_load();
+	printf("ok   game id\n");
+}
+
+static void test_channels(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], sector[MC_SEC_SIZE], blank[MC_SEC_SIZE];
+	static uint8_t channel0[MC_SIZE];
+	host_sim_init(image_path);
+	memcpy(channel0, mc.data, MC_SIZE);
+
+	/* MEMCARD_NAME answers from RAM */
+	const uint8_t name_cmd[] = { 0x81, 0x26, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	size_t sent = host_sim_transfer(name_cmd, NULL, sizeof(name_cmd), out);
+	CHECK(sent == sizeof(name_cmd) && out[2] == 0x20 && out[3] == 3 && !memcmp(&out[4], "0-1", 3) && out[7] == 0xff,
+		"card name reply");
+
+	const uint8_t next_cmd[] = { 0x81, 0x23, 0x00, 0x00 };
+	host_sim_transfer(next_cmd, NULL, sizeof(next_cmd), out);
+	CHECK(request_next_chan && out[2] == 0x20, "next channel not requested");
+	request_next_chan = false;
+	const uint8_t next_card_cmd[] = { 0x81, 0x25, 0x00, 0x00 };
+	host_sim_transfer(next_card_cmd, NULL, sizeof(next_card_cmd), out);
+	CHECK(request_next_mc, "next card not requested");
+	request_next_mc = false;
+
+	/* a new channel is appended to the open image, formatted */
+	CHECK(memory_card_switch_channel(&mc, 1) == MC_OK && mc.channel_count == 2, "channel 1 not created");
+	while(!memory_card_import_done(&mc))
+		memory_card_import_step(&mc);
+	memory_card_blank_sector(0, blank);
+	CHECK(!memcmp(mc.data, blank, MC_SEC_SIZE), "new channel not formatted");
+
+	/* writes land in the channel's slot of the file */
+	memset(sector, 0x3c, MC_SEC_SIZE);
+	size_t len = host_sim_build_write(cmd, 100, sector, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	while(memory_card_has_pending(&mc))
+		sync_step();
+	memory_card_flush(&mc);
+	uint8_t stored[MC_SEC_SIZE];
+	CHECK(host_sim_read_image(MC_SEC_COUNT + 100, stored, 1) && !memcmp(stored, sector, MC_SEC_SIZE), "channel 1 write not stored");
+	CHECK(host_sim_read_image(100, stored, 1) && !memcmp(stored, &channel0[100 * MC_SEC_SIZE], MC_SEC_SIZE), "channel 0 modified");
+
+	CHECK(memory_card_switch_channel(&mc, 0) == MC_OK, "back to channel 0");
+	while(!memory_card_import_done(&mc))
+		memory_card_import_step(&mc);
+	CHECK(!memcmp(mc.data, channel0, MC_SIZE), "channel 0 content");
+	CHECK(memcard_manager_rescan() == MM_OK && memcard_manager_exist(HOST_SIM_IMAGE), "multi-channel image not indexed");
+	printf("ok   channels\n");
+}
+
+static void test_pad_combos(void) {
+	static const struct {
+		uint16_t buttons;
+		bool* flag;
+	} combos[] = {
+		{ START & SELECT & UP, &request_next_mc },
+		{ START & SELECT & DOWN, &request_prev_mc },
+		{ START & SELECT & TRIANGLE, &request_new_mc },
+	};
+	for(size_t i = 0; i < sizeof(combos) / sizeof(combos[0]); i++) {
+		const uint8_t cmd[] = { 0x01, 0x42, 0x00, 0x00, 0x00 };
+		const uint8_t dat[] = { 0xff, 0x41, 0x5a, combos[i].buttons & 0xff, combos[i].buttons >> 8 };
+		uint8_t out[MOCK_BUS_MAX_LEN];
+		host_sim_init(image_path);
+		size_t sent = host_sim_transfer(cmd, dat, sizeof(cmd), out);
+		CHECK(sent == 0, "card replied during pad poll");
+		CHECK(*combos[i].flag, "pad combo %04x not detected", combos[i].buttons);
+	}
+	printf("ok   pad combos\n");
+}
+
+static void test_switch_stats(void) {
+	switch_phase_stats_t stats;
+	switch_stats_reset();
+	for(uint32_t us = 100; us >= 1; us--)
+		switch_stats_record(SWITCH_PHASE_TOTAL, us);
+	switch_stats_get(SWITCH_PHASE_TOTAL, &stats);
+	CHECK(stats.count == 100 && stats.min == 1 && stats.max == 100, "count %u min %u max %u",
+		(unsigned) stats.count, (unsigned) stats.min, (unsigned) stats.max);
+	CHECK(stats.avg == 50 && stats.p99 == 99, "avg %u p99 %u", (unsigned) stats.avg, (unsigned) stats.p99);
+	/* older samples roll out of the window */
+	for(uint32_t i = 0; i < SWITCH_STATS_WINDOW; i++)
+		switch_stats_record(SWITCH_PHASE_TOTAL, 1000);
+	switch_stats_get(SWITCH_PHASE_TOTAL, &stats);
+	CHECK(stats.count == 100 + SWITCH_STATS_WINDOW && stats.min == 1000 && stats.p99 == 1000, "window kept old samples");
+	switch_stats_reset();
+	switch_stats_get(SWITCH_PHASE_TOTAL, &stats);
+	CHECK(stats.count == 0, "reset kept %u samples", (unsigned) stats.count);
+
+	/* core1 stamps the request and the first READ served once armed */
+	const uint8_t cmd[] = { 0x01, 0x42, 0x00, 0x00, 0x00 };
+	const uint8_t dat[] = { 0xff, 0x41, 0x5a, (START & SELECT & UP) & 0xff, (START & SELECT & UP) >> 8 };
+	uint8_t read_cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	host_sim_init(image_path);
+	switch_request_time = 0;
+	sleep_ms(5);
+	host_sim_transfer(cmd, dat, sizeof(cmd), out);
+	CHECK(request_next_mc && switch_request_time != 0, "combo did not stamp the request");
+	uint32_t request_time = switch_request_time;
+	sleep_ms(5);
+	host_sim_transfer(cmd, dat, sizeof(cmd), out);	// combo still held
+	CHECK(switch_request_time == request_time, "held combo restarted the timing");
+	first_read_armed = true;
+	size_t len = host_sim_build_read(read_cmd, 0x0001);
+	host_sim_transfer(read_cmd, NULL, len, out);
+	CHECK(!first_read_armed && first_read_time - request_time >= 5000, "first READ not stamped");
+	printf("ok   card switch latency\n");
+}
+
+/* Send one console frame, returns the length of what the console answered in reply */
+static uint32_t console_request(uint8_t command, const uint8_t* payload, uint8_t length, uint8_t* reply) {
+	uint8_t frame[CONSOLE_SECTOR_PAYLOAD + 4] = { CONSOLE_SOF, command, length };
+	uint8_t checksum = command ^ length;
+	for(uint32_t i = 0; i < length; i++)
+		checksum ^= frame[3 + i] = payload[i];
+	frame[3 + length] = checksum;
+	console_receive(frame, length + 4);
+	return console_transmit(reply, 256);
+}
+
+static void test_console(void) {
+	uint8_t reply[256], cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	console_counters_t before, after;
+	host_sim_init(image_path);
+	console_init();
+
+	uint32_t len = console_request(CONSOLE_PING, NULL, 0, reply);
+	CHECK(len == 5 && reply[0] == CONSOLE_SOF && reply[1] == (CONSOLE_PING | CONSOLE_REPLY) && reply[2] == 1
+		&& reply[3] == CONSOLE_VERSION && reply[4] == (reply[1] ^ reply[2] ^ reply[3]), "PING reply");
+
+	const uint8_t corrupted[] = { 0x00, CONSOLE_SOF, CONSOLE_PING, 0x00, 0x42 };	// leading garbage is skipped
+	console_receive(corrupted, sizeof(corrupted));
+	len = console_transmit(reply, sizeof(reply));
+	CHECK(len == 6 && reply[1] == CONSOLE_ERROR && reply[3] == CONSOLE_PING && reply[4] == CONSOLE_BAD_CHECKSUM, "bad checksum not reported");
+
+	len = console_request(CONSOLE_COUNTERS, NULL, 0, reply);
+	CHECK(len == sizeof(before) + 4 && reply[2] == sizeof(before), "COUNTERS reply of %u bytes", (unsigned) len);
+	memcpy(&before, &reply[3], sizeof(before));
+	host_sim_transfer(cmd, NULL, host_sim_build_read(cmd, 0x0002), out);
+	uint8_t data[MC_SEC_SIZE] = { 0 };
+	host_sim_transfer(cmd, NULL, host_sim_build_write(cmd, 0x0003, data, false), out);
+	host_sim_transfer(cmd, NULL, host_sim_build_id(cmd), out);
+	console_request(CONSOLE_COUNTERS, NULL, 0, reply);
+	memcpy(&after, &reply[3], sizeof(after));
+	CHECK(after.reads == before.reads + 1 && after.writes == before.writes + 1 && after.ids == before.ids + 1,
+		"transactions not counted");
+	CHECK(after.bad_checksums == before.bad_checksums + 1, "bad checksum WRITE not counted");
+	CHECK(after.pending == 1, "sync backlog %u", (unsigned) after.pending);
+
+	len = console_request(CONSOLE_IMAGE, NULL, 0, reply);
+	CHECK(len == 7 && !memcmp(&reply[3], "0-1", 3), "IMAGE reply");
+
+	/* streaming: one COUNTERS frame per period, none in between */
+	const uint8_t period[] = { 20, 0 };
+	len = console_request(CONSOLE_STREAM, period, sizeof(period), reply);
+	CHECK(len == 6 && reply[1] == (CONSOLE_STREAM | CONSOLE_REPLY), "STREAM reply");
+	len = console_transmit(reply, sizeof(reply));
+	CHECK(len == sizeof(before) + 4, "STREAM did not start with a sample");
+	CHECK(console_transmit(reply, sizeof(reply)) == 0, "sample sent before the period");
+	sleep_ms(20);
+	len = console_transmit(reply, sizeof(reply));
+	CHECK(len == sizeof(before) + 4 && reply[1] == (CONSOLE_COUNTERS | CONSOLE_REPLY), "no sample after the period");
+	const uint8_t stop[] = { 0, 0 };
+	console_request(CONSOLE_STREAM, stop, sizeof(stop), reply);
+	sleep_ms(20);
+	CHECK(console_transmit(reply, sizeof(reply)) == 0, "sample sent after stopping");
+	printf("ok   console\n");
+}
+
+static void test_trace(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	uint8_t data[MC_SEC_SIZE] = { 0 };
+	trace_record_t records[8];
+	host_sim_init(image_path);
+	host_sim_transfer(cmd, NULL, host_sim_build_read(cmd, 0x0005), out);
+	CHECK(trace_pop(records, 8) == 0, "traced while off");
+
+	trace_set_output(TRACE_UART);
+	host_sim_transfer(cmd, NULL, host_sim_build_read(cmd, 0x0005), out);
+	host_sim_transfer(cmd, NULL, host_sim_build_write(cmd, 0x0006, data, false), out);
+	host_sim_transfer(cmd, NULL, host_sim_build_read(cmd, 0x0400), out);	// out of range
+	uint32_t count = trace_pop(records, 8);
+	CHECK(count == 3, "%u records", (unsigned) count);
+	CHECK(records[0].command == 0x52 && records[0].address == 0x0005 && records[0].status == MC_GOOD
+		&& records[0].bytes == MC_SEC_SIZE, "READ record");
+	CHECK(records[1].command == 0x57 && records[1].address == 0x0006 && records[1].status == MC_BAD_CHK, "WRITE record");
+	CHECK(records[2].command == 0x52 && records[2].status == 0xff && records[2].bytes == 0, "aborted READ record");
+	CHECK(records[0].time <= records[1].time && records[1].time <= records[2].time, "timestamps out of order");
+
+	/* a full ring drops new records instead of blocking core1 */
+	for(uint32_t i = 0; i < TRACE_RING_SIZE + 10; i++)
+		trace_push(0x53, 0, 0, 4);
+	CHECK(trace_ring.dropped == 10, "%u records dropped", (unsigned) trace_ring.dropped);
+	uint32_t drained = 0;
+	while((count = trace_pop(records, 8)))
+		drained += count;
+	CHECK(drained == TRACE_RING_SIZE, "%u records drained", (unsigned) drained);
+
+	/* over CDC, records follow as TRACE_DATA frames */
+	uint8_t reply[256];
+	const uint8_t on[] = { 1 };
+	console_init();
+	console_request(CONSOLE_TRACE, on, sizeof(on), reply);
+	CHECK(trace_get_output() == TRACE_CDC, "console did not start the trace");
+	host_sim_transfer(cmd, NULL, host_sim_build_id(cmd), out);
+	uint32_t len = console_transmit(reply, sizeof(reply));
+	CHECK(len == sizeof(trace_record_t) + 4 && reply[1] == CONSOLE_TRACE_DATA && reply[3 + 8] == 0x53, "TRACE_DATA frame");
+	trace_set_output(TRACE_OFF);
+	printf("ok   protocol trace\n");
+}
+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize);
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject);
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize);
+
+static void test_msc(void) {
+	static uint8_t chunk[3][CFG_TUD_MSC_EP_BUFSIZE], readback[CFG_TUD_MSC_EP_BUFSIZE];
+	const uint32_t blocks = CFG_TUD_MSC_EP_BUFSIZE / BLOCK_SIZE;
+	for(uint32_t i = 0; i < 3; i++)
+		memset(chunk[i], 0x10 + i, sizeof(chunk[i]));
+	sd_init_card(sd_get_by_num(0));	// as done when USB mounts
+	msc_flush();
+	uint32_t writes = host_sd_write_calls;
+
+	/* writes are acknowledged before reaching SD, as long as a staging buffer is free */
+	CHECK(tud_msc_write10_cb(0, 16, 0, chunk[0], sizeof(chunk[0])) == sizeof(chunk[0]), "WRITE10 rejected");
+	CHECK(tud_msc_write10_cb(0, 16 + blocks, 0, chunk[1], sizeof(chunk[1])) == sizeof(chunk[1]), "WRITE10 rejected");
+	CHECK(host_sd_write_calls == writes, "WRITE10 not staged");
+	CHECK(tud_msc_write10_cb(0, 16 + 2 * blocks, 0, chunk[2], sizeof(chunk[2])) == sizeof(chunk[2]), "WRITE10 rejected");
+	CHECK(host_sd_write_calls == writes + 1, "full staging did not write the oldest chunk");
+	msc_task();
+	CHECK(host_sd_write_calls == writes + 2, "msc_task() did not write a chunk");
+
+	/* reads flush what is staged first, each chunk is a single multi-block transfer */
+	uint32_t reads = host_sd_read_calls;
+	CHECK(tud_msc_read10_cb(0, 16 + 2 * blocks, 0, readback, sizeof(readback)) == sizeof(readback), "READ10 failed");
+	CHECK(host_sd_write_calls == writes + 3 && host_sd_read_calls == reads + 1, "%u SD writes, %u SD reads",
+		(unsigned) (host_sd_write_calls - writes), (unsigned) (host_sd_read_calls - reads));
+	CHECK(!memcmp(readback, chunk[2], sizeof(readback)), "READ10 does not return the staged data");
+	tud_msc_read10_cb(0, 16, 0, readback, sizeof(readback));
+	CHECK(!memcmp(readback, chunk[0], sizeof(readback)), "first chunk lost");
+	CHECK(tud_msc_read10_cb(0, HOST_SD_BLOCKS - 1, 0, readback, sizeof(readback)) == -1, "READ10 past the end accepted");
+	CHECK(tud_msc_write10_cb(0, 16, 0, chunk[0], BLOCK_SIZE + 1) == -1, "partial block accepted");
+
+	/* a failed deferred write fails the next command */
+	host_sd_fail_writes = true;
+	CHECK(tud_msc_write10_cb(0, 16, 0, chunk[1], sizeof(chunk[1])) == sizeof(chunk[1]), "WRITE10 rejected");
+	msc_task();
+	host_sd_fail_writes = false;
+	host_msc_sense_key = 0;
+	CHECK(tud_msc_write10_cb(0, 16, 0, chunk[1], sizeof(chunk[1])) == -1 && host_msc_sense_key == SCSI_SENSE_MEDIUM_ERROR,
+		"write error not reported");
+	CHECK(tud_msc_write10_cb(0, 16, 0, chunk[1], sizeof(chunk[1])) == sizeof(chunk[1]), "error reported twice");
+	msc_flush();
+	printf("ok   USB mass storage\n");
+}
+
+static void test_msc_cache(void) {
+	static uint8_t block0[BLOCK_SIZE], data[8 * BLOCK_SIZE], readback[8 * BLOCK_SIZE];
+	sd_card_t* p_sd = sd_get_by_num(0);
+	msc_cache_stats_t stats;
+	/* FAT16 volume without MBR: 4 reserved blocks, 2 FATs of 8 blocks, 512 root entries (32 blocks) */
+	memset(block0, 0, sizeof(block0));
+	block0[0] = 0xeb;
+	block0[0x0b] = BLOCK_SIZE & 0xff;
+	block0[0x0c] = BLOCK_SIZE >> 8;
+	block0[0x0d] = 4;
+	block0[0x0e] = 4;
+	block0[0x10] = 2;
+	block0[0x12] = 512 >> 8;
+	block0[0x16] = 8;
+	block0[510] = 0x55;
+	block0[511] = 0xaa;
+	sd_write_blocks(p_sd, block0, 0, 1);
+	msc_cache_init();
+	msc_cache_read(200, readback, 1);	// first access finds the FAT region
+	msc_cache_get_stats(&stats);
+	CHECK(stats.meta_start == 0 && stats.meta_end == 52, "FAT region %u-%u", (unsigned) stats.meta_start, (unsigned) stats.meta_end);
+
+	uint32_t reads = host_sd_read_calls, writes = host_sd_write_calls;
+	tud_msc_read10_cb(0, 4, 0, readback, sizeof(readback));
+	tud_msc_read10_cb(0, 4, 0, readback, sizeof(readback));
+	CHECK(host_sd_read_calls == reads + 1, "FAT read twice from SD");
+
+	/* FAT writes stay in RAM until the host is idle for MSC_WRITE_SYNC_TIMEOUT */
+	memset(data, 0x5a, sizeof(data));
+	CHECK(tud_msc_write10_cb(0, 6, 0, data, BLOCK_SIZE) == BLOCK_SIZE, "FAT WRITE10 failed");
+	msc_task();
+	CHECK(host_sd_write_calls == writes, "FAT write not kept in RAM");
+	tud_msc_read10_cb(0, 6, 0, readback, BLOCK_SIZE);
+	CHECK(!memcmp(readback, data, BLOCK_SIZE), "cached FAT block not read back");
+	sleep_ms(MSC_WRITE_SYNC_TIMEOUT);
+	msc_task();
+	CHECK(host_sd_write_calls == writes + 1, "FAT block not written back");
+	sd_read_blocks(p_sd, readback, 6, 1);
+	CHECK(!memcmp(readback, data, BLOCK_SIZE), "FAT block on SD differs");
+
+	/* consecutive dirty blocks go back in one command, mixed chunks are written through */
+	writes = host_sd_write_calls;
+	tud_msc_write10_cb(0, 8, 0, data, 4 * BLOCK_SIZE);
+	tud_msc_write10_cb(0, 12, 0, data, BLOCK_SIZE);
+	msc_flush();
+	CHECK(host_sd_write_calls == writes + 1, "%u write backs for one run", (unsigned) (host_sd_write_calls - writes));
+	writes = host_sd_write_calls;
+	tud_msc_write10_cb(0, 48, 0, data, 8 * BLOCK_SIZE);
+	CHECK(host_sd_write_calls == writes + 1, "mixed chunk not written through");
+
+	/* sequential data reads are extended into the read-ahead window */
+	reads = host_sd_read_calls;
+	tud_msc_read10_cb(0, 100, 0, readback, sizeof(readback));
+	tud_msc_read10_cb(0, 108, 0, readback, sizeof(readback));
+	tud_msc_read10_cb(0, 116, 0, readback, sizeof(readback));
+	CHECK(host_sd_read_calls == reads + 2, "%u SD reads for 3 sequential reads", (unsigned) (host_sd_read_calls - reads));
+	tud_msc_write10_cb(0, 118, 0, data, BLOCK_SIZE);
+	tud_msc_read10_cb(0, 116, 0, readback, sizeof(readback));
+	CHECK(!memcmp(&readback[2 * BLOCK_SIZE], data, BLOCK_SIZE), "read-ahead window kept stale data");
+
+	memset(block0, 0, sizeof(block0));
+	sd_write_blocks(p_sd, block0, 0, 1);
+	msc_cache_init();
+	printf("ok   USB mass storage cache\n");
+}
+
+static void test_sd_clock(void) {
+	static uint8_t buffer[BLOCK_SIZE];
+	sd_card_t* p_sd = sd_get_by_num(0);
+	sd_clock_stats_t stats;
+	sd_init_card(p_sd);
+
+	/* the fastest rate is kept on a clean card, as produced by the SPI divider */
+	host_sd_max_baud = 0;
+	CHECK(sd_clock_calibrate(p_sd) == 31250000, "clean card not run at 31.25MHz");
+	host_sd_max_baud = 25000000;
+	CHECK(sd_clock_calibrate(p_sd) == 20833333, "25MHz step not reached");
+	sd_clock_get_stats(&stats);
+	uint32_t crc_errors = stats.crc_errors;
+	host_sd_max_baud = 15000000;
+	CHECK(sd_clock_calibrate(p_sd) == 12500000 && p_sd->spi->baud_rate == 12500000, "CRC errors did not stop the search");
+	sd_clock_get_stats(&stats);
+	CHECK(stats.crc_errors == crc_errors + 1, "CRC error not counted");
+
+	/* silently corrupted data keeps the card at the base rate */
+	host_sd_max_baud = 0;
+	host_sd_corrupt_reads = 1;
+	CHECK(sd_clock_calibrate(p_sd) < 12500000, "corrupted probe accepted");
+	host_sd_corrupt_reads = 0;
+
+	/* errors at runtime step the clock down until the transfer goes through */
+	sd_clock_calibrate(p_sd);
+	sd_clock_get_stats(&stats);
+	uint32_t fallbacks = stats.fallbacks;
+	host_sd_max_baud = 15000000;
+	CHECK(sd_read_blocks_retry(p_sd, buffer, 0, 1) == SD_BLOCK_DEVICE_ERROR_NONE, "read not retried at a slower clock");
+	sd_clock_get_stats(&stats);
+	CHECK(stats.baud_rate == 12500000 && stats.fallbacks == fallbacks + 2, "%u Hz after %u fallbacks",
+		(unsigned) stats.baud_rate, (unsigned) (stats.fallbacks - fallbacks));
+	CHECK(sd_write_blocks_retry(p_sd, buffer, 0, 1) == SD_BLOCK_DEVICE_ERROR_NONE, "write failed at a working clock");
+	host_sd_max_baud = 1000;
+	CHECK(sd_read_blocks_retry(p_sd, buffer, 0, 1) == SD_BLOCK_DEVICE_ERROR_CRC, "error hidden at the base rate");
+	CHECK(!sd_clock_fallback(p_sd), "fell back below BAUD_RATE");
+
+	/* a write back failing at the negotiated clock goes through at a slower one */
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], data[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	host_sd_max_baud = 0;
+	host_sim_init(image_path);
+	sd_clock_calibrate(p_sd);
+	memset(data, 0x3c, sizeof(data));
+	size_t len = host_sim_build_write(cmd, 0x0150, data, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	host_sd_max_baud = 15000000;
+	CHECK(sync_step() == MC_OK && !memory_card_has_pending(&mc) && p_sd->spi->baud_rate == 12500000,
+		"failed sync not retried at a slower clock");
+	memory_card_flush(&mc);
+	CHECK(host_sim_read_image(0x0150, stored, 1) && !memcmp(stored, data, MC_SEC_SIZE), "retried sync not on SD");
+
+	host_sd_max_baud = 0;
+	sd_clock_calibrate(p_sd);
+	printf("ok   SD clock calibration\n");
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun);
+
+static void test_usb_merge(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], psx[MC_SEC_SIZE], host[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	static uint8_t block[BLOCK_SIZE];
+	memory_card_stats_t before, after;
+	uint32_t merged;
+	host_sim_init(image_path);
+	memset(psx, 0x11, sizeof(psx));
+	memset(host, 0x22, sizeof(host));
+	memory_card_get_stats(&mc, &before);
+
+	/* the PSX writes 0x200 and 0x210 while the host rewrites 0x210 and 0x300 on SD */
+	size_t len = host_sim_build_write(cmd, 0x200, psx, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	len = host_sim_build_write(cmd, 0x210, psx, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(host_sim_write_image(0x210, host, 1) && host_sim_write_image(0x300, host, 1), "cannot write image");
+	memory_card_detach(&mc);
+	CHECK(memory_card_merge(&mc, HOST_SIM_IMAGE, &merged) == MC_OK && merged == 2, "%u sectors merged", (unsigned) merged);
+	memory_card_get_stats(&mc, &after);
+	CHECK(after.merge_conflicts == before.merge_conflicts + 1, "conflict not counted");
+	CHECK(!memcmp(memory_card_get_sector_ptr(&mc, 0x300), host, MC_SEC_SIZE), "host write not merged");
+	CHECK(!memcmp(memory_card_get_sector_ptr(&mc, 0x210), host, MC_SEC_SIZE), "conflict not resolved for the host");
+	CHECK(!memcmp(memory_card_get_sector_ptr(&mc, 0x200), psx, MC_SEC_SIZE), "PSX write lost");
+	CHECK(memory_card_pending_count(&mc) == 1, "%u sectors pending after merge", (unsigned) memory_card_pending_count(&mc));
+	uint8_t checksum = 0;
+	for(uint32_t i = 0; i < MC_SEC_SIZE; i++)
+		checksum ^= host[i];
+	CHECK(memory_card_get_sector_checksum(&mc, 0x300) == checksum, "READ checksum of a merged sector");
+	while(memory_card_has_pending(&mc))
+		sync_step();
+	memory_card_flush(&mc);
+	CHECK(host_sim_read_image(0x200, stored, 1) && !memcmp(stored, psx, MC_SEC_SIZE), "PSX write not synced after merge");
+	CHECK(host_sim_read_image(0x210, stored, 1) && !memcmp(stored, host, MC_SEC_SIZE), "host write overwritten");
+
+	/* a scrub repair still in the FatFs buffer when the volume is taken is not mistaken for a host change */
+	uint8_t junk[MC_SEC_SIZE], repaired[MC_SEC_SIZE];
+	memset(junk, 0xee, sizeof(junk));
+	memcpy(repaired, memory_card_get_sector_ptr(&mc, 0x081), MC_SEC_SIZE);
+	CHECK(host_sim_write_image(0x081, junk, 1), "cannot corrupt image");
+	for(uint32_t i = 0; i < MC_BLOCK_COUNT; i++)
+		memory_card_scrub_step(&mc);
+	CHECK(host_sim_write_image(0x081, junk, 1), "cannot drop the repair");	// buffered write lost with FatFs state
+	memory_card_detach(&mc);
+	CHECK(memory_card_merge(&mc, HOST_SIM_IMAGE, &merged) == MC_OK && merged == 0, "%u sectors merged", (unsigned) merged);
+	memory_card_flush(&mc);
+	CHECK(!memcmp(memory_card_get_sector_ptr(&mc, 0x081), repaired, MC_SEC_SIZE) &&
+		host_sim_read_image(0x081, stored, 1) && !memcmp(stored, repaired, MC_SEC_SIZE), "lost scrub repair merged as a host change");
+
+	/* the simulator stays off the volume while the host writes, then gets it back once */
+	sd_init_card(sd_get_by_num(0));
+	sleep_ms(MSC_WRITE_SYNC_TIMEOUT);
+	msc_take_host_writes();
+	tud_msc_write10_cb(0, 200, 0, block, BLOCK_SIZE);
+	CHECK(msc_host_busy() && !msc_take_host_writes(), "volume handed back while the host writes");
+	sleep_ms(MSC_WRITE_SYNC_TIMEOUT);
+	CHECK(!msc_host_busy() && msc_take_host_writes() && !msc_take_host_writes(), "volume not handed back once");
+
+	/* FatFs writes are reported to the host once */
+	msc_volume_changed();
+	host_msc_sense_key = 0;
+	CHECK(!tud_msc_test_unit_ready_cb(0) && host_msc_sense_key == SCSI_SENSE_UNIT_ATTENTION, "media change not reported");
+	CHECK(tud_msc_test_unit_ready_cb(0), "media change reported twice");
+	flush_step();
+	CHECK(tud_msc_test_unit_ready_cb(0), "media change reported without a save written back");
+	host_sim_transfer(cmd, NULL, host_sim_build_write(cmd, 0x0042, block, true), out);
+	while(memory_card_has_pending(&mc))
+		sync_step();
+	flush_step();
+	CHECK(!tud_msc_test_unit_ready_cb(0), "save written back not reported");
+	printf("ok   USB writes merged into the served card\n");
+}
+
+static void build_upload_frame(uint8_t* frame, const uint8_t* image, sector_t sector, bool corrupt) {
+	frame[0] = sector;
+	frame[1] = sector >> 8;
+	memcpy(&frame[2], &image[sector * MC_SEC_SIZE], MC_SEC_SIZE);
+	uint32_t crc = crc32(frame, 2 + MC_SEC_SIZE) + corrupt;
+	memcpy(&frame[2 + MC_SEC_SIZE], &crc, 4);
+}
+
+static void test_usb_hold(void) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1], next[MAX_MC_FILENAME_LEN + 1], last[MAX_MC_FILENAME_LEN + 1];
+	uint8_t frame[XFER_FRAME_SIZE], reply[256], image[MC_SIZE] = { 0 };
+	uint8_t prevent[16] = { SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL, 0, 0, 0, 1 };
+	uint8_t allow[16] = { SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL };
+	FIL file;
+	host_sim_init(image_path);
+	memcard_manager_init();
+	console_init();
+	transfer_init();
+	uint32_t count = memcard_manager_count();
+
+	/* the host locks the volume when mounting it: nothing may allocate a cluster behind its back */
+	msc_host_connected(true);
+	tud_msc_scsi_cb(0, prevent, NULL, 0);
+	CHECK(msc_host_mounted(), "locked volume not mounted");
+	memcard_manager_hold_writes(true);
+	CHECK(memcard_manager_create(name) == MM_BUSY && memcard_manager_count() == count, "image created while mounted");
+	f_unlink("MemcardCatalog.dat");
+	f_unlink("LastMemcardIndex.dat");
+	memcard_manager_rescan();
+	CHECK(memcard_manager_get(0, name) == MM_OK && memcard_manager_get_next(name, next) == MM_OK, "no second image");
+	CHECK(f_stat("MemcardCatalog.dat", NULL) != FR_OK && f_stat("LastMemcardIndex.dat", NULL) != FR_OK, "files created while mounted");
+	build_upload_frame(frame, image, 0, false);
+	CHECK(console_request(CONSOLE_SECTOR_DATA, frame, CONSOLE_SECTOR_PAYLOAD, reply) == 6 && reply[1] == CONSOLE_ERROR &&
+		reply[4] == CONSOLE_BUSY, "upload accepted while mounted");
+
+	/* unlocked when unmounted, until the host reads the volume again */
+	tud_msc_scsi_cb(0, allow, NULL, 0);
+	CHECK(!msc_host_mounted(), "unlocked volume still mounted");
+	memcard_manager_hold_writes(false);
+	CHECK(f_stat("MemcardCatalog.dat", NULL) == FR_OK, "held catalog not written");
+	CHECK(f_open(&file, "LastMemcardIndex.dat", FA_READ) == FR_OK && f_gets((TCHAR*) last, sizeof(last), &file) &&
+		f_close(&file) == FR_OK && !strcmp(last, next), "held last card %s", last);
+
+	/* an eject holds until the medium is loaded and used again */
+	tud_msc_scsi_cb(0, prevent, NULL, 0);
+	CHECK(msc_host_mounted() && tud_msc_start_stop_cb(0, 0, false, true) && !msc_host_mounted(), "eject not released");
+	CHECK(!tud_msc_test_unit_ready_cb(0), "ejected medium reported present");
+	tud_msc_start_stop_cb(0, 0, true, true);
+	CHECK(tud_msc_test_unit_ready_cb(0) && msc_host_mounted(), "loaded medium not mounted");
+	msc_host_connected(false);
+	CHECK(!msc_host_mounted(), "mounted after the host left");
+	printf("ok   allocating writes held while a USB host mounts the volume\n");
+}
+
+static void test_flash_tier(void) {
+	static uint8_t image[MC_SIZE], favourite[MC_SIZE];
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN];
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint8_t host[MC_SEC_SIZE];
+	uint32_t merged, steps;
+	FIL file;
+	UINT written;
+	host_sim_init(image_path);
+	flash_tier_init();
+	CHECK(!flash_tier_load_last(name, image), "empty flash restored an image");
+
+	/* slot 0 follows the card served, but flash is only programmed while allowed */
+	for(steps = 0; steps < 100; steps++)
+		flash_tier_step((const uint8_t*) HOST_SIM_IMAGE, mc.data, false);
+	CHECK(host_flash_erases == 0 && !flash_tier_load((const uint8_t*) HOST_SIM_IMAGE, image), "flash programmed while not allowed");
+	for(steps = 0; steps < 1000 && flash_tier_step((const uint8_t*) HOST_SIM_IMAGE, mc.data, true); steps++);
+	CHECK(flash_tier_load_last(name, image) && !strcmp(name, HOST_SIM_IMAGE) && !memcmp(image, mc.data, MC_SIZE), "last card not stored in flash");
+	CHECK(flash_tier_load((const uint8_t*) HOST_SIM_IMAGE, image), "stored card not served");
+	uint32_t erases = host_flash_erases;
+	CHECK(!flash_tier_step((const uint8_t*) HOST_SIM_IMAGE, mc.data, true) && host_flash_erases == erases, "card in step rewritten");
+
+	/* boot: served from flash, then merged with what changed on SD meanwhile */
+	memset(host, 0x33, sizeof(host));
+	CHECK(host_sim_write_image(0x300, host, 1), "cannot write image");
+	flash_tier_init();
+	CHECK(flash_tier_load_last(name, mc.data) && memory_card_import_ram(&mc) == MC_OK && memory_card_import_done(&mc), "card not served from flash");
+	CHECK(memory_card_merge(&mc, name, &merged) == MC_OK && merged == 1, "%u sectors merged from SD", (unsigned) merged);
+	CHECK(!memcmp(memory_card_get_sector_ptr(&mc, 0x300), host, MC_SEC_SIZE), "SD change lost at boot");
+	flash_tier_changed(name);
+	erases = host_flash_erases;
+	for(steps = 0; steps < 1000 && flash_tier_step(name, mc.data, true); steps++);
+	CHECK(host_flash_erases - erases == 3, "%u flash sectors erased for one changed sector", (unsigned) (host_flash_erases - erases));
+	CHECK(flash_tier_load_last(name, image) && !memcmp(&image[0x300 * MC_SEC_SIZE], host, MC_SEC_SIZE), "flash copy not updated");
+
+	/* favourites are read from their SD files, the USB host writing the volume makes them unverified */
+	memcpy(image, mc.data, MC_SIZE);
+	image[0] ^= 0xff;
+	const char* favourites = "# loaded without the SD card\r\nFAV.MCR\r\n";
+	CHECK(f_open(&file, "FAV.MCR", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK &&
+		f_write(&file, image, MC_SIZE, &written) == FR_OK && f_close(&file) == FR_OK, "cannot write FAV.MCR");
+	CHECK(f_open(&file, "Favourites.txt", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK &&
+		f_write(&file, favourites, strlen(favourites), &written) == FR_OK && f_close(&file) == FR_OK, "cannot write Favourites.txt");
+	CHECK(flash_tier_load_favourites() == FT_OK, "cannot read Favourites.txt");
+	for(steps = 0; steps < 1000 && flash_tier_step(NULL, NULL, true); steps++);
+	memset(image, 0, MC_SIZE);
+	CHECK(flash_tier_load((const uint8_t*) "FAV.MCR", image) && (image[0] ^ mc.data[0]) == 0xff, "favourite not stored in flash");
+	flash_tier_invalidate();
+	CHECK(!flash_tier_load((const uint8_t*) "FAV.MCR", image), "unverified favourite served");
+	erases = host_flash_erases;
+	for(steps = 0; steps < 1000 && flash_tier_step(name, mc.data, false); steps++);
+	CHECK(flash_tier_load((const uint8_t*) "FAV.MCR", image) && flash_tier_load(name, image) && host_flash_erases == erases,
+		"unchanged slots not verified without programming");
+
+	/* switching to a card held in flash: restored while withdrawn, then published whole without reading SD */
+	CHECK(flash_tier_load((const uint8_t*) "FAV.MCR", favourite), "favourite lost");
+	memcard_cache_init();
+	uint32_t reads = host_ff_stats.reads;
+	CHECK(load_mc((uint8_t*) "FAV.MCR") == MC_OK && memory_card_import_done(&mc) && host_ff_stats.reads == reads,
+		"card not switched to from flash");
+	size_t len = host_sim_build_read(cmd, 0x0000);
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(!memcmp(mc.data, favourite, MC_SIZE) && !memcmp(&out[9], favourite, MC_SEC_SIZE) &&
+		out[9 + MC_SEC_SIZE] == memory_card_get_sector_checksum(&mc, 0), "flash copy served with stale metadata");
+	f_unlink("Favourites.txt");
+	f_unlink("FAV.MCR");
+	printf("ok   flash tier serves the last card and favourites\n");
+}
+
+static void test_flash_journal(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], psx[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t channel, replayed, steps;
+	flash_journal_stats_t stats;
+	host_sim_init(image_path);
+	flash_journal_init();
+	flash_journal_track((const uint8_t*) HOST_SIM_IMAGE, 0);
+	memset(psx, 0x5a, sizeof(psx));
+
+	/* a PSX write is appended once flash has been erased for it */
+	size_t len = host_sim_build_write(cmd, 0x200, psx, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	CHECK(!flash_journal_covers(&mc), "write reported journaled before being appended");
+	for(steps = 0; steps < 100 && flash_journal_step(&mc, true, false); steps++);
+	CHECK(!flash_journal_covers(&mc), "write appended to flash never erased");
+	for(steps = 0; steps < 100 && !flash_journal_covers(&mc); steps++)
+		flash_journal_step(&mc, true, true);
+	flash_journal_get_stats(&stats);
+	CHECK(flash_journal_covers(&mc) && stats.records == 1, "%u records appended", (unsigned) stats.records);
+
+	/* power lost before the SD sync: the write is replayed at boot */
+	host_sim_init(image_path);
+	flash_journal_init();
+	CHECK(flash_journal_pending_image(name, &channel) && !strcmp(name, HOST_SIM_IMAGE) && channel == 0, "no image to replay");
+	CHECK(flash_journal_replay(&mc, name, &replayed) == MC_OK && replayed == 1, "%u sectors replayed", (unsigned) replayed);
+	memory_card_flush(&mc);
+	CHECK(!memcmp(memory_card_get_sector_ptr(&mc, 0x200), psx, MC_SEC_SIZE), "replayed write not in RAM");
+	CHECK(host_sim_read_image(0x200, stored, 1) && !memcmp(stored, psx, MC_SEC_SIZE), "replayed write not on SD");
+	flash_journal_checkpoint();
+	flash_journal_step(&mc, true, false);
+	flash_journal_init();
+	CHECK(!flash_journal_pending_image(name, &channel), "committed writes replayed again");
+
+	/* synced and checkpointed writes are reclaimed, so the log wraps around without filling up */
+	flash_journal_track((const uint8_t*) HOST_SIM_IMAGE, 0);
+	for(steps = 0; steps < 100 && flash_journal_step(&mc, true, true); steps++);	// never erased so far
+	for(uint32_t round = 0; round < 4; round++) {
+		for(uint32_t i = 0; i < 100; i++) {
+			psx[0] = (uint8_t) (round * 100 + i);
+			len = host_sim_build_write(cmd, 0x100 + i, psx, true);
+			host_sim_transfer(cmd, NULL, len, out);
+			for(steps = 0; steps < 4 && !flash_journal_covers(&mc); steps++)
+				flash_journal_step(&mc, true, false);
+		}
+		CHECK(flash_journal_covers(&mc), "journal full in round %u", (unsigned) round);
+		while(memory_card_has_pending(&mc))
+			sync_step();
+		memory_card_flush(&mc);
+		flash_journal_checkpoint();
+		for(steps = 0; steps < 100 && flash_journal_step(&mc, true, true); steps++);
+	}
+	flash_journal_get_stats(&stats);
+	CHECK(stats.records == 400 && stats.checkpoints == 4 && stats.erases >= 8, "%u records, %u checkpoints, %u erases",
+		(unsigned) stats.records, (unsigned) stats.checkpoints, (unsigned) stats.erases);
+	flash_journal_init();
+	CHECK(!flash_journal_pending_image(name, &channel), "committed writes pending after wrapping");
+
+	/* one page goes in the gap after a WRITE, core1 then answers the next transaction without waiting for a SEL edge */
+	flash_journal_track((const uint8_t*) HOST_SIM_IMAGE, 0);
+	len = host_sim_build_write(cmd, 0x180, psx, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	flash_journal_step(&mc, true, false);	// image record
+	len = host_sim_build_write(cmd, 0x181, psx, true);
+	host_sim_transfer(cmd, NULL, len, out);
+	sel_isr_callback();		// end of the WRITE
+	flash_journal_get_stats(&stats);
+	uint32_t records = stats.records;
+	journal_step(time_us_64());
+	journal_step(time_us_64());
+	flash_journal_get_stats(&stats);
+	CHECK(stats.records == records + 1, "%u pages appended after one WRITE", (unsigned) (stats.records - records));
+	len = host_sim_build_read(cmd, 0x181);
+	CHECK(host_core1_entry && mock_bus_transfer(cmd, NULL, len, out) >= len - 1 && !memcmp(&out[9], psx, MC_SEC_SIZE) &&
+		out[10 + MC_SEC_SIZE] == MC_GOOD, "READ right after an append not answered");
+
+	/* records are only committed once a failed sync has been written again */
+	for(steps = 0; steps < 100 && !flash_journal_covers(&mc); steps++)
+		flash_journal_step(&mc, true, false);
+	host_ff_fail_writes = true;
+	CHECK(sync_step() != MC_OK, "sync did not fail");
+	host_ff_fail_writes = false;
+	flush_step();
+	for(steps = 0; steps < 100 && flash_journal_step(&mc, true, false); steps++);
+	flash_journal_init();
+	CHECK(flash_journal_pending_image(name, &channel), "writes never synced committed by a flush");
+	flash_journal_track((const uint8_t*) HOST_SIM_IMAGE, 0);
+	CHECK(sync_step() == MC_OK, "sync failed again");
+	flush_step();
+	for(steps = 0; steps < 100 && flash_journal_step(&mc, true, false); steps++);
+	flash_journal_init();
+	CHECK(!flash_journal_pending_image(name, &channel), "synced writes not committed");
+	printf("ok   flash journal keeps writes across a power loss\n");
+}
+
+static void test_snapshots(void) {
+	uint8_t cmd[MOCK_BUS_MAX_LEN], out[MOCK_BUS_MAX_LEN], psx[MC_SEC_SIZE], original[MC_SEC_SIZE], stored[MC_SEC_SIZE];
+	snapshot_info_t info[CONSOLE_SNAPSHOTS_MAX];
+	uint32_t index, count, total, restored;
+	FILINFO file_info;
+	host_sim_init(image_path);
+	snapshot_init();
+	memcpy(original, memory_card_get_sector_ptr(&mc, 0x200), MC_SEC_SIZE);
+
+	/* the first snapshot holds what differs from a blank card, the next ones only what the sync path wrote */
+	CHECK(snapshot_take(&mc, (const uint8_t*) HOST_SIM_IMAGE, SN_BOOT, &index) == SN_OK && index == 0, "no base snapshot");
+	CHECK(f_stat("0.SN1", &file_info) == FR_OK && f_stat("0.SD1", &file_info) == FR_OK, "snapshot files not next to the image");
+	CHECK(snapshot_take(&mc, (const uint8_t*) HOST_SIM_IMAGE, SN_WRITES, &index) == SN_OK && index == SN_NO_INDEX, "unchanged card recorded");
+	memset(psx, 0x11, sizeof(psx));
+	host_sim_transfer(cmd, NULL, host_sim_build_write(cmd, 0x200, psx, true), out);
+	sync_step();
+	CHECK(snapshot_take(&mc, (const uint8_t*) HOST_SIM_IMAGE, SN_WRITES, &index) == SN_OK && index == 1, "write not recorded");
+	memset(psx, 0x22, sizeof(psx));
+	host_sim_transfer(cmd, NULL, host_sim_build_write(cmd, 0x200, psx, true), out);
+	host_sim_transfer(cmd, NULL, host_sim_build_write(cmd, 0x201, psx, true), out);
+	sync_step();
+	CHECK(snapshot_take(&mc, (const uint8_t*) HOST_SIM_IMAGE, SN_SWITCH, &index) == SN_OK && index == 2, "writes not recorded");
+	CHECK(snapshot_list((const uint8_t*) HOST_SIM_IMAGE, 0, 1, info, CONSOLE_SNAPSHOTS_MAX, &count, &total) == SN_OK &&
+		total == 3 && count == 2 && info[0].index == 1 && info[0].sectors == 1 && info[1].sectors == 2 && info[1].reason == SN_SWITCH,
+		"%u of %u snapshots listed", (unsigned) count, (unsigned) total);
+
+	/* any point is rebuilt from the deltas up to it, written through to SD */
+	CHECK(snapshot_restore(&mc, (const uint8_t*) HOST_SIM_IMAGE, 1, &restored) == SN_OK && restored == 2, "%u sectors restored", (unsigned) restored);
+	memory_card_flush(&mc);
+	CHECK(memory_card_get_sector_ptr(&mc, 0x200)[0] == 0x11 && !memcmp(memory_card_get_sector_ptr(&mc, 0x201), original, MC_SEC_SIZE),
+		"card not back to snapshot 1");
+	CHECK(host_sim_read_image(0x200, stored, 1) && stored[0] == 0x11, "restored sector not on SD");
+	CHECK(snapshot_restore(&mc, (const uint8_t*) HOST_SIM_IMAGE, 0, &restored) == SN_OK && restored == 1 &&
+		!memcmp(memory_card_get_sector_ptr(&mc, 0x200), original, MC_SEC_SIZE), "card not back to the base snapshot");
+	CHECK(snapshot_restore(&mc, (const uint8_t*) HOST_SIM_IMAGE, 3, &restored) == SN_NOT_FOUND, "missing snapshot restored");
+	CHECK(snapshot_take(&mc, (const uint8_t*) HOST_SIM_IMAGE, SN_RESTORED, &index) == SN_OK && index == 3, "restore not recorded");
+
+	/* changes made while the card was not served are found by comparing with the latest snapshot */
+	memset(psx, 0x33, sizeof(psx));
+	host_sim_init(image_path);
+	CHECK(host_sim_write_image(0x300, psx, 1) && memory_card_import(&mc, (uint8_t*) HOST_SIM_IMAGE) == MC_OK, "cannot reload image");
+	CHECK(snapshot_take(&mc, (const uint8_t*) HOST_SIM_IMAGE, SN_BOOT, &index) == SN_OK && index == 4, "SD change not recorded");
+	CHECK(snapshot_list((const uint8_t*) HOST_SIM_IMAGE, 0, 4, info, 1, &count, &total) == SN_OK && count == 1 && info[0].sectors == 1,
+		"SD change recorded as %u sectors", (unsigned) info[0].sectors);
+
+	/* hundreds of snapshots: listing reads one page, restoring replays the index once */
+	for(uint32_t i = 0; i < 300; i++) {
+		psx[0] = (uint8_t) i;
+		psx[1] = (uint8_t) (i >> 8);
+		host_sim_transfer(cmd, NULL, host_sim_build_write(cmd, 0x100 + i % 64, psx, true), out);
+		sync_step();
+		snapshot_take(&mc, (const uint8_t*) HOST_SIM_IMAGE, SN_WRITES, &index);
+	}
+	CHECK(index == 304, "last snapshot %u", (unsigned) index);
+	uint32_t reads = host_ff_stats.reads;
+	CHECK(snapshot_list((const uint8_t*) HOST_SIM_IMAGE, 0, 250, info, CONSOLE_SNAPSHOTS_MAX, &count, &total) == SN_OK &&
+		total == 305 && count == CONSOLE_SNAPSHOTS_MAX && info[0].index == 250 && info[0].sectors == 1, "snapshot page");
+	CHECK(host_ff_stats.reads - reads <= 1 + CONSOLE_SNAPSHOTS_MAX, "%u reads to list a page", (unsigned) (host_ff_stats.reads - reads));
+	memory_card_flush(&mc);
+	CHECK(snapshot_restore(&mc, (const uint8_t*) HOST_SIM_IMAGE, 104, &restored) == SN_OK && restored == 64, "%u sectors restored", (unsigned) restored);
+	memory_card_flush(&mc);
+	for(uint32_t i = 36; i < 100; i++)
+		CHECK(memory_card_get_sector_ptr(&mc, 0x100 + i % 64)[0] == (uint8_t) i, "sector %03x not at snapshot 104", 0x100 + i % 64);
+	CHECK(memory_card_get_sector_ptr(&mc, 0x300)[0] == 0x33, "SD change lost by the restore");
+	f_unlink("0.SN1");
+	f_unlink("0.SD1");
+	printf("ok   snapshots rebuild any point of the card\n");
+}
+
+/* Upload frame of sector from image, with a CRC32 off by one when corrupt */
+static void test_transfer(void) {
+	static uint8_t image[MC_SIZE];
+	uint8_t frame[XFER_FRAME_SIZE], reply[512], stored[MC_SEC_SIZE], name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t crc, received, first_missing, channel, len, sectors = 0;
+	bool built;
+	FILINFO file_info;
+	host_sim_init(image_path);
+	transfer_init();
+
+	/* the card served streams from RAM, every frame checked by its CRC32 */
+	CHECK(transfer_download(&mc, NULL, 0, 0) == XFER_OK, "RAM download refused");
+	while(transfer_downloading()) {
+		CHECK(transfer_download_frame(frame, &built) == XFER_OK && built, "frame %u not built", (unsigned) sectors);
+		memcpy(&crc, &frame[2 + MC_SEC_SIZE], 4);
+		sector_t sector = frame[0] | frame[1] << 8;
+		CHECK(sector == sectors && crc == crc32(frame, 2 + MC_SEC_SIZE) &&
+			!memcmp(&frame[2], memory_card_get_sector_ptr(&mc, sector), MC_SEC_SIZE), "bad frame for sector %03x", sector);
+		sectors++;
+	}
+	CHECK(sectors == MC_SEC_COUNT, "%u sectors downloaded", (unsigned) sectors);
+
+	/* resumed near the end through the console, frames packed back to back in the USB buffer */
+	console_init();
+	CHECK(transfer_download(&mc, NULL, 0, MC_SEC_COUNT - 4) == XFER_OK, "resume refused");
+	len = console_transmit(reply, sizeof(reply));
+	CHECK(len == 3 * (CONSOLE_SECTOR_PAYLOAD + 4), "%u bytes of frames", (unsigned) len);
+	for(uint32_t i = 0; i < 3 && len == 3 * (CONSOLE_SECTOR_PAYLOAD + 4); i++) {
+		uint8_t* f = &reply[i * (CONSOLE_SECTOR_PAYLOAD + 4)];
+		uint8_t checksum = 0;
+		for(uint32_t j = 1; j < CONSOLE_SECTOR_PAYLOAD + 4; j++)
+			checksum ^= f[j];
+		CHECK(f[0] == CONSOLE_SOF && f[1] == CONSOLE_SECTOR_DATA && f[2] == CONSOLE_SECTOR_PAYLOAD && !checksum &&
+			(uint32_t) (f[3] | f[4] << 8) == MC_SEC_COUNT - 4 + i, "bad console frame %u", (unsigned) i);
+	}
+	CHECK(console_transmit(reply, sizeof(reply)) == CONSOLE_SECTOR_PAYLOAD + 4 && !transfer_downloading(), "last frame not sent");
+
+	/* stored images are read from SD, a card reloaded ends a RAM download */
+	CHECK(transfer_download(&mc, (const uint8_t*) HOST_SIM_IMAGE, 1, 0) == XFER_BAD_IMAGE, "missing channel downloaded");
+	CHECK(transfer_download(&mc, (const uint8_t*) HOST_SIM_IMAGE, 0, 0x10) == XFER_OK &&
+		transfer_download_frame(frame, &built) == XFER_OK && built, "file download refused");
+	CHECK(host_sim_read_image(0x10, stored, 1) && frame[0] == 0x10 && !memcmp(&frame[2], stored, MC_SEC_SIZE), "file frame differs");
+	transfer_download(&mc, NULL, 0, 0);
+	memory_card_import(&mc, (uint8_t*) HOST_SIM_IMAGE);
+	CHECK(transfer_download_frame(frame, &built) == XFER_CHANGED && !built && !transfer_downloading(), "download survived a reload");
+
+	/* upload interrupted with a damaged frame, then resumed from the first sector missing */
+	for(uint32_t i = 0; i < MC_SIZE; i++)
+		image[i] = i * 7 + (i >> 7);
+	CHECK(transfer_upload((const uint8_t*) HOST_SIM_IMAGE, 0, &received, &first_missing) == XFER_OK &&
+		received == 0 && first_missing == 0, "upload refused");
+	for(sector_t sector = 0; sector < MC_SEC_COUNT / 2; sector++) {
+		build_upload_frame(frame, image, sector, sector == 5);
+		CHECK(transfer_upload_sector(frame) == (sector == 5 ? XFER_BAD_CRC : XFER_OK), "sector %03x", sector);
+	}
+	CHECK(transfer_commit(crc32(image, MC_SIZE)) == XFER_INCOMPLETE, "incomplete upload committed");
+	CHECK(transfer_upload((const uint8_t*) HOST_SIM_IMAGE, 0, &received, &first_missing) == XFER_OK &&
+		received == MC_SEC_COUNT / 2 - 1 && first_missing == 5, "resume at %u with %u", (unsigned) first_missing, (unsigned) received);
+	for(sector_t sector = first_missing; sector < MC_SEC_COUNT; sector++) {
+		build_upload_frame(frame, image, sector, false);
+		transfer_upload_sector(frame);
+	}
+
+	/* a damaged frame is reported by the console */
+	build_upload_frame(frame, image, 0, true);
+	len = console_request(CONSOLE_SECTOR_DATA, frame, CONSOLE_SECTOR_PAYLOAD, reply);
+	CHECK(len == 6 && reply[1] == CONSOLE_ERROR && reply[3] == CONSOLE_SECTOR_DATA && reply[4] == CONSOLE_BAD_CRC, "bad sector frame not reported");
+
+	/* the whole image is checked before it can be swapped in */
+	CHECK(transfer_commit(crc32(image, MC_SIZE) ^ 1) == XFER_BAD_CRC && !transfer_swap_pending(name, &channel), "wrong image committed");
+	CHECK(transfer_upload((const uint8_t*) HOST_SIM_IMAGE, 0, &received, &first_missing) == XFER_OK && received == 0,
+		"%u sectors kept after a bad commit", (unsigned) received);
+	for(sector_t sector = 0; sector < MC_SEC_COUNT; sector++) {
+		build_upload_frame(frame, image, sector, false);
+		transfer_upload_sector(frame);
+	}
+	CHECK(transfer_commit(crc32(image, MC_SIZE)) == XFER_OK && transfer_swap_pending(name, &channel) &&
+		!strcmp(name, HOST_SIM_IMAGE) && channel == 0, "verified upload not pending");
+	CHECK(host_sim_read_image(0x10, stored, 1) && memcmp(stored, &image[0x10 * MC_SEC_SIZE], MC_SEC_SIZE),
+		"image replaced before the swap");
+
+	/* the swap as done by the simulator: the card is imported again from the image copied in */
+	memory_card_close(&mc);
+	CHECK(transfer_apply() == XFER_OK && !transfer_swap_pending(name, &channel), "upload not applied");
+	CHECK(f_stat("UPLOAD.TMP", &file_info) != FR_OK, "shadow file left behind");
+	CHECK(memory_card_import_channel(&mc, (uint8_t*) HOST_SIM_IMAGE, 0) == MC_OK, "cannot import the uploaded image");
+	while(!memory_card_import_done(&mc))
+		memory_card_import_step(&mc);
+	CHECK(!memcmp(mc.data, image, MC_SIZE), "served card is not the uploaded image");
+	printf("ok   image transfer with CRC framing, resume and swap\n");
+}
+
+int main(int argc, char** argv) {
+	if(argc != 3) {
+		fprintf(stderr, "usage: %s <image.mcr> <trace dir>\n", argv[0]);
+		return 2;
+	}
+	image_path = argv[1];
+	if(host_sim_init(image_path) != MC_OK) {
+		fprintf(stderr, "cannot import %s\n", image_path);
+		return 2;
+	}
+	replay_traces(argv[2]);
+	test_read_all_sectors();
+	test_read_interrupted();
+	test_first_ack();
+	test_write_updates_card();
+	test_rewrites_coalesce();
+	test_sync_uses_open_image();
+	test_sync_skips_test_sector();
+	test_unchanged_sector_skipped();
+	test_sync_failure_retried();
+	test_crc_and_checksum();
+	test_scrub_repairs_sd();
+	test_image_cache();
+	test_streaming_import();
+	test_image_index();
+	test_image_catalog();
+	test_image_shards();
+	test_game_id();
+	test_channels();
+	test_pad_combos();
+	test_switch_stats();
+	test_console();
+	test_trace();
+	test_msc();
+	test_msc_cache();
+	test_sd_clock();
+	test_usb_merge();
+	test_usb_hold();
+	test_flash_tier();
+	test_flash_journal();
+	test_snapshots();
+	test_transfer();
+	host_sim_cleanup();
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
@@ -2,12 +2,41 @@
 #define __CONFIG_H__
 
 /* Global configuration options for PicoMemcard */
-#define TUD_MOUNT_TIMEOUT	3000			// max time (in ms) before giving up on MSC mode (USB) and starting memcard simulation
-#define MSC_WRITE_SYNC_TIMEOUT 1 * 1000		// time (in ms) expired since last MSC write before exporting RAM disk into LFS
-#define IDLE_AUTOSYNC_TIMEOUT 5 * 1000		// time (in ms) the memory card must be inactive before automatic sync from RAM to LFS
-#define MAX_MC_FILENAME_LEN	32				// max length of memory card file name (including extension)
-#define MAX_MC_IMAGES	255					// maximum number of different mc images
+#define MSC_WRITE_SYNC_TIMEOUT 1 * 1000		// time (in ms) expired since last MSC write before cached FAT/directory blocks are written back and the simulator takes the SD card back
+#define CACHE_RAM_BUDGET	(72 * 1024)		// RAM (in bytes) for the image cache and the USB drive buffers together, in use at the same time as the 138KB card
+#define MSC_RAM_BUDGET		(36 * 1024)		// of which the USB drive: FAT/directory lines, read-ahead window, write-back run and staged writes
+#define MSC_CACHE_META_BLOCKS	32			// SD blocks of the FAT and root directory cached in MSC mode (512 bytes each)
+#define MSC_CACHE_DATA_BLOCKS	16			// other SD blocks cached in MSC mode, filled by read-ahead
+#define MSC_WRITE_BACK_RUN	8				// consecutive dirty FAT/directory blocks written back by one SD command
+#define MSC_READ_AHEAD		8				// blocks read past a sequential MSC read
+#define IDLE_AUTOSYNC_TIMEOUT 500			// time (in ms) without new writes before the open image is flushed to the SD card
+#define SYNC_COALESCE_TIME	100				// time (in ms) without new writes before dirty sectors are written back
+#define SYNC_MAX_DELAY		1000			// max time (in ms) a dirty sector waits for the PSX to stop writing
+#define SCRUB_INTERVAL		50				// time (in ms) between two SD blocks verified against the RAM copy while idle
+#define MC_CACHE_ENTRIES	4				// memory card images kept compressed in RAM for fast switching
+#define MC_CACHE_BUDGET		(CACHE_RAM_BUDGET - MSC_RAM_BUDGET)	// max RAM (in bytes) used by compressed memory card images
+#define MC_CACHE_PREFETCH_INTERVAL	5		// time (in ms) between two SD blocks read while prefetching neighbouring images
+#define JOURNAL_COALESCE_TIME	3000		// time (in ms) without new writes before sectors safe in the flash journal are written back to the SD card
+#define JOURNAL_MAX_DELAY	30000			// max time (in ms) a journaled sector waits for the PSX to stop writing
+#define JOURNAL_APPEND_WINDOW	2			// time (in ms) after a completed WRITE in which one journal page may be programmed, the PSX leaves the port alone for a few ms after a WRITE
+#define FLASH_JOURNAL_OFFSET	(1456 * 1024)	// start of the flash write journal, memmap.ld ends the firmware there
+#define FLASH_JOURNAL_SIZE	(64 * 1024)		// 256 records of one sector write each, followed by the flash tier
+#define FLASH_TIER_OFFSET	(FLASH_JOURNAL_OFFSET + FLASH_JOURNAL_SIZE)	// start of the flash partition holding images
+#define FLASH_TIER_SLOTS	4				// images kept in flash (132KB each, up to the 2MB end): the last one served and Favourites.txt
+#define FLASH_TIER_IDLE_TIME	3000		// time (in ms) without PSX transactions before flash is programmed, the card does not answer meanwhile
+#define FLASH_TIER_INTERVAL	10				// time (in ms) between two steps of background flash tier work
+#define SNAPSHOT_WRITES		256				// sector writes from the PSX between two automatic snapshots of the card served
+#define SNAPSHOT_MAX_COUNT	2048			// snapshots kept per image channel (index entries of 144 bytes), later ones are not taken
+#define MAX_MC_FILENAME_LEN	64				// max length of memory card file name (including folder and extension)
+#define MAX_MC_DIRNAME_LEN	31				// max length of a folder holding memory card images
+#define MAX_MC_IMAGES	6000				// maximum number of different mc images (8 bytes of RAM each)
+#define MAX_MC_DIRS		256					// maximum number of folders holding mc images (including root)
+#define MC_SHARD_SIZE	256					// created images per folder (MCR000, MCR001...)
+#define MAX_GAME_ID_LEN	31					// max length of a game ID sent by the PSX, longer ones are truncated
+#define MC_MAX_CHANNELS	8					// memory card channels (128KB slots) per image file
 #define MC_RECONNECT_TIME	1000				// time (in ms) the memory card stays disconnected when simulating reconnection
+#define CONSOLE_MIN_PERIOD	10					// shortest period (in ms) of counters streamed over USB CDC
+#define TRACE_RING_SIZE		256					// protocol trace records buffered from core1 to core0 (power of 2, 12 bytes each)
 
 /* Board targeted by build */
 #define PICO
@@ -35,8 +64,12 @@
 
 /* SD Card Configuration */
 #define BLOCK_SIZE	512				// SD card communicate using only 512 block size for consistency
-#define BAUD_RATE	5000 * 1000
+#define BAUD_RATE	5000 * 1000		// SPI clock the card always works at, calibration starts from here
+#define SD_BAUD_RATES	{ 12500 * 1000, 25000 * 1000, 31250 * 1000 }	// tried in order at startup, the fastest clean one is kept
+#define SD_CALIBRATE_PASSES	4		// error free reads of the probe blocks required to accept a rate
+#define SD_PROBE_BLOCKS	4			// blocks per probe read, at the start and in the middle of the card
 #ifdef PICO
+	#define PIN_VBUS	24				// high when powered over USB, sensed through the wireless chip on a Pico W
 	#define PIN_MISO	16
 	#define PIN_MOSI	19
 	#define PIN_SCK		18
@@ -0,0 +1,88 @@
+#ifndef __CONSOLE_H__
+#define __CONSOLE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "snapshot.h"
+#include "transfer.h"
+
+/*
+ *	Binary command console over USB CDC. Every frame, in both directions, is
+ *
+ *		CONSOLE_SOF | command | length | payload[length] | checksum
+ *
+ *	with checksum the XOR of command, length and payload. Replies carry the
+ *	command with CONSOLE_REPLY set, errors are CONSOLE_ERROR frames holding the
+ *	command and an error code. Multi-byte values are little endian.
+ *
+ *	Images move as SECTOR_DATA frames, one sector each with its own CRC32, the
+ *	only frames allowed past CONSOLE_MAX_PAYLOAD. A download streams them with
+ *	no reply in between; an upload sends them back to back and only hears of
+ *	the ones dropped, then UPLOAD again tells where to resume and COMMIT checks
+ *	the whole image before the card swaps it in.
+ */
+#define CONSOLE_SOF				0xa5
+#define CONSOLE_MAX_PAYLOAD		96
+#define CONSOLE_REPLY			0x80
+
+/* Commands */
+#define CONSOLE_PING			0x01	// reply: protocol version
+#define CONSOLE_COUNTERS		0x02	// reply: console_counters_t
+#define CONSOLE_IMAGE			0x03	// reply: name of the card being served, e.g. "FF7/0-1"
+#define CONSOLE_STREAM			0x04	// payload: period in ms (uint16, 0 stops), COUNTERS replies follow every period
+#define CONSOLE_TRACE			0x05	// payload: 1 to start the protocol trace over CDC, 0 to stop
+#define CONSOLE_TRACE_DATA		0x06	// sent by the card only: up to 8 trace_record_t while tracing
+#define CONSOLE_SNAPSHOTS		0x07	// payload: first snapshot (uint16), reply: total (uint16) then up to CONSOLE_SNAPSHOTS_MAX snapshot_info_t of the card served
+#define CONSOLE_RESTORE			0x08	// payload: snapshot (uint16) the card served goes back to, reply: same payload, restored in background
+#define CONSOLE_DOWNLOAD		0x09	// payload: first sector (uint16), channel, image name (empty for the card served), reply: first sector then SECTOR_DATA frames to the end
+#define CONSOLE_SECTOR_DATA		0x0a	// payload: sector (uint16), data, CRC32 of both; no reply to uploaded ones unless dropped
+#define CONSOLE_UPLOAD			0x0b	// payload: channel, image name (empty for the card served), reply: sectors received (uint16), first missing (uint16)
+#define CONSOLE_COMMIT			0x0c	// payload: CRC32 of the whole image, reply: same payload, swapped in background
+#define CONSOLE_ERROR			0xff	// reply: command, error code
+
+#define CONSOLE_VERSION			2
+
+/* Error codes */
+#define CONSOLE_OK				0
+#define CONSOLE_BAD_CHECKSUM	1
+#define CONSOLE_BAD_COMMAND		2
+#define CONSOLE_BAD_LENGTH		3
+#define CONSOLE_BUSY			4	// the USB host owns the SD card, try again later
+#define CONSOLE_BAD_INDEX		5
+#define CONSOLE_FAILED			6	// SD card or file error
+#define CONSOLE_BAD_CRC			7	// resend the sector, or the whole image after a COMMIT
+#define CONSOLE_INCOMPLETE		8	// upload sectors still missing
+
+#define CONSOLE_SNAPSHOTS_MAX	((CONSOLE_MAX_PAYLOAD - 2) / sizeof(snapshot_info_t))
+#define CONSOLE_SECTOR_PAYLOAD	XFER_FRAME_SIZE
+
+/* Payload of a COUNTERS reply, sent as is */
+typedef struct __attribute__((packed)) {
+	uint32_t uptime_ms;
+	uint32_t reads;				// READ transactions served
+	uint32_t writes;			// WRITE transactions completed
+	uint32_t ids;				// ID transactions
+	uint32_t bad_checksums;		// WRITEs answered with a checksum error
+	uint32_t pending;			// sectors waiting to be synced (backlog)
+	uint32_t max_pending;
+	uint32_t sector_syncs;		// sectors written back to the SD card
+	uint32_t sd_write_last_us;	// duration of the last sync/flush
+	uint32_t sd_write_max_us;
+	uint32_t free_heap;			// bytes
+	uint32_t channel;			// channel of the image being served, starting from 0
+	uint32_t dropped;			// replies that did not fit the output buffer
+	uint32_t trace_dropped;		// protocol trace records lost to a full ring
+	uint32_t sd_baud_rate;		// SPI clock negotiated with the SD card, Hz
+	uint32_t sd_crc_errors;		// SD transfers failed with a CRC error
+	uint32_t sd_fallbacks;		// SD clock steps down after an error
+	uint32_t first_ack_us;		// boot to first memory card command answered, 0 until then
+} console_counters_t;
+
+void console_init();
+void console_receive(const uint8_t* data, uint32_t len);
+uint32_t console_transmit(uint8_t* out, uint32_t max);
+
+/* Platform specific, bytes of heap still available */
+uint32_t console_free_heap();
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3, reflected 0xEDB88320), same result as zlib's crc32() */
+uint32_t crc32(const uint8_t* data, uint32_t len);
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t len);
+
+#endif
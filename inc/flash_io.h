@@ -0,0 +1,18 @@
+#ifndef __FLASH_IO_H__
+#define __FLASH_IO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ *	Erasing and programming the QSPI flash past the firmware (flash tier and
+ *	write journal). XIP is unavailable meanwhile, so core1 is stopped and the
+ *	PSX goes unanswered: callers only write while the card is not selected
+ *	and core1 is not in a WRITE (write_transaction held), core1 is relaunched
+ *	before returning. Only core0 calls it.
+ */
+void flash_io_write(uint32_t offset, bool erase, const uint8_t* data, uint32_t len);
+bool flash_io_is_erased(uint32_t offset, uint32_t len);
+uint32_t flash_io_last_us();
+
+#endif
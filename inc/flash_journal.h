@@ -0,0 +1,41 @@
+#ifndef __FLASH_JOURNAL_H__
+#define __FLASH_JOURNAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "memory_card.h"
+
+/* Error codes */
+#define FJ_OK				0
+#define FJ_FULL				1
+
+/*
+ *	Sector writes accepted from the PSX are appended to a log in flash, one
+ *	256 byte page per record, within milliseconds of the WRITE, so they survive
+ *	a power loss long before they reach the SD card. Records are sequence
+ *	numbered and CRC protected; a checkpoint record marks everything appended
+ *	before it as committed to SD (image flushed with nothing pending), and
+ *	sectors holding only committed records are erased while the PSX is idle.
+ *	At boot the records past the last checkpoint are replayed into the image
+ *	they were written to. Only core0 uses the journal.
+ */
+typedef struct {
+	uint32_t records;			// sector writes appended
+	uint32_t checkpoints;
+	uint32_t full;				// steps that found no erased page, writes then wait for SD
+	uint32_t erases;			// flash sectors reclaimed
+	uint32_t replayed;			// sectors restored at boot
+	uint32_t append_us;			// time the PSX went unanswered for the last page
+} flash_journal_stats_t;
+
+void flash_journal_init();
+bool flash_journal_pending_image(uint8_t* name, uint32_t* channel);
+uint32_t flash_journal_replay(memory_card_t* mc, const uint8_t* name, uint32_t* replayed);
+void flash_journal_track(const uint8_t* name, uint32_t channel);
+bool flash_journal_covers(memory_card_t* mc);
+void flash_journal_checkpoint();
+bool flash_journal_step(memory_card_t* mc, bool may_program, bool may_erase);
+void flash_journal_get_stats(flash_journal_stats_t* stats);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __FLASH_TIER_H__
+#define __FLASH_TIER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/* Error codes */
+#define FT_OK				0
+#define FT_FILE_ERR			1
+
+/*
+ *	Memory card images kept in a partition at the end of the QSPI flash, past
+ *	the firmware (memmap.ld). Slot 0 holds the last image served, so that boot
+ *	answers the PSX from flash before the SD card is even mounted; the other
+ *	slots hold the favourites listed in Favourites.txt, one image per line, so
+ *	that switching to them skips the SD card too. The SD copy stays the one of
+ *	record: slots are rewritten in background once they no longer match it,
+ *	and a slot is only served when its content was checked against SD since
+ *	the volume was last mounted. Only core0 uses the tier.
+ */
+typedef struct {
+	uint32_t hits;				// images restored from flash instead of SD
+	uint32_t misses;
+	uint32_t slot_writes;		// slots brought in step with their SD copy
+	uint32_t sector_writes;		// 4KB flash sectors erased and programmed
+	uint32_t sector_skips;		// sectors that already held the data
+	uint32_t program_us;		// time the PSX went unanswered for the last sector
+} flash_tier_stats_t;
+
+void flash_tier_init();
+bool flash_tier_load_last(uint8_t* name, uint8_t* data);
+bool flash_tier_load(const uint8_t* name, uint8_t* data);
+uint32_t flash_tier_load_favourites();
+void flash_tier_changed(const uint8_t* name);
+void flash_tier_invalidate();
+bool flash_tier_step(const uint8_t* name, const uint8_t* data, bool may_program);
+void flash_tier_get_stats(flash_tier_stats_t* stats);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef __GAME_MAP_H__
+#define __GAME_MAP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/* Error codes */
+#define GM_OK				0
+#define GM_ALLOC_FAIL		1
+#define GM_BAD_ID			2
+
+/*
+ *	Game IDs sent by the PSX (MEMCARD_GAMEID) mapped to memory card images, as
+ *	listed in GameMap.txt on the SD card, one "<game id> <image or folder>" per
+ *	line. The table is an open addressing hash table (FNV-1a, linear probing)
+ *	loaded on first use, so lookups cost the same with thousands of titles.
+ *	Games without an entry use the folder named after their ID. Only core0 uses it.
+ */
+uint32_t game_map_load();
+const uint8_t* game_map_find(const uint8_t* game_id);
+uint32_t game_map_count();
+bool game_map_normalize(const uint8_t* game_id, uint8_t* out);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __MEMCARD_CACHE_H__
+#define __MEMCARD_CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/* Error codes */
+#define MCC_OK				0
+#define MCC_ALLOC_FAIL		1
+#define MCC_TOO_LARGE		2
+#define MCC_FILE_ERR		3
+#define MCC_BAD_DATA		4
+
+/*
+ *	Compressed copies of recently used and neighbouring memory card images, so that
+ *	switching card can restore mc.data from RAM instead of reading 128KB from SD.
+ *	Images are stored as a bitmap of non-zero sectors followed by every non-zero
+ *	sector compressed with PackBits. Only core0 uses the cache.
+ */
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t entries;
+	uint32_t used_bytes;		// compressed bytes held, at most MC_CACHE_BUDGET
+	uint32_t prefetched;		// images loaded in background from SD
+	uint32_t last_decompress_us;
+	uint32_t max_decompress_us;
+} memcard_cache_stats_t;
+
+void memcard_cache_init();
+bool memcard_cache_load(const uint8_t* name, uint8_t* data);
+uint32_t memcard_cache_store(const uint8_t* name, const uint8_t* data);
+void memcard_cache_invalidate(const uint8_t* name);
+void memcard_cache_set_prefetch(const uint8_t* prev, const uint8_t* next);
+bool memcard_cache_prefetch_step();
+void memcard_cache_get_stats(memcard_cache_stats_t* stats);
+
+#endif
@@ -13,7 +13,12 @@
 #define MM_NAME_CONFLICT		5
 #define MM_FILE_OPEN_ERR		6
 #define MM_FILE_WRITE_ERR		7
+#define MM_BAD_CATALOG			8
+#define MM_BUSY					9	// would allocate clusters while writes are held
 
+uint32_t memcard_manager_init();
+uint32_t memcard_manager_rescan();
+bool memcard_manager_verify_step();
 bool memcard_manager_exist(uint8_t* filename);
 uint32_t memcard_manager_count();
 uint32_t memcard_manager_get(uint32_t index, uint8_t* out_filename);
@@ -21,6 +26,10 @@ uint32_t memcard_manager_get(uint32_t index, uint8_t* out_filename);
 uint32_t memcard_manager_get_prev_loaded_memcard_index();
 uint32_t memcard_manager_get_next(uint8_t* filename, uint8_t* out_nextfile);
 uint32_t memcard_manager_get_prev(uint8_t* filename, uint8_t* out_prevfile);
+uint32_t memcard_manager_get_neighbours(uint8_t* filename, uint8_t* out_prevfile, uint8_t* out_nextfile);
+uint32_t memcard_manager_get_game(const uint8_t* game_id, uint8_t* out_filename);
 uint32_t memcard_manager_create(uint8_t* out_filename);
+uint32_t memcard_manager_create_in(const uint8_t* folder, uint8_t* out_filename);
+void memcard_manager_hold_writes(bool hold);
 
 #endif
\ No newline at end of file
@@ -1,9 +1,34 @@
-#include <sys/cdefs.h>
-
 #ifndef __MEMCARD_SIMULATOR_H__
 #define __MEMCARD_SIMULATOR_H__
 
-_Noreturn
-int simulate_memory_card();
+#include <stdint.h>
+#include <stdbool.h>
+#include "snapshot.h"
+
+/* Snapshot of the simulation for monitoring, taken without stopping core1 */
+typedef struct {
+	uint32_t reads;				// READ transactions served (core1)
+	uint32_t writes;			// WRITE transactions completed (core1)
+	uint32_t ids;				// ID transactions (core1)
+	uint32_t bad_checksums;		// WRITEs answered with MC_BAD_CHK (core1)
+	uint32_t pending;			// sectors waiting to be synced
+	uint32_t max_pending;
+	uint32_t sector_syncs;
+	uint32_t sd_write_last_us;	// duration of the last sync or flush
+	uint32_t sd_write_max_us;
+	uint32_t channel;
+	uint32_t first_ack_us;		// time from power on to the first command answered, 0 before (core1)
+} memcard_telemetry_t;
+
+uint32_t simulate_memory_card_init();
+void simulate_memory_card_resume();
+void simulate_memory_card_task();
+bool memcard_simulator_running();
+void memcard_simulator_get_telemetry(memcard_telemetry_t* telemetry);
+const uint8_t* memcard_simulator_get_name();
+uint32_t memcard_simulator_list_snapshots(uint32_t first, snapshot_info_t* out, uint32_t max, uint32_t* count, uint32_t* total);
+void memcard_simulator_restore_snapshot(uint32_t index);
+uint32_t memcard_simulator_download(const uint8_t* name, uint32_t channel, uint32_t first);
+uint32_t memcard_simulator_upload(const uint8_t* name, uint32_t channel, uint32_t* received, uint32_t* first_missing);
 
-#endif
\ No newline at end of file
+#endif
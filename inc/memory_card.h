@@ -4,10 +4,12 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "config.h"
+#include "ff.h"
 
 #define MC_SEC_SIZE			128		// size of single sector in bytes
 #define MC_SEC_COUNT		1024	// number of sector in one memory card
-#define MC_SIZE				MC_SEC_SIZE * MC_SEC_COUNT		// size of memory card in bytes
+#define MC_SIZE				(MC_SEC_SIZE * MC_SEC_COUNT)	// size of memory card (one channel) in bytes
+#define MC_IS_IMAGE_SIZE(size)	((size) >= MC_SIZE && (size) <= MC_MAX_CHANNELS * MC_SIZE && (size) % MC_SIZE == 0)
 #define MC_FLAG_BYTE_DEF	0x08	// bit 3 set = new memory card inserted
 
 #define MC_ID1 0x5A
@@ -15,6 +17,8 @@
 #define MC_ACK1 0x5C
 #define MC_ACK2 0x5D
 #define MC_TEST_SEC 0x3f	// sector 63 is the "write test" sector
+#define MC_SEC_PER_BLOCK	(BLOCK_SIZE / MC_SEC_SIZE)		// sectors sharing one SD card block
+#define MC_BLOCK_COUNT		(MC_SEC_COUNT / MC_SEC_PER_BLOCK)
 
 #define MC_GOOD 0x47
 #define MC_BAD_SEC 0xFF
@@ -27,19 +31,111 @@
 #define MC_FILE_WRITE_ERR	3
 #define MC_FILE_SIZE_ERR	4
 #define MC_NO_INIT			5
+#define MC_SCRUB_MISMATCH	6
 
+#define MC_DIRTY_WORDS		(MC_SEC_COUNT / 32)
+
+/*
+ *	Per-sector metadata kept next to the data. generation works as a sequence lock:
+ *	core1 bumps it before and after changing the sector, so it is odd while a write is
+ *	in progress and core0 can tell whether the data moved under a CRC it computed.
+ */
+typedef struct {
+	uint32_t crc;				// CRC32 of the sector as stored on the SD card (core0)
+	volatile uint16_t generation;	// write sequence counter (core1)
+	uint16_t sync_generation;	// generation crc was computed at (core0)
+	uint8_t checksum;			// XOR of the sector data, sent by READ (core1)
+	bool crc_valid;				// crc is known to match the SD copy (core0)
+} sector_meta_t;
+
+/*
+ *	Sectors waiting to be synced are tracked without locks: a sector is dirty when its
+ *	bit differs between dirty_set (only written by core1) and dirty_ack (only written
+ *	by core0). Each word has a single writer, so plain 32 bit stores are enough.
+ */
 typedef struct {
 	uint8_t flag_byte;
 	uint8_t* data;
+	sector_meta_t* meta;	// one entry per sector
+	volatile int32_t write_sector;	// sector core1 is writing, -1 if none
+	volatile uint32_t resident[MC_DIRTY_WORDS];	// sectors already loaded from the image (core0)
+	volatile int32_t priority_sector;	// non resident sector asked for by the PSX, loaded next (core1)
+	FIL file;			// image the data was imported from, kept open until the next import
+	uint32_t channel;		// MC_SIZE slot of the file being served
+	uint32_t channel_count;	// slots in the file, grows as channels are first used
+	bool file_open;
+	bool file_dirty;	// sectors written to file but not yet flushed
+	volatile uint32_t dirty_set[MC_DIRTY_WORDS];
+	volatile uint32_t dirty_ack[MC_DIRTY_WORDS];
+	uint32_t sync_failed[MC_DIRTY_WORDS];	// acknowledged sectors whose write back failed, still dirty (core0)
+	volatile uint32_t write_count;	// sector writes accepted from the PSX (core1)
+	uint32_t sync_count;			// sectors written back to the image (core0)
+	uint32_t block_count;			// SD blocks written to carry them
+	uint32_t max_pending;			// highest number of dirty sectors seen by a sync
+	uint32_t skip_count;			// dirty sectors whose content was already on the SD card
+	uint32_t scrub_block;			// next SD block verified by the scrub
+	uint32_t scrub_count;			// SD blocks verified by the scrub
+	uint32_t scrub_errors;			// sectors found differing from their CRC
+	uint32_t merge_count;			// sectors taken from an image rewritten over USB
+	uint32_t merge_conflicts;		// of which the PSX had also changed
+	uint32_t changed[MC_DIRTY_WORDS];	// sectors whose SD copy changed since the last snapshot (core0)
+	uint32_t buffered[MC_DIRTY_WORDS];	// sectors written as part of an SD block since the last f_sync, maybe only in the FatFs buffer (core0)
+	uint32_t import_count;			// images or channels loaded so far, changed only covers the last one (core0)
 } memory_card_t;
 
+typedef struct {
+	uint32_t sector_writes;		// sectors written by the PSX that need syncing
+	uint32_t sector_syncs;		// sectors written back, sector_writes / sector_syncs is the coalescing ratio
+	uint32_t block_writes;		// SD blocks written, block_writes / sector_writes is the write amplification
+	uint32_t pending;			// sectors currently dirty (sync backlog)
+	uint32_t max_pending;
+	uint32_t sector_skips;		// dirty sectors not written back since the SD card already held them
+	uint32_t scrub_blocks;		// SD blocks verified against the RAM copy
+	uint32_t scrub_errors;		// sectors that diverged from their CRC
+	uint32_t merged_sectors;	// sectors rewritten by the USB host and loaded into RAM
+	uint32_t merge_conflicts;	// of which the PSX had also written, the host version is kept
+} memory_card_stats_t;
+
 typedef uint16_t sector_t;
 
+/* Sectors of a dirty word waiting to be synced: marked by core1, or left over by a failed sync */
+static inline uint32_t memory_card_dirty_word(memory_card_t* mc, uint32_t word) {
+	return (mc->dirty_set[word] ^ mc->dirty_ack[word]) | mc->sync_failed[word];
+}
+
 uint32_t memory_card_init(memory_card_t* mc);
 uint32_t memory_card_import(memory_card_t* mc, uint8_t* file_name);
+uint32_t memory_card_import_cached(memory_card_t* mc, uint8_t* file_name);
+uint32_t memory_card_import_ram(memory_card_t* mc);
+void memory_card_withdraw(memory_card_t* mc);
+uint32_t memory_card_import_begin(memory_card_t* mc, uint8_t* file_name);
+uint32_t memory_card_import_channel(memory_card_t* mc, uint8_t* file_name, uint32_t channel);
+uint32_t memory_card_import_step(memory_card_t* mc);
+bool memory_card_import_done(memory_card_t* mc);
+uint32_t memory_card_switch_channel(memory_card_t* mc, uint32_t channel);
+void memory_card_blank_sector(sector_t sector, uint8_t* buffer);
+uint32_t memory_card_write_blank(FIL* file);
+bool memory_card_request_sector(memory_card_t* mc, sector_t sector);
 bool memory_card_is_sector_valid(memory_card_t* mc, sector_t sector);
 uint8_t* memory_card_get_sector_ptr(memory_card_t* mc, sector_t sector);
 void memory_card_reset_seen_flag(memory_card_t* mc);
-uint32_t memory_card_sync_sector(memory_card_t* mc, sector_t sector, uint8_t* file_name);
+uint8_t memory_card_get_sector_checksum(memory_card_t* mc, sector_t sector);
+void memory_card_begin_write(memory_card_t* mc, sector_t sector);
+void memory_card_end_write(memory_card_t* mc, sector_t sector, uint8_t checksum);
+void memory_card_recover_write(memory_card_t* mc);
+void memory_card_mark_dirty(memory_card_t* mc, sector_t sector);
+bool memory_card_has_pending(memory_card_t* mc);
+uint32_t memory_card_pending_count(memory_card_t* mc);
+uint32_t memory_card_sync(memory_card_t* mc);
+uint32_t memory_card_sync_sector(memory_card_t* mc, sector_t sector);
+uint32_t memory_card_sync_blocks(memory_card_t* mc, uint32_t block, uint32_t count);
+void memory_card_get_stats(memory_card_t* mc, memory_card_stats_t* stats);
+uint32_t memory_card_flush(memory_card_t* mc);
+uint32_t memory_card_scrub_step(memory_card_t* mc);
+void memory_card_detach(memory_card_t* mc);
+uint32_t memory_card_merge(memory_card_t* mc, uint8_t* file_name, uint32_t* merged);
+uint32_t memory_card_restore_sector(memory_card_t* mc, sector_t sector, const uint8_t* data);
+uint32_t memory_card_close(memory_card_t* mc);
+bool memory_card_is_dirty(memory_card_t* mc);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,40 @@
+#ifndef __MSC_CACHE_H__
+#define __MSC_CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/* Error codes */
+#define MSCC_OK				0
+#define MSCC_ALLOC_FAIL		1
+#define MSCC_READ_ERR		2
+#define MSCC_WRITE_ERR		3
+
+/*
+ *	RAM cache of SD blocks for USB mass storage mode. Blocks of the FAT and root
+ *	directory (found from the boot sector) have their own lines, kept dirty and
+ *	written back MSC_WRITE_SYNC_TIMEOUT after the last write or on flush. Other
+ *	blocks are only cached clean, filled by read-ahead on sequential reads, so
+ *	file data keeps going straight to the SD card.
+ */
+#define MSC_CACHE_RAM		((MSC_CACHE_META_BLOCKS + MSC_CACHE_DATA_BLOCKS + MSC_WRITE_BACK_RUN) * BLOCK_SIZE)
+typedef struct {
+	uint32_t hits;			// blocks served from RAM
+	uint32_t misses;		// blocks read from SD
+	uint32_t read_ahead;	// blocks read past what the host asked for
+	uint32_t absorbed;		// metadata block writes kept in RAM
+	uint32_t write_backs;	// SD write commands issued for dirty blocks
+	uint32_t meta_start;	// first block of the FAT/root directory region
+	uint32_t meta_end;
+} msc_cache_stats_t;
+
+void msc_cache_init();
+uint32_t msc_cache_read(uint32_t lba, uint8_t* buffer, uint32_t count);
+bool msc_cache_write(uint32_t lba, const uint8_t* buffer, uint32_t count);
+bool msc_cache_is_meta(uint32_t lba, uint32_t count);
+uint32_t msc_cache_flush();
+uint32_t msc_cache_task();
+void msc_cache_get_stats(msc_cache_stats_t* stats);
+
+#endif
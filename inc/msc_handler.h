@@ -0,0 +1,15 @@
+#ifndef __MSC_HANDLER_H__
+#define __MSC_HANDLER_H__
+
+/* Staged WRITE10 data goes to the SD card from the main loop, so that USB keeps receiving meanwhile */
+void msc_task();
+void msc_flush();
+
+/* Sharing of the volume with the simulator, which uses it through FatFs meanwhile */
+void msc_host_connected(bool connected);
+bool msc_host_mounted();
+bool msc_host_busy();
+bool msc_take_host_writes();
+void msc_volume_changed();
+
+#endif
@@ -13,6 +13,21 @@ extern "C" {
     size_t spi_get_num();
     spi_t *spi_get_by_num(size_t num);
 
+    /* SPI clock negotiated with the card and the errors that drove it */
+    typedef struct {
+        uint32_t baud_rate;         // Hz, as produced by the SPI divider
+        uint32_t crc_errors;        // transfers failed with a CRC error or returning wrong data
+        uint32_t io_errors;         // other failed transfers
+        uint32_t fallbacks;         // steps down to a slower clock after an error
+        uint32_t calibrate_us;
+    } sd_clock_stats_t;
+
+    uint32_t sd_clock_calibrate(sd_card_t *p_sd);
+    bool sd_clock_fallback(sd_card_t *p_sd);
+    int sd_read_blocks_retry(sd_card_t *p_sd, uint8_t *buffer, uint64_t lba, uint32_t count);
+    int sd_write_blocks_retry(sd_card_t *p_sd, const uint8_t *buffer, uint64_t lba, uint32_t count);
+    void sd_clock_get_stats(sd_clock_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,67 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "memory_card.h"
+
+/* Error codes */
+#define SN_OK				0
+#define SN_FILE_ERR			1
+#define SN_NOT_FOUND		2
+#define SN_FULL				3
+#define SN_CORRUPTED		4
+#define SN_BUSY				5	// a sector changed while being copied, try again
+#define SN_ALLOC_FAIL		6
+
+#define SN_NO_INDEX			0xFFFFFFFF	// nothing changed, no snapshot recorded
+
+/* Why a snapshot was taken */
+#define SN_BOOT				0
+#define SN_SWITCH			1	// leaving or arriving on the card
+#define SN_WRITES			2	// SNAPSHOT_WRITES sector writes since the last one
+#define SN_USB				3	// the USB host wrote to the SD card
+#define SN_BEFORE_RESTORE	4
+#define SN_RESTORED			5
+#define SN_BEFORE_UPLOAD	6	// the card served is about to be replaced by an image sent over USB
+#define SN_UPLOADED			7
+
+/*
+ *	Rollback points of each channel of each image, kept on the SD card next to
+ *	it: "FF7/0.MCR" channel 1 has its snapshots in "FF7/0.SN1" (index) and
+ *	"FF7/0.SD1" (sector data). A snapshot only stores the sectors that changed
+ *	since the previous one, as reported by the sync path (memory_card_t
+ *	changed); the first one stores the sectors differing from a blank card.
+ *	Point k is rebuilt by taking, for each sector, its copy in the latest of
+ *	snapshots 0..k holding it. Index entries are fixed size and carry the
+ *	sector map of their snapshot, so listing is a seek and one read, and
+ *	rebuilding a point is a sequential read of the index followed by the
+ *	sector data it needs. Only core0 uses snapshots.
+ */
+typedef struct __attribute__((packed)) {
+	uint16_t index;
+	uint16_t sectors;			// stored by this snapshot, changed since the previous one
+	uint8_t reason;
+	uint8_t channel;
+	uint32_t uptime_s;			// time since power on when taken
+	uint32_t writes;			// PSX sector writes since power on when taken
+} snapshot_info_t;
+
+typedef struct {
+	uint32_t taken;
+	uint32_t unchanged;			// snapshots skipped since nothing changed
+	uint32_t sectors;			// sectors stored by the snapshots taken
+	uint32_t restores;
+	uint32_t restored_sectors;
+	uint32_t last_us;			// time spent on the last snapshot or restore
+} snapshot_stats_t;
+
+void snapshot_init();
+void snapshot_invalidate();
+uint32_t snapshot_take(memory_card_t* mc, const uint8_t* name, uint8_t reason, uint32_t* index);
+uint32_t snapshot_list(const uint8_t* name, uint32_t channel, uint32_t first, snapshot_info_t* out, uint32_t max, uint32_t* count, uint32_t* total);
+uint32_t snapshot_restore(memory_card_t* mc, const uint8_t* name, uint32_t index, uint32_t* restored);
+void snapshot_get_stats(snapshot_stats_t* stats);
+
+#endif
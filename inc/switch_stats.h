@@ -0,0 +1,37 @@
+#ifndef __SWITCH_STATS_H__
+#define __SWITCH_STATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Phases of a card switch, each timed in us */
+#define SWITCH_PHASE_PICKUP		0	// request raised by core1 until core0 handles it
+#define SWITCH_PHASE_SYNC		1	// writing back the card being left
+#define SWITCH_PHASE_LOOKUP		2	// finding the next card (memcard_manager)
+#define SWITCH_PHASE_IMPORT		3	// load_mc() until the new card can be served
+#define SWITCH_PHASE_RECONNECT	4	// simulated card removal
+#define SWITCH_PHASE_FIRST_READ	5	// reconnect until the PSX read a sector
+#define SWITCH_PHASE_TOTAL		6	// request raised until the first READ
+#define SWITCH_PHASE_COUNT		7
+
+#define SWITCH_STATS_WINDOW		128	// latest samples kept per phase for min/avg/p99
+
+typedef struct {
+	uint32_t count;		// samples since the last reset
+	uint32_t min;		// over the last SWITCH_STATS_WINDOW samples
+	uint32_t avg;
+	uint32_t p99;
+	uint32_t max;
+} switch_phase_stats_t;
+
+/*
+ *	Latency of card switches, per phase, recorded by core0. Each phase keeps a
+ *	rolling window of samples for min/avg/p99 and a power of two histogram of
+ *	every sample since the last reset.
+ */
+void switch_stats_reset();
+void switch_stats_record(uint32_t phase, uint32_t us);
+void switch_stats_get(uint32_t phase, switch_phase_stats_t* stats);
+void switch_stats_print();
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/sync.h"
+#include "pico/time.h"
+#include "config.h"
+
+/* Where drained records go, TRACE_OFF stops core1 from recording */
+#define TRACE_OFF		0
+#define TRACE_UART		1
+#define TRACE_CDC		2
+
+/* One protocol transaction, as seen by core1 */
+typedef struct {
+	uint32_t time;		// time_us_32() at the end of the transaction
+	uint16_t address;	// sector for READ/WRITE, 0 otherwise
+	uint16_t bytes;		// payload bytes exchanged (sector data, ID, game ID, name)
+	uint8_t command;	// MEMCARD_* command byte
+	uint8_t status;		// last byte sent by the card (MC_GOOD, MC_BAD_CHK, 0xff on abort...)
+	uint8_t reserved[2];
+} trace_record_t;
+
+/*
+ *	Single producer (core1), single consumer (core0) ring: core1 only writes
+ *	head, core0 only writes tail, so neither side ever waits for the other. When
+ *	the ring is full new records are dropped and counted.
+ */
+typedef struct {
+	trace_record_t records[TRACE_RING_SIZE];
+	volatile uint32_t head;		// next record written (core1)
+	volatile uint32_t tail;		// next record read (core0)
+	volatile uint32_t dropped;	// records lost to a full ring (core1)
+	volatile uint32_t output;	// TRACE_OFF, TRACE_UART or TRACE_CDC (core0)
+} trace_ring_t;
+
+extern trace_ring_t trace_ring;
+
+/* Called by core1 at the end of a transaction, a few loads and stores when enabled */
+static inline void trace_push(uint8_t command, uint16_t address, uint8_t status, uint16_t bytes) {
+	if(trace_ring.output == TRACE_OFF)
+		return;
+	uint32_t head = trace_ring.head;
+	if(head - trace_ring.tail >= TRACE_RING_SIZE) {
+		trace_ring.dropped++;
+		return;
+	}
+	trace_record_t* record = &trace_ring.records[head % TRACE_RING_SIZE];
+	record->time = time_us_32();
+	record->address = address;
+	record->bytes = bytes;
+	record->command = command;
+	record->status = status;
+	__dmb();	// record visible before head moves
+	trace_ring.head = head + 1;
+}
+
+void trace_set_output(uint32_t output);
+uint32_t trace_get_output();
+uint32_t trace_pop(trace_record_t* records, uint32_t max);
+void trace_print(const trace_record_t* record);
+uint32_t trace_measure_push();
+
+#endif
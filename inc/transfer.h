@@ -0,0 +1,50 @@
+#ifndef __TRANSFER_H__
+#define __TRANSFER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "memory_card.h"
+
+/* Error codes */
+#define XFER_OK				0
+#define XFER_FILE_ERR		1
+#define XFER_BAD_IMAGE		2	// not an image, or channel past its end
+#define XFER_BAD_CRC		3
+#define XFER_INCOMPLETE		4	// sectors of the upload still missing
+#define XFER_CHANGED		5	// another card was loaded while downloading the one served
+#define XFER_BUSY			6	// the USB host owns the SD card
+
+#define XFER_FRAME_SIZE		(2 + MC_SEC_SIZE + 4)	// sector (uint16), data, CRC32 of both
+
+/*
+ *	Memory card images moved over the USB console one sector per frame, each
+ *	carrying its own CRC32, so that a transfer is resumed from the first sector
+ *	missing or damaged instead of started over. Downloads read the card served
+ *	straight from its RAM copy (a sector at a time, never torn by a PSX write)
+ *	or a stored image from SD. Uploads go to a shadow file on the SD card, are
+ *	verified against the CRC32 of the whole image, then copied over their
+ *	target channel by core0 when the simulator swaps them in. Only core0 uses
+ *	transfers.
+ */
+typedef struct {
+	uint32_t sectors_sent;
+	uint32_t sectors_received;
+	uint32_t bad_crcs;			// upload frames dropped
+	uint32_t swaps;				// uploads copied over their image
+	uint32_t swap_us;			// time the last copy held write_transaction
+} transfer_stats_t;
+
+void transfer_init();
+void transfer_invalidate();
+uint32_t transfer_download(memory_card_t* mc, const uint8_t* name, uint32_t channel, uint32_t first);
+bool transfer_downloading();
+uint32_t transfer_download_frame(uint8_t* out, bool* built);
+uint32_t transfer_upload(const uint8_t* name, uint32_t channel, uint32_t* received, uint32_t* first_missing);
+uint32_t transfer_upload_sector(const uint8_t* frame);
+uint32_t transfer_commit(uint32_t crc);
+bool transfer_swap_pending(uint8_t* name, uint32_t* channel);
+uint32_t transfer_apply();
+void transfer_get_stats(transfer_stats_t* stats);
+
+#endif
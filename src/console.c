@@ -0,0 +1,359 @@
+#include "console.h"
+#include <string.h>
+#include "pico/stdlib.h"
+#include "memcard_simulator.h"
+#include "msc_handler.h"
+#include "trace.h"
+#include "sd_config.h"
+#include "config.h"
+
+#define TX_BUFFER_SIZE	256
+#define RX_BUFFER_SIZE	(CONSOLE_SECTOR_PAYLOAD > CONSOLE_MAX_PAYLOAD ? CONSOLE_SECTOR_PAYLOAD : CONSOLE_MAX_PAYLOAD)
+
+typedef enum {
+	WAIT_SOF,
+	WAIT_COMMAND,
+	WAIT_LENGTH,
+	WAIT_PAYLOAD,
+	WAIT_CHECKSUM
+} rx_state_t;
+
+static struct {
+	rx_state_t state;
+	uint8_t command;
+	uint8_t length;
+	uint8_t received;
+	uint8_t checksum;
+	uint8_t payload[RX_BUFFER_SIZE];
+} rx;
+
+static uint8_t tx[TX_BUFFER_SIZE];
+static uint32_t tx_len;
+static uint32_t dropped;
+static uint32_t stream_period_us;	// 0 when not streaming
+static uint64_t stream_next;
+
+/* Queue a frame, dropped whole when the host is not reading fast enough */
+static void send_frame(uint8_t command, const void* payload, uint32_t length) {
+	if(tx_len + length + 4 > TX_BUFFER_SIZE) {
+		dropped++;
+		return;
+	}
+	uint8_t checksum = command ^ length;
+	tx[tx_len++] = CONSOLE_SOF;
+	tx[tx_len++] = command;
+	tx[tx_len++] = length;
+	for(uint32_t i = 0; i < length; i++)
+		checksum ^= tx[tx_len++] = ((const uint8_t*) payload)[i];
+	tx[tx_len++] = checksum;
+}
+
+static void send_error(uint8_t command, uint8_t error) {
+	uint8_t payload[] = { command, error };
+	send_frame(CONSOLE_ERROR, payload, sizeof(payload));
+}
+
+/* Only reads counters core1 increments on its own, so sampling never stalls the simulation */
+static void send_counters() {
+	memcard_telemetry_t telemetry;
+	memcard_simulator_get_telemetry(&telemetry);
+	sd_clock_stats_t clock;
+	sd_clock_get_stats(&clock);
+	console_counters_t counters = {
+		.uptime_ms = time_us_64() / 1000,
+		.reads = telemetry.reads,
+		.writes = telemetry.writes,
+		.ids = telemetry.ids,
+		.bad_checksums = telemetry.bad_checksums,
+		.pending = telemetry.pending,
+		.max_pending = telemetry.max_pending,
+		.sector_syncs = telemetry.sector_syncs,
+		.sd_write_last_us = telemetry.sd_write_last_us,
+		.sd_write_max_us = telemetry.sd_write_max_us,
+		.free_heap = console_free_heap(),
+		.channel = telemetry.channel,
+		.dropped = dropped,
+		.trace_dropped = trace_ring.dropped,
+		.sd_baud_rate = clock.baud_rate,
+		.sd_crc_errors = clock.crc_errors,
+		.sd_fallbacks = clock.fallbacks,
+		.first_ack_us = telemetry.first_ack_us
+	};
+	send_frame(CONSOLE_COUNTERS | CONSOLE_REPLY, &counters, sizeof(counters));
+}
+
+/* One page of the snapshot index of the card served, a seek and a read on the SD card */
+static void send_snapshots(uint32_t first) {
+	uint8_t payload[CONSOLE_MAX_PAYLOAD];
+	uint32_t count, total;
+	uint32_t status = memcard_simulator_list_snapshots(first, (snapshot_info_t*) &payload[2], CONSOLE_SNAPSHOTS_MAX, &count, &total);
+	if(status != SN_OK) {
+		send_error(CONSOLE_SNAPSHOTS, status == SN_BUSY ? CONSOLE_BUSY : CONSOLE_FAILED);
+		return;
+	}
+	payload[0] = total;
+	payload[1] = total >> 8;
+	send_frame(CONSOLE_SNAPSHOTS | CONSOLE_REPLY, payload, 2 + count * sizeof(snapshot_info_t));
+}
+
+static uint8_t transfer_error(uint32_t status) {
+	switch(status) {
+		case XFER_BUSY:			return CONSOLE_BUSY;
+		case XFER_BAD_IMAGE:	return CONSOLE_BAD_INDEX;
+		case XFER_BAD_CRC:		return CONSOLE_BAD_CRC;
+		case XFER_INCOMPLETE:	return CONSOLE_INCOMPLETE;
+		default:				return CONSOLE_FAILED;
+	}
+}
+
+/* Uploads grow a shadow file, which waits until the USB host let go of the volume */
+static bool upload_blocked() {
+	return msc_host_busy() || msc_host_mounted();
+}
+
+/* Image name ending the payload from offset, false if too long */
+static bool payload_name(uint32_t offset, uint8_t* name) {
+	uint32_t len = rx.length - offset;
+	if(len > MAX_MC_FILENAME_LEN)
+		return false;
+	memcpy(name, &rx.payload[offset], len);
+	name[len] = '\0';
+	return true;
+}
+
+static void process_frame() {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+
+	switch(rx.command) {
+		case CONSOLE_PING:
+			{
+				uint8_t version = CONSOLE_VERSION;
+				send_frame(CONSOLE_PING | CONSOLE_REPLY, &version, 1);
+			}
+			break;
+		case CONSOLE_COUNTERS:
+			send_counters();
+			break;
+		case CONSOLE_IMAGE:
+			{
+				const uint8_t* name = memcard_simulator_get_name();
+				send_frame(CONSOLE_IMAGE | CONSOLE_REPLY, name, strlen(name));
+			}
+			break;
+		case CONSOLE_STREAM:
+			{
+				if(rx.length != 2) {
+					send_error(rx.command, CONSOLE_BAD_LENGTH);
+					return;
+				}
+				uint32_t period = rx.payload[0] | rx.payload[1] << 8;
+				if(period && period < CONSOLE_MIN_PERIOD)
+					period = CONSOLE_MIN_PERIOD;
+				stream_period_us = period * 1000;
+				stream_next = time_us_64();
+				send_frame(CONSOLE_STREAM | CONSOLE_REPLY, rx.payload, 2);
+			}
+			break;
+		case CONSOLE_TRACE:
+			if(rx.length != 1) {
+				send_error(rx.command, CONSOLE_BAD_LENGTH);
+				return;
+			}
+			trace_set_output(rx.payload[0] ? TRACE_CDC : TRACE_OFF);
+			send_frame(CONSOLE_TRACE | CONSOLE_REPLY, rx.payload, 1);
+			break;
+		case CONSOLE_SNAPSHOTS:
+			if(rx.length != 2) {
+				send_error(rx.command, CONSOLE_BAD_LENGTH);
+				return;
+			}
+			send_snapshots(rx.payload[0] | rx.payload[1] << 8);
+			break;
+		case CONSOLE_RESTORE:
+			{
+				if(rx.length != 2) {
+					send_error(rx.command, CONSOLE_BAD_LENGTH);
+					return;
+				}
+				uint32_t count, total;
+				uint32_t index = rx.payload[0] | rx.payload[1] << 8;
+				uint32_t status = memcard_simulator_list_snapshots(0, NULL, 0, &count, &total);
+				if(status != SN_OK) {
+					send_error(rx.command, status == SN_BUSY ? CONSOLE_BUSY : CONSOLE_FAILED);
+					return;
+				}
+				if(index >= total) {
+					send_error(rx.command, CONSOLE_BAD_INDEX);
+					return;
+				}
+				memcard_simulator_restore_snapshot(index);
+				send_frame(CONSOLE_RESTORE | CONSOLE_REPLY, rx.payload, 2);
+			}
+			break;
+		case CONSOLE_DOWNLOAD:
+			{
+				if(rx.length < 3 || !payload_name(3, name)) {
+					send_error(rx.command, CONSOLE_BAD_LENGTH);
+					return;
+				}
+				uint32_t status = memcard_simulator_download(name, rx.payload[2], rx.payload[0] | rx.payload[1] << 8);
+				if(status != XFER_OK) {
+					send_error(rx.command, transfer_error(status));
+					return;
+				}
+				send_frame(CONSOLE_DOWNLOAD | CONSOLE_REPLY, rx.payload, 2);	// sector frames follow
+			}
+			break;
+		case CONSOLE_SECTOR_DATA:
+			{
+				if(rx.length != CONSOLE_SECTOR_PAYLOAD) {
+					send_error(rx.command, CONSOLE_BAD_LENGTH);
+					return;
+				}
+				uint32_t status = upload_blocked() ? XFER_BUSY : transfer_upload_sector(rx.payload);
+				if(status != XFER_OK)
+					send_error(rx.command, transfer_error(status));
+			}
+			break;
+		case CONSOLE_UPLOAD:
+			{
+				uint32_t received, first_missing;
+				if(rx.length < 1 || !payload_name(1, name)) {
+					send_error(rx.command, CONSOLE_BAD_LENGTH);
+					return;
+				}
+				uint32_t status = memcard_simulator_upload(name, rx.payload[0], &received, &first_missing);
+				if(status != XFER_OK) {
+					send_error(rx.command, transfer_error(status));
+					return;
+				}
+				uint8_t payload[] = { received, received >> 8, first_missing, first_missing >> 8 };
+				send_frame(CONSOLE_UPLOAD | CONSOLE_REPLY, payload, sizeof(payload));
+			}
+			break;
+		case CONSOLE_COMMIT:
+			{
+				if(rx.length != 4) {
+					send_error(rx.command, CONSOLE_BAD_LENGTH);
+					return;
+				}
+				uint32_t crc = rx.payload[0] | rx.payload[1] << 8 | rx.payload[2] << 16 | (uint32_t) rx.payload[3] << 24;
+				uint32_t status = upload_blocked() ? XFER_BUSY : transfer_commit(crc);
+				if(status != XFER_OK) {
+					send_error(rx.command, transfer_error(status));
+					return;
+				}
+				send_frame(CONSOLE_COMMIT | CONSOLE_REPLY, rx.payload, 4);
+			}
+			break;
+		default:
+			send_error(rx.command, CONSOLE_BAD_COMMAND);
+			break;
+	}
+}
+
+void console_init() {
+	rx.state = WAIT_SOF;
+	tx_len = 0;
+	dropped = 0;
+	stream_period_us = 0;
+}
+
+/* Feed bytes read from CDC, replies are queued for console_transmit() */
+void console_receive(const uint8_t* data, uint32_t len) {
+	for(uint32_t i = 0; i < len; i++) {
+		uint8_t byte = data[i];
+		switch(rx.state) {
+			case WAIT_SOF:
+				if(byte == CONSOLE_SOF)
+					rx.state = WAIT_COMMAND;
+				break;
+			case WAIT_COMMAND:
+				rx.command = byte;
+				rx.checksum = byte;
+				rx.state = WAIT_LENGTH;
+				break;
+			case WAIT_LENGTH:
+				if(byte > (rx.command == CONSOLE_SECTOR_DATA ? CONSOLE_SECTOR_PAYLOAD : CONSOLE_MAX_PAYLOAD)) {
+					send_error(rx.command, CONSOLE_BAD_LENGTH);
+					rx.state = WAIT_SOF;
+					break;
+				}
+				rx.length = byte;
+				rx.received = 0;
+				rx.checksum ^= byte;
+				rx.state = byte ? WAIT_PAYLOAD : WAIT_CHECKSUM;
+				break;
+			case WAIT_PAYLOAD:
+				rx.payload[rx.received++] = byte;
+				rx.checksum ^= byte;
+				if(rx.received == rx.length)
+					rx.state = WAIT_CHECKSUM;
+				break;
+			case WAIT_CHECKSUM:
+				if(byte == rx.checksum)
+					process_frame();
+				else
+					send_error(rx.command, CONSOLE_BAD_CHECKSUM);
+				rx.state = WAIT_SOF;
+				break;
+		}
+	}
+}
+
+/***
+ *	Append download frames to out while they fit: the sector data is built in
+ *	place by the transfer module, straight from the RAM copy of the card, and
+ *	only the frame header and checksum are added around it here.
+ */
+static uint32_t transmit_sectors(uint8_t* out, uint32_t max) {
+	uint32_t count = 0;
+	while(transfer_downloading() && count + CONSOLE_SECTOR_PAYLOAD + 4 <= max) {
+		bool built;
+		uint8_t* frame = &out[count];
+		uint32_t status = transfer_download_frame(&frame[3], &built);
+		if(status != XFER_OK)
+			send_error(CONSOLE_DOWNLOAD, transfer_error(status));
+		if(!built)
+			break;
+		uint8_t checksum = CONSOLE_SECTOR_DATA ^ CONSOLE_SECTOR_PAYLOAD;
+		for(uint32_t i = 0; i < CONSOLE_SECTOR_PAYLOAD; i++)
+			checksum ^= frame[3 + i];
+		frame[0] = CONSOLE_SOF;
+		frame[1] = CONSOLE_SECTOR_DATA;
+		frame[2] = CONSOLE_SECTOR_PAYLOAD;
+		frame[3 + CONSOLE_SECTOR_PAYLOAD] = checksum;
+		count += CONSOLE_SECTOR_PAYLOAD + 4;
+	}
+	return count;
+}
+
+/***
+ *	Move up to max bytes of queued replies to out, returns how many. While
+ *	streaming, a COUNTERS frame is queued each period once earlier replies are
+ *	out, so samples never pile up when the host is behind. Trace records are
+ *	moved from the ring the same way. Download frames go out once the replies
+ *	queued are, and pause while the USB host owns the SD card.
+ */
+uint32_t console_transmit(uint8_t* out, uint32_t max) {
+	uint64_t now = time_us_64();
+	if(stream_period_us && now >= stream_next && !tx_len) {
+		send_counters();
+		stream_next += stream_period_us;
+		if(stream_next < now)
+			stream_next = now + stream_period_us;	// host was not reading, do not catch up
+	}
+	if(trace_get_output() == TRACE_CDC && !tx_len) {
+		trace_record_t records[CONSOLE_MAX_PAYLOAD / sizeof(trace_record_t)];
+		uint32_t count = trace_pop(records, CONSOLE_MAX_PAYLOAD / sizeof(trace_record_t));
+		if(count)
+			send_frame(CONSOLE_TRACE_DATA, records, count * sizeof(trace_record_t));
+	}
+	uint32_t count = tx_len < max ? tx_len : max;
+	memcpy(out, tx, count);
+	memmove(tx, &tx[count], tx_len - count);
+	tx_len -= count;
+	if(!tx_len && !msc_host_busy())
+		count += transmit_sectors(&out[count], max - count);
+	return count;
+}
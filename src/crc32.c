@@ -0,0 +1,30 @@
+#include "crc32.h"
+#include <stdbool.h>
+
+static uint32_t crc_table[256];
+static bool crc_table_ready = false;
+
+/* Table is built at first use instead of being stored in flash, lookups stay in RAM */
+static void crc32_init_table() {
+	for(uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for(uint32_t k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+		crc_table[i] = c;
+	}
+	crc_table_ready = true;
+}
+
+/* Continue a CRC over more data, start with crc = 0 */
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t len) {
+	if(!crc_table_ready)
+		crc32_init_table();
+	crc = ~crc;
+	while(len--)
+		crc = crc_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+uint32_t crc32(const uint8_t* data, uint32_t len) {
+	return crc32_update(0, data, len);
+}
@@ -0,0 +1,48 @@
+#include "flash_io.h"
+#include "memcard_simulator.h"
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+static uint32_t last_us;
+
+/***
+ *	Erase the flash sector at offset if asked, then program len bytes (a
+ *	multiple of the page size, 0 for none) from data. Nothing may run from
+ *	flash meanwhile: the SEL interrupt is turned off and core1 held in reset,
+ *	and core0 interrupts are masked around the SDK routines, which run from RAM.
+ *	A page takes about 1ms, an erase tens of ms. The state machines and core1
+ *	are then restarted as on a SEL edge, so that a transaction starting right
+ *	after is answered; when the PSX selected the card meanwhile, the SEL edge
+ *	ending that transaction does it.
+ */
+void flash_io_write(uint32_t offset, bool erase, const uint8_t* data, uint32_t len) {
+	uint64_t start = time_us_64();
+	irq_set_enabled(IO_IRQ_BANK0, false);
+	multicore_reset_core1();
+	uint32_t interrupts = save_and_disable_interrupts();
+	if(erase)
+		flash_range_erase(offset, FLASH_SECTOR_SIZE);
+	if(len)
+		flash_range_program(offset, data, len);
+	restore_interrupts(interrupts);
+	simulate_memory_card_resume();
+	irq_set_enabled(IO_IRQ_BANK0, true);
+	last_us = time_us_64() - start;
+}
+
+/* Every byte reads 0xFF, i.e. can be programmed without erasing first */
+bool flash_io_is_erased(uint32_t offset, uint32_t len) {
+	const uint32_t* word = (const uint32_t*) (XIP_BASE + offset);
+	for(uint32_t i = 0; i < len / 4; i++)
+		if(word[i] != 0xFFFFFFFF)
+			return false;
+	return true;
+}
+
+/* Time the PSX went unanswered for the last write */
+uint32_t flash_io_last_us() {
+	return last_us;
+}
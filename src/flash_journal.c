@@ -0,0 +1,308 @@
+#include "flash_journal.h"
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "crc32.h"
+#include "flash_io.h"
+
+#define JOURNAL_PAGES		(FLASH_JOURNAL_SIZE / FLASH_PAGE_SIZE)
+#define JOURNAL_SECTORS		(FLASH_JOURNAL_SIZE / FLASH_SECTOR_SIZE)
+#define PAGES_PER_SECTOR	(FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define JOURNAL_MAGIC		0x4C4E524A	// "JRNL", erased flash reads 0xFFFFFFFF
+#define NOT_JOURNALED		0xFFFF		// odd, never the generation of a settled sector
+
+/* Record types */
+#define RECORD_IMAGE		1	// following sector records belong to the image named in payload
+#define RECORD_SECTOR		2	// payload is the new content of sector
+#define RECORD_CHECKPOINT	3	// records up to value are on SD
+
+/* One record per flash page */
+typedef struct {
+	uint32_t magic;
+	uint32_t crc;				// CRC32 of the rest of the page
+	uint32_t sequence;			// increases with every record, never reused
+	uint16_t type;
+	uint16_t sector;
+	uint32_t value;				// channel of RECORD_IMAGE, last sequence committed by RECORD_CHECKPOINT
+	uint8_t payload[FLASH_PAGE_SIZE - 20];	// sector data or image name
+} journal_page_t;
+
+static uint32_t write_page;				// next page appended
+static uint32_t next_sequence;
+static uint32_t last_record;			// sequence of the last image or sector record
+static uint32_t committed;				// last sequence covered by a checkpoint written
+static uint32_t checkpoint_sequence;	// sequence to commit with the next step, 0 if none
+static bool full;						// no erased page left at write_page
+static bool reclaim_done;				// nothing left to erase until the next checkpoint
+static uint8_t image_name[MAX_MC_FILENAME_LEN + 1];	// image the PSX writes to
+static uint32_t image_channel;
+static bool image_logged;				// an image record precedes its sector records
+static uint16_t journaled[MC_SEC_COUNT];	// generation of each sector as last appended
+static journal_page_t page;				// record being appended
+static flash_journal_stats_t stats;
+
+static inline uint32_t page_offset(uint32_t index) {
+	return FLASH_JOURNAL_OFFSET + index * FLASH_PAGE_SIZE;
+}
+
+/* Records are read through XIP */
+static inline const journal_page_t* journal_page(uint32_t index) {
+	return (const journal_page_t*) (XIP_BASE + page_offset(index));
+}
+
+static uint32_t page_crc(const journal_page_t* record) {
+	return crc32((const uint8_t*) &record->sequence, FLASH_PAGE_SIZE - 2 * sizeof(uint32_t));
+}
+
+static bool page_valid(const journal_page_t* record) {
+	return record->magic == JOURNAL_MAGIC && record->crc == page_crc(record);
+}
+
+/* Scan the journal for the append position and the last checkpoint */
+void flash_journal_init() {
+	uint32_t head = JOURNAL_PAGES;
+	next_sequence = 1;
+	last_record = committed = 0;
+	for(uint32_t i = 0; i < JOURNAL_PAGES; i++) {
+		const journal_page_t* record = journal_page(i);
+		if(!page_valid(record))
+			continue;
+		if(record->sequence >= next_sequence) {
+			next_sequence = record->sequence + 1;
+			head = i;
+		}
+		if(record->type == RECORD_CHECKPOINT && record->value > committed)
+			committed = record->value;
+		else if(record->type != RECORD_CHECKPOINT && record->sequence > last_record)
+			last_record = record->sequence;
+	}
+	write_page = head == JOURNAL_PAGES ? 0 : (head + 1) % JOURNAL_PAGES;
+	checkpoint_sequence = 0;
+	full = reclaim_done = false;
+	image_name[0] = '\0';
+	image_logged = false;
+	for(sector_t sector = 0; sector < MC_SEC_COUNT; sector++)
+		journaled[sector] = NOT_JOURNALED;
+	memset(&stats, 0, sizeof(stats));
+}
+
+/* Pages of the image and sector records not committed yet in sequence order, returns their count */
+static uint32_t uncommitted_pages(uint16_t* pages) {
+	uint32_t count = 0;
+	for(uint32_t i = 0; i < JOURNAL_PAGES; i++) {
+		const journal_page_t* record = journal_page(i);
+		if(!page_valid(record) || record->sequence <= committed || record->type == RECORD_CHECKPOINT)
+			continue;
+		uint32_t j = count++;
+		while(j > 0 && journal_page(pages[j - 1])->sequence > record->sequence) {
+			pages[j] = pages[j - 1];
+			j--;
+		}
+		pages[j] = i;
+	}
+	return count;
+}
+
+static bool image_record_valid(const journal_page_t* record) {
+	return record->type == RECORD_IMAGE && memchr(record->payload, '\0', MAX_MC_FILENAME_LEN + 1);
+}
+
+/***
+ *	Image (and channel) the last uncommitted sector records were written to,
+ *	the one to load at boot before flash_journal_replay(). Returns false when
+ *	every write reached the SD card.
+ */
+bool flash_journal_pending_image(uint8_t* name, uint32_t* channel) {
+	uint16_t pages[JOURNAL_PAGES];
+	uint32_t count = uncommitted_pages(pages);
+	const journal_page_t* image = NULL;
+	bool found = false;
+	for(uint32_t i = 0; i < count; i++) {
+		const journal_page_t* record = journal_page(pages[i]);
+		if(image_record_valid(record)) {
+			image = record;
+		} else if(record->type == RECORD_SECTOR && image) {
+			strcpy(name, image->payload);
+			*channel = image->value;
+			found = true;
+		}
+	}
+	return found;
+}
+
+/***
+ *	Write the uncommitted records of name (channel mc->channel) into the image,
+ *	in the order the PSX wrote them. The image must be fully resident and the
+ *	caller hold write_transaction. Records of other images are dropped, they
+ *	are only left behind when leaving a card failed to flush it. Returns
+ *	MC_OK or the error of the image write, replayed receives the sectors restored.
+ */
+uint32_t flash_journal_replay(memory_card_t* mc, const uint8_t* name, uint32_t* replayed) {
+	uint16_t pages[JOURNAL_PAGES];
+	uint32_t count = uncommitted_pages(pages);
+	bool match = false;
+	*replayed = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		const journal_page_t* record = journal_page(pages[i]);
+		if(record->type == RECORD_IMAGE) {
+			match = image_record_valid(record) && !strcmp(record->payload, name) && record->value == mc->channel;
+		} else if(match && record->type == RECORD_SECTOR && record->sector < MC_SEC_COUNT) {
+			uint32_t status = memory_card_restore_sector(mc, record->sector, record->payload);
+			if(status != MC_OK)
+				return status;
+			(*replayed)++;
+		}
+	}
+	stats.replayed += *replayed;
+	return MC_OK;
+}
+
+/* The PSX is now served name (channel), none of its sectors is journaled yet */
+void flash_journal_track(const uint8_t* name, uint32_t channel) {
+	strcpy(image_name, name);
+	image_channel = channel;
+	image_logged = false;
+	for(sector_t sector = 0; sector < MC_SEC_COUNT; sector++)
+		journaled[sector] = NOT_JOURNALED;
+}
+
+/* First dirty sector whose content is not in the journal, -1 if none */
+static int32_t next_unjournaled(memory_card_t* mc) {
+	for(uint32_t word = 0; word < MC_DIRTY_WORDS; word++) {
+		for(uint32_t dirty = memory_card_dirty_word(mc, word); dirty; dirty &= dirty - 1) {
+			sector_t sector = word * 32 + __builtin_ctz(dirty);
+			if(journaled[sector] != mc->meta[sector].generation)
+				return sector;
+		}
+	}
+	return -1;
+}
+
+/* Every sector waiting for the SD card is safe in flash */
+bool flash_journal_covers(memory_card_t* mc) {
+	return next_unjournaled(mc) < 0;
+}
+
+/* Everything appended so far is on SD (image flushed, nothing pending), committed by the next step */
+void flash_journal_checkpoint() {
+	if(last_record > committed)
+		checkpoint_sequence = next_sequence - 1;
+}
+
+/***
+ *	Program page as the next record, skipping what is left of a sector holding
+ *	a torn page. Returns false when the next sector has not been erased yet.
+ */
+static bool append(uint16_t type, uint16_t sector, uint32_t value) {
+	if(!flash_io_is_erased(page_offset(write_page), FLASH_PAGE_SIZE) && write_page % PAGES_PER_SECTOR)
+		write_page = (write_page / PAGES_PER_SECTOR + 1) * PAGES_PER_SECTOR % JOURNAL_PAGES;
+	if(!flash_io_is_erased(page_offset(write_page), FLASH_PAGE_SIZE)) {
+		if(!full)
+			stats.full++;
+		full = true;
+		reclaim_done = false;
+		return false;
+	}
+	full = false;
+	page.magic = JOURNAL_MAGIC;
+	page.sequence = next_sequence;
+	page.type = type;
+	page.sector = sector;
+	page.value = value;
+	page.crc = page_crc(&page);
+	flash_io_write(page_offset(write_page), false, (const uint8_t*) &page, FLASH_PAGE_SIZE);
+	stats.append_us = flash_io_last_us();
+	bool written = page_valid(journal_page(write_page));
+	write_page = (write_page + 1) % JOURNAL_PAGES;
+	if(!written)
+		return false;	// retried on the next page
+	if(type != RECORD_CHECKPOINT)
+		last_record = next_sequence;
+	next_sequence++;
+	return true;
+}
+
+/***
+ *	Erase one flash sector holding only committed records (or torn pages),
+ *	the one appended to next first. When the journal is full with a checkpoint
+ *	waiting, records it will commit are reclaimed too, nothing else could make
+ *	room for it. Sectors are only looked at when erasing is allowed, scanning
+ *	them costs several ms of flash reads. Returns true while there is work left.
+ */
+static bool reclaim_step(bool may_erase) {
+	if(reclaim_done || !may_erase)
+		return false;
+	uint32_t limit = full && checkpoint_sequence ? checkpoint_sequence : committed;
+	for(uint32_t i = 0; i < JOURNAL_SECTORS; i++) {
+		if(i == 0 && write_page % PAGES_PER_SECTOR)
+			continue;	// being appended to
+		uint32_t first = ((write_page / PAGES_PER_SECTOR + i) % JOURNAL_SECTORS) * PAGES_PER_SECTOR;
+		if(flash_io_is_erased(page_offset(first), FLASH_SECTOR_SIZE))
+			continue;
+		bool reclaimable = true;
+		for(uint32_t j = 0; j < PAGES_PER_SECTOR && reclaimable; j++) {
+			const journal_page_t* record = journal_page(first + j);
+			reclaimable = !page_valid(record) || record->sequence <= limit;
+		}
+		if(!reclaimable)
+			continue;
+		flash_io_write(page_offset(first), true, NULL, 0);
+		stats.erases++;
+		return true;
+	}
+	reclaim_done = true;
+	return false;
+}
+
+/***
+ *	Append one record: a pending checkpoint first, then dirty sectors not in
+ *	the journal yet, each preceded once by the image it belongs to. Pages are
+ *	programmed only when may_program is set, the caller makes sure the PSX is
+ *	not in a transaction; with nothing to append, committed flash sectors are
+ *	erased when may_erase is set (the PSX idle for a while). A sector core1 is
+ *	rewriting is appended once it settles. Returns true while there is work left
+ *	that the flags allow.
+ */
+bool flash_journal_step(memory_card_t* mc, bool may_program, bool may_erase) {
+	if(checkpoint_sequence) {
+		if(!may_program)
+			return true;
+		memset(page.payload, 0, sizeof(page.payload));
+		if(!append(RECORD_CHECKPOINT, 0, checkpoint_sequence))
+			return reclaim_step(may_erase);
+		committed = checkpoint_sequence;
+		checkpoint_sequence = 0;
+		reclaim_done = false;
+		image_logged = false;	// later sector records need an uncommitted image record
+		stats.checkpoints++;
+		return true;
+	}
+	int32_t sector = image_name[0] ? next_unjournaled(mc) : -1;
+	if(sector < 0)
+		return reclaim_step(may_erase);
+	if(!may_program)
+		return true;
+	if(!image_logged) {
+		memset(page.payload, 0, sizeof(page.payload));
+		strcpy(page.payload, image_name);
+		image_logged = append(RECORD_IMAGE, 0, image_channel);
+		return image_logged || reclaim_step(may_erase);
+	}
+	sector_meta_t* meta = &mc->meta[sector];
+	uint16_t generation = meta->generation;
+	__dmb();
+	memcpy(page.payload, &mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE);
+	__dmb();
+	if((generation & 1) || generation != meta->generation)
+		return true;
+	if(!append(RECORD_SECTOR, sector, 0))
+		return reclaim_step(may_erase);
+	journaled[sector] = generation;
+	stats.records++;
+	return true;
+}
+
+void flash_journal_get_stats(flash_journal_stats_t* out) {
+	*out = stats;
+}
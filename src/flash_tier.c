@@ -0,0 +1,324 @@
+#include "flash_tier.h"
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "ff.h"
+#include "crc32.h"
+#include "flash_io.h"
+#include "memory_card.h"
+
+#define SLOT_SIZE			(FLASH_SECTOR_SIZE + MC_SIZE)	// header sector followed by the image
+#define IMAGE_SECTORS		(MC_SIZE / FLASH_SECTOR_SIZE)
+#define FLASH_TIER_MAGIC	0x524D4350	// "PCMR", erased flash reads 0xFFFFFFFF
+#define NO_JOB				FLASH_TIER_SLOTS
+
+static const char favourites_filename[] = "Favourites.txt";
+
+/* First page of the header sector */
+typedef struct {
+	uint32_t magic;
+	uint32_t generation;		// bumped on every rewrite of the slot
+	uint32_t crc;				// CRC32 of the image, also of its SD copy when written
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+} slot_header_t;
+
+typedef struct {
+	uint8_t wanted[MAX_MC_FILENAME_LEN + 1];	// image the slot should hold, "" if none
+	bool verified;		// flash copy known to match the SD copy of wanted
+} slot_state_t;
+
+/* Slot being brought in step with its source, a 4KB sector per step */
+typedef struct {
+	uint32_t slot;		// NO_JOB when idle
+	bool from_file;		// favourite read from SD, otherwise the image served from RAM
+	FIL file;
+	uint8_t* buffer;	// sector read from file, FLASH_SECTOR_SIZE bytes
+	bool loaded;		// buffer holds the sector, not programmed yet
+	uint32_t sector;	// next image sector
+	uint32_t crc;		// of the file sectors read so far
+	bool erased;		// header erased, the slot is invalid until the job completes
+} flash_job_t;
+
+static slot_state_t slots[FLASH_TIER_SLOTS];
+static flash_job_t job = { .slot = NO_JOB };
+static flash_tier_stats_t stats;
+
+static inline uint32_t slot_offset(uint32_t slot) {
+	return FLASH_TIER_OFFSET + slot * SLOT_SIZE;
+}
+
+/* Flash contents are read through XIP */
+static inline const slot_header_t* slot_header(uint32_t slot) {
+	return (const slot_header_t*) (XIP_BASE + slot_offset(slot));
+}
+
+static inline const uint8_t* slot_image(uint32_t slot) {
+	return (const uint8_t*) (XIP_BASE + slot_offset(slot) + FLASH_SECTOR_SIZE);
+}
+
+static bool header_valid(const slot_header_t* header) {
+	return header->magic == FLASH_TIER_MAGIC && memchr(header->name, '\0', sizeof(header->name));
+}
+
+/* Slot content is an image of name known to match its SD copy */
+static bool slot_serves(uint32_t slot, const uint8_t* name) {
+	return slots[slot].verified && !strcmp(slots[slot].wanted, name) &&
+		header_valid(slot_header(slot)) && !strcmp(slot_header(slot)->name, name);
+}
+
+static void end_job() {
+	if(job.slot == NO_JOB)
+		return;
+	if(job.from_file)
+		f_close(&job.file);
+	free(job.buffer);
+	job.buffer = NULL;
+	job.slot = NO_JOB;
+}
+
+/* Scan the partition, nothing is verified until the SD card is mounted */
+void flash_tier_init() {
+	end_job();
+	for(uint32_t i = 0; i < FLASH_TIER_SLOTS; i++) {
+		const slot_header_t* header = slot_header(i);
+		strcpy(slots[i].wanted, header_valid(header) ? (const char*) header->name : "");
+		slots[i].verified = false;
+	}
+	memset(&stats, 0, sizeof(stats));
+}
+
+/***
+ *	Restore the last image served into data (MC_SIZE bytes) and its name, at
+ *	boot before the SD card is mounted. The copy is not verified yet: the caller
+ *	merges it with the SD copy (memory_card_merge()) once the card is mounted.
+ *	Returns false when slot 0 holds no intact image.
+ */
+bool flash_tier_load_last(uint8_t* name, uint8_t* data) {
+	const slot_header_t* header = slot_header(0);
+	if(!header_valid(header))
+		return false;
+	memcpy(data, slot_image(0), MC_SIZE);
+	if(crc32(data, MC_SIZE) != header->crc)
+		return false;	// torn by a power loss while programmed
+	strcpy(name, header->name);
+	stats.hits++;
+	return true;
+}
+
+/***
+ *	Restore name into data (MC_SIZE bytes) from a slot matching its SD copy.
+ *	Returns false on a miss, data is then left untouched. When data is the
+ *	card being served, it must have been withdrawn (memory_card_withdraw()).
+ */
+bool flash_tier_load(const uint8_t* name, uint8_t* data) {
+	for(uint32_t i = 0; i < FLASH_TIER_SLOTS; i++) {
+		if(slot_serves(i, name)) {
+			memcpy(data, slot_image(i), MC_SIZE);
+			stats.hits++;
+			return true;
+		}
+	}
+	stats.misses++;
+	return false;
+}
+
+/***
+ *	(Re)read Favourites.txt, a missing file is an empty list. Favourites keep
+ *	the slot already holding them, so editing the list rewrites only the slots
+ *	of images added to it.
+ */
+uint32_t flash_tier_load_favourites() {
+	FIL file;
+	uint8_t line[MAX_MC_FILENAME_LEN + 16];
+	uint8_t names[FLASH_TIER_SLOTS - 1][MAX_MC_FILENAME_LEN + 1];
+	bool placed[FLASH_TIER_SLOTS - 1];
+	uint32_t count = 0;
+	if(FR_OK == f_open(&file, favourites_filename, FA_OPEN_EXISTING | FA_READ)) {
+		while(count < FLASH_TIER_SLOTS - 1 && f_gets(line, sizeof(line), &file)) {
+			uint8_t* name = strtok(line, "\r\n");
+			if(!name || name[0] == '#' || strlen(name) > MAX_MC_FILENAME_LEN)
+				continue;
+			strcpy(names[count], name);
+			placed[count++] = false;
+		}
+		f_close(&file);
+	}
+
+	bool taken[FLASH_TIER_SLOTS] = { true };	// slot 0 is the last image served
+	for(uint32_t i = 0; i < count; i++) {
+		for(uint32_t slot = 1; slot < FLASH_TIER_SLOTS && !placed[i]; slot++) {
+			if(!taken[slot] && !strcmp(slots[slot].wanted, names[i]))
+				placed[i] = taken[slot] = true;
+		}
+	}
+	for(uint32_t i = 0; i < count; i++) {
+		for(uint32_t slot = 1; slot < FLASH_TIER_SLOTS && !placed[i]; slot++) {
+			if(!taken[slot]) {
+				if(job.slot == slot)
+					end_job();
+				strcpy(slots[slot].wanted, names[i]);
+				slots[slot].verified = false;
+				placed[i] = taken[slot] = true;
+			}
+		}
+	}
+	for(uint32_t slot = 1; slot < FLASH_TIER_SLOTS; slot++) {
+		if(!taken[slot]) {
+			if(job.slot == slot)
+				end_job();
+			slots[slot].wanted[0] = '\0';
+			slots[slot].verified = false;
+		}
+	}
+	return FT_OK;
+}
+
+/* The SD copy of name was written, the slots holding it are out of date */
+void flash_tier_changed(const uint8_t* name) {
+	for(uint32_t i = 0; i < FLASH_TIER_SLOTS; i++) {
+		if(!strcmp(slots[i].wanted, name)) {
+			slots[i].verified = false;
+			if(job.slot == i)
+				end_job();
+		}
+	}
+}
+
+/* The volume was written by someone else (USB host), every slot has to be checked again */
+void flash_tier_invalidate() {
+	end_job();
+	for(uint32_t i = 0; i < FLASH_TIER_SLOTS; i++)
+		slots[i].verified = false;
+}
+
+/* Pick the next slot to bring in step, slot 0 first as it is switched back to the most */
+static bool start_job(const uint8_t* name) {
+	uint32_t slot = NO_JOB;
+	if(name && (!slots[0].verified || strcmp(slots[0].wanted, name))) {
+		strcpy(slots[0].wanted, name);
+		slots[0].verified = false;
+		slot = 0;
+	}
+	for(uint32_t i = 1; i < FLASH_TIER_SLOTS && slot == NO_JOB; i++)
+		if(slots[i].wanted[0] && !slots[i].verified)
+			slot = i;
+	if(slot == NO_JOB)
+		return false;
+
+	job.from_file = slot != 0;
+	if(job.from_file) {
+		job.buffer = malloc(FLASH_SECTOR_SIZE);
+		if(!job.buffer || FR_OK != f_open(&job.file, slots[slot].wanted, FA_OPEN_EXISTING | FA_READ)) {
+			free(job.buffer);
+			job.buffer = NULL;
+			slots[slot].wanted[0] = '\0';	// give up on this favourite until the list is read again
+			return true;
+		}
+		if(!MC_IS_IMAGE_SIZE(f_size(&job.file))) {
+			f_close(&job.file);
+			free(job.buffer);
+			job.buffer = NULL;
+			slots[slot].wanted[0] = '\0';
+			return true;
+		}
+	}
+	job.slot = slot;
+	job.loaded = false;
+	job.sector = 0;
+	job.crc = 0;
+	job.erased = false;
+	return true;
+}
+
+/* Every image sector matches its source: write the header if it changed, then serve the slot */
+static bool finish_job(const uint8_t* data, bool may_program) {
+	slot_state_t* slot = &slots[job.slot];
+	const slot_header_t* header = slot_header(job.slot);
+	uint32_t crc = job.crc;
+	if(!job.from_file) {
+		if(memcmp(data, slot_image(job.slot), MC_SIZE)) {
+			job.sector = 0;	// the PSX wrote meanwhile, go over the image again
+			return true;
+		}
+		crc = crc32(data, MC_SIZE);
+	}
+	if(job.erased || !header_valid(header) || header->crc != crc || strcmp(header->name, slot->wanted)) {
+		if(!may_program)
+			return true;
+		static uint8_t page[FLASH_PAGE_SIZE];
+		slot_header_t* next = (slot_header_t*) page;
+		memset(page, 0xFF, sizeof(page));
+		next->magic = FLASH_TIER_MAGIC;
+		next->generation = header_valid(header) ? header->generation + 1 : 1;
+		next->crc = crc;
+		strcpy(next->name, slot->wanted);
+		flash_io_write(slot_offset(job.slot), true, page, FLASH_PAGE_SIZE);
+		stats.program_us = flash_io_last_us();
+		stats.sector_writes++;
+		stats.slot_writes++;
+	}
+	slot->verified = true;
+	end_job();
+	return true;
+}
+
+/***
+ *	Advance the background work by one 4KB sector: slot 0 follows the image
+ *	served, given as name and data (MC_SIZE bytes) when RAM matches its SD
+ *	copy (NULL otherwise), then favourites are checked against their SD files.
+ *	Sectors already holding the data are skipped, the others are programmed
+ *	only when may_program is set, the caller keeps the PSX idle meanwhile.
+ *	Returns true while there is work left.
+ */
+bool flash_tier_step(const uint8_t* name, const uint8_t* data, bool may_program) {
+	if(job.slot == NO_JOB)
+		return start_job(name);
+	if(!job.from_file && (!name || strcmp(name, slots[job.slot].wanted))) {
+		end_job();	// RAM no longer a clean copy of the image
+		return true;
+	}
+	if(job.sector == IMAGE_SECTORS)
+		return finish_job(data, may_program);
+
+	const uint8_t* source;
+	if(job.from_file) {
+		if(!job.loaded) {
+			UINT bytes_read;
+			if(FR_OK != f_read(&job.file, job.buffer, FLASH_SECTOR_SIZE, &bytes_read) || bytes_read != FLASH_SECTOR_SIZE) {
+				slots[job.slot].wanted[0] = '\0';
+				end_job();
+				return true;
+			}
+			job.crc = crc32_update(job.crc, job.buffer, FLASH_SECTOR_SIZE);
+			job.loaded = true;
+		}
+		source = job.buffer;
+	} else {
+		source = &data[job.sector * FLASH_SECTOR_SIZE];
+	}
+	const uint8_t* target = &slot_image(job.slot)[job.sector * FLASH_SECTOR_SIZE];
+	if(memcmp(source, target, FLASH_SECTOR_SIZE)) {
+		if(!may_program)
+			return true;
+		if(!job.erased) {
+			/* the slot stops being valid before any of its image changes */
+			flash_io_write(slot_offset(job.slot), true, NULL, 0);
+			stats.program_us = flash_io_last_us();
+			job.erased = true;
+			return true;
+		}
+		flash_io_write(slot_offset(job.slot) + FLASH_SECTOR_SIZE + job.sector * FLASH_SECTOR_SIZE, true, source, FLASH_SECTOR_SIZE);
+		stats.program_us = flash_io_last_us();
+		stats.sector_writes++;
+	} else {
+		stats.sector_skips++;
+	}
+	job.loaded = false;
+	job.sector++;
+	return true;
+}
+
+void flash_tier_get_stats(flash_tier_stats_t* out) {
+	*out = stats;
+}
@@ -0,0 +1,144 @@
+#include "game_map.h"
+#include <stdlib.h>
+#include <string.h>
+#include "ff.h"
+
+#define MIN_SLOTS	64		// power of two, the table is kept at most half full
+
+/* text file listing "<game id> <image or folder>" lines, # starts a comment */
+static const char game_map_filename[] = "GameMap.txt";
+
+typedef struct {
+	uint32_t hash;		// 0 marks a free slot
+	uint32_t offset;	// of "<game id>\0<image>\0" in pool
+} slot_t;
+
+static slot_t* slots = NULL;
+static uint32_t slot_count = 0;
+static uint32_t entry_count = 0;
+static uint8_t* pool = NULL;
+static uint32_t pool_size = 0;
+static uint32_t pool_capacity = 0;
+static bool loaded = false;
+
+static uint32_t hash_id(const uint8_t* id) {
+	uint32_t hash = 2166136261u;
+	while(*id)
+		hash = (hash ^ *id++) * 16777619u;
+	return hash ? hash : 1;
+}
+
+/* Slot holding id, or the free slot where it would go */
+static slot_t* find_slot(slot_t* table, uint32_t count, const uint8_t* id, uint32_t hash) {
+	uint32_t i = hash & (count - 1);
+	while(table[i].hash && (table[i].hash != hash || strcmp(&pool[table[i].offset], id)))
+		i = (i + 1) & (count - 1);
+	return &table[i];
+}
+
+static bool grow_table() {
+	uint32_t count = slot_count ? slot_count * 2 : MIN_SLOTS;
+	slot_t* table = calloc(count, sizeof(slot_t));
+	if(!table)
+		return false;
+	for(uint32_t i = 0; i < slot_count; i++)
+		if(slots[i].hash)
+			*find_slot(table, count, &pool[slots[i].offset], slots[i].hash) = slots[i];
+	free(slots);
+	slots = table;
+	slot_count = count;
+	return true;
+}
+
+/* Add or replace the image of a (normalized) game id, later lines of the file win */
+static uint32_t insert(const uint8_t* id, const uint8_t* image) {
+	if(2 * (entry_count + 1) > slot_count && !grow_table())
+		return GM_ALLOC_FAIL;
+	uint32_t size = strlen(id) + strlen(image) + 2;
+	if(pool_size + size > pool_capacity) {
+		uint32_t capacity = pool_capacity ? pool_capacity * 2 : 1024;
+		while(capacity < pool_size + size)
+			capacity *= 2;
+		uint8_t* new_pool = realloc(pool, capacity);
+		if(!new_pool)
+			return GM_ALLOC_FAIL;
+		pool = new_pool;
+		pool_capacity = capacity;
+	}
+	uint32_t hash = hash_id(id);
+	slot_t* slot = find_slot(slots, slot_count, id, hash);
+	if(!slot->hash)
+		++entry_count;
+	slot->hash = hash;
+	slot->offset = pool_size;
+	strcpy(&pool[pool_size], id);
+	strcpy(&pool[pool_size + strlen(id) + 1], image);
+	pool_size += size;
+	return GM_OK;
+}
+
+/***
+ *	Turn a game ID into the key used for lookups, which is also the name of its
+ *	per-game folder: upper case, characters FAT does not like replaced with '_',
+ *	at most MAX_MC_DIRNAME_LEN long. Returns false if nothing usable is left.
+ */
+bool game_map_normalize(const uint8_t* game_id, uint8_t* out) {
+	uint32_t len = 0;
+	for(; *game_id && len < MAX_MC_DIRNAME_LEN; game_id++) {
+		uint8_t c = *game_id;
+		if(c >= 'a' && c <= 'z')
+			c = c - 'a' + 'A';
+		else if(!((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.'))
+			c = '_';
+		out[len++] = c;
+	}
+	while(len > 0 && (out[len - 1] == '.' || out[len - 1] == '_'))	// padding and trailing dots
+		--len;
+	out[len] = '\0';
+	return len > 0;
+}
+
+/* (Re)read GameMap.txt, a missing file is an empty map */
+uint32_t game_map_load() {
+	FIL file;
+	uint8_t line[MAX_GAME_ID_LEN + MAX_MC_FILENAME_LEN + 16];
+	free(slots);
+	slots = NULL;
+	slot_count = 0;
+	entry_count = 0;
+	pool_size = 0;
+	loaded = true;
+	if(!grow_table())
+		return GM_ALLOC_FAIL;
+	if(FR_OK != f_open(&file, game_map_filename, FA_OPEN_EXISTING | FA_READ))
+		return GM_OK;
+	uint32_t status = GM_OK;
+	while(status == GM_OK && f_gets(line, sizeof(line), &file)) {
+		uint8_t* id = strtok(line, " \t\r\n");
+		uint8_t* image = strtok(NULL, " \t\r\n");
+		uint8_t key[MAX_MC_DIRNAME_LEN + 1];
+		if(!id || !image || id[0] == '#' || !game_map_normalize(id, key))
+			continue;
+		status = insert(key, image);
+	}
+	f_close(&file);
+	return status;
+}
+
+/* Image (path or folder) listed for game_id, NULL when the game has no entry */
+const uint8_t* game_map_find(const uint8_t* game_id) {
+	uint8_t key[MAX_MC_DIRNAME_LEN + 1];
+	if(!loaded && game_map_load() != GM_OK)
+		return NULL;
+	if(!slot_count || !game_map_normalize(game_id, key))
+		return NULL;
+	uint32_t hash = hash_id(key);
+	slot_t* slot = find_slot(slots, slot_count, key, hash);
+	if(!slot->hash)
+		return NULL;
+	return &pool[slot->offset + strlen(&pool[slot->offset]) + 1];
+}
+
+uint32_t game_map_count() {
+	return entry_count;
+}
@@ -17,6 +17,7 @@
 static uint smWs2813;
 static uint offsetWs2813;
 static int32_t picoW = -1;
+static bool led_ready = false;	// the card engine starts first and may signal before led_init(), those are dropped
 
 #ifdef RP2040ZERO
 void ws2812_put_pixel(uint32_t pixel_grb) {
@@ -47,9 +48,12 @@ void led_init() {
 	smWs2813 = pio_claim_unused_sm(pio1, true);
 	ws2812_program_init(pio1, smWs2813, offsetWs2813, 16, 800000, true);
 	#endif
+	led_ready = true;
 }
 
 void led_output_sync_status(bool out_of_sync) {
+	if(!led_ready)
+		return;
 	#ifdef PICO
 	set_led(PICO_LED_PIN, !out_of_sync);
 	#endif
@@ -64,6 +68,8 @@ void led_output_sync_status(bool out_of_sync) {
 }
 
 void led_blink_error(int amount) {
+	if(!led_ready)
+		return;
 	/* ensure led is off */
 	#ifdef PICO
 	set_led(PICO_LED_PIN, false);
@@ -92,6 +98,8 @@ void led_blink_error(int amount) {
 }
 
 void led_output_mc_change() {
+	if(!led_ready)
+		return;
 	#ifdef PICO
 	set_led(PICO_LED_PIN, false);
 	sleep_ms(100);
@@ -108,6 +116,8 @@ void led_output_mc_change() {
 }
 
 void led_output_end_mc_list() {
+	if(!led_ready)
+		return;
 	#ifdef PICO
 	for(int i = 0; i < 3; ++i) {
 		set_led(PICO_LED_PIN, false);
@@ -126,6 +136,8 @@ void led_output_end_mc_list() {
 }
 
 void led_output_new_mc() {
+	if(!led_ready)
+		return;
 	#ifdef PICO
 	for(int i = 0; i < 10; ++i) {
 		set_led(PICO_LED_PIN, false);
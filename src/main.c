@@ -1,3 +1,4 @@
+#include <malloc.h>
 #include "pico/stdio.h"
 #include "pico/stdlib.h"
 /* SD Card */
@@ -9,35 +10,63 @@
 #include "tusb.h"
 /* Memcard Simulation */
 #include "memcard_simulator.h"
+/* Command Console */
+#include "console.h"
+/* USB Mass Storage */
+#include "msc_handler.h"
+#include "msc_cache.h"
 /* LED Control */
 #include "led.h"
+/* Memory Card Error Codes */
+#include "memory_card.h"
 /* Global Configuration */
 #include "config.h"
 
 
-bool tud_mount_status = false;
-
 void cdc_task(void);
 
+static bool usb_started = false;
+
+/* USB only needs bringing up once a host may be there, a Pico senses VBUS */
+static bool usb_host_possible() {
+#ifdef PIN_VBUS
+	if(is_pico_w())
+		return true;	// VBUS is behind the wireless chip, not worth starting it for
+	return gpio_get(PIN_VBUS);
+#else
+	return true;
+#endif
+}
+
 /*------------- MAIN -------------*/
 int main(void) {
 	stdio_init_all();
-	led_init();
-	
-	/* Pico connected to PC, initialize USB transfer mode */
+#ifdef PIN_VBUS
+	gpio_init(PIN_VBUS);
+#endif
+
+	/* the PSX probes the card slot right after power up, the simulation starts first */
+	uint32_t status = simulate_memory_card_init();
+	led_init();	// slow on a Pico W
 	board_init();
-	tusb_init();
 
 	while(true) {
-		tud_task(); // tinyusb device task
-		cdc_task();
-
-		if(to_ms_since_boot(get_absolute_time()) > TUD_MOUNT_TIMEOUT && !tud_mount_status)
-			break;
+		/* USB (drive and console) is brought up lazily and enumerates in the background */
+		if(!usb_started && usb_host_possible()) {
+			tusb_init();
+			console_init();
+			usb_started = true;
+		}
+		if(usb_started) {
+			tud_task(); // tinyusb device task
+			cdc_task();
+			msc_task();	// SD writes overlap the next USB transfer
+		}
+		if(status == MC_OK)
+			simulate_memory_card_task();
+		else if(!tud_mounted())
+			led_blink_error(status);	// nothing to serve, a PC can still be used to fix the SD card
 	}
-	
-	/* Pico powered by PSX, initialize memory card simulation */
-	simulate_memory_card();	
 
 	return 0;
 }
@@ -48,15 +77,19 @@ int main(void) {
 
 // Invoked when device is mounted
 void tud_mount_cb(void) {
-	tud_mount_status = true;
-	/* Initialize SD card */
 	sd_card_t *p_sd = sd_get_by_num(0);
 	if (!p_sd) return;
-	sd_init_card(p_sd);
+	/* Initialize SD card, unless the simulation already did */
+	if(p_sd->m_Status != 0 && sd_init_card(p_sd) == 0)
+		sd_clock_calibrate(p_sd);
+	msc_cache_init();	// FAT region is found from the boot sector on first access
+	msc_host_connected(true);	// the volume may be mounted from now on
 }
 
 // Invoked when device is unmounted
-void tud_umount_cb(void) {}
+void tud_umount_cb(void) {
+	msc_host_connected(false);
+}
 
 // Invoked when usb bus is suspended
 // remote_wakeup_en : if host allow us  to perform remote wakeup
@@ -72,28 +105,31 @@ void tud_resume_cb(void) {}
 // USB CDC
 //--------------------------------------------------------------------+
 void cdc_task(void) {
-	// connected() check for DTR bit
-	// Most but not all terminal client set this when making connection
-	// if ( tud_cdc_connected() )
-	{
-		// connected and there are data available
-		if ( tud_cdc_available() )
-		{
-			// read datas
-			char buf[64];
-			uint32_t count = tud_cdc_read(buf, sizeof(buf));
-			(void) count;
-
-			// Echo back
-			// Note: Skip echo by commenting out write() and write_flush()
-			// for throughput test e.g
-			//    $ dd if=/dev/zero of=/dev/ttyACM0 count=10000
+	/* up to a FIFO worth per call, uploads send sector frames back to back */
+	for(uint32_t total = 0; total < CFG_TUD_CDC_RX_BUFSIZE && tud_cdc_available(); ) {
+		uint8_t buf[64];
+		uint32_t count = tud_cdc_read(buf, sizeof(buf));
+		console_receive(buf, count);
+		total += count;
+	}
+	uint32_t space = tud_cdc_write_available();
+	if(space) {
+		static uint8_t buf[CFG_TUD_CDC_TX_BUFSIZE];
+		uint32_t count = console_transmit(buf, space < sizeof(buf) ? space : sizeof(buf));
+		if(count) {
 			tud_cdc_write(buf, count);
 			tud_cdc_write_flush();
 		}
 	}
 }
 
+/* Heap between the end of static data and the stack, minus what malloc handed out */
+uint32_t console_free_heap() {
+	extern char __StackLimit, __bss_end__;
+	struct mallinfo info = mallinfo();
+	return &__StackLimit - &__bss_end__ - info.uordblks;
+}
+
 // Invoked when cdc when line state changed e.g connected/disconnected
 void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts) {
 	(void) itf;
@@ -0,0 +1,324 @@
+#include "memcard_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "ff.h"
+#include "memory_card.h"
+
+#define SEC_MAP_SIZE	(MC_SEC_COUNT / 8)	// bitmap of non-zero sectors at the start of each blob
+#define BUILD_CHUNK		(4 * 1024)			// growth step of an image being prefetched
+
+typedef struct {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint8_t* blob;
+	uint32_t size;
+	uint32_t last_use;
+} cache_entry_t;
+
+/* Image being compressed from SD a block at a time */
+typedef struct {
+	bool active;
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	FIL file;
+	uint32_t block;
+	uint8_t* blob;
+	uint32_t size;
+	uint32_t capacity;
+} cache_build_t;
+
+static cache_entry_t entries[MC_CACHE_ENTRIES];
+static cache_build_t build;
+static uint8_t prefetch_names[2][MAX_MC_FILENAME_LEN + 1];
+static uint32_t use_clock;
+static memcard_cache_stats_t stats;
+
+/***
+ *	PackBits: a header n >= 0 is followed by n + 1 literal bytes, a header
+ *	n < 0 by one byte repeated 1 - n times. out may be NULL to only get the size.
+ */
+static uint32_t packbits_encode(const uint8_t* in, uint32_t len, uint8_t* out) {
+	uint32_t size = 0;
+	uint32_t i = 0;
+	while(i < len) {
+		uint32_t run = 1;
+		while(i + run < len && run < 128 && in[i + run] == in[i])
+			run++;
+		if(run >= 3) {
+			if(out) {
+				out[size] = (uint8_t) (1 - (int32_t) run);
+				out[size + 1] = in[i];
+			}
+			size += 2;
+			i += run;
+		} else {
+			/* literals last until the next run worth encoding */
+			uint32_t start = i;
+			while(i < len && i - start < 128) {
+				if(i + 2 < len && in[i] == in[i + 1] && in[i] == in[i + 2])
+					break;
+				i++;
+			}
+			if(out) {
+				out[size] = (uint8_t) (i - start - 1);
+				memcpy(&out[size + 1], &in[start], i - start);
+			}
+			size += 1 + i - start;
+		}
+	}
+	return size;
+}
+
+static const uint8_t* packbits_decode(const uint8_t* in, const uint8_t* end, uint8_t* out, uint32_t len) {
+	uint32_t i = 0;
+	while(i < len) {
+		if(in >= end)
+			return NULL;
+		int8_t header = (int8_t) *in++;
+		if(header >= 0) {
+			uint32_t count = header + 1;
+			if(i + count > len || in + count > end)
+				return NULL;
+			memcpy(&out[i], in, count);
+			in += count;
+			i += count;
+		} else {
+			uint32_t count = 1 - header;
+			if(i + count > len || in >= end)
+				return NULL;
+			memset(&out[i], *in++, count);
+			i += count;
+		}
+	}
+	return in;
+}
+
+static bool is_zero_sector(const uint8_t* sector) {
+	for(uint32_t i = 0; i < MC_SEC_SIZE; i++)
+		if(sector[i])
+			return false;
+	return true;
+}
+
+/* Append one sector to a blob, out may be NULL to only get the size */
+static uint32_t encode_sector(const uint8_t* sector, sector_t index, uint8_t* blob, uint32_t offset) {
+	if(is_zero_sector(sector))
+		return 0;
+	if(blob) {
+		blob[index / 8] |= 1 << (index % 8);
+		return packbits_encode(sector, MC_SEC_SIZE, &blob[offset]);
+	}
+	return packbits_encode(sector, MC_SEC_SIZE, NULL);
+}
+
+static cache_entry_t* find_entry(const uint8_t* name) {
+	for(uint32_t i = 0; i < MC_CACHE_ENTRIES; i++)
+		if(entries[i].blob && !strcmp(entries[i].name, name))
+			return &entries[i];
+	return NULL;
+}
+
+static void free_entry(cache_entry_t* entry) {
+	stats.used_bytes -= entry->size;
+	stats.entries--;
+	free(entry->blob);
+	entry->blob = NULL;
+	entry->size = 0;
+}
+
+static void abort_build() {
+	if(!build.active)
+		return;
+	f_close(&build.file);
+	free(build.blob);
+	build.blob = NULL;
+	build.active = false;
+}
+
+/* Free least recently used entries until size more bytes fit, returns a free slot */
+static cache_entry_t* make_room(uint32_t size) {
+	if(size > MC_CACHE_BUDGET)
+		return NULL;
+	while(true) {
+		cache_entry_t* free_slot = NULL;
+		cache_entry_t* oldest = NULL;
+		for(uint32_t i = 0; i < MC_CACHE_ENTRIES; i++) {
+			if(!entries[i].blob)
+				free_slot = &entries[i];
+			else if(!oldest || entries[i].last_use < oldest->last_use)
+				oldest = &entries[i];
+		}
+		if(free_slot && stats.used_bytes + size <= MC_CACHE_BUDGET)
+			return free_slot;
+		if(!oldest)
+			return NULL;
+		free_entry(oldest);
+	}
+}
+
+static uint32_t insert_entry(const uint8_t* name, uint8_t* blob, uint32_t size) {
+	cache_entry_t* entry = make_room(size);
+	if(!entry)
+		return MCC_TOO_LARGE;
+	strcpy(entry->name, name);
+	entry->blob = blob;
+	entry->size = size;
+	entry->last_use = ++use_clock;
+	stats.used_bytes += size;
+	stats.entries++;
+	return MCC_OK;
+}
+
+void memcard_cache_init() {
+	for(uint32_t i = 0; i < MC_CACHE_ENTRIES; i++)
+		if(entries[i].blob)
+			free_entry(&entries[i]);
+	abort_build();
+	prefetch_names[0][0] = prefetch_names[1][0] = '\0';
+	use_clock = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+/***
+ *	Restore a cached image into data (MC_SIZE bytes). Returns false on a miss,
+ *	data is then left untouched and the image has to be read from SD.
+ */
+bool memcard_cache_load(const uint8_t* name, uint8_t* data) {
+	cache_entry_t* entry = find_entry(name);
+	if(!entry) {
+		stats.misses++;
+		return false;
+	}
+	uint64_t start = time_us_64();
+	const uint8_t* in = &entry->blob[SEC_MAP_SIZE];
+	const uint8_t* end = &entry->blob[entry->size];
+	for(sector_t sector = 0; sector < MC_SEC_COUNT && in; sector++) {
+		uint8_t* out = &data[sector * MC_SEC_SIZE];
+		if(entry->blob[sector / 8] & (1 << (sector % 8)))
+			in = packbits_decode(in, end, out, MC_SEC_SIZE);
+		else
+			memset(out, 0, MC_SEC_SIZE);
+	}
+	if(!in) {
+		/* corrupted entry, data is partly overwritten but will be imported from SD */
+		free_entry(entry);
+		stats.misses++;
+		return false;
+	}
+	stats.last_decompress_us = time_us_64() - start;
+	if(stats.last_decompress_us > stats.max_decompress_us)
+		stats.max_decompress_us = stats.last_decompress_us;
+	entry->last_use = ++use_clock;
+	stats.hits++;
+	return true;
+}
+
+/***
+ *	Compress the image currently in data and keep it as the most recently used
+ *	entry, replacing any older copy. data must match the image on SD (synced).
+ */
+uint32_t memcard_cache_store(const uint8_t* name, const uint8_t* data) {
+	memcard_cache_invalidate(name);
+	uint32_t size = SEC_MAP_SIZE;
+	for(sector_t sector = 0; sector < MC_SEC_COUNT; sector++)
+		size += encode_sector(&data[sector * MC_SEC_SIZE], sector, NULL, 0);
+	if(!make_room(size))
+		return MCC_TOO_LARGE;
+	uint8_t* blob = calloc(size, 1);
+	if(!blob)
+		return MCC_ALLOC_FAIL;
+	uint32_t offset = SEC_MAP_SIZE;
+	for(sector_t sector = 0; sector < MC_SEC_COUNT; sector++)
+		offset += encode_sector(&data[sector * MC_SEC_SIZE], sector, blob, offset);
+	return insert_entry(name, blob, size);
+}
+
+void memcard_cache_invalidate(const uint8_t* name) {
+	cache_entry_t* entry = find_entry(name);
+	if(entry)
+		free_entry(entry);
+	if(build.active && !strcmp(build.name, name))
+		abort_build();
+}
+
+/* Neighbours of the current image in memcard_manager order, prefetched when idle */
+void memcard_cache_set_prefetch(const uint8_t* prev, const uint8_t* next) {
+	strcpy(prefetch_names[0], next ? (const char*) next : "");
+	strcpy(prefetch_names[1], prev ? (const char*) prev : "");
+	if(build.active && strcmp(build.name, prefetch_names[0]) && strcmp(build.name, prefetch_names[1]))
+		abort_build();
+}
+
+/***
+ *	Advance the background prefetch by one SD block (4 sectors), so that core0
+ *	never stalls on it. Returns true while there is prefetch work left.
+ */
+bool memcard_cache_prefetch_step() {
+	if(!build.active) {
+		uint8_t* target = NULL;
+		for(uint32_t i = 0; i < 2 && !target; i++)
+			if(prefetch_names[i][0] && !find_entry(prefetch_names[i]))
+				target = prefetch_names[i];
+		if(!target)
+			return false;
+		build.blob = calloc(BUILD_CHUNK, 1);
+		if(!build.blob || FR_OK != f_open(&build.file, target, FA_READ)) {
+			free(build.blob);
+			build.blob = NULL;
+			target[0] = '\0';	// give up on this image
+			return true;
+		}
+		strcpy(build.name, target);
+		build.active = true;
+		build.block = 0;
+		build.size = SEC_MAP_SIZE;
+		build.capacity = BUILD_CHUNK;
+		return true;
+	}
+
+	uint8_t buffer[BLOCK_SIZE];
+	UINT bytes_read;
+	if(FR_OK != f_read(&build.file, buffer, BLOCK_SIZE, &bytes_read) || bytes_read != BLOCK_SIZE) {
+		for(uint32_t i = 0; i < 2; i++)
+			if(!strcmp(prefetch_names[i], build.name))
+				prefetch_names[i][0] = '\0';
+		abort_build();
+		return true;
+	}
+	for(uint32_t i = 0; i < MC_SEC_PER_BLOCK; i++) {
+		sector_t sector = build.block * MC_SEC_PER_BLOCK + i;
+		uint32_t size = encode_sector(&buffer[i * MC_SEC_SIZE], sector, NULL, 0);
+		if(build.size + size > build.capacity) {
+			uint8_t* blob = build.capacity + BUILD_CHUNK <= MC_CACHE_BUDGET ? realloc(build.blob, build.capacity + BUILD_CHUNK) : NULL;
+			if(!blob) {
+				/* does not fit, do not try again until the neighbours change */
+				for(uint32_t j = 0; j < 2; j++)
+					if(!strcmp(prefetch_names[j], build.name))
+						prefetch_names[j][0] = '\0';
+				abort_build();
+				return true;
+			}
+			build.blob = blob;
+			build.capacity += BUILD_CHUNK;
+		}
+		build.size += encode_sector(&buffer[i * MC_SEC_SIZE], sector, build.blob, build.size);
+	}
+	if(++build.block < MC_BLOCK_COUNT)
+		return true;
+
+	/* image complete */
+	f_close(&build.file);
+	build.active = false;
+	uint8_t* blob = realloc(build.blob, build.size);
+	if(!blob)
+		blob = build.blob;
+	build.blob = NULL;
+	if(insert_entry(build.name, blob, build.size) != MCC_OK)
+		free(blob);
+	else
+		stats.prefetched++;
+	return true;
+}
+
+void memcard_cache_get_stats(memcard_cache_stats_t* out) {
+	*out = stats;
+}
@@ -4,125 +4,671 @@
 #include <stdio.h>
 #include "sd_config.h"
 #include "memory_card.h"
+#include "game_map.h"
 
 /* extension for memcard files */
 static const char memcard_file_ext[] = ".MCR";
 
-/* filename to store previously loaded memcard index */
+/* filename to store previously loaded memcard, by path ("FF7/0.MCR"); older firmware stored its position */
 static const char memcard_lastmemcardindex_filename[] = "LastMemcardIndex.dat";
 
-bool is_name_valid(uint8_t* filename) {
-	if(!filename)
-		return false;
-	filename = strupr(filename);	// convert to upper case
-	/* check .MCR extension */
-	uint8_t* ext = strrchr(filename, '.');
-	if(!ext || strcmp(ext, memcard_file_ext))
-		return false;
-	/* check that filename (excluding extension) is only digits */
-	uint32_t digit_char_count = strspn(filename, "0123456789");
-	if(digit_char_count != strlen(filename) - strlen(memcard_file_ext))
+/***
+ *	Sorted index of the valid images on the SD card, in the root directory and
+ *	one level of folders below it. Images are kept as folder position plus number
+ *	(8 bytes each) and ordered by folder name, then numerically, so thousands of
+ *	images fit in RAM. The index is loaded from a catalog file at boot, checked
+ *	against the SD card in background and updated by memcard_manager_create(),
+ *	so lookups never touch the SD card. last_pos remembers the image found last,
+ *	next/prev from the current image do not even need the binary search.
+ */
+#define NAME_SIZE		(MAX_MC_FILENAME_LEN + 1)
+#define DIR_NAME_SIZE	(MAX_MC_DIRNAME_LEN + 1)
+#define MAX_DIGITS		9		// longest image number, fits in uint32_t
+
+/* catalog of valid images kept on the SD card, so boot does not have to scan the directories */
+static const char memcard_catalog_filename[] = "MemcardCatalog.dat";
+#define CATALOG_MAGIC		0x43434d50	// "PMCC"
+#define CATALOG_VERSION		2
+#define VERIFY_ENTRIES		8			// directory entries read per memcard_manager_verify_step()
+
+/* created images are spread over MCR000/, MCR001/... so no FAT directory grows past MC_SHARD_SIZE of them */
+static const char memcard_shard_prefix[] = "MCR";
+
+typedef struct {
+	uint32_t number;
+	uint16_t dir;		// position in dirs, 0 is the root directory
+	uint8_t digits;		// printed width, keeps leading zeros of names like 007.MCR
+	uint8_t reserved;
+} index_entry_t;
+
+typedef struct {
+	uint8_t (*dirs)[DIR_NAME_SIZE];	// dir_count names sorted with strcmp, root ("") first
+	uint32_t dir_count;
+	uint32_t dir_capacity;
+	index_entry_t* entries;			// count entries, see compare_entries()
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t name_hash;				// sum of image_hash() over all images
+	uint32_t next_id;				// number of the next created image
+} image_index_t;
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t dir_count;
+	uint32_t count;
+	uint32_t sorted;		// entries past this were appended by memcard_manager_create()
+	uint32_t next_id;
+	uint32_t name_hash;		// compared with the directories by memcard_manager_verify_step()
+	uint32_t checksum;		// FNV-1a over the folder names and entries
+} catalog_header_t;
+
+static image_index_t images;
+static bool index_ready = false;
+static bool index_verified = false;			// index matched against the directories since boot
+static uint32_t last_pos = 0;
+static catalog_header_t catalog;			// header of the catalog on SD, valid when catalog_ok
+static bool catalog_ok = false;
+
+/* while a USB host may have the volume mounted, the catalog and the last card wait in RAM and no image is created */
+static bool writes_held = false;
+static bool catalog_pending = false;
+static bool last_pending = false;
+static uint8_t last_path[NAME_SIZE];
+
+/* Directory walk, run all at once by memcard_manager_rescan() or a few entries at a time to verify the catalog */
+static struct {
+	bool active;
+	bool open;
+	DIR dir;
+	uint32_t dir_pos;
+	image_index_t* out;
+	bool keep_entries;		// only count and hash when verifying
+} scan;
+static image_index_t verify_result;
+
+static uint32_t fnv_update(uint32_t hash, const void* data, uint32_t len) {
+	const uint8_t* bytes = data;
+	for(uint32_t i = 0; i < len; i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return hash;
+}
+#define FNV_INIT	2166136261u
+
+/* Identifies one image in the catalog checks, combined by sum so that order does not matter */
+static uint32_t image_hash(const uint8_t* dir, const uint8_t* name, uint32_t size) {
+	uint32_t hash = fnv_update(FNV_INIT, dir, strlen(dir) + 1);
+	hash = fnv_update(hash, name, strlen(name) + 1);
+	return fnv_update(hash, &size, sizeof(size));
+}
+
+static bool array_reserve(void** array, uint32_t* capacity, uint32_t count, uint32_t item_size) {
+	if(count <= *capacity)
+		return true;
+	uint32_t new_capacity = count + count / 8 + 16;	// large libraries should not cost twice their size
+	void* new_array = realloc(*array, item_size * new_capacity);
+	if(!new_array)
 		return false;
+	*array = new_array;
+	*capacity = new_capacity;
 	return true;
 }
 
-bool is_image_valid(uint8_t* filename) {
-	if(!filename)
-		return false;
-	filename = strupr(filename);	// convert to upper case
-	if(!is_name_valid(filename))
+static void index_clear(image_index_t* index) {
+	index->dir_count = 0;
+	index->count = 0;
+	index->name_hash = 0;
+	index->next_id = 0;
+	if(array_reserve((void**) &index->dirs, &index->dir_capacity, 1, DIR_NAME_SIZE)) {
+		memset(index->dirs[0], 0, DIR_NAME_SIZE);	// root
+		index->dir_count = 1;
+	}
+}
+
+static int compare_entries(const void* a, const void* b) {
+	const index_entry_t* x = a;
+	const index_entry_t* y = b;
+	if(x->dir != y->dir)
+		return x->dir < y->dir ? -1 : 1;
+	if(x->number != y->number)
+		return x->number < y->number ? -1 : 1;
+	return (int) x->digits - (int) y->digits;
+}
+
+static int compare_dirs(const void* a, const void* b) {
+	return strcmp(a, b);
+}
+
+static void entry_name(const index_entry_t* entry, uint8_t* out) {
+	sprintf(out, "%0*u%s", (int) entry->digits, (unsigned) entry->number, memcard_file_ext);
+}
+
+static void entry_path(const image_index_t* index, const index_entry_t* entry, uint8_t* out) {
+	if(entry->dir == 0) {
+		entry_name(entry, out);
+	} else {
+		uint32_t len = sprintf(out, "%s/", index->dirs[entry->dir]);
+		entry_name(entry, &out[len]);
+	}
+}
+
+/* Number and width of a valid image name (N.MCR), false if it is not one */
+static bool parse_name(const uint8_t* name, index_entry_t* entry) {
+	uint32_t digits = strspn(name, "0123456789");
+	if(digits == 0 || digits > MAX_DIGITS || strcasecmp(&name[digits], memcard_file_ext))
 		return false;
+	entry->number = strtoul(name, NULL, 10);
+	entry->digits = digits;
+	entry->reserved = 0;
+	return true;
+}
+
+static uint32_t dir_find(const image_index_t* index, const uint8_t* dir, bool* found) {
+	uint32_t low = 1;	// root is only ever looked up as ""
+	uint32_t high = index->dir_count;
+	*found = false;
+	if(!dir[0]) {
+		*found = true;
+		return 0;
+	}
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		int32_t cmp = strcmp(dir, index->dirs[mid]);
+		if(cmp == 0) {
+			*found = true;
+			return mid;
+		}
+		if(cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return low;
+}
+
+/* Folder and image of a path relative to the root, e.g. "MCR001/300.MCR" */
+static bool parse_path(const uint8_t* path, uint8_t* dir, index_entry_t* entry) {
+	const uint8_t* name = strrchr(path, '/');
+	dir[0] = '\0';
+	if(name) {
+		if(name - path > MAX_MC_DIRNAME_LEN)
+			return false;
+		memcpy(dir, path, name - path);
+		dir[name - path] = '\0';
+		name++;
+	} else {
+		name = path;
+	}
+	return parse_name(name, entry);
+}
+
+/* Position of filename in the index, or where it would be inserted (found set to false) */
+static uint32_t index_find(const uint8_t* filename, bool* found) {
+	uint8_t dir[DIR_NAME_SIZE];
+	index_entry_t key;
+	*found = false;
+	if(!parse_path(filename, dir, &key))
+		return images.count;
+	bool dir_found;
+	key.dir = dir_find(&images, dir, &dir_found);
+	if(!dir_found)
+		return images.count;
+	if(last_pos < images.count && !compare_entries(&key, &images.entries[last_pos])) {
+		*found = true;
+		return last_pos;
+	}
+	uint32_t low = 0;
+	uint32_t high = images.count;
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		int32_t cmp = compare_entries(&key, &images.entries[mid]);
+		if(cmp == 0) {
+			*found = true;
+			last_pos = mid;
+			return mid;
+		}
+		if(cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return low;
+}
+
+/* Position of the first image not before key */
+static uint32_t index_lower_bound(const index_entry_t* key) {
+	uint32_t low = 0;
+	uint32_t high = images.count;
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		if(compare_entries(&images.entries[mid], key) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* Number following the last image of a folder, 0 for an empty one */
+static uint32_t next_in_dir(uint32_t dir_pos) {
+	index_entry_t key = { .number = 0, .dir = dir_pos + 1, .digits = 0 };
+	uint32_t low = index_lower_bound(&key);
+	if(low > 0 && images.entries[low - 1].dir == dir_pos)
+		return images.entries[low - 1].number + 1;
+	return 0;
+}
+
+/* Add a folder to the sorted list, entries of the folders after it are renumbered */
+static uint32_t dir_insert(image_index_t* index, const uint8_t* dir, uint32_t* out_pos) {
+	bool found;
+	uint32_t pos = dir_find(index, dir, &found);
+	*out_pos = pos;
+	if(found)
+		return MM_OK;
+	if(index->dir_count >= MAX_MC_DIRS)
+		return MM_INDEX_OUT_OF_BOUNDS;
+	if(!array_reserve((void**) &index->dirs, &index->dir_capacity, index->dir_count + 1, DIR_NAME_SIZE))
+		return MM_ALLOC_FAIL;
+	memmove(index->dirs[pos + 1], index->dirs[pos], DIR_NAME_SIZE * (index->dir_count - pos));
+	memset(index->dirs[pos], 0, DIR_NAME_SIZE);	// padding is saved and checksummed too
+	strcpy(index->dirs[pos], dir);
+	++index->dir_count;
+	for(uint32_t i = 0; i < index->count; i++)
+		if(index->entries[i].dir >= pos)
+			index->entries[i].dir++;
+	return MM_OK;
+}
+
+/* Record one valid image, appended while scanning (sorted at the end) or inserted in place */
+static uint32_t index_add(image_index_t* index, const index_entry_t* entry, bool keep_entries, bool sorted) {
+	uint8_t name[NAME_SIZE];
+	if(index->count >= MAX_MC_IMAGES)
+		return MM_INDEX_OUT_OF_BOUNDS;
+	if(keep_entries && !array_reserve((void**) &index->entries, &index->capacity, index->count + 1, sizeof(index_entry_t)))
+		return MM_ALLOC_FAIL;
+	entry_name(entry, name);
+	index->name_hash += image_hash(index->dirs[entry->dir], name, MC_SIZE);
+	if(entry->number >= index->next_id)
+		index->next_id = entry->number + 1;
+	if(keep_entries) {
+		uint32_t pos = index->count;
+		if(sorted) {
+			uint32_t low = 0;
+			while(low < pos) {
+				uint32_t mid = (low + pos) / 2;
+				if(compare_entries(entry, &index->entries[mid]) < 0)
+					pos = mid;
+				else
+					low = mid + 1;
+			}
+			memmove(&index->entries[pos + 1], &index->entries[pos], sizeof(index_entry_t) * (index->count - pos));
+		}
+		index->entries[pos] = *entry;
+	}
+	++index->count;
+	return MM_OK;
+}
+
+static void scan_stop() {
+	if(scan.open)
+		f_closedir(&scan.dir);
+	scan.open = false;
+	scan.active = false;
+}
+
+static void scan_start(image_index_t* out, bool keep_entries) {
+	scan_stop();
+	index_clear(out);
+	scan.out = out;
+	scan.keep_entries = keep_entries;
+	scan.dir_pos = 0;
+	scan.active = true;
+}
+
+/* Move on to the next folder once the current one is read, done is set after the last one */
+static void scan_next_dir(bool* done) {
+	image_index_t* out = scan.out;
+	if(scan.open)
+		f_closedir(&scan.dir);
+	scan.open = false;
+	if(scan.dir_pos == 0)
+		qsort(out->dirs[1], out->dir_count - 1, DIR_NAME_SIZE, compare_dirs);	// folders are known once the root is read
+	if(++scan.dir_pos < out->dir_count)
+		return;
+	if(scan.keep_entries)
+		qsort(out->entries, out->count, sizeof(index_entry_t), compare_entries);
+	scan.active = false;
+	*done = true;
+}
+
+/***
+ *	Read up to max_entries directory entries, the root first and then each folder
+ *	found in it. Images in deeper folders are ignored.
+ */
+static uint32_t scan_step(uint32_t max_entries, bool* done) {
+	image_index_t* out = scan.out;
+	*done = false;
+	if(!scan.open) {
+		if(FR_OK != f_opendir(&scan.dir, out->dirs[scan.dir_pos])) {
+			if(scan.dir_pos == 0) {
+				scan_stop();
+				return MM_FILE_OPEN_ERR;
+			}
+			scan_next_dir(done);	// folder removed meanwhile
+			return MM_OK;
+		}
+		scan.open = true;
+	}
 	FILINFO f_info;
-	FRESULT f_res = f_stat(filename, &f_info);
-	if(f_res != FR_OK)
+	for(uint32_t i = 0; i < max_entries; i++) {
+		FRESULT res = f_readdir(&scan.dir, &f_info);
+		if(res != FR_OK || f_info.fname[0] == 0) {
+			scan_next_dir(done);
+			return MM_OK;
+		}
+		if(f_info.fattrib & (AM_HID | AM_SYS))
+			continue;
+		if(f_info.fattrib & AM_DIR) {
+			if(scan.dir_pos == 0 && strlen(f_info.fname) <= MAX_MC_DIRNAME_LEN && out->dir_count < MAX_MC_DIRS &&
+					array_reserve((void**) &out->dirs, &out->dir_capacity, out->dir_count + 1, DIR_NAME_SIZE)) {
+				memset(out->dirs[out->dir_count], 0, DIR_NAME_SIZE);
+				strcpy(out->dirs[out->dir_count], f_info.fname);
+				++out->dir_count;
+			}
+			continue;
+		}
+		index_entry_t entry;
+		if(!parse_name(f_info.fname, &entry) || !MC_IS_IMAGE_SIZE(f_info.fsize))
+			continue;
+		entry.dir = scan.dir_pos;
+		if(index_add(out, &entry, scan.keep_entries, false) == MM_ALLOC_FAIL) {
+			scan_stop();
+			return MM_ALLOC_FAIL;
+		}
+	}
+	return MM_OK;
+}
+
+static uint32_t catalog_checksum(const image_index_t* index) {
+	uint32_t checksum = fnv_update(FNV_INIT, index->dirs, DIR_NAME_SIZE * index->dir_count);
+	return fnv_update(checksum, index->entries, sizeof(index_entry_t) * index->count);
+}
+
+/* Read the catalog into the index, fails on anything unexpected so the directories get scanned instead */
+static uint32_t catalog_load() {
+	FIL file;
+	UINT bytes_read;
+	catalog_header_t header;
+	catalog_ok = false;
+	index_clear(&images);
+	if(FR_OK != f_open(&file, memcard_catalog_filename, FA_OPEN_EXISTING | FA_READ))
+		return MM_FILE_OPEN_ERR;
+	uint32_t status = MM_BAD_CATALOG;
+	if(FR_OK == f_read(&file, &header, sizeof(header), &bytes_read) && bytes_read == sizeof(header) &&
+			header.magic == CATALOG_MAGIC && header.version == CATALOG_VERSION &&
+			header.entry_size == sizeof(index_entry_t) && header.dir_count >= 1 && header.dir_count <= MAX_MC_DIRS &&
+			header.count <= MAX_MC_IMAGES && header.sorted <= header.count) {
+		if(!array_reserve((void**) &images.dirs, &images.dir_capacity, header.dir_count, DIR_NAME_SIZE) ||
+				!array_reserve((void**) &images.entries, &images.capacity, header.count, sizeof(index_entry_t))) {
+			status = MM_ALLOC_FAIL;
+		} else if(FR_OK == f_read(&file, images.dirs, DIR_NAME_SIZE * header.dir_count, &bytes_read) &&
+				bytes_read == DIR_NAME_SIZE * header.dir_count &&
+				FR_OK == f_read(&file, images.entries, sizeof(index_entry_t) * header.count, &bytes_read) &&
+				bytes_read == sizeof(index_entry_t) * header.count) {
+			images.dir_count = header.dir_count;
+			images.count = header.count;
+			if(catalog_checksum(&images) == header.checksum)
+				status = MM_OK;
+		}
+	}
+	f_close(&file);
+	if(status == MM_OK) {
+		if(header.sorted < header.count)
+			qsort(images.entries, images.count, sizeof(index_entry_t), compare_entries);	// merge images created since the last save
+		if(images.dirs[0][0])
+			status = MM_BAD_CATALOG;
+		for(uint32_t i = 1; i < images.dir_count && status == MM_OK; i++)
+			if(i > 1 && strcmp(images.dirs[i - 1], images.dirs[i]) >= 0)
+				status = MM_BAD_CATALOG;
+		for(uint32_t i = 0; i < images.count && status == MM_OK; i++)
+			if(images.entries[i].dir >= images.dir_count || (i > 0 && compare_entries(&images.entries[i - 1], &images.entries[i]) >= 0))
+				status = MM_BAD_CATALOG;
+	}
+	if(status != MM_OK) {
+		index_clear(&images);
+		return status;
+	}
+	images.name_hash = header.name_hash;
+	images.next_id = header.next_id;
+	catalog = header;
+	catalog_ok = true;
+	return MM_OK;
+}
+
+static uint32_t catalog_save() {
+	FIL file;
+	UINT bytes_written;
+	catalog.magic = CATALOG_MAGIC;
+	catalog.version = CATALOG_VERSION;
+	catalog.entry_size = sizeof(index_entry_t);
+	catalog.dir_count = images.dir_count;
+	catalog.count = images.count;
+	catalog.sorted = images.count;
+	catalog.next_id = images.next_id;
+	catalog.name_hash = images.name_hash;
+	catalog.checksum = catalog_checksum(&images);
+	catalog_ok = false;
+	catalog_pending = writes_held;
+	if(writes_held)
+		return MM_BUSY;
+	if(FR_OK != f_open(&file, memcard_catalog_filename, FA_CREATE_ALWAYS | FA_WRITE))
+		return MM_FILE_OPEN_ERR;
+	uint32_t status = MM_OK;
+	if(FR_OK != f_write(&file, &catalog, sizeof(catalog), &bytes_written) || bytes_written != sizeof(catalog) ||
+			FR_OK != f_write(&file, images.dirs, DIR_NAME_SIZE * images.dir_count, &bytes_written) ||
+			bytes_written != DIR_NAME_SIZE * images.dir_count ||
+			FR_OK != f_write(&file, images.entries, sizeof(index_entry_t) * images.count, &bytes_written) ||
+			bytes_written != sizeof(index_entry_t) * images.count)
+		status = MM_FILE_WRITE_ERR;
+	f_close(&file);
+	catalog_ok = status == MM_OK;
+	return status;
+}
+
+/* Add one image to the catalog on SD: the entry goes at the end and the header is rewritten, whatever the library size */
+static uint32_t catalog_append(const index_entry_t* entry) {
+	FIL file;
+	UINT bytes_written;
+	if(writes_held || !catalog_ok || catalog.dir_count != images.dir_count)
+		return catalog_save();	// the entry may need a new cluster
+	catalog_ok = false;
+	if(FR_OK != f_open(&file, memcard_catalog_filename, FA_OPEN_EXISTING | FA_WRITE))
+		return catalog_save();
+	catalog.checksum = fnv_update(catalog.checksum, entry, sizeof(index_entry_t));
+	catalog.next_id = images.next_id;
+	catalog.name_hash = images.name_hash;
+	uint32_t status = MM_OK;
+	if(FR_OK != f_lseek(&file, sizeof(catalog) + DIR_NAME_SIZE * catalog.dir_count + sizeof(index_entry_t) * catalog.count++) ||
+			FR_OK != f_write(&file, entry, sizeof(index_entry_t), &bytes_written) || bytes_written != sizeof(index_entry_t) ||
+			FR_OK != f_lseek(&file, 0) ||
+			FR_OK != f_write(&file, &catalog, sizeof(catalog), &bytes_written) || bytes_written != sizeof(catalog))
+		status = MM_FILE_WRITE_ERR;
+	f_close(&file);
+	catalog_ok = status == MM_OK;
+	return status;
+}
+
+/* Walk all folders and save the result as the new catalog */
+uint32_t memcard_manager_rescan() {
+	uint32_t next_id = images.next_id;	// never hand out an id twice, even if its image was deleted
+	last_pos = 0;
+	index_ready = false;
+	scan_start(&images, true);
+	bool done = false;
+	while(!done) {
+		uint32_t status = scan_step(UINT32_MAX, &done);
+		if(status != MM_OK)
+			return status;
+	}
+	if(images.next_id < next_id)
+		images.next_id = next_id;
+	index_ready = true;
+	index_verified = true;
+	catalog_save();	// a failure only costs another scan on next boot
+	return MM_OK;
+}
+
+/***
+ *	Load the index from the catalog, which costs a single file read of 8 bytes
+ *	per image. The catalog is trusted until memcard_manager_verify_step() has
+ *	compared it with the SD card; the folders are only walked here when there
+ *	is no usable catalog.
+ */
+uint32_t memcard_manager_init() {
+	scan_stop();
+	last_pos = 0;
+	index_verified = false;
+	if(catalog_load() == MM_OK) {
+		index_ready = true;
+		return MM_OK;
+	}
+	return memcard_manager_rescan();
+}
+
+/***
+ *	Compare the catalog loaded at boot with the SD card, VERIFY_ENTRIES directory
+ *	entries per call. Only names are counted and hashed, so it needs no second
+ *	index in RAM; when images were added or removed from a PC the folders are
+ *	walked again and the catalog rewritten. Returns true while there is work left.
+ */
+bool memcard_manager_verify_step() {
+	if(!index_ready || index_verified)
 		return false;
-	if(f_info.fsize != MC_SIZE)	// check that memory card image has correct size
+	if(!scan.active) {
+		scan_start(&verify_result, false);
+		return true;
+	}
+	bool done;
+	if(scan_step(VERIFY_ENTRIES, &done) != MM_OK) {
+		index_verified = true;	// do not retry, the catalog stays in use
 		return false;
+	}
+	if(!done)
+		return true;
+	index_verified = true;
+	if(verify_result.count == images.count && verify_result.name_hash == images.name_hash)
+		return true;
+	printf("Catalog stale (%u images listed, %u found), rebuilding\n", (unsigned) images.count, (unsigned) verify_result.count);
+	memcard_manager_rescan();
 	return true;
 }
 
-uint32_t update_prev_loaded_memcard_index(uint32_t index) {
-	/* update the previously loaded memcard index stored on the SD card */
+static uint32_t index_ensure() {
+	if(index_ready)
+		return MM_OK;
+	return memcard_manager_init();
+}
+
+bool memcard_manager_exist(uint8_t* filename) {
+	if(!filename || index_ensure() != MM_OK)
+		return false;
+	bool found;
+	index_find(filename, &found);
+	return found;
+}
+
+uint32_t memcard_manager_count() {
+	if(index_ensure() != MM_OK)
+		return 0;
+	return images.count;
+}
+
+static uint32_t write_last_path(const uint8_t* path) {
 	uint32_t retVal = MM_OK;
 	FIL data_file;
-	uint32_t buff_size = 100;
 	FRESULT res = f_open(&data_file, memcard_lastmemcardindex_filename, FA_CREATE_ALWAYS | FA_WRITE);
 	if (res == FR_OK) {
-		/* int to string */
-		char str_index[buff_size];
-		int index_len = sprintf(str_index, "%d", index);
-
-		/* overwrite the contents with new index */
+		/* overwrite the contents with new path */
 		UINT bytes_written;
-		f_write(&data_file, str_index, index_len, &bytes_written);
-		if (bytes_written < index_len) {
+		f_write(&data_file, path, strlen(path), &bytes_written);
+		if (bytes_written < strlen(path)) {
 			/* error writing to file. disk full? */
 			retVal = MM_FILE_WRITE_ERR;
 		}
 		f_close(&data_file);
 	}
-
 	return retVal;
 }
 
-bool memcard_manager_exist(uint8_t* filename) {
-	if(!filename)
-		return false;
-	return is_image_valid(filename);
+/* Record the image at index as the one to load at next boot, by path so that it survives changes of the index */
+static uint32_t update_prev_loaded_memcard_index(uint32_t index) {
+	if(index >= images.count)
+		return MM_INDEX_OUT_OF_BOUNDS;
+	entry_path(&images, &images.entries[index], last_path);
+	last_pending = writes_held;
+	return writes_held ? MM_OK : write_last_path(last_path);
 }
 
-uint32_t memcard_manager_count() {
-	FRESULT res;
-	DIR root;
-	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t count = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname))
-					++count;
-			}
-		}
-	}
-	return count;
+/***
+ *	Hold back every write that may allocate clusters, while a USB host may have
+ *	the volume mounted: the catalog and the last card are kept in RAM and
+ *	written once released, creating an image fails with MM_BUSY.
+ */
+void memcard_manager_hold_writes(bool hold) {
+	writes_held = hold;
+	if(hold)
+		return;
+	if(catalog_pending && index_ready)
+		catalog_save();
+	catalog_pending = false;
+	if(last_pending)
+		write_last_path(last_path);
+	last_pending = false;
+}
+
+static int compare_root_names(const void* a, const void* b) {
+	uint8_t x[NAME_SIZE], y[NAME_SIZE];
+	entry_name(&images.entries[*(const uint32_t*) a], x);
+	entry_name(&images.entries[*(const uint32_t*) b], y);
+	return strcmp(x, y);
+}
+
+/***
+ *	Position of the image older firmware stored as old_index: it only listed
+ *	the images in the root directory, in strcmp() order ("10.MCR" before
+ *	"2.MCR"), where the index sorts them numerically. Only used once, the path
+ *	is stored in its place.
+ */
+static uint32_t convert_old_index(uint32_t old_index) {
+	uint32_t root_count = 0;
+	while(root_count < images.count && images.entries[root_count].dir == 0)	// root sorts first
+		root_count++;
+	if(old_index >= root_count)
+		return 0;
+	uint32_t* order = malloc(root_count * sizeof(uint32_t));
+	if(!order)
+		return 0;
+	for(uint32_t i = 0; i < root_count; i++)
+		order[i] = i;
+	qsort(order, root_count, sizeof(uint32_t), compare_root_names);
+	uint32_t pos = order[old_index];
+	free(order);
+	return pos;
 }
 
 uint32_t memcard_manager_get(uint32_t index, uint8_t* out_filename) {
 	if(!out_filename)
 		return MM_BAD_PARAM;
-	if(index < 0 || index > MAX_MC_IMAGES)
+	if(index > MAX_MC_IMAGES)
 		return MM_INDEX_OUT_OF_BOUNDS;
-	uint32_t count = memcard_manager_count();
-	if(index >= count)
+	uint32_t status = index_ensure();
+	if(status != MM_OK)
+		return status;
+	if(index >= images.count)
 		return MM_INDEX_OUT_OF_BOUNDS;
-	uint8_t* image_names = malloc(((MAX_MC_FILENAME_LEN + 1) * count));	// allocate space for image names
-	if(!image_names)
-		return MM_ALLOC_FAIL; // malloc failed
-	/* retrive images names */
-	FRESULT res;
-	DIR root;
-	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t i = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname)) {
-					strcpy(&image_names[(MAX_MC_FILENAME_LEN + 1) * i], f_info.fname);
-					++i;
-				}
-			}
-		}
-	}
-	/* sort names alphabetically */
-	qsort(image_names, count, (MAX_MC_FILENAME_LEN + 1), (__compar_fn_t) strcmp);
-	strcpy(out_filename, &image_names[(MAX_MC_FILENAME_LEN + 1) * index]);
-	free(image_names);	// free allocated memory
+	entry_path(&images, &images.entries[index], out_filename);
+	last_pos = index;
 	return MM_OK;
 }
 
@@ -130,15 +676,24 @@ uint32_t memcard_manager_get_prev_loaded_memcard_index() {
 	/* read which memcard to load from last session from SD card */
 	uint32_t index = 0;
 	FIL data_file;
-	uint32_t buff_size = 100;
+	char line[NAME_SIZE];
+	if(index_ensure() != MM_OK)
+		return 0;
 	FRESULT res = f_open(&data_file, memcard_lastmemcardindex_filename, FA_OPEN_EXISTING | FA_READ);
 	if (res == FR_OK) {
-		char line[buff_size];
-		if (f_gets(line, sizeof(line), &data_file)) {
-			/* string to int (base 10) */
-			index = (uint32_t)strtol(line, (char**)NULL, 10);
-		}
+		bool read = f_gets(line, sizeof(line), &data_file) != NULL;
 		f_close(&data_file);
+		if (read)
+			line[strcspn(line, "\r\n")] = '\0';
+		if (read && line[0] && strspn(line, "0123456789") == strlen(line)) {
+			/* position stored by older firmware, converted to the path of the same card */
+			index = convert_old_index((uint32_t)strtol(line, (char**)NULL, 10));
+			update_prev_loaded_memcard_index(index);
+		} else if (read) {
+			bool found;
+			uint32_t pos = index_find(line, &found);
+			index = found ? pos : 0;
+		}
 	}
 	return index;
 }
@@ -146,217 +701,172 @@ uint32_t memcard_manager_get_prev_loaded_memcard_index() {
 uint32_t memcard_manager_get_next(uint8_t* filename, uint8_t* out_nextfile) {
 	if(!filename || !out_nextfile)
 		return MM_BAD_PARAM;
-	uint32_t count = memcard_manager_count();
-	uint32_t buff_size = (MAX_MC_FILENAME_LEN + 1) * count;
-	uint8_t* image_names = malloc(buff_size);	// allocate space for image names
-	if(!image_names)
-		return MM_ALLOC_FAIL; // malloc failed
-	/* retrive images names */
-	FRESULT res;
-	DIR root;
-	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t i = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname)) {
-					strcpy(&image_names[(MAX_MC_FILENAME_LEN + 1) * i], f_info.fname);
-					++i;
-				}
-			}
-		}
-	}
-	/* sort names alphabetically */
-	qsort(image_names, count, (MAX_MC_FILENAME_LEN + 1), (__compar_fn_t) strcmp);
+	uint32_t status = index_ensure();
+	if(status != MM_OK)
+		return status;
 	/* find current and return following one */
-	bool found = false;
-	for(uint32_t i = 0; i < buff_size; i = i + (MAX_MC_FILENAME_LEN + 1)) {
-		if(!strcmp(filename, &image_names[i])) {
-			int32_t next_i = i + (MAX_MC_FILENAME_LEN + 1);
-			if(next_i < buff_size) {
-				int32_t new_index = next_i / ((MAX_MC_FILENAME_LEN + 1));
-				update_prev_loaded_memcard_index(new_index);
-				strcpy(out_nextfile, &image_names[next_i]);
-				found = true;
-				break;
-			}
-		}
-	}
-	free(image_names);	// free allocated memory
-	/* return */
-	if(found)
-		return MM_OK;
-	else
+	bool found;
+	uint32_t pos = index_find(filename, &found);
+	if(!found || pos + 1 >= images.count)
 		return MM_NO_ENTRY;
+	update_prev_loaded_memcard_index(pos + 1);
+	entry_path(&images, &images.entries[pos + 1], out_nextfile);
+	last_pos = pos + 1;
+	return MM_OK;
 }
 
 uint32_t memcard_manager_get_prev(uint8_t* filename, uint8_t* out_prevfile) {
 	if(!filename || !out_prevfile)
 		return MM_BAD_PARAM;
-	uint32_t count = memcard_manager_count();
-	uint32_t buff_size = (MAX_MC_FILENAME_LEN + 1) * count;
-	uint8_t* image_names = malloc(buff_size);	// allocate space for image names
-	if(!image_names)
-		return MM_ALLOC_FAIL; // malloc failed
-	/* retrive images names */
-	FRESULT res;
-	DIR root;
-	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t i = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname)) {
-					strcpy(&image_names[(MAX_MC_FILENAME_LEN + 1) * i], f_info.fname);
-					++i;
-				}
-			}
+	uint32_t status = index_ensure();
+	if(status != MM_OK)
+		return status;
+	/* find current and return prior one */
+	bool found;
+	uint32_t pos = index_find(filename, &found);
+	if(!found || pos == 0)
+		return MM_NO_ENTRY;
+	update_prev_loaded_memcard_index(pos - 1);
+	entry_path(&images, &images.entries[pos - 1], out_prevfile);
+	last_pos = pos - 1;
+	return MM_OK;
+}
+
+/***
+ *	Image to use for game_id: the one listed in GameMap.txt (an image, or the
+ *	first image of a folder), else the first image of the folder named after the
+ *	game, which is created with a blank image on first use. Costs a hash lookup
+ *	and a binary search, the SD card is only touched to create the folder.
+ */
+uint32_t memcard_manager_get_game(const uint8_t* game_id, uint8_t* out_filename) {
+	if(!game_id || !out_filename)
+		return MM_BAD_PARAM;
+	uint32_t status = index_ensure();
+	if(status != MM_OK)
+		return status;
+	uint8_t folder[DIR_NAME_SIZE];
+	const uint8_t* mapped = game_map_find(game_id);
+	if(mapped && strlen(mapped) <= MAX_MC_FILENAME_LEN) {
+		bool found;
+		uint32_t pos = index_find(mapped, &found);
+		if(found) {
+			entry_path(&images, &images.entries[pos], out_filename);
+			update_prev_loaded_memcard_index(pos);
+			return MM_OK;
 		}
 	}
-	/* sort names alphabetically */
-	qsort(image_names, count, (MAX_MC_FILENAME_LEN + 1), (__compar_fn_t) strcmp);
-	/* find current and return prior one */
-	bool found = false;
-	for(uint32_t i = 0; i < buff_size; i = i + (MAX_MC_FILENAME_LEN + 1)) {
-		if(!strcmp(filename, &image_names[i])) {
-			int32_t prev_i = i - (MAX_MC_FILENAME_LEN + 1);
-			if(prev_i >= 0) {
-				int32_t new_index = prev_i / (MAX_MC_FILENAME_LEN + 1);
-				update_prev_loaded_memcard_index(new_index);
-				strcpy(out_prevfile, &image_names[prev_i]);
-				found = true;
-				break;
-			}
+	if(mapped && strlen(mapped) <= MAX_MC_DIRNAME_LEN && !strchr(mapped, '/'))
+		strcpy(folder, mapped);
+	else if(!game_map_normalize(game_id, folder))
+		return MM_BAD_PARAM;
+	bool found;
+	uint32_t dir_pos = dir_find(&images, folder, &found);
+	if(found) {
+		index_entry_t key = { .number = 0, .dir = dir_pos, .digits = 0 };
+		uint32_t low = index_lower_bound(&key);
+		if(low < images.count && images.entries[low].dir == dir_pos) {
+			entry_path(&images, &images.entries[low], out_filename);
+			last_pos = low;
+			update_prev_loaded_memcard_index(low);
+			return MM_OK;
 		}
 	}
-	free(image_names);	// free allocated memory
-	/* return */
-	if(found)
-		return MM_OK;
-	else
+	return memcard_manager_create_in(folder, out_filename);
+}
+
+/* Images before and after filename, without recording anything as loaded. Missing neighbours are returned as "" */
+uint32_t memcard_manager_get_neighbours(uint8_t* filename, uint8_t* out_prevfile, uint8_t* out_nextfile) {
+	if(!filename || !out_prevfile || !out_nextfile)
+		return MM_BAD_PARAM;
+	uint32_t status = index_ensure();
+	if(status != MM_OK)
+		return status;
+	bool found;
+	uint32_t pos = index_find(filename, &found);
+	out_prevfile[0] = out_nextfile[0] = '\0';
+	if(!found)
 		return MM_NO_ENTRY;
+	if(pos > 0)
+		entry_path(&images, &images.entries[pos - 1], out_prevfile);
+	if(pos + 1 < images.count)
+		entry_path(&images, &images.entries[pos + 1], out_nextfile);
+	return MM_OK;
 }
 
 uint32_t memcard_manager_create(uint8_t* out_filename) {
-	if(!out_filename)
+	return memcard_manager_create_in(NULL, out_filename);
+}
+
+/* Create a blank image in folder (made if missing), or in the current MCRnnn folder when folder is NULL */
+uint32_t memcard_manager_create_in(const uint8_t* folder, uint8_t* out_filename) {
+	if(!out_filename || (folder && (!folder[0] || strlen(folder) > MAX_MC_DIRNAME_LEN || strchr(folder, '/'))))
 		return MM_BAD_PARAM;
 
-  uint8_t name[MAX_MC_FILENAME_LEN + 1];
-  FIL memcard_image;
-
-  uint8_t memcard_n = 0;
-  FRESULT f_res;
-  do {
-    snprintf(name, MAX_MC_FILENAME_LEN + 1, "%d.MCR", memcard_n++); // Set name to %d.MCR
-    f_res = f_open(&memcard_image, name, FA_CREATE_NEW | FA_WRITE); // Open new file for writing
-  } while (f_res == FR_EXIST); // Repeat if file exists.
-
-  strcpy(out_filename, name); // We have a valid name, copy it to out_filename
-
-	if(f_res == FR_OK) {
-		UINT bytes_written = 0;
-		uint8_t buffer[MC_SEC_SIZE];
-		uint8_t xor;
-		/* header frame (block 0, sec 0) */
-		buffer[0] = 'M';
-		buffer[1] = 'C';
-		xor = buffer[0] ^ buffer[1];
-		for(int i = 2; i < MC_SEC_SIZE - 1; i++) {
-			buffer[i] = 0;
-			xor = xor ^ buffer[i];
-		}
-		buffer[MC_SEC_SIZE - 1] = xor;
-		f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-		if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-			f_close(&memcard_image);
-			return MM_FILE_WRITE_ERR;
-		}
-		/* directory frames (block 0, sec 1..15) */
-		buffer[0] = 0xa0;	// free block
-		xor = buffer[0];
-		for(int i = 1; i < 8; i++) {
-			buffer[i] = 0;
-			xor = xor ^ buffer[i];
-		}
-		buffer[8] = buffer[9] = 0xff;	// no next block
-		xor = xor ^ buffer[8] ^ buffer[9];
-		for(int i = 10; i < MC_SEC_SIZE - 1; i++) {
-			buffer[i] = 0;
-			xor = xor ^ buffer[i];
-		}
-		buffer[MC_SEC_SIZE - 1] = xor;
-		for(int i = 0; i < 15; i++) {
-			f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-			if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-				f_close(&memcard_image);
-				return MM_FILE_WRITE_ERR;
-			}
-		}
-		/* broken sector list (block 0, sec 16..35) */
-		buffer[0] = buffer[1] = buffer[2] = buffer[3] = 0xff;	// no broken sector
-		xor = buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3];
-		buffer[4] = buffer[5] = buffer[6] = buffer[7] = 0x00;	// 0 fill
-		xor = xor ^ buffer[4] ^ buffer[5] ^ buffer[6] ^ buffer[7];
-		buffer[8] = buffer[9] = 0xff;	// 1 fill
-		xor = xor ^ buffer[8] ^ buffer[9];
-		for(int i = 10; i < MC_SEC_SIZE - 1; i++) {
-			buffer[i] = 0x00;
-			xor = xor ^ buffer[i];
-		}
-		buffer[MC_SEC_SIZE - 1] = xor;
-		for(int i = 0; i < 20; i++) {
-			f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-			if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-				f_close(&memcard_image);
-				return MM_FILE_WRITE_ERR;
-			}
-		}
-		/* broken sector replacement data (block 0, sec 36..55) and unused frames (block 0, sec 56..62) */
-		for(int i = 0; i < MC_SEC_SIZE; i++) {
-			buffer[i] = 0x00;
-		}
-		for(int i = 0; i < 27; i++) {
-			f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-			if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-				f_close(&memcard_image);
-				return MM_FILE_WRITE_ERR;
-			}
-		}
-		/* test write sector (block 0, sec 63) */
-		buffer[0] = 'M';
-		buffer[1] = 'C';
-		xor = buffer[0] ^ buffer[1];
-		for(int i = 2; i < MC_SEC_SIZE - 1; i++) {
-			buffer[i] = 0;
-			xor = xor ^ buffer[i];
-		}
-		buffer[MC_SEC_SIZE - 1] = xor;
-		f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-		if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-			f_close(&memcard_image);
-			return MM_FILE_WRITE_ERR;
-		}
-		/* fill remaining 15 blocks with zeros */
-		for(int i = 0; i < MC_SEC_SIZE; i++) {
-			buffer[i] = 0;
+	if(writes_held)
+		return MM_BUSY;	// a folder, an image and a catalog entry are allocated
+	uint32_t status = index_ensure();
+	if(status != MM_OK)
+		return status;
+
+	uint8_t name[MAX_MC_FILENAME_LEN + 1] = "";
+	uint8_t dir[DIR_NAME_SIZE];
+	index_entry_t entry;
+	FIL memcard_image;
+	FRESULT f_res;
+	uint32_t folder_id = 0;
+	if(folder) {
+		bool found;
+		uint32_t pos = dir_find(&images, folder, &found);
+		folder_id = found ? next_in_dir(pos) : 0;
+	}
+	/* ids come from the counter kept in the catalog (or the folder's last image), so this normally takes a single open */
+	do {
+		uint32_t id;
+		if(folder) {
+			id = folder_id++;
+			strcpy(dir, folder);
+		} else {
+			id = images.next_id++;
+			snprintf(dir, sizeof(dir), "%s%03u", memcard_shard_prefix, (unsigned) (id / MC_SHARD_SIZE));
 		}
-		for(int i = 0; i < MC_SEC_COUNT - 64; i++) {	// 64 are the number of sectors written already (forming block 0)
-			f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-			if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-				f_close(&memcard_image);
-				return MM_FILE_WRITE_ERR;
-			}
+		bool dir_found;
+		dir_find(&images, dir, &dir_found);
+		if(!dir_found) {
+			f_res = f_mkdir(dir);
+			if(f_res != FR_OK && f_res != FR_EXIST)
+				break;
 		}
-		f_close(&memcard_image);
-	} else {
+		snprintf(name, sizeof(name), "%s/%u%s", dir, (unsigned) id, memcard_file_ext);	// Set name to <folder>/%d.MCR
+		f_res = f_open(&memcard_image, name, FA_CREATE_NEW | FA_WRITE);	// Open new file for writing
+	} while(f_res == FR_EXIST);	// Repeat if file exists (put there from a PC).
+
+	if(f_res != FR_OK)
 		return MM_FILE_OPEN_ERR;
+	status = memory_card_write_blank(&memcard_image);
+	if(FR_OK != f_close(&memcard_image))
+		status = MC_FILE_WRITE_ERR;
+	if(status != MC_OK) {
+		f_unlink(name);	// never leave a partial image behind
+		return MM_FILE_WRITE_ERR;
+	}
+	/* index and catalog are updated in place, the catalog is only rewritten for a new folder */
+	scan_stop();	// a verification in progress may have missed the new image
+	uint32_t dir_pos;
+	parse_path(name, dir, &entry);
+	status = dir_insert(&images, dir, &dir_pos);
+	if(status == MM_OK) {
+		entry.dir = dir_pos;
+		status = index_add(&images, &entry, true, true);
 	}
-	update_prev_loaded_memcard_index(memcard_n - 1);
+	if(status != MM_OK) {
+		f_unlink(name);	// an image the index does not hold could not be switched to
+		return status;
+	}
+	catalog_append(&entry);
+	bool found;
+	uint32_t pos = index_find(name, &found);
+	if(found)
+		update_prev_loaded_memcard_index(pos);
+	strcpy(out_filename, name);
 	return MM_OK;
-}
\ No newline at end of file
+}
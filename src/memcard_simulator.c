@@ -3,13 +3,23 @@
 #include "stdio.h"
 #include "pico/multicore.h"
 #include "pico/platform.h"  // __time_critical_func macro
-#include "pico/util/queue.h"
+#include "pico/stdio.h"     // getchar_timeout_us for console queries
 #include "hardware/pio.h"
 #include "hardware/irq.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
 #include "psxSPI.pio.h"
 #include "memory_card.h"
 #include "sd_config.h"
 #include "memcard_manager.h"
+#include "memcard_cache.h"
+#include "flash_tier.h"
+#include "flash_journal.h"
+#include "snapshot.h"
+#include "transfer.h"
+#include "switch_stats.h"
+#include "trace.h"
+#include "msc_handler.h"
 #include "config.h"
 #include "pad.h"
 #include "led.h"
@@ -43,16 +53,123 @@ uint offsetCmdReader;
 uint offsetDatWriter;
 uint offsetDatReader;
 
+uint dmaSectorWriter;
+uint dmaTrailerWriter;
+uint dmaCmdDrain;
+uint8_t read_trailer[2];    // checksum and GOOD sent after the sector data
+uint32_t cmd_discard;
+
 memory_card_t mc;
 bool request_next_mc = false;
 bool request_prev_mc = false;
 bool request_new_mc = false;
+bool request_game_mc = false;
+bool request_next_chan = false;
+bool request_prev_chan = false;
+bool request_restore = false;
+uint32_t requested_snapshot;    // snapshot of the card served to restore, set before request_restore
+uint8_t requested_game_id[MAX_GAME_ID_LEN + 1];   // written by core1 only while request_game_mc is clear, core0 clears it once copied
 mutex_t write_transaction;
-queue_t mc_sector_sync_queue;
+volatile bool write_transaction_held = false;   // core1 owns write_transaction
 const uint8_t id_data[] = {0x04, 0x00, 0x00, 0x80};
 
+/* Name of the card being served for MEMCARD_NAME, core0 fills the spare buffer then flips name_current */
+uint8_t mc_names[2][MAX_MC_FILENAME_LEN + 4];
+volatile uint32_t name_current = 0;
+
+/* Card switch latency: core1 stamps when a request is raised and the first READ served after a switch */
+volatile uint32_t switch_request_time = 0;
+volatile bool first_read_armed = false;
+volatile uint32_t first_read_time = 0;
+static bool switch_timing_active = false;   // core0 waits for first_read_time of the last switch
+static uint32_t switch_start;               // switch_request_time of the switch being timed
+static uint32_t switch_phase_start;
+
+/* Boot to first ACK: core1 stamps the first memory card command it answers, core0 reports it */
+volatile uint32_t first_ack_time = 0;
+static bool first_ack_reported = false;
+
+/* Transaction counters, each only incremented by core1 */
+volatile uint32_t read_transactions = 0;
+volatile uint32_t write_transactions = 0;
+volatile uint32_t id_transactions = 0;
+volatile uint32_t bad_checksum_writes = 0;
+volatile uint32_t write_end_time = 0;      // time_us_32() when the last WRITE frame ended
+
+/* Core0 state kept across simulate_memory_card_task() calls */
+static uint8_t mc_file_name[MAX_MC_FILENAME_LEN + 1];	// +1 for null terminator character
+static bool simulation_running = false;
+static uint32_t sd_write_last_us = 0;
+static uint32_t sd_write_max_us = 0;
+static uint64_t last_sync_time = 0;
+static uint64_t last_scrub_time = 0;
+static uint64_t last_prefetch_time = 0;
+static uint64_t last_flash_time = 0;
+static uint64_t last_psx_time = 0;          // last time the transaction counters moved
+static uint32_t last_transactions = 0;
+static uint32_t journal_gap_writes = 0;     // write_transactions when the gap after the last WRITE was used
+static bool sync_incomplete = false;        // a sync failed and no clean sync followed, the flash journal keeps every record
+static uint64_t last_write_time = 0;
+static uint64_t pending_since = 0;
+static uint32_t last_write_count = 0;
+static bool snapshot_due = false;           // arrived on a card, its first snapshot is taken once idle
+static uint8_t snapshot_reason;
+static uint32_t snapshot_write_count = 0;   // mc.write_count at the last snapshot
+static bool volume_shared = false;          // a USB host may have the volume mounted, nothing allocating clusters is written
+static bool game_deferred = false;          // the card of deferred_game_id is to be created once the volume is no longer shared
+static uint8_t deferred_game_id[MAX_GAME_ID_LEN + 1];
+
+/* Stop a READ frame still being streamed, it would otherwise leak into the next transaction */
+void __time_critical_func(abort_read_dma)(void) {
+    dma_channel_abort(dmaSectorWriter);
+    dma_channel_abort(dmaTrailerWriter);    // after the sector channel, which may chain to it while aborting
+    dma_channel_abort(dmaCmdDrain);
+}
+
+/* Raise a request for core0, timing starts with the first request of a burst (e.g. a held combo) */
+static inline void raise_request(bool* request) {
+    if(!*request)
+        switch_request_time = time_us_32();
+    *request = true;
+}
+
+/* Core0 picked up a switch request, its phases are then recorded as they complete */
+void switch_timing_begin() {
+    first_read_armed = false;
+    switch_phase_start = time_us_32();
+    switch_start = switch_request_time;
+    switch_timing_active = true;
+    switch_stats_record(SWITCH_PHASE_PICKUP, switch_phase_start - switch_start);
+}
+
+void switch_timing_phase(uint32_t phase) {
+    uint32_t now = time_us_32();
+    if(!switch_timing_active)
+        return;
+    switch_stats_record(phase, now - switch_phase_start);
+    switch_phase_start = now;
+}
+
+/* The PSX sees the new card from now on, wait for core1 to serve its first READ */
+void switch_timing_reconnected() {
+    switch_timing_phase(SWITCH_PHASE_RECONNECT);
+    __dmb();
+    first_read_armed = switch_timing_active;
+}
+
+/* Called from the main loop, completes the switch being timed once the PSX read from the new card */
+void switch_timing_poll() {
+    if(!switch_timing_active || first_read_armed)
+        return;
+    __dmb();
+    switch_stats_record(SWITCH_PHASE_FIRST_READ, first_read_time - switch_phase_start);
+    switch_stats_record(SWITCH_PHASE_TOTAL, first_read_time - switch_start);
+    switch_timing_active = false;
+}
+
 void simulate_mc_reconnect() {
     irq_set_enabled(IO_IRQ_BANK0, false);
+    abort_read_dma();
 	pio_restart_sm_mask(pio0, 1 << smCmdReader | 1 << smDatReader | 1 << smDatWriter);
 	pio_sm_exec(pio0, smCmdReader, pio_encode_jmp(offsetCmdReader));	// restart smCmdReader PC
 	pio_sm_exec(pio0, smDatReader, pio_encode_jmp(offsetDatReader));	// restart smDatReader PC
@@ -62,7 +179,14 @@ void simulate_mc_reconnect() {
 	pio_sm_drain_tx_fifo(pio0, smDatWriter); // drain instead of clear, so that we empty the OSR
 	printf("Simulating reconnection...");
 	led_output_mc_change();
-	sleep_ms(MC_RECONNECT_TIME);
+	/* keep streaming the new image in while the PSX sees no card, core1 only answers once it is all loaded */
+	uint64_t reconnect_end = time_us_64() + MC_RECONNECT_TIME * 1000;
+	while(time_us_64() < reconnect_end || !memory_card_import_done(&mc)) {
+		if(memory_card_import_done(&mc))
+			sleep_ms(1);
+		else if(memory_card_import_step(&mc) != MC_OK)
+			break;	// the card stays disconnected, the main loop reports the error
+	}
     printf("  done\n");
     irq_set_enabled(IO_IRQ_BANK0, true);
 }
@@ -90,6 +214,12 @@ void process_memcard_cmd() {
                 uint8_t checksum = ((read_address & 0xFF00) >> 8) ^ (read_address & 0x00FF);
                 if(!memory_card_is_sector_valid(&mc, read_address)) {
                     SEND(0xff); // abort transaction
+                    trace_push(MEMCARD_READ, read_address, 0xff, 0);
+                    return;
+                }
+                if(!memory_card_request_sector(&mc, read_address)) {
+                    SEND(0xff); // not loaded yet, abort transaction and let the PSX retry
+                    trace_push(MEMCARD_READ, read_address, 0xff, 0);
                     return;
                 }
                 SEND((read_address & 0xFF00) >> 8); // confirm MSB
@@ -97,22 +227,27 @@ void process_memcard_cmd() {
                 SEND(read_address & 0x00FF);    // confirm LSB
                 RECV_CMD();
 
-                /* send data */
+                /* send data, checksum and GOOD through DMA, CMD bytes received meanwhile are dropped */
                 uint8_t* sec_ptr = memory_card_get_sector_ptr(&mc, read_address);
-                for (uint32_t i = 0; i < MC_SEC_SIZE; i++) {
-                    SEND(sec_ptr[i]);
-                    RECV_CMD();
-                    checksum ^= sec_ptr[i];
+                read_trailer[0] = checksum ^ memory_card_get_sector_checksum(&mc, read_address);
+                read_trailer[1] = MC_GOOD;
+                dma_channel_set_read_addr(dmaTrailerWriter, read_trailer, false);
+                dma_channel_start(dmaCmdDrain);
+                dma_channel_set_read_addr(dmaSectorWriter, sec_ptr, true);
+                if(first_read_armed) {
+                    first_read_time = time_us_32();
+                    __dmb();
+                    first_read_armed = false;
                 }
-                SEND(checksum);
-                RECV_CMD();
-                SEND(MC_GOOD);
-                RECV_CMD();
+                read_transactions++;
+                trace_push(MEMCARD_READ, read_address, MC_GOOD, MC_SEC_SIZE);
+                dma_channel_wait_for_finish_blocking(dmaCmdDrain);
             }
             break;
         case MEMCARD_WRITE:
             {
                 mutex_enter_blocking(&write_transaction);
+                write_transaction_held = true;
                 SEND(MC_ID1);
                 RECV_CMD();
                 SEND(MC_ID2);
@@ -124,17 +259,24 @@ void process_memcard_cmd() {
                 data = RECV_CMD();
                 write_address |= data;
                 uint8_t checksum = ((write_address & 0xFF00) >> 8) ^ (write_address & 0x00FF);
-                if(!memory_card_is_sector_valid(&mc, write_address)) {
-                    SEND(0xff); // abort transaction
+                if(!memory_card_is_sector_valid(&mc, write_address) || !memory_card_request_sector(&mc, write_address)) {
+                    SEND(0xff); // abort transaction, PSX retries once a not yet loaded sector is resident
+                    trace_push(MEMCARD_WRITE, write_address, 0xff, 0);
+                    write_transaction_held = false;
+                    mutex_exit(&write_transaction);
                     return;
                 }
                 uint8_t* sec_ptr = memory_card_get_sector_ptr(&mc, write_address);
+                uint8_t sec_checksum = 0;
+                memory_card_begin_write(&mc, write_address);
                 for(uint32_t i = 0; i < MC_SEC_SIZE; i++) {
                     SEND(data); // ack previous data
                     data = RECV_CMD();  // receive new data
-                    checksum ^= data;
+                    sec_checksum ^= data;
                     sec_ptr[i] = data;
                 }
+                memory_card_end_write(&mc, write_address, sec_checksum);
+                checksum ^= sec_checksum;
                 SEND(data); // send remaining sector byte
                 uint8_t recv_checksum = RECV_CMD();
                 /* send acks */
@@ -144,13 +286,17 @@ void process_memcard_cmd() {
                 RECV_CMD();
                 memory_card_reset_seen_flag(&mc);
                 if(write_address != MC_TEST_SEC) {
-                    queue_add_blocking(&mc_sector_sync_queue, &write_address);
+                    memory_card_mark_dirty(&mc, write_address);
                 }
-                if(checksum == recv_checksum)
-                    SEND(MC_GOOD);
-                else
-                    SEND(MC_BAD_CHK);
+                uint8_t status = checksum == recv_checksum ? MC_GOOD : MC_BAD_CHK;
+                SEND(status);
+                if(status == MC_BAD_CHK)
+                    bad_checksum_writes++;
+                write_transactions++;
+                trace_push(MEMCARD_WRITE, write_address, status, MC_SEC_SIZE);
                 RECV_CMD();
+                write_end_time = time_us_32();
+                write_transaction_held = false;
                 mutex_exit(&write_transaction);
             }
             break;
@@ -170,6 +316,8 @@ void process_memcard_cmd() {
                     SEND(id_data[i]);
                     RECV_CMD();
                 }
+                id_transactions++;
+                trace_push(MEMCARD_ID, 0, id_data[sizeof(id_data) - 1], sizeof(id_data));
             }
             break;
         case MEMCARD_PING:
@@ -180,23 +328,70 @@ void process_memcard_cmd() {
                 RECV_CMD();
                 SEND(0x27); // card present
                 RECV_CMD();
-                printf("MC Received Ping from PS\n");
+                trace_push(MEMCARD_PING, 0, 0x27, 0);
             }
             break;
         case MEMCARD_GAMEID:
             {
+                uint8_t game_id[MAX_GAME_ID_LEN + 1];
                 SEND(0x00);
                 uint8_t game_id_len = RECV_CMD();
                 data = 0x00;
-                uint8_t game_id[256] = {0};
-                /* read game id */
+                /* read game id, core0 maps it to an image once the command is complete */
                 for(uint32_t i = 0; i < game_id_len; i++) {
                     SEND(data); // ack previous data
                     data = RECV_CMD();
-                    game_id[i] = data;
+                    if(i < MAX_GAME_ID_LEN)
+                        game_id[i] = data;
                 }
+                game_id[game_id_len < MAX_GAME_ID_LEN ? game_id_len : MAX_GAME_ID_LEN] = '\0';
                 SEND(data); // ack last byte
-                printf("Game ID: %s\n", game_id);
+                /* handed over only once core0 copied the previous one, which is then served */
+                if(!request_game_mc) {
+                    strcpy(requested_game_id, game_id);
+                    __dmb();
+                    raise_request(&request_game_mc);
+                }
+                trace_push(MEMCARD_GAMEID, 0, data, game_id_len);
+            }
+            break;
+        case MEMCARD_PREV_CHAN:
+        case MEMCARD_NEXT_CHAN:
+        case MEMCARD_PREV_CARD:
+        case MEMCARD_NEXT_CARD:
+            {
+                SEND(0x00); // byte 1 reserved
+                RECV_CMD();
+                SEND(0x20); // command accepted
+                RECV_CMD();
+                SEND(0xff); // change happens on core0 as the PSX sees a card reconnect
+                if(data == MEMCARD_PREV_CHAN)
+                    raise_request(&request_prev_chan);
+                else if(data == MEMCARD_NEXT_CHAN)
+                    raise_request(&request_next_chan);
+                else if(data == MEMCARD_PREV_CARD)
+                    raise_request(&request_prev_mc);
+                else
+                    raise_request(&request_next_mc);
+                trace_push(data, 0, 0xff, 0);
+            }
+            break;
+        case MEMCARD_NAME:
+            {
+                const uint8_t* name = mc_names[name_current];
+                SEND(0x00); // byte 1 reserved
+                RECV_CMD();
+                SEND(0x20); // command accepted
+                RECV_CMD();
+                uint8_t name_len = strlen(name);
+                SEND(name_len);
+                RECV_CMD();
+                for(uint32_t i = 0; i < name_len; i++) {
+                    SEND(name[i]);
+                    RECV_CMD();
+                }
+                SEND(0xff);
+                trace_push(MEMCARD_NAME, 0, 0xff, name_len);
             }
             break;
         default:
@@ -213,13 +408,13 @@ void process_pad_cmd() {    /* during pad interaction never call SEND() only int
     sw_status |= RECV_DAT() << 8;
     switch(sw_status) {
         case START & SELECT & UP:
-            request_next_mc = true;
+            raise_request(&request_next_mc);
             break;
         case START & SELECT & DOWN:
-            request_prev_mc = true;
+            raise_request(&request_prev_mc);
             break;
         case START & SELECT & TRIANGLE:
-            request_new_mc = true;
+            raise_request(&request_new_mc);
             break;
         default:
             break;
@@ -229,6 +424,11 @@ void process_pad_cmd() {    /* during pad interaction never call SEND() only int
 void process_cmd(uint8_t cmd) {
     switch (cmd) {
         case MEMCARD_TOP:
+            /* no ACK, like an empty slot, until the whole image is loaded */
+            if(!memory_card_import_done(&mc))
+                break;
+            if(!first_ack_time)
+                first_ack_time = time_us_32();
             process_memcard_cmd();
             break;
         case PAD_TOP:
@@ -240,12 +440,19 @@ void process_cmd(uint8_t cmd) {
 }
 
 _Noreturn void simulation_thread() {
+    /* previous transaction may have ended in the middle of a WRITE */
+    memory_card_recover_write(&mc);
+    if(write_transaction_held) {
+        write_transaction_held = false;
+        mutex_exit(&write_transaction);
+    }
 	while(true) {
         process_cmd(RECV_CMD());
 	}
 }
 
 void __time_critical_func(restart_pio_sm)(void) {
+    abort_read_dma();
     pio_set_sm_mask_enabled(pio0, 1 << smCmdReader | 1 << smDatReader | 1 << smDatWriter, false);
     pio_restart_sm_mask(pio0, 1 << smCmdReader | 1 << smDatReader | 1 << smDatWriter);
     pio_sm_exec(pio0, smCmdReader, pio_encode_jmp(offsetCmdReader));	// restart smCmdReader PC
@@ -261,6 +468,16 @@ void __time_critical_func(restart_pio_sm)(void) {
     pio_enable_sm_mask_in_sync(pio0, 1 << smCmdReader | 1 << smDatReader | 1 << smDatWriter);
 }
 
+/***
+ *	Restart the state machines and core1 after core0 held core1 in reset (flash
+ *	writes), so that the next transaction is answered. When the PSX selected
+ *	the card meanwhile, the SEL edge ending that transaction does it instead.
+ */
+void simulate_memory_card_resume() {
+    if(gpio_get(PIN_SEL))
+        restart_pio_sm();
+}
+
 void init_pio() {
     gpio_set_dir(PIN_DAT, false);
     gpio_set_dir(PIN_CMD, false);
@@ -286,6 +503,34 @@ void init_pio() {
     dat_writer_program_init(pio0, smDatWriter, offsetDatWriter);
 }
 
+/***
+ *	READ responses are streamed by three DMA channels: one feeds the sector data to
+ *	the DAT writer and chains to a second one sending checksum and GOOD, while a third
+ *	drains the CMD reader. Channels are paced by the FIFO DREQs, so the frame goes out
+ *	at the PSX clock without core1 touching the FIFOs.
+ */
+void init_dma() {
+    dmaSectorWriter = dma_claim_unused_channel(true);
+    dmaTrailerWriter = dma_claim_unused_channel(true);
+    dmaCmdDrain = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(dmaTrailerWriter);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(pio0, smDatWriter, true));
+    dma_channel_configure(dmaTrailerWriter, &c, &pio0->txf[smDatWriter], read_trailer, sizeof(read_trailer), false);
+    channel_config_set_chain_to(&c, dmaTrailerWriter);
+    dma_channel_configure(dmaSectorWriter, &c, &pio0->txf[smDatWriter], NULL, MC_SEC_SIZE, false);
+
+    c = dma_channel_get_default_config(dmaCmdDrain);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(pio0, smCmdReader, false));
+    dma_channel_configure(dmaCmdDrain, &c, &cmd_discard, &pio0->rxf[smCmdReader], MC_SEC_SIZE + sizeof(read_trailer), false);
+}
+
 void __time_critical_func(sel_isr_callback()) {
     // TODO refractor comment, also is __time_critical_func needed for speed? we should test if everything works without it!
     /* begin inlined call of:  gpio_acknowledge_irq(PIN_SEL, GPIO_IRQ_EDGE_RISE); kept in RAM for performance reasons */
@@ -295,59 +540,311 @@ void __time_critical_func(sel_isr_callback()) {
     restart_pio_sm();
 }
 
-void queue_sync_step(queue_t* queue, uint8_t* mc_file_name) {
-    uint16_t next_entry;
-    queue_remove_blocking(queue, &next_entry);
-    uint32_t status = memory_card_sync_sector(&mc, next_entry, mc_file_name);
-    if(status != MC_OK)
+/* Keep the SD write latency reported to the console */
+static void record_sd_write(uint64_t start) {
+    sd_write_last_us = time_us_64() - start;
+    if(sd_write_last_us > sd_write_max_us)
+        sd_write_max_us = sd_write_last_us;
+}
+
+/* FatFs transfers fail as a whole, slow the SD clock down so the next attempt has a better chance */
+static void report_sd_error(uint32_t status) {
+    sd_clock_fallback(sd_get_by_num(0));
+    led_blink_error(status);
+}
+
+/***
+ *	Write back every sector dirty so far, the SD card sees them as one batch.
+ *	Sectors of a failed write stay dirty and are written again right away at
+ *	each slower SD clock, until they go through or fail at BAUD_RATE too.
+ */
+uint32_t sync_step() {
+    uint64_t start = time_us_64();
+    uint32_t status = memory_card_sync(&mc);
+    while(status == MC_FILE_WRITE_ERR && sd_clock_fallback(sd_get_by_num(0)))
+        status = memory_card_sync(&mc);
+    record_sd_write(start);
+    if(status != MC_OK) {
+        sync_incomplete = true;
         led_blink_error(status);
+    } else if(!memory_card_has_pending(&mc)) {
+        sync_incomplete = false;    // whatever failed before has been written since
+    }
+    return status;
 }
 
-_Noreturn int simulate_memory_card() {
-	mutex_init(&write_transaction);
-	queue_init(&mc_sector_sync_queue, sizeof(sector_t), MC_SEC_COUNT);	// enough space to do complete MC copy
-	uint8_t mc_file_name[MAX_MC_FILENAME_LEN + 1];	// +1 for null terminator character
+/* Commit the open image and report how well writes have been coalesced */
+void flush_step() {
+    bool written = memory_card_is_dirty(&mc);
+    uint64_t start = time_us_64();
+    uint32_t status = memory_card_flush(&mc);
+    record_sd_write(start);
+    if(written)
+        msc_volume_changed();   // a mounted host sees UNIT ATTENTION once per save written back, not per flush
+    if(status != MC_OK) {
+        report_sd_error(status);
+        return;
+    }
+    if(written)
+        flash_tier_changed(mc_file_name);   // flash copies are now behind the SD one
+    if(!memory_card_has_pending(&mc) && !sync_incomplete)
+        flash_journal_checkpoint();         // every write journaled so far is on SD
+    memory_card_stats_t stats;
+    memory_card_get_stats(&mc, &stats);
+    printf("Synced %u sectors as %u SD blocks for %u writes, %u unchanged (max backlog %u)\n",
+        (unsigned) stats.sector_syncs, (unsigned) stats.block_writes, (unsigned) stats.sector_writes,
+        (unsigned) stats.sector_skips, (unsigned) stats.max_pending);
+}
 
-	/* Mount and test SD card filesystem */
-	sd_card_t *p_sd = sd_get_by_num(0);
-	if(FR_OK != f_mount(&p_sd->fatfs, "", 1)) {
-		while(true)
-			led_blink_error(1);
-	}
+/* Verify the next SD block of the image against the RAM copy */
+void scrub_step() {
+    uint32_t status = memory_card_scrub_step(&mc);
+    if(status == MC_SCRUB_MISMATCH) {
+        memory_card_stats_t stats;
+        memory_card_get_stats(&mc, &stats);
+        printf("Scrub: sector mismatch found (%u errors in %u blocks checked)\n",
+            (unsigned) stats.scrub_errors, (unsigned) stats.scrub_blocks);
+    } else if(status != MC_OK) {
+        led_blink_error(status);
+    }
+}
 
-    uint32_t status = memory_card_init(&mc);
-	if(status != MC_OK) {
-		while(true) {
-			led_blink_error(status);
-			sleep_ms(2000);
-		}
-	}
-	status = memcard_manager_get_initial(mc_file_name);	// get initial memory card to load
-	if(status != MM_OK) {
-		status = memcard_manager_get(0, mc_file_name);	// revert to first mem card if failing to load previously loaded card
-		if(status != MM_OK) {
-			while(true) {
-				led_blink_error(status);
-				sleep_ms(1000);
-			}
-		}
-	}
-	status = memory_card_import(&mc, mc_file_name);
-	if(status != MC_OK) {
-		while(true) {
-			led_blink_error(status);
-			sleep_ms(2000);
-		}
-	}
+/* The PSX has left the card alone long enough for flash erases */
+static bool psx_idle(uint64_t now) {
+    uint32_t transactions = read_transactions + write_transactions + id_transactions;
+    if(transactions != last_transactions) {
+        last_transactions = transactions;
+        last_psx_time = now;
+    }
+    return now - last_psx_time > FLASH_TIER_IDLE_TIME * 1000;
+}
+
+/***
+ *	Append the next PSX write to the flash journal, ms after core1 accepted it.
+ *	A page program stops core1 for about 1ms, so a page is only programmed in
+ *	the gap the PSX leaves after a completed WRITE (one per WRITE, within
+ *	JOURNAL_APPEND_WINDOW of its end) or once the PSX is idle. SEL must still be
+ *	high (no transaction on the port) and write_transaction free (core1 not in a WRITE).
+ */
+void journal_step(uint64_t now) {
+    bool may_erase = psx_idle(now);
+    uint32_t writes = write_transactions;
+    bool in_gap = writes != journal_gap_writes && time_us_32() - write_end_time < JOURNAL_APPEND_WINDOW * 1000;
+    if(!(in_gap || may_erase) || !gpio_get(PIN_SEL) || !mutex_try_enter(&write_transaction, NULL))
+        return;
+    flash_journal_step(&mc, true, may_erase);
+    journal_gap_writes = writes;
+    mutex_exit(&write_transaction);
+}
+
+/***
+ *	Bring the flash tier one sector closer to the card served and the favourites.
+ *	Programming flash leaves the PSX unanswered, so it waits until the PSX has
+ *	left the card alone for FLASH_TIER_IDLE_TIME, and for write_transaction.
+ */
+void flash_step(uint64_t now) {
+    bool may_program = psx_idle(now) && gpio_get(PIN_SEL);
+    if(!mutex_try_enter(&write_transaction, NULL))
+        return;
+    flash_tier_step(mc.channel == 0 ? mc_file_name : NULL, mc.data, may_program);
+    mutex_exit(&write_transaction);
+}
+
+/* Record the card served as a snapshot, pending writes have been synced */
+static uint32_t take_snapshot(uint8_t reason) {
+    uint32_t index;
+    if(volume_shared)
+        return SN_BUSY;     // snapshot files grow, taken once the host let go of the volume
+    uint32_t status = snapshot_take(&mc, mc_file_name, reason, &index);
+    if(status == SN_BUSY)
+        return status;
+    snapshot_write_count = mc.write_count;
+    if(status != SN_OK) {
+        printf("Snapshot of %s failed (%u)\n", mc_file_name, (unsigned) status);
+    } else if(index != SN_NO_INDEX) {
+        snapshot_stats_t stats;
+        snapshot_get_stats(&stats);
+        printf("Snapshot %u of %s channel %u taken in %u us\n", (unsigned) index, mc_file_name,
+            (unsigned) mc.channel + 1, (unsigned) stats.last_us);
+    }
+    return status;
+}
+
+/* A card was loaded, its first snapshot catches what changed since the last time it was served */
+static void schedule_snapshot(uint8_t reason) {
+    snapshot_due = true;
+    snapshot_reason = reason;
+}
+
+/***
+ *	Automatic rollback points: the snapshot scheduled when a card was loaded,
+ *	then one every SNAPSHOT_WRITES sector writes. Only called with nothing
+ *	pending, so the SD copy holds what is recorded; a PSX write landing on a
+ *	sector being copied makes it try again on the next call.
+ */
+void snapshot_step() {
+    if(!snapshot_due && mc.write_count - snapshot_write_count < SNAPSHOT_WRITES)
+        return;
+    if(take_snapshot(snapshot_due ? snapshot_reason : SN_WRITES) != SN_BUSY)
+        snapshot_due = false;
+}
+
+/* Write back all dirty sectors and commit the open image, used before leaving the current card */
+void sync_all() {
+    led_output_sync_status(true);
+    while(memory_card_has_pending(&mc) && sync_step() == MC_OK);
+    flush_step();
+    led_output_sync_status(false);
+}
+
+/* Publish "<image without extension>-<channel>" as the card name, e.g. "FF7/0-1" */
+void update_mc_name(const uint8_t* file_name, uint32_t channel) {
+    uint8_t* name = mc_names[!name_current];
+    const uint8_t* ext = strrchr(file_name, '.');
+    uint32_t len = ext ? (uint32_t) (ext - file_name) : strlen(file_name);
+    memcpy(name, file_name, len);
+    sprintf(&name[len], "-%u", (unsigned) channel + 1);
+    __dmb();
+    name_current = !name_current;
+}
+
+/* Import file_name, from the compressed image cache or the flash tier when possible, and queue its neighbours for prefetch */
+uint32_t load_mc(uint8_t* file_name) {
+    uint32_t status;
+    uint64_t start = time_us_64();
+    memory_card_withdraw(&mc);  // core1 keeps serving READs, not while mc.data is overwritten
+    if(memcard_cache_load(file_name, mc.data) || flash_tier_load(file_name, mc.data))
+        status = memory_card_import_cached(&mc, file_name);
+    else
+        status = memory_card_import_begin(&mc, file_name);    // rest of the image is streamed by the main loop
+    flash_journal_track(file_name, 0);
+    printf("Card %s usable after %u us\n", file_name, (unsigned) (time_us_64() - start));
+    update_mc_name(file_name, 0);
+    uint8_t prev_name[MAX_MC_FILENAME_LEN + 1];
+    uint8_t next_name[MAX_MC_FILENAME_LEN + 1];
+    if(memcard_manager_get_neighbours(file_name, prev_name, next_name) == MM_OK)
+        memcard_cache_set_prefetch(prev_name, next_name);
+    memcard_cache_stats_t stats;
+    memcard_cache_get_stats(&stats);
+    printf("Image cache: %u hits, %u misses, %u entries (%u bytes), last decompression %u us\n",
+        (unsigned) stats.hits, (unsigned) stats.misses, (unsigned) stats.entries,
+        (unsigned) stats.used_bytes, (unsigned) stats.last_decompress_us);
+    return status;
+}
 
-    printf("Initializing PIO...");
+/* Leave the current card for new_name, then let the PSX see a card change */
+void switch_mc(uint8_t* mc_file_name, const uint8_t* new_name) {
+    mutex_enter_blocking(&write_transaction);
+    /* ensure latest write operations have been synced */
+    sync_all();
+    if(memory_card_import_done(&mc)) {
+        take_snapshot(SN_SWITCH);
+        if(mc.channel == 0)
+            memcard_cache_store(mc_file_name, mc.data);   // keep the card being left for a quick return
+    }
+    switch_timing_phase(SWITCH_PHASE_SYNC);
+    strcpy(mc_file_name, new_name);
+    uint32_t status = load_mc(mc_file_name);
+    if(status != MC_OK)
+        led_blink_error(status);
+    schedule_snapshot(SN_SWITCH);
+    switch_timing_phase(SWITCH_PHASE_IMPORT);
+    msc_volume_changed();   // image list and last loaded index updated
+    simulate_mc_reconnect();
+    switch_timing_reconnected();
+    mutex_exit(&write_transaction);
+}
+
+/***
+ *	The USB host wrote to the SD card and went idle: what FatFs cached (FAT
+ *	window, open files) may predate its writes, so the volume is mounted again,
+ *	the image list rebuilt and the card being served merged with its SD copy.
+ *	If the host changed the card, the PSX sees it reinserted and reads it again.
+ */
+void take_back_volume() {
+    mutex_enter_blocking(&write_transaction);
+    sd_card_t *p_sd = sd_get_by_num(0);
+    uint32_t merged = 0;
+    memory_card_detach(&mc);
+    memcard_cache_init();   // compressed copies may be of images the host replaced
+    flash_tier_invalidate();
+    snapshot_invalidate();
+    transfer_invalidate();
+    uint32_t status = FR_OK == f_mount(&p_sd->fatfs, "", 1) ? MC_OK : MC_NO_INIT;
+    if(status == MC_OK) {
+        memcard_manager_rescan();
+        flash_tier_load_favourites();
+        status = memory_card_merge(&mc, mc_file_name, &merged);
+    }
+    if(status != MC_OK && memcard_manager_get(0, mc_file_name) == MM_OK) {
+        /* image deleted or truncated by the host, serve another one */
+        printf("Card image gone after USB writes, loading %s\n", mc_file_name);
+        status = load_mc(mc_file_name);
+        merged = MC_SEC_COUNT;
+    }
+    flash_journal_track(mc_file_name, mc.channel);   // merged sectors start over at generation 0
+    schedule_snapshot(SN_USB);
+    if(status != MC_OK)
+        led_blink_error(status);
+    else if(merged)
+        printf("USB host changed %u sectors of %s\n", (unsigned) merged, mc_file_name);
+    if(merged)
+        simulate_mc_reconnect();
+    msc_volume_changed();   // catalog rewritten
+    mutex_exit(&write_transaction);
+}
+
+/***
+ *	Put an image uploaded over the USB console in place of its target channel.
+ *	When that is the card served, the PSX keeps reading the old content while
+ *	the upload is copied over the file, then every sector is withdrawn at once
+ *	by importing the image again and the PSX sees the card reinserted, so it
+ *	never reads a mix of both. The state replaced is kept as a snapshot.
+ */
+static void hot_swap(const uint8_t* name, uint32_t channel) {
+    mutex_enter_blocking(&write_transaction);
+    bool served = !strcmp(name, mc_file_name);
+    uint32_t served_channel = mc.channel;
+    uint32_t status = MC_OK;
+    if(served) {
+        sync_all();
+        if(channel == served_channel && memory_card_import_done(&mc))
+            take_snapshot(SN_BEFORE_UPLOAD);
+        memory_card_close(&mc);
+    }
+    uint32_t swap_status = transfer_apply();
+    memcard_cache_invalidate(name);
+    flash_tier_changed(name);
+    if(served) {
+        status = memory_card_import_channel(&mc, mc_file_name, served_channel);
+        flash_journal_track(mc_file_name, mc.channel);
+        if(channel == served_channel)
+            schedule_snapshot(SN_UPLOADED);
+    }
+    transfer_stats_t stats;
+    transfer_get_stats(&stats);
+    if(swap_status != XFER_OK)
+        printf("Upload to %s channel %u not applied (%u)\n", name, (unsigned) channel + 1, (unsigned) swap_status);
+    else
+        printf("Upload to %s channel %u applied in %u us\n", name, (unsigned) channel + 1, (unsigned) stats.swap_us);
+    if(status != MC_OK)
+        led_blink_error(status);
+    msc_volume_changed();
+    if(served && channel == served_channel)
+        simulate_mc_reconnect();
+    mutex_exit(&write_transaction);
+}
+
+/* PIO, DMA and SEL interrupt, then core1: from here on the PSX sees a card */
+static void start_engine() {
     init_pio();
-    printf("  done\n");
+    init_dma();
 
     /* Setup SEL interrupt on GPIO */
     // gpio_set_irq_enabled_with_callback(PIN_SEL, GPIO_IRQ_EDGE_RISE, true, my_gpio_callback);  // decomposed into:
     gpio_set_irq_enabled(PIN_SEL, GPIO_IRQ_EDGE_RISE, true);
     irq_set_exclusive_handler(IO_IRQ_BANK0, sel_isr_callback); // instead of normal gpio_set_irq_callback() which has slower handling
+    irq_set_priority(IO_IRQ_BANK0, PICO_HIGHEST_IRQ_PRIORITY);  // ahead of USB, which stays active for the console
     irq_set_enabled(IO_IRQ_BANK0, true);
 
     /* Setup additional GPIO configuration options */
@@ -355,74 +852,477 @@ _Noreturn int simulate_memory_card() {
     gpio_set_drive_strength(PIN_DAT, GPIO_DRIVE_STRENGTH_12MA);
 
     /* SMs are automatically enabled on first SEL reset */
-
-	/* Launch memory card thread */
-    printf("Starting simulation core...");
 	multicore_launch_core1(simulation_thread);
-    printf("  done\n");
+}
 
-    /* Process sync/switch/creation requests */
-	while(true) {
-		if(!queue_is_empty(&mc_sector_sync_queue)) {
-			led_output_sync_status(true);
-            queue_sync_step(&mc_sector_sync_queue, mc_file_name);
-		} else {
-			led_output_sync_status(false);
+/* No image could be loaded, the PSX sees an empty slot rather than a card failing every READ */
+static void stop_engine() {
+    irq_set_enabled(IO_IRQ_BANK0, false);
+    multicore_reset_core1();
+    pio_set_sm_mask_enabled(pio0, 1 << smCmdReader | 1 << smDatReader | 1 << smDatWriter, false);
+    abort_read_dma();
+}
+
+/* Pick the image served at boot and start streaming it in, the caller owns write_transaction */
+static uint32_t load_initial_mc() {
+	uint32_t status = memcard_manager_get_initial(mc_file_name);	// get initial memory card to load
+	if(status != MM_OK) {
+		status = memcard_manager_get(0, mc_file_name);	// revert to first mem card if failing to load previously loaded card
+		if(status != MM_OK)
+			return status;
+	}
+	memcard_cache_init();
+	status = load_mc(mc_file_name);
+	if(status != MC_OK && memcard_manager_rescan() == MM_OK) {
+		/* catalog was stale and listed a deleted or truncated image, retry with a fresh index */
+		status = memcard_manager_get_initial(mc_file_name);
+		if(status != MM_OK)
+			status = memcard_manager_get(0, mc_file_name);
+		if(status == MM_OK)
+			status = load_mc(mc_file_name);
+	}
+	return status;
+}
+
+/***
+ *	Attach the file of the image served from flash since boot and take what
+ *	changed on SD meanwhile (e.g. edited on a PC), the caller owns write_transaction.
+ */
+static uint32_t attach_flash_mc() {
+	uint32_t merged;
+	uint32_t status = memory_card_merge(&mc, mc_file_name, &merged);
+	if(status != MC_OK)
+		return status;
+	uint8_t prev_name[MAX_MC_FILENAME_LEN + 1];
+	uint8_t next_name[MAX_MC_FILENAME_LEN + 1];
+	if(memcard_manager_get_neighbours(mc_file_name, prev_name, next_name) == MM_OK)
+		memcard_cache_set_prefetch(prev_name, next_name);
+	if(merged) {
+		printf("Card %s changed on SD since it was stored in flash, %u sectors\n", mc_file_name, (unsigned) merged);
+		flash_tier_changed(mc_file_name);
+		simulate_mc_reconnect();	// the PSX may have read the flash version already
+	}
+	return MC_OK;
+}
+
+/***
+ *	Writes made before power was lost that never reached the SD card are in the
+ *	flash journal: load the card they belong to and write them back, then let
+ *	the PSX read the card again. The caller owns write_transaction.
+ */
+static uint32_t replay_journal() {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t channel;
+	uint32_t replayed = 0;
+	uint32_t status = MC_OK;
+	if(!flash_journal_pending_image(name, &channel))
+		return MC_OK;
+	if(strcmp(name, mc_file_name)) {
+		strcpy(mc_file_name, name);
+		status = load_mc(mc_file_name);
+	}
+	while(status == MC_OK && !memory_card_import_done(&mc))
+		status = memory_card_import_step(&mc);
+	if(status == MC_OK && channel != mc.channel) {
+		status = memory_card_switch_channel(&mc, channel);
+		update_mc_name(mc_file_name, mc.channel);
+	}
+	if(status == MC_OK)
+		status = flash_journal_replay(&mc, mc_file_name, &replayed);
+	if(status == MC_OK)
+		status = memory_card_flush(&mc);
+	if(status != MC_OK)
+		return status;
+	flash_journal_checkpoint();
+	if(replayed) {
+		printf("Flash journal: %u sectors of %s restored\n", (unsigned) replayed, mc_file_name);
+		flash_tier_changed(mc_file_name);
+		simulate_mc_reconnect();
+	}
+	return MC_OK;
+}
+
+/***
+ *	Start serving the PSX, then mount the SD card and load the initial image.
+ *	The BIOS probes the slot right after power up, so the card answers before
+ *	anything is read from SD: the last image served is restored from the flash
+ *	tier when it holds one, otherwise READs are refused until their sector has
+ *	been streamed in, which the PSX retries. Everything else (SD clock
+ *	calibration, USB, LED) comes after. Writes the flash journal holds are
+ *	replayed once the image is loaded. Returns the reason when no image could
+ *	be served, the engine is then stopped and USB keeps the SD card available
+ *	so that it can be fixed from a PC.
+ */
+uint32_t simulate_memory_card_init() {
+	mutex_init(&write_transaction);
+    uint32_t status = memory_card_init(&mc);	// nothing resident yet
+	if(status != MC_OK)
+		return status;
+    uint32_t trace_cost = trace_measure_push();	// before core1 pushes to the ring
+	flash_tier_init();
+	flash_journal_init();
+	snapshot_init();
+	transfer_init();
+	bool from_flash = flash_tier_load_last(mc_file_name, mc.data);
+	if(from_flash) {
+		memory_card_import_ram(&mc);	// every sector resident before the first SEL
+		update_mc_name(mc_file_name, 0);
+	}
+    start_engine();
+	uint64_t boot_engine = time_us_64();
+
+	/* Mount and test SD card filesystem */
+	mutex_enter_blocking(&write_transaction);
+	sd_card_t *p_sd = sd_get_by_num(0);
+	if(FR_OK != f_mount(&p_sd->fatfs, "", 1))
+		status = MC_NO_INIT;
+	uint64_t boot_mount = time_us_64();
+	if(status == MC_OK) {
+		memcard_manager_init();	// index from the catalog, switching then never scans the directory
+		flash_tier_load_favourites();
+	}
+	uint64_t boot_index = time_us_64();
+	if(status == MC_OK && from_flash && attach_flash_mc() != MC_OK) {
+		printf("Card %s from flash not found on SD\n", mc_file_name);
+		from_flash = false;
+	}
+	if(status == MC_OK && !from_flash)
+		status = load_initial_mc();
+	if(status == MC_OK && replay_journal() != MC_OK) {
+		printf("Flash journal could not be replayed into %s\n", mc_file_name);
+		status = load_initial_mc();
+	}
+	if(status == MC_OK) {
+		flash_journal_track(mc_file_name, mc.channel);
+		schedule_snapshot(SN_BOOT);
+	}
+	mutex_exit(&write_transaction);
+	if(status != MC_OK) {
+		stop_engine();
+		return status;
+	}
+	uint64_t boot_image = time_us_64();
+
+	/* the PSX is served from here on, nothing below delays it */
+	sd_clock_calibrate(p_sd);	// card starts at BAUD_RATE, faster clocks are used only once proven clean
+    sd_clock_stats_t clock;
+    sd_clock_get_stats(&clock);
+    printf("SD clock: %u kHz, calibrated in %u us (%u CRC errors)\n",
+        (unsigned) (clock.baud_rate / 1000), (unsigned) clock.calibrate_us, (unsigned) clock.crc_errors);
+    printf("Protocol trace: %u ns per transaction when enabled\n", (unsigned) trace_cost);
+    printf("Boot: card answering %u us after power on%s, mount %u us, image index %u us (%u images), %s %u us\n",
+        (unsigned) boot_engine, from_flash ? " from flash" : "", (unsigned) (boot_mount - boot_engine),
+        (unsigned) (boot_index - boot_mount), (unsigned) memcard_manager_count(),
+        from_flash ? "merge with SD" : "block 0 of the first image", (unsigned) (boot_image - boot_index));
+    simulation_running = true;
+    return MC_OK;
+}
+
+/* The channel requested is past the end of the image, which grows by a blank channel */
+static bool channel_grows() {
+    return request_next_chan && !request_prev_chan && mc.channel + 1 >= mc.channel_count && mc.channel + 1 < MC_MAX_CHANNELS;
+}
+
+/* Serve the card of game_id, switch timing was started by the caller. A card to be created waits while the volume is shared */
+static void switch_to_game(const uint8_t* game_id) {
+    uint8_t new_name[MAX_MC_FILENAME_LEN + 1];
+    uint32_t status = memcard_manager_get_game(game_id, new_name);
+    switch_timing_phase(SWITCH_PHASE_LOOKUP);
+    if(status == MM_BUSY) {
+        printf("Game ID: %s, card created once the USB drive is ejected\n", game_id);
+        strcpy(deferred_game_id, game_id);
+        game_deferred = true;
+        switch_timing_active = false;
+    } else if(status != MM_OK) {
+        printf("Game ID: %s, no card (%u)\n", game_id, (unsigned) status);
+        led_blink_error(status);
+        switch_timing_active = false;
+    } else {
+        printf("Game ID: %s -> %s\n", game_id, new_name);
+        if(strcmp(new_name, mc_file_name))
+            switch_mc(mc_file_name, new_name);
+        else
+            switch_timing_active = false;   // already on its card, nothing to time
+    }
+}
+
+/***
+ *	Process sync/switch/creation requests, one step per call so that the caller
+ *	can keep servicing USB in between.
+ */
+void simulate_memory_card_task() {
+	uint32_t status;
+	uint8_t swap_name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t swap_channel;
+	uint64_t now = time_us_64();
+	switch_timing_poll();
+	if(first_ack_time && !first_ack_reported) {
+		first_ack_reported = true;
+		printf("Boot: first ACK %u us after power on\n", (unsigned) first_ack_time);
+	}
+	/* the USB host owns the volume while it writes, FatFs state is stale until it is mounted again */
+	if(msc_host_busy())
+		return;
+	if(msc_host_mounted() != volume_shared) {
+		/* what allocates clusters waits until the host ejects or unmounts the volume */
+		volume_shared = !volume_shared;
+		memcard_manager_hold_writes(volume_shared);
+		if(!volume_shared)
+			printf("USB drive ejected, queued SD card changes go ahead\n");
+	}
+	if(msc_take_host_writes()) {
+		take_back_volume();
+		return;
+	}
+	/* writes reach the flash journal first, the SD card can then wait for more of them */
+	journal_step(now);
+	if(!memory_card_import_done(&mc)) {
+		/* finish loading the current image before anything else */
+		status = memory_card_import_step(&mc);
+		if(status != MC_OK)
+			report_sd_error(status);
+		return;
+	}
+	if(mc.write_count != last_write_count) {
+		last_write_count = mc.write_count;
+		last_write_time = now;
+	}
+	if(memory_card_has_pending(&mc)) {
+		bool journaled = flash_journal_covers(&mc);
+		led_output_sync_status(!journaled);	// a power loss no longer loses journaled writes
+		if(!pending_since)
+			pending_since = now;
+		/* let rewrites of the same sectors coalesce while the PSX is still writing, longer once they are safe in flash */
+		uint32_t coalesce_time = journaled ? JOURNAL_COALESCE_TIME : SYNC_COALESCE_TIME;
+		uint32_t max_delay = journaled ? JOURNAL_MAX_DELAY : SYNC_MAX_DELAY;
+		if(now - last_write_time > coalesce_time * 1000 || now - pending_since > max_delay * 1000) {
+			sync_step();
+			last_sync_time = now;
+			pending_since = 0;
+		}
+	} else if(memory_card_is_dirty(&mc)) {
+		/* commit once the PSX stopped writing, so one save costs a single flush */
+		if(time_us_64() - last_sync_time > IDLE_AUTOSYNC_TIMEOUT * 1000) {
+			flush_step();
+		}
+	} else {
+		led_output_sync_status(false);
+		/* nothing to write back, verify the SD copy a block at a time */
+		if(now - last_scrub_time > SCRUB_INTERVAL * 1000) {
+			scrub_step();
+			last_scrub_time = now;
 		}
-		if(request_next_mc || request_prev_mc) {
-			if(request_next_mc && request_prev_mc) {
-				/* requested change in both directions, do nothing */
+		/* load neighbouring images into the cache, ahead of a switch */
+		if(now - last_prefetch_time > MC_CACHE_PREFETCH_INTERVAL * 1000) {
+			memcard_cache_prefetch_step();
+			last_prefetch_time = now;
+		}
+		/* keep the flash tier in step with the card served and the favourites */
+		if(now - last_flash_time > FLASH_TIER_INTERVAL * 1000) {
+			flash_step(now);
+			last_flash_time = now;
+		}
+		/* rollback points of the card served */
+		snapshot_step();
+		/* check the catalog used at boot against the directory */
+		memcard_manager_verify_step();
+		/* console queries: 's' prints card switch latencies, 'r' clears them, 't' toggles the protocol trace */
+		int query = getchar_timeout_us(0);
+		if(query == 's')
+			switch_stats_print();
+		else if(query == 'r')
+			switch_stats_reset();
+		else if(query == 't')
+			trace_set_output(trace_get_output() == TRACE_UART ? TRACE_OFF : TRACE_UART);
+	}
+	if(trace_get_output() == TRACE_UART) {
+		/* a few records per pass, so that printing never holds back syncing */
+		trace_record_t records[4];
+		uint32_t count = trace_pop(records, 4);
+		for(uint32_t i = 0; i < count; i++)
+			trace_print(&records[i]);
+	}
+	if(request_next_mc || request_prev_mc) {
+		if(request_next_mc && request_prev_mc) {
+			/* requested change in both directions, do nothing */
+			request_next_mc = false;
+			request_prev_mc = false;
+		} else {
+			uint8_t new_file_name[MAX_MC_FILENAME_LEN + 1];
+			switch_timing_begin();
+			if(request_next_mc)
+				status = memcard_manager_get_next(mc_file_name, new_file_name);
+			else if (request_prev_mc)
+				status = memcard_manager_get_prev(mc_file_name, new_file_name);
+			if(status != MM_OK) {
+				led_output_end_mc_list();
+				switch_timing_active = false;
 				request_next_mc = false;
 				request_prev_mc = false;
 			} else {
-				uint8_t new_file_name[MAX_MC_FILENAME_LEN + 1];
-				if(request_next_mc)
-					status = memcard_manager_get_next(mc_file_name, new_file_name);
-				else if (request_prev_mc)
-					status = memcard_manager_get_prev(mc_file_name, new_file_name);
-				if(status != MM_OK) {
-					led_output_end_mc_list();
-					request_next_mc = false;
-					request_prev_mc = false;
-				} else {
-                    mutex_enter_blocking(&write_transaction);
-                    /* ensure latest write operations have been synced */
-                    led_output_sync_status(true);
-                    while(!queue_is_empty(&mc_sector_sync_queue))
-                        queue_sync_step(&mc_sector_sync_queue, mc_file_name);
-                    led_output_sync_status(false);
-                    /* switch mc */
-                    strcpy(mc_file_name, new_file_name);
-                    status = memory_card_import(&mc, mc_file_name);
-                    if(status != MC_OK)
-                        led_blink_error(status);
-                    simulate_mc_reconnect();
-                    request_next_mc = false;
-                    request_prev_mc = false;
-                    mutex_exit(&write_transaction);
-				}
+                switch_timing_phase(SWITCH_PHASE_LOOKUP);
+                switch_mc(mc_file_name, new_file_name);
+                request_next_mc = false;
+                request_prev_mc = false;
 			}
-		} else if(request_new_mc) {
-				mutex_enter_blocking(&write_transaction);
-                /* ensure latest write operations have been synced */
-                led_output_sync_status(true);
-                while(!queue_is_empty(&mc_sector_sync_queue))
-                    queue_sync_step(&mc_sector_sync_queue, mc_file_name);
-                led_output_sync_status(false);
-                /* create new mc */
-                uint8_t new_name[MAX_MC_FILENAME_LEN + 1];
-                status = memcard_manager_create(new_name);
-                if(status == MM_OK) {
-                    led_output_new_mc();
-                    strcpy(mc_file_name, new_name);
-                    status = memory_card_import(&mc, mc_file_name);	// switch to newly created mc image
-                    if(status != MC_OK)
-                        led_blink_error(status);
-                } else
-                    led_blink_error(status);
-                simulate_mc_reconnect();
-                request_new_mc = false;
-                mutex_exit(&write_transaction);
 		}
+	} else if(request_new_mc && !volume_shared) {
+			mutex_enter_blocking(&write_transaction);
+            switch_timing_begin();
+            /* ensure latest write operations have been synced */
+            sync_all();
+            switch_timing_phase(SWITCH_PHASE_SYNC);
+            /* create new mc */
+            uint8_t new_name[MAX_MC_FILENAME_LEN + 1];
+            status = memcard_manager_create(new_name);
+            switch_timing_phase(SWITCH_PHASE_LOOKUP);
+            if(status == MM_OK) {
+                led_output_new_mc();
+                if(memory_card_import_done(&mc)) {
+                    take_snapshot(SN_SWITCH);
+                    if(mc.channel == 0)
+                        memcard_cache_store(mc_file_name, mc.data);   // keep the card being left for a quick return
+                }
+                strcpy(mc_file_name, new_name);
+                status = load_mc(mc_file_name);	// switch to newly created mc image
+                if(status != MC_OK)
+                    led_blink_error(status);
+                schedule_snapshot(SN_SWITCH);
+            } else
+                led_blink_error(status);
+            switch_timing_phase(SWITCH_PHASE_IMPORT);
+            msc_volume_changed();
+            simulate_mc_reconnect();
+            switch_timing_reconnected();
+            request_new_mc = false;
+            mutex_exit(&write_transaction);
+	} else if((request_next_chan || request_prev_chan) && !(volume_shared && channel_grows())) {
+        int32_t channel = mc.channel + (request_next_chan ? 1 : -1);
+        if((request_next_chan && request_prev_chan) || channel < 0 || channel >= MC_MAX_CHANNELS) {
+            led_output_end_mc_list();
+        } else {
+            /* channels are slots of the open image, switching is a seek instead of a lookup */
+            mutex_enter_blocking(&write_transaction);
+            switch_timing_begin();
+            sync_all();
+            if(memory_card_import_done(&mc)) {
+                take_snapshot(SN_SWITCH);
+                if(mc.channel == 0)
+                    memcard_cache_store(mc_file_name, mc.data);
+            }
+            switch_timing_phase(SWITCH_PHASE_SYNC);
+            status = memory_card_switch_channel(&mc, channel);
+            if(status != MC_OK)
+                led_blink_error(status);
+            update_mc_name(mc_file_name, mc.channel);
+            flash_journal_track(mc_file_name, mc.channel);
+            schedule_snapshot(SN_SWITCH);
+            printf("Card %s channel %u\n", mc_file_name, (unsigned) mc.channel + 1);
+            switch_timing_phase(SWITCH_PHASE_IMPORT);
+            msc_volume_changed();   // a new channel grows the image
+            simulate_mc_reconnect();
+            switch_timing_reconnected();
+            mutex_exit(&write_transaction);
+        }
+        request_next_chan = false;
+        request_prev_chan = false;
+	} else if(request_game_mc) {
+        /* game started, swap in its card without waiting for a combo */
+        uint8_t game_id[MAX_GAME_ID_LEN + 1];
+        switch_timing_begin();
+        strcpy(game_id, requested_game_id);
+        __dmb();
+        request_game_mc = false;    // core1 may now write the next one
+        game_deferred = false;      // superseded
+        switch_to_game(game_id);
+	} else if(game_deferred && !volume_shared) {
+        game_deferred = false;
+        switch_timing_begin();
+        switch_to_game(deferred_game_id);
+	} else if(!volume_shared && transfer_swap_pending(swap_name, &swap_channel)) {
+        /* the state replaced is kept as a snapshot first */
+        hot_swap(swap_name, swap_channel);
+	} else if(request_restore && !volume_shared) {
+        /* the state being replaced is recorded first, so that the restore can be undone */
+        uint32_t restored = 0;
+        mutex_enter_blocking(&write_transaction);
+        sync_all();
+        status = take_snapshot(SN_BEFORE_RESTORE);
+        if(status == SN_OK || status == SN_FULL)
+            status = snapshot_restore(&mc, mc_file_name, requested_snapshot, &restored);
+        if(restored)
+            flush_step();   // also after an error, for the sectors restored before it
+        if(status == SN_OK) {
+            take_snapshot(SN_RESTORED);
+            printf("Card %s back to snapshot %u, %u sectors restored\n", mc_file_name,
+                (unsigned) requested_snapshot, (unsigned) restored);
+        } else {
+            printf("Snapshot %u of %s not restored (%u)\n", (unsigned) requested_snapshot, mc_file_name, (unsigned) status);
+        }
+        if(restored)
+            simulate_mc_reconnect();
+        request_restore = false;
+        mutex_exit(&write_transaction);
 	}
-}
\ No newline at end of file
+}
+
+bool memcard_simulator_running() {
+    return simulation_running;
+}
+
+void memcard_simulator_get_telemetry(memcard_telemetry_t* telemetry) {
+    memory_card_stats_t stats;
+    memory_card_get_stats(&mc, &stats);
+    telemetry->reads = read_transactions;
+    telemetry->writes = write_transactions;
+    telemetry->ids = id_transactions;
+    telemetry->bad_checksums = bad_checksum_writes;
+    telemetry->pending = stats.pending;
+    telemetry->max_pending = stats.max_pending;
+    telemetry->sector_syncs = stats.sector_syncs;
+    telemetry->sd_write_last_us = sd_write_last_us;
+    telemetry->sd_write_max_us = sd_write_max_us;
+    telemetry->channel = mc.channel;
+    telemetry->first_ack_us = first_ack_time;
+}
+
+/* Snapshots of the card being served, SN_BUSY while the USB host owns the volume */
+uint32_t memcard_simulator_list_snapshots(uint32_t first, snapshot_info_t* out, uint32_t max, uint32_t* count, uint32_t* total) {
+    *count = *total = 0;
+    if(!simulation_running || msc_host_busy())
+        return SN_BUSY;
+    return snapshot_list(mc_file_name, mc.channel, first, out, max, count, total);
+}
+
+/* Ask core0 to bring the card being served back to a snapshot, done by the next simulate_memory_card_task() */
+void memcard_simulator_restore_snapshot(uint32_t index) {
+    requested_snapshot = index;
+    request_restore = true;
+}
+
+/* Start sending the card served from RAM (name empty) or a stored image over the USB console */
+uint32_t memcard_simulator_download(const uint8_t* name, uint32_t channel, uint32_t first) {
+    if(!simulation_running)
+        return XFER_BUSY;
+    if(!name[0])
+        return transfer_download(&mc, NULL, mc.channel, first);   // RAM copy, the SD card is not needed
+    if(msc_host_busy())
+        return XFER_BUSY;
+    return transfer_download(&mc, name, channel, first);
+}
+
+/* Start or resume an upload to a stored image, or to the card served when name is empty */
+uint32_t memcard_simulator_upload(const uint8_t* name, uint32_t channel, uint32_t* received, uint32_t* first_missing) {
+    if(!simulation_running || msc_host_busy() || volume_shared)
+        return XFER_BUSY;   // the shadow file is allocated, wait for the USB drive to be ejected
+    if(!name[0]) {
+        name = mc_file_name;
+        channel = mc.channel;
+    }
+    return transfer_upload(name, channel, received, first_missing);
+}
+
+/* Name of the card being served, "<image without extension>-<channel>" */
+const uint8_t* memcard_simulator_get_name() {
+    return mc_names[name_current];
+}
@@ -1,48 +1,312 @@
 #include "memory_card.h"
 #include <stdlib.h>
+#include <string.h>
 #include "config.h"
 #include "ff.h"
 #include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "crc32.h"
+
+static uint8_t scrub_buffer[BLOCK_SIZE];
+
+/* position of a byte of the channel being served within the image file */
+#define FILE_OFFSET(mc, offset)	((FSIZE_t) (mc)->channel * MC_SIZE + (offset))
 
 uint32_t memory_card_init(memory_card_t* mc) {
 	if(!mc)
 		return MC_NO_INIT;
 	mc->flag_byte = MC_FLAG_BYTE_DEF;
+	mc->file_open = false;
+	mc->file_dirty = false;
+	mc->channel = 0;
+	mc->channel_count = 0;
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		mc->dirty_set[i] = mc->dirty_ack[i] = mc->sync_failed[i] = 0;
+	mc->write_count = mc->sync_count = mc->block_count = mc->max_pending = 0;
+	mc->skip_count = mc->scrub_block = mc->scrub_count = mc->scrub_errors = 0;
+	mc->merge_count = mc->merge_conflicts = 0;
+	mc->import_count = 0;
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		mc->changed[i] = mc->buffered[i] = 0;
+	mc->write_sector = -1;
+	mc->priority_sector = -1;
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		mc->resident[i] = 0;
 	mc->data = (uint8_t*) malloc(sizeof(uint8_t) * MC_SIZE);
-	if(!mc->data)
+	mc->meta = (sector_meta_t*) calloc(MC_SEC_COUNT, sizeof(sector_meta_t));
+	if(!mc->data || !mc->meta)
 		return MC_NO_INIT;	// malloc failed
 	return MC_OK;
 }
 
-uint32_t memory_card_import(memory_card_t* mc, uint8_t* file_name) {
+/* RAM and SD hold the same data right after loading, compute checksums and CRCs once */
+static void rebuild_meta(memory_card_t* mc, sector_t first, uint32_t count, bool crc_valid) {
+	for(sector_t sector = first; sector < first + count; sector++) {
+		uint8_t* sec_ptr = &mc->data[sector * MC_SEC_SIZE];
+		uint8_t checksum = 0;
+		for(uint32_t i = 0; i < MC_SEC_SIZE; i++)
+			checksum ^= sec_ptr[i];
+		mc->meta[sector].checksum = checksum;
+		mc->meta[sector].crc = crc32(sec_ptr, MC_SEC_SIZE);
+		mc->meta[sector].generation = mc->meta[sector].sync_generation = 0;
+		mc->meta[sector].crc_valid = crc_valid;
+	}
+}
+
+/***
+ *	Forget the sectors being served: every sector becomes non resident, so the
+ *	PSX is never served a mix of the old and new image, and pending writes of
+ *	the old one are dropped (callers sync first).
+ */
+static void reset_image(memory_card_t* mc) {
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		mc->resident[i] = 0;
+	mc->priority_sector = -1;
+	__dmb();
+	for(sector_t sector = 0; sector < MC_SEC_COUNT; sector++)
+		mc->meta[sector].crc_valid = false;	// describes the previous image until loaded
+	mc->flag_byte = MC_FLAG_BYTE_DEF;
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++) {
+		mc->dirty_ack[i] = mc->dirty_set[i];	// nothing of the new image needs syncing
+		mc->sync_failed[i] = 0;
+		mc->changed[i] = 0;
+	}
+	mc->import_count++;
+}
+
+/***
+ *	Flush and close the current image, then open file_name read/write in its
+ *	place, serving its first channel.
+ */
+static uint32_t reopen_image(memory_card_t* mc, uint8_t* file_name) {
+	reset_image(mc);
+	memory_card_close(mc);
+	mc->channel = 0;
+	mc->channel_count = 0;
+	if(FR_OK != f_open(&mc->file, file_name, FA_READ | FA_WRITE))
+		return MC_FILE_OPEN_ERR;
+	mc->file_open = true;
+	if(!MC_IS_IMAGE_SIZE(f_size(&mc->file)))
+		return MC_FILE_SIZE_ERR;
+	mc->channel_count = f_size(&mc->file) / MC_SIZE;
+	return MC_OK;
+}
+
+/* Read the 32 sectors tracked by one resident word and publish them */
+static uint32_t load_word(memory_card_t* mc, uint32_t word) {
 	uint32_t status = MC_OK;
-	FIL memcard;
-
-	if(mc) {
-		mc->flag_byte = MC_FLAG_BYTE_DEF;
-		if(FR_OK == f_open(&memcard, file_name, FA_READ)) {
-			UINT bytes_read;
-			if(FR_OK == f_read(&memcard, mc->data, MC_SIZE, &bytes_read)) {
-				if(MC_SIZE != bytes_read) {
-					status = MC_FILE_READ_ERR;
-				}
-			} else {
-				status = MC_FILE_SIZE_ERR;
-			}
-			f_close(&memcard);
-		} else {
-			status = MC_FILE_OPEN_ERR;
+	UINT bytes_read;
+	sector_t first = word * 32;
+	if(FR_OK != f_lseek(&mc->file, FILE_OFFSET(mc, first * MC_SEC_SIZE)) ||
+		FR_OK != f_read(&mc->file, &mc->data[first * MC_SEC_SIZE], 32 * MC_SEC_SIZE, &bytes_read))
+		return MC_FILE_SIZE_ERR;
+	if(32 * MC_SEC_SIZE != bytes_read)
+		status = MC_FILE_READ_ERR;
+	rebuild_meta(mc, first, 32, status == MC_OK);
+	__dmb();	// data and metadata visible before the sectors are
+	mc->resident[word] = 0xFFFFFFFF;
+	return status;
+}
+
+/***
+ *	Start loading a memory card image: block 0 (header and directory frames) is
+ *	read right away, the other blocks are left to memory_card_import_step(). The
+ *	card is reported disconnected until memory_card_import_done(), a sector found
+ *	not resident later on is refused and loaded next (memory_card_request_sector()).
+ *	The image file stays open (read/write) so that later syncs only need to seek
+ *	and write, the previously imported image is flushed and closed first.
+ */
+uint32_t memory_card_import_begin(memory_card_t* mc, uint8_t* file_name) {
+	return memory_card_import_channel(mc, file_name, 0);
+}
+
+/***
+ *	memory_card_import_begin() serving another channel of the image right
+ *	away, the PSX is never served a sector of the first one meanwhile.
+ */
+uint32_t memory_card_import_channel(memory_card_t* mc, uint8_t* file_name, uint32_t channel) {
+	if(!mc)
+		return MC_NO_INIT;
+	uint32_t status = reopen_image(mc, file_name);
+	if(status != MC_OK)
+		return status;
+	if(channel >= mc->channel_count)
+		return MC_FILE_SIZE_ERR;
+	mc->channel = channel;
+	for(uint32_t word = 0; word < (64 / 32) && status == MC_OK; word++)	// block 0 is 64 sectors
+		status = load_word(mc, word);
+	return status;
+}
+
+/* Load the next 32 non resident sectors, those asked for by the PSX first */
+uint32_t memory_card_import_step(memory_card_t* mc) {
+	if(!mc || !mc->file_open)
+		return MC_NO_INIT;
+	int32_t priority = mc->priority_sector;
+	if(priority >= 0) {
+		mc->priority_sector = -1;	// a request racing with this store is only served in order
+		if(!mc->resident[priority / 32])
+			return load_word(mc, priority / 32);
+	}
+	for(uint32_t word = 0; word < MC_DIRTY_WORDS; word++)
+		if(!mc->resident[word])
+			return load_word(mc, word);
+	return MC_OK;
+}
+
+bool memory_card_import_done(memory_card_t* mc) {
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		if(mc->resident[i] != 0xFFFFFFFF)
+			return false;
+	return true;
+}
+
+/***
+ *	Serve another channel of the open image, streamed in like a new image. A
+ *	channel past the end of the file is first added as a freshly formatted card.
+ *	Pending writes must have been synced.
+ */
+uint32_t memory_card_switch_channel(memory_card_t* mc, uint32_t channel) {
+	if(!mc || !mc->file_open)
+		return MC_NO_INIT;
+	if(channel >= MC_MAX_CHANNELS)
+		return MC_FILE_SIZE_ERR;
+	uint32_t status = memory_card_flush(mc);
+	if(status != MC_OK)
+		return status;
+	reset_image(mc);
+	if(channel >= mc->channel_count) {
+		if(FR_OK != f_lseek(&mc->file, (FSIZE_t) mc->channel_count * MC_SIZE))
+			return MC_FILE_WRITE_ERR;
+		mc->file_dirty = true;
+		while(mc->channel_count <= channel) {
+			status = memory_card_write_blank(&mc->file);
+			if(status != MC_OK)
+				return status;
+			mc->channel_count++;
 		}
+		status = memory_card_flush(mc);
+		if(status != MC_OK)
+			return status;
+	}
+	mc->channel = channel;
+	for(uint32_t word = 0; word < (64 / 32) && status == MC_OK; word++)	// block 0 is 64 sectors
+		status = load_word(mc, word);
+	return status;
+}
+
+/* Content of a sector of a freshly formatted memory card */
+void memory_card_blank_sector(sector_t sector, uint8_t* buffer) {
+	memset(buffer, 0, MC_SEC_SIZE);
+	if(sector == 0 || sector == MC_TEST_SEC) {
+		/* header frame (block 0, sec 0) and test write sector (block 0, sec 63) */
+		buffer[0] = 'M';
+		buffer[1] = 'C';
+	} else if(sector <= 15) {
+		/* directory frames (block 0, sec 1..15) */
+		buffer[0] = 0xa0;	// free block
+		buffer[8] = buffer[9] = 0xff;	// no next block
+	} else if(sector <= 35) {
+		/* broken sector list (block 0, sec 16..35) */
+		buffer[0] = buffer[1] = buffer[2] = buffer[3] = 0xff;	// no broken sector
+		buffer[8] = buffer[9] = 0xff;	// 1 fill
 	} else {
-		status = MC_NO_INIT;
+		return;	// replacement data, unused frames and data blocks are all zeros
 	}
+	uint8_t xor = 0;
+	for(int i = 0; i < MC_SEC_SIZE - 1; i++)
+		xor ^= buffer[i];
+	buffer[MC_SEC_SIZE - 1] = xor;
+}
 
+/* Write a freshly formatted memory card (MC_SIZE bytes) at the current position of file */
+uint32_t memory_card_write_blank(FIL* file) {
+	uint8_t buffer[BLOCK_SIZE];
+	UINT bytes_written;
+	for(uint32_t block = 0; block < MC_BLOCK_COUNT; block++) {
+		for(uint32_t i = 0; i < MC_SEC_PER_BLOCK; i++)
+			memory_card_blank_sector(block * MC_SEC_PER_BLOCK + i, &buffer[i * MC_SEC_SIZE]);
+		if(FR_OK != f_write(file, buffer, BLOCK_SIZE, &bytes_written) || bytes_written != BLOCK_SIZE)
+			return MC_FILE_WRITE_ERR;
+	}
+	return MC_OK;
+}
+
+/***
+ *	Load memory card image into RAM, waiting for every sector to be resident.
+ */
+uint32_t memory_card_import(memory_card_t* mc, uint8_t* file_name) {
+	uint32_t status = memory_card_import_begin(mc, file_name);
+	while(status == MC_OK && !memory_card_import_done(mc))
+		status = memory_card_import_step(mc);
 	return status;
 }
 
+/***
+ *	Same as memory_card_import() for an image whose content has already been
+ *	restored into mc->data (e.g. from memcard_cache) after memory_card_withdraw():
+ *	only the file is opened, no data is read from the SD card.
+ */
+uint32_t memory_card_import_cached(memory_card_t* mc, uint8_t* file_name) {
+	if(!mc)
+		return MC_NO_INIT;
+	uint32_t status = reopen_image(mc, file_name);
+	if(status != MC_OK)
+		return status;
+	rebuild_meta(mc, 0, MC_SEC_COUNT, true);
+	__dmb();
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		mc->resident[i] = 0xFFFFFFFF;
+	return MC_OK;
+}
+
+/***
+ *	Stop serving the current image before core0 restores another one into
+ *	mc->data (memory_card_import_cached()): READs are refused until the import
+ *	publishes the new sectors, so the PSX never reads a half restored card or
+ *	new data with the old checksums. Pending writes are dropped, callers sync first.
+ */
+void memory_card_withdraw(memory_card_t* mc) {
+	if(mc)
+		reset_image(mc);
+}
+
+/***
+ *	Serve an image already restored into mc->data (e.g. from the flash tier at
+ *	boot) before its file can be opened: every sector is published with the
+ *	restored content as the SD base. Nothing can be synced until the file is
+ *	attached by memory_card_merge(), which also takes what changed on SD since.
+ */
+uint32_t memory_card_import_ram(memory_card_t* mc) {
+	if(!mc)
+		return MC_NO_INIT;
+	reset_image(mc);
+	memory_card_close(mc);
+	mc->channel = 0;
+	mc->channel_count = 0;
+	rebuild_meta(mc, 0, MC_SEC_COUNT, true);
+	__dmb();
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		mc->resident[i] = 0xFFFFFFFF;
+	return MC_OK;
+}
+
+/***
+ *	Called by core1 before serving a sector: returns false if the sector is not
+ *	loaded yet, in which case core0 loads it next and the PSX has to retry.
+ */
+bool memory_card_request_sector(memory_card_t* mc, sector_t sector) {
+	if(mc->resident[sector / 32] & (1u << (sector % 32))) {
+		__dmb();	// resident mark seen before the data
+		return true;
+	}
+	mc->priority_sector = sector;
+	return false;
+}
+
 bool memory_card_is_sector_valid(memory_card_t* mc, sector_t sector) {
 	(void) mc;
-	if(sector < 0 || sector >= MC_SEC_COUNT)
+	if(sector >= MC_SEC_COUNT)
 		return false;
 	return true;
 }
@@ -58,33 +322,481 @@ void memory_card_reset_seen_flag(memory_card_t* mc) {
 		mc->flag_byte &= ~(1 << 3);
 }
 
+/* XOR checksum of the sector data, READ only adds the address bytes to it */
+uint8_t memory_card_get_sector_checksum(memory_card_t* mc, sector_t sector) {
+	return mc->meta[sector].checksum;
+}
+
+/***
+ *	Called by core1 around the update of a sector, generation is odd in between.
+ *	begin_write() also steps over a generation left odd by an interrupted write.
+ */
+void memory_card_begin_write(memory_card_t* mc, sector_t sector) {
+	mc->write_sector = sector;
+	mc->meta[sector].generation = (mc->meta[sector].generation + 1) | 1;
+	__dmb();	// generation visible before the data changes
+}
+
+void memory_card_end_write(memory_card_t* mc, sector_t sector, uint8_t checksum) {
+	mc->meta[sector].checksum = checksum;
+	__dmb();	// data and checksum visible before the generation
+	mc->meta[sector].generation++;
+	mc->write_sector = -1;
+}
+
+/***
+ *	Called by core1 when it restarts. A WRITE cut short by SEL going high left
+ *	part of its sector in RAM: that is what READ serves from now on, so its
+ *	checksum is recomputed and the sector synced like a complete write.
+ */
+void memory_card_recover_write(memory_card_t* mc) {
+	int32_t sector = mc->write_sector;
+	if(sector < 0)
+		return;
+	uint8_t* sec_ptr = &mc->data[sector * MC_SEC_SIZE];
+	uint8_t checksum = 0;
+	for(uint32_t i = 0; i < MC_SEC_SIZE; i++)
+		checksum ^= sec_ptr[i];
+	memory_card_end_write(mc, sector, checksum);
+	if(sector != MC_TEST_SEC)
+		memory_card_mark_dirty(mc, sector);
+}
+
+/***
+ *	Called by core1 once a sector has been written into the in-RAM copy.
+ *	The sector becomes dirty by making its dirty_set bit differ from dirty_ack,
+ *	marking it again before core0 syncs it has no effect, so rewrites coalesce.
+ *	Data must be written before the mark: core0 acknowledges the mark first
+ *	and reads the data afterwards, any write it misses re-marks the sector.
+ */
+void memory_card_mark_dirty(memory_card_t* mc, sector_t sector) {
+	uint32_t word = sector / 32;
+	uint32_t mask = 1u << (sector % 32);
+	__dmb();	// sector data visible before the mark
+	mc->dirty_set[word] = (mc->dirty_set[word] & ~mask) | (~mc->dirty_ack[word] & mask);
+	mc->write_count++;
+}
+
+bool memory_card_has_pending(memory_card_t* mc) {
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		if(memory_card_dirty_word(mc, i))
+			return true;
+	return false;
+}
+
+uint32_t memory_card_pending_count(memory_card_t* mc) {
+	uint32_t count = 0;
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		count += __builtin_popcount(memory_card_dirty_word(mc, i));
+	return count;
+}
+
+/* Dirty sectors of the snapshot falling into the given SD block */
+static inline uint32_t block_dirty_mask(const uint32_t* snapshot, uint32_t block) {
+	uint32_t first = block * MC_SEC_PER_BLOCK;
+	return (snapshot[first / 32] >> (first % 32)) & ((1u << MC_SEC_PER_BLOCK) - 1);
+}
+
 /***
- *	Sync memory card modified sectors back into flash storage.
+ *	Conclude the write back of the snapshot sectors in [first, end): written,
+ *	the CRC computed for a sector stable at the time describes the SD copy,
+ *	otherwise they stay dirty for the next sync.
+ */
+static void sync_done(memory_card_t* mc, const uint32_t* snapshot, const uint32_t* stable, sector_t first, sector_t end, bool written) {
+	for(sector_t sector = first; sector < end; sector++) {
+		uint32_t word = sector / 32;
+		uint32_t mask = 1u << (sector % 32);
+		sector_meta_t* meta = &mc->meta[sector];
+		if(!(snapshot[word] & mask))
+			continue;
+		if(!written)
+			mc->sync_failed[word] |= mask;
+		else if((stable[word] & mask) && !(meta->sync_generation & 1) && meta->sync_generation == meta->generation)
+			meta->crc_valid = true;
+	}
+}
+
+/***
+ *	Snapshot and clear the dirty sectors, then write them back in sector order.
+ *	Every SD block holding a dirty sector is written whole, and runs of adjacent
+ *	blocks go out as a single write so the card never sees partial blocks.
+ *	The block holding the write test sector is the exception: its test data
+ *	must not reach the SD card, so its dirty sectors are written one by one.
+ *	Sectors are only written to the open image, memory_card_flush() commits them.
+ *	Sectors of a failed write stay dirty and are written again by the next call.
+ */
+uint32_t memory_card_sync(memory_card_t* mc) {
+	uint32_t status = MC_OK;
+	uint32_t snapshot[MC_DIRTY_WORDS];
+	uint32_t stable[MC_DIRTY_WORDS];
+	uint32_t pending = 0;
+
+	if(!mc || !mc->file_open)
+		return MC_NO_INIT;
+
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++) {
+		uint32_t dirty = mc->dirty_set[i] ^ mc->dirty_ack[i];
+		mc->dirty_ack[i] ^= dirty;	// acknowledge exactly the sectors seen as dirty
+		snapshot[i] = dirty | mc->sync_failed[i];
+		mc->sync_failed[i] = 0;
+		stable[i] = 0;
+		pending += __builtin_popcount(snapshot[i]);
+	}
+	__dmb();	// acknowledge before reading sector data
+	if(pending > mc->max_pending)
+		mc->max_pending = pending;
+
+	/* drop sectors rewritten with the content the SD card already holds */
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++) {
+		for(uint32_t bits = snapshot[i]; bits; bits &= bits - 1) {
+			sector_t sector = i * 32 + __builtin_ctz(bits);
+			sector_meta_t* meta = &mc->meta[sector];
+			uint16_t generation = meta->generation;
+			__dmb();
+			uint32_t crc = crc32(&mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE);
+			__dmb();
+			bool settled = !(generation & 1) && generation == meta->generation;
+			if(settled && meta->crc_valid && crc == meta->crc) {
+				meta->sync_generation = generation;
+				snapshot[i] &= ~(1u << (sector % 32));
+				mc->skip_count++;
+				pending--;
+			} else {
+				meta->crc = crc;
+				meta->sync_generation = generation;
+				meta->crc_valid = false;	// confirmed once the data is written
+				if(settled)
+					stable[i] |= 1u << (sector % 32);
+			}
+		}
+	}
+	mc->sync_count += pending;
+	for(uint32_t i = 0; i < MC_DIRTY_WORDS; i++)
+		mc->changed[i] |= snapshot[i];	// picked up by the next snapshot
+
+	uint32_t block = 0;
+	while(block < MC_BLOCK_COUNT) {
+		uint32_t run_status = MC_OK;
+		uint32_t dirty = block_dirty_mask(snapshot, block);
+		if(!dirty) {
+			block++;
+		} else if(block == MC_TEST_SEC / MC_SEC_PER_BLOCK) {
+			for(uint32_t i = 0; i < MC_SEC_PER_BLOCK; i++) {
+				sector_t sector = block * MC_SEC_PER_BLOCK + i;
+				if(!(dirty & (1u << i)))
+					continue;
+				if(run_status == MC_OK)
+					run_status = memory_card_sync_sector(mc, sector);
+				sync_done(mc, snapshot, stable, sector, sector + 1, run_status == MC_OK);
+			}
+			block++;
+		} else {
+			uint32_t first = block;
+			while(block < MC_BLOCK_COUNT && block != MC_TEST_SEC / MC_SEC_PER_BLOCK && block_dirty_mask(snapshot, block))
+				block++;
+			run_status = memory_card_sync_blocks(mc, first, block - first);
+			sync_done(mc, snapshot, stable, first * MC_SEC_PER_BLOCK, block * MC_SEC_PER_BLOCK, run_status == MC_OK);
+		}
+		if(run_status != MC_OK)
+			status = run_status;
+	}
+	return status;
+}
+
+/***
+ *	Write a run of whole SD blocks back into the open image file.
+ *	The image starts on a cluster boundary and the write is block aligned,
+ *	so FatFs hands it to the card as one multi-block write without going
+ *	through its sector buffer (no read-modify-write).
+ */
+uint32_t memory_card_sync_blocks(memory_card_t* mc, uint32_t block, uint32_t count) {
+	uint32_t status = MC_OK;
+	sector_t first = block * MC_SEC_PER_BLOCK;
+	sector_t end = (block + count) * MC_SEC_PER_BLOCK;
+
+	if(!mc || !mc->file_open)
+		return MC_NO_INIT;
+
+	/* sectors of the run changed since their CRC was computed are not described by it */
+	for(sector_t sector = first; sector < end; sector++)
+		if(mc->meta[sector].sync_generation != mc->meta[sector].generation)
+			mc->meta[sector].crc_valid = false;
+	__dmb();
+	UINT bytes_written;
+	mc->file_dirty = true;
+	if(FR_OK == f_lseek(&mc->file, FILE_OFFSET(mc, block * BLOCK_SIZE)) &&
+		FR_OK == f_write(&mc->file, &mc->data[block * BLOCK_SIZE], count * BLOCK_SIZE, &bytes_written)) {
+		if(count * BLOCK_SIZE != bytes_written) {
+			status = MC_FILE_SIZE_ERR;
+		}
+	} else {
+		status = MC_FILE_WRITE_ERR;
+	}
+	mc->block_count += count;
+
+	/* a CRC only describes the SD copy if the sector did not change while being written */
+	__dmb();
+	for(sector_t sector = first; sector < end; sector++) {
+		sector_meta_t* meta = &mc->meta[sector];
+		if(status != MC_OK || (meta->sync_generation & 1) || meta->sync_generation != meta->generation)
+			meta->crc_valid = false;
+	}
+
+	return status;
+}
+
+/***
+ *	Sync memory card modified sectors back into the open image file.
  *	Does not create concurrency problem as it only reads from the in-RAM copy.
  * 	If a sector is being synced while the in-RAM copy is being modified,
  * 	then there is a transient loss of consistency. Consistency is eventually
- * 	resolved since there will be another entry further down the queue
- * 	enforcing the sync for that same sector to occurr once again.
+ * 	resolved since the write marks the sector dirty again, enforcing the
+ * 	sync for that same sector to occurr once again.
+ *	A single sector only covers part of an SD block, FatFs has to read the
+ *	block back before writing it, prefer memory_card_sync_blocks().
  */
-uint32_t memory_card_sync_sector(memory_card_t* mc, sector_t sector, uint8_t* file_name) {
+uint32_t memory_card_sync_sector(memory_card_t* mc, sector_t sector) {
 	uint32_t status = MC_OK;
-	FIL memcard;
-
-	if(FR_OK == f_open(&memcard, file_name, FA_READ | FA_WRITE)) {
-		UINT bytes_written;
-		f_lseek(&memcard, (sector * MC_SEC_SIZE));
-		if(FR_OK == f_write(&memcard, &mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE, &bytes_written)) {
-			if(MC_SEC_SIZE != bytes_written) {
-				status = MC_FILE_SIZE_ERR;
-			}
-		} else {
-			status = MC_FILE_WRITE_ERR;
+
+	if(!mc || !mc->file_open)
+		return MC_NO_INIT;
+
+	sector_meta_t* meta = &mc->meta[sector];
+	if(meta->sync_generation != meta->generation)
+		meta->crc_valid = false;
+	__dmb();
+	UINT bytes_written;
+	mc->file_dirty = true;
+	if(FR_OK == f_lseek(&mc->file, FILE_OFFSET(mc, sector * MC_SEC_SIZE)) &&
+		FR_OK == f_write(&mc->file, &mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE, &bytes_written)) {
+		if(MC_SEC_SIZE != bytes_written) {
+			status = MC_FILE_SIZE_ERR;
 		}
+	} else {
+		status = MC_FILE_WRITE_ERR;
+	}
+	mc->block_count++;
+	mc->buffered[sector / 32] |= 1u << (sector % 32);
+	__dmb();
+	if(status != MC_OK || (meta->sync_generation & 1) || meta->sync_generation != meta->generation)
+		meta->crc_valid = false;
+
+	return status;
+}
+
+/***
+ *	Verify one SD block of the image against the RAM copy, a full pass takes
+ *	MC_BLOCK_COUNT calls. Each sector not waiting for a sync must have both its
+ *	SD and RAM copies match the CRC recorded when it was last imported or synced:
+ *	- SD copy differs: the sector is written back from RAM;
+ *	- RAM copy differs: reported only, the PSX may already have read it.
+ *	Sectors written by core1 meanwhile are skipped, they will be synced anyway.
+ *	Returns MC_SCRUB_MISMATCH if a sector diverged.
+ */
+uint32_t memory_card_scrub_step(memory_card_t* mc) {
+	uint32_t status = MC_OK;
+
+	if(!mc || !mc->file_open)
+		return MC_NO_INIT;
+
+	uint32_t block = mc->scrub_block;
+	mc->scrub_block = (block + 1) % MC_BLOCK_COUNT;
 
-		f_close(&memcard);
+	UINT bytes_read;
+	if(FR_OK != f_lseek(&mc->file, FILE_OFFSET(mc, block * BLOCK_SIZE)) ||
+		FR_OK != f_read(&mc->file, scrub_buffer, BLOCK_SIZE, &bytes_read) || BLOCK_SIZE != bytes_read)
+		return MC_FILE_READ_ERR;
+	mc->scrub_count++;
+
+	for(uint32_t i = 0; i < MC_SEC_PER_BLOCK; i++) {
+		sector_t sector = block * MC_SEC_PER_BLOCK + i;
+		sector_meta_t* meta = &mc->meta[sector];
+		bool dirty = memory_card_dirty_word(mc, sector / 32) & (1u << (sector % 32));
+		bool resident = mc->resident[sector / 32] & (1u << (sector % 32));
+		if(sector == MC_TEST_SEC || dirty || !resident || !meta->crc_valid)
+			continue;
+		uint16_t generation = meta->generation;
+		__dmb();
+		uint32_t ram_crc = crc32(&mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE);
+		__dmb();
+		if((generation & 1) || generation != meta->generation || generation != meta->sync_generation)
+			continue;	// being written right now, or written since the last sync
+		if(ram_crc != meta->crc) {
+			mc->scrub_errors++;
+			status = MC_SCRUB_MISMATCH;
+		} else if(crc32(&scrub_buffer[i * MC_SEC_SIZE], MC_SEC_SIZE) != meta->crc) {
+			mc->scrub_errors++;
+			status = MC_SCRUB_MISMATCH;
+			uint32_t sync_status = memory_card_sync_sector(mc, sector);
+			if(sync_status != MC_OK)
+				return sync_status;
+		}
+	}
+	return status;
+}
+
+/***
+ *	Forget the open image before the volume is mounted again under it (the USB
+ *	host wrote to the SD card). Nothing is written: a dirty file would have its
+ *	directory entry written from FatFs state that predates the host writes.
+ *	Sectors written on their own since the last f_sync (test block, scrub
+ *	repairs, merges, restores) may only be in the FatFs sector buffer, which
+ *	is lost with it, so their CRCs no longer describe the SD copy.
+ */
+void memory_card_detach(memory_card_t* mc) {
+	if(!mc || !mc->file_open)
+		return;
+	if(mc->file_dirty) {
+		for(uint32_t word = 0; word < MC_DIRTY_WORDS; word++)
+			for(uint32_t bits = mc->buffered[word]; bits; bits &= bits - 1)
+				mc->meta[word * 32 + __builtin_ctz(bits)].crc_valid = false;
 	} else {
-		status = MC_FILE_OPEN_ERR;
+		f_close(&mc->file);
 	}
+	memset(mc->buffered, 0, sizeof(mc->buffered));
+	mc->file_open = false;
+	mc->file_dirty = false;
+}
 
+/***
+ *	Open file_name again after memory_card_detach() and merge what the USB host
+ *	wrote into the RAM copy. Each resident sector is merged three ways, with the
+ *	CRC of the SD copy as last imported or synced as the common base:
+ *	- SD copy unchanged: RAM is kept, PSX writes not synced yet included;
+ *	- SD copy changed, RAM not: the host version is loaded into RAM;
+ *	- both changed: the host version wins, it is an explicit action of the user;
+ *	- no valid base: RAM wins and is written back right away.
+ *	Sectors are taken out of the resident set while replaced, so core1 never
+ *	serves them half updated. The caller holds write_transaction, which keeps
+ *	core1 from writing meanwhile. merged receives the sectors taken from SD.
+ */
+uint32_t memory_card_merge(memory_card_t* mc, uint8_t* file_name, uint32_t* merged) {
+	*merged = 0;
+	if(!mc)
+		return MC_NO_INIT;
+	memory_card_detach(mc);
+	if(FR_OK != f_open(&mc->file, file_name, FA_READ | FA_WRITE))
+		return MC_FILE_OPEN_ERR;
+	mc->file_open = true;
+	if(!MC_IS_IMAGE_SIZE(f_size(&mc->file)) || f_size(&mc->file) / MC_SIZE <= mc->channel)
+		return MC_FILE_SIZE_ERR;
+	mc->channel_count = f_size(&mc->file) / MC_SIZE;
+
+	for(uint32_t block = 0; block < MC_BLOCK_COUNT; block++) {
+		UINT bytes_read;
+		if(FR_OK != f_lseek(&mc->file, FILE_OFFSET(mc, block * BLOCK_SIZE)) ||
+			FR_OK != f_read(&mc->file, scrub_buffer, BLOCK_SIZE, &bytes_read) || BLOCK_SIZE != bytes_read)
+			return MC_FILE_READ_ERR;
+		for(uint32_t i = 0; i < MC_SEC_PER_BLOCK; i++) {
+			sector_t sector = block * MC_SEC_PER_BLOCK + i;
+			uint32_t word = sector / 32;
+			uint32_t mask = 1u << (sector % 32);
+			sector_meta_t* meta = &mc->meta[sector];
+			uint8_t* sd_ptr = &scrub_buffer[i * MC_SEC_SIZE];
+			uint8_t* ram_ptr = &mc->data[sector * MC_SEC_SIZE];
+			if(sector == MC_TEST_SEC || !(mc->resident[word] & mask))
+				continue;	// test data never leaves RAM, non resident sectors are still to be read from the file
+			uint32_t sd_crc = crc32(sd_ptr, MC_SEC_SIZE);
+			bool dirty = memory_card_dirty_word(mc, word) & mask;
+			if(!memcmp(sd_ptr, ram_ptr, MC_SEC_SIZE)) {
+				meta->crc = sd_crc;
+				meta->sync_generation = meta->generation;
+				meta->crc_valid = true;
+				continue;
+			}
+			if(!meta->crc_valid) {
+				/* base unknown, the RAM copy goes back to SD */
+				meta->crc = crc32(ram_ptr, MC_SEC_SIZE);
+				meta->sync_generation = meta->generation;
+				meta->crc_valid = true;
+				uint32_t status = memory_card_sync_sector(mc, sector);
+				if(status != MC_OK)
+					return status;
+				mc->sync_failed[word] &= ~mask;	// a failed sync of the PSX write is now done
+				continue;
+			}
+			if(sd_crc == meta->crc)
+				continue;	// host left it alone, RAM changes stay pending
+			if(dirty) {
+				mc->dirty_ack[word] ^= (mc->dirty_set[word] ^ mc->dirty_ack[word]) & mask;	// host version wins over the unsynced PSX write
+				mc->sync_failed[word] &= ~mask;
+				mc->merge_conflicts++;
+			}
+			mc->resident[word] &= ~mask;
+			__dmb();	// out of the resident set before the data changes
+			memcpy(ram_ptr, sd_ptr, MC_SEC_SIZE);
+			rebuild_meta(mc, sector, 1, true);
+			__dmb();
+			mc->resident[word] |= mask;
+			mc->changed[word] |= mask;
+			mc->merge_count++;
+			(*merged)++;
+		}
+	}
+	return MC_OK;
+}
+
+/***
+ *	Replace a resident sector from core0 (replaying the flash journal, restoring
+ *	a snapshot) and write it through to the image. The caller holds
+ *	write_transaction, so core1 is not writing; a sector the PSX wrote since is
+ *	newer and left alone. The sector leaves the resident set while it changes.
+ */
+uint32_t memory_card_restore_sector(memory_card_t* mc, sector_t sector, const uint8_t* data) {
+	if(!mc || !mc->file_open)
+		return MC_NO_INIT;
+	uint32_t word = sector / 32;
+	uint32_t mask = 1u << (sector % 32);
+	if(!(mc->resident[word] & mask) || (memory_card_dirty_word(mc, word) & mask))
+		return MC_OK;
+	mc->resident[word] &= ~mask;
+	__dmb();
+	memcpy(&mc->data[sector * MC_SEC_SIZE], data, MC_SEC_SIZE);
+	rebuild_meta(mc, sector, 1, true);
+	__dmb();
+	mc->resident[word] |= mask;
+	mc->changed[word] |= mask;
+	return memory_card_sync_sector(mc, sector);
+}
+
+void memory_card_get_stats(memory_card_t* mc, memory_card_stats_t* stats) {
+	stats->sector_writes = mc->write_count;
+	stats->sector_syncs = mc->sync_count;
+	stats->block_writes = mc->block_count;
+	stats->pending = memory_card_pending_count(mc);
+	stats->max_pending = mc->max_pending;
+	stats->sector_skips = mc->skip_count;
+	stats->scrub_blocks = mc->scrub_count;
+	stats->scrub_errors = mc->scrub_errors;
+	stats->merged_sectors = mc->merge_count;
+	stats->merge_conflicts = mc->merge_conflicts;
+}
+
+/* Commit buffered data and file metadata of the open image to the SD card */
+uint32_t memory_card_flush(memory_card_t* mc) {
+	if(!mc || !mc->file_open)
+		return MC_NO_INIT;
+	if(!mc->file_dirty)
+		return MC_OK;
+	if(FR_OK != f_sync(&mc->file))
+		return MC_FILE_WRITE_ERR;
+	memset(mc->buffered, 0, sizeof(mc->buffered));
+	mc->file_dirty = false;
+	return MC_OK;
+}
+
+uint32_t memory_card_close(memory_card_t* mc) {
+	uint32_t status = MC_OK;
+	if(!mc || !mc->file_open)
+		return MC_OK;
+	status = memory_card_flush(mc);
+	f_close(&mc->file);
+	memset(mc->buffered, 0, sizeof(mc->buffered));
+	mc->file_open = false;
+	mc->file_dirty = false;
 	return status;
+}
+
+bool memory_card_is_dirty(memory_card_t* mc) {
+	return mc && mc->file_dirty;
 }
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "msc_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "sd_config.h"
+
+#define META_LINES		MSC_CACHE_META_BLOCKS
+#define WRITE_BACK_RUN	MSC_WRITE_BACK_RUN
+
+typedef struct {
+	uint32_t lba;
+	uint32_t last_use;
+	bool valid;
+	bool dirty;
+} cache_line_t;
+
+static cache_line_t lines[META_LINES];
+static uint8_t* line_data;		// META_LINES blocks
+static uint8_t* window;			// MSC_CACHE_DATA_BLOCKS blocks read ahead of the host
+static uint8_t* scratch;		// WRITE_BACK_RUN blocks, also holds the boot sector while probing
+static uint32_t window_lba;
+static uint32_t window_count;	// blocks held by window, 0 when empty
+static uint32_t next_sequential;	// block following the last read, where read-ahead pays off
+static uint32_t use_clock;
+static uint64_t last_write_time;
+static msc_cache_stats_t stats;
+
+static uint16_t get_le16(const uint8_t* p) { return p[0] | p[1] << 8; }
+static uint32_t get_le32(const uint8_t* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24; }
+
+/***
+ *	Find the FAT region of the first volume: from its boot sector (MBR or not)
+ *	through the FATs and the root directory. Leaves an empty region if the card
+ *	is not FAT12/16/32 or exFAT, everything is then cached as data.
+ */
+static void find_meta_region(sd_card_t* p_sd) {
+	stats.meta_start = stats.meta_end = 0;
+	if(sd_read_blocks_retry(p_sd, scratch, 0, 1) != SD_BLOCK_DEVICE_ERROR_NONE || get_le16(&scratch[510]) != 0xaa55)
+		return;
+	uint32_t volume = 0;
+	if(scratch[0] != 0xeb && scratch[0] != 0xe9) {
+		volume = get_le32(&scratch[0x1c6]);	// MBR, first partition
+		if(sd_read_blocks_retry(p_sd, scratch, volume, 1) != SD_BLOCK_DEVICE_ERROR_NONE || get_le16(&scratch[510]) != 0xaa55)
+			return;
+	}
+	uint32_t end;
+	if(!memcmp(&scratch[3], "EXFAT   ", 8)) {
+		uint32_t heap = get_le32(&scratch[0x58]);
+		uint32_t root = get_le32(&scratch[0x60]);
+		end = volume + heap + ((root - 2) << scratch[0x6d]) + (1u << scratch[0x6d]);	// up to the end of the first root cluster
+	} else {
+		if(get_le16(&scratch[0x0b]) != BLOCK_SIZE)
+			return;
+		uint32_t fat_size = get_le16(&scratch[0x16]) ? get_le16(&scratch[0x16]) : get_le32(&scratch[0x24]);
+		uint32_t root_blocks = (get_le16(&scratch[0x11]) * 32 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		uint32_t data = volume + get_le16(&scratch[0x0e]) + scratch[0x10] * fat_size + root_blocks;
+		end = data;
+		if(!root_blocks)	// FAT32, root directory is a cluster chain, keep its first cluster
+			end += (get_le32(&scratch[0x2c]) - 2) * scratch[0x0d] + scratch[0x0d];
+	}
+	if(end > volume && end <= p_sd->sectors) {
+		stats.meta_start = volume;
+		stats.meta_end = end;
+	}
+}
+
+static bool is_meta(uint32_t lba) {
+	return lba >= stats.meta_start && lba < stats.meta_end;
+}
+
+/* Buffers are allocated on first use, MSC_CACHE_RAM bytes counted in MSC_RAM_BUDGET since the simulation runs alongside */
+static sd_card_t* get_ready_card() {
+	sd_card_t* p_sd = sd_get_by_num(0);
+	if(!p_sd)
+		return NULL;
+	if(!line_data) {
+		line_data = malloc(META_LINES * BLOCK_SIZE);
+		window = malloc(MSC_CACHE_DATA_BLOCKS * BLOCK_SIZE);
+		scratch = malloc(WRITE_BACK_RUN * BLOCK_SIZE);
+		if(!line_data || !window || !scratch) {
+			free(line_data);
+			free(window);
+			free(scratch);
+			line_data = window = scratch = NULL;
+			return NULL;
+		}
+		find_meta_region(p_sd);
+	}
+	return p_sd;
+}
+
+static cache_line_t* find_line(uint32_t lba) {
+	for(uint32_t i = 0; i < META_LINES; i++)
+		if(lines[i].valid && lines[i].lba == lba)
+			return &lines[i];
+	return NULL;
+}
+
+static uint8_t* line_ptr(cache_line_t* line) {
+	return &line_data[(line - lines) * BLOCK_SIZE];
+}
+
+/* Write back the run of consecutive dirty blocks starting at line */
+static uint32_t write_back(sd_card_t* p_sd, cache_line_t* line) {
+	cache_line_t* run[WRITE_BACK_RUN];
+	uint32_t count = 0;
+	for(cache_line_t* next = line; next && next->dirty && count < WRITE_BACK_RUN; next = find_line(line->lba + count)) {
+		memcpy(&scratch[count * BLOCK_SIZE], line_ptr(next), BLOCK_SIZE);
+		run[count++] = next;
+	}
+	if(sd_write_blocks_retry(p_sd, scratch, line->lba, count) != SD_BLOCK_DEVICE_ERROR_NONE)
+		return MSCC_WRITE_ERR;
+	for(uint32_t i = 0; i < count; i++)
+		run[i]->dirty = false;
+	stats.write_backs++;
+	return MSCC_OK;
+}
+
+/* Least recently used line, written back first if dirty. NULL if that fails */
+static cache_line_t* alloc_line(sd_card_t* p_sd, uint32_t lba) {
+	cache_line_t* victim = &lines[0];
+	for(uint32_t i = 0; i < META_LINES; i++) {
+		if(!lines[i].valid) {
+			victim = &lines[i];
+			break;
+		}
+		if(lines[i].last_use < victim->last_use)
+			victim = &lines[i];
+	}
+	if(victim->valid && victim->dirty && write_back(p_sd, victim) != MSCC_OK)
+		return NULL;
+	victim->valid = true;
+	victim->dirty = false;
+	victim->lba = lba;
+	return victim;
+}
+
+void msc_cache_init() {
+	memset(lines, 0, sizeof(lines));
+	window_count = 0;
+	next_sequential = 0;
+	use_clock = 0;
+	memset(&stats, 0, sizeof(stats));
+	sd_card_t* p_sd = sd_get_by_num(0);
+	if(p_sd && line_data)
+		find_meta_region(p_sd);	// card may have been reformatted
+}
+
+/***
+ *	Read count blocks at lba into buffer. FAT and root directory blocks come from
+ *	their cache lines, a sequential read is extended by MSC_READ_AHEAD blocks
+ *	into the read-ahead window.
+ */
+uint32_t msc_cache_read(uint32_t lba, uint8_t* buffer, uint32_t count) {
+	sd_card_t* p_sd = get_ready_card();
+	if(!p_sd) {
+		p_sd = sd_get_by_num(0);
+		return p_sd && sd_read_blocks_retry(p_sd, buffer, lba, count) == SD_BLOCK_DEVICE_ERROR_NONE ? MSCC_OK : MSCC_READ_ERR;
+	}
+	bool sequential = lba == next_sequential;
+	next_sequential = lba + count;
+
+	uint32_t cached = 0;
+	while(cached < count && find_line(lba + cached))
+		cached++;
+	if(cached == count) {
+		for(uint32_t i = 0; i < count; i++) {
+			cache_line_t* line = find_line(lba + i);
+			line->last_use = ++use_clock;
+			memcpy(&buffer[i * BLOCK_SIZE], line_ptr(line), BLOCK_SIZE);
+		}
+		stats.hits += count;
+		return MSCC_OK;
+	}
+	if(window_count && lba >= window_lba && lba + count <= window_lba + window_count) {
+		memcpy(buffer, &window[(lba - window_lba) * BLOCK_SIZE], count * BLOCK_SIZE);
+		stats.hits += count;
+		return MSCC_OK;
+	}
+
+	bool meta = is_meta(lba) || is_meta(lba + count - 1);
+	if(sequential && !meta && count + MSC_READ_AHEAD <= MSC_CACHE_DATA_BLOCKS && lba + count + MSC_READ_AHEAD <= p_sd->sectors) {
+		window_count = 0;
+		if(sd_read_blocks_retry(p_sd, window, lba, count + MSC_READ_AHEAD) != SD_BLOCK_DEVICE_ERROR_NONE)
+			return MSCC_READ_ERR;
+		window_lba = lba;
+		window_count = count + MSC_READ_AHEAD;
+		memcpy(buffer, window, count * BLOCK_SIZE);
+		stats.misses += count;
+		stats.read_ahead += MSC_READ_AHEAD;
+		return MSCC_OK;
+	}
+
+	if(sd_read_blocks_retry(p_sd, buffer, lba, count) != SD_BLOCK_DEVICE_ERROR_NONE)
+		return MSCC_READ_ERR;
+	stats.misses += count;
+	for(uint32_t i = 0; i < count; i++) {
+		if(!is_meta(lba + i))
+			continue;
+		cache_line_t* line = find_line(lba + i);
+		if(line)
+			memcpy(&buffer[i * BLOCK_SIZE], line_ptr(line), BLOCK_SIZE);	// newer than the SD copy
+		else if((line = alloc_line(p_sd, lba + i)))
+			memcpy(line_ptr(line), &buffer[i * BLOCK_SIZE], BLOCK_SIZE);
+		if(line)
+			line->last_use = ++use_clock;
+	}
+	return MSCC_OK;
+}
+
+/***
+ *	Update the cached copies of count blocks at lba. Returns true when every block
+ *	is FAT/root directory and now waits in RAM for write back, otherwise the
+ *	caller writes the blocks to the SD card.
+ */
+bool msc_cache_write(uint32_t lba, const uint8_t* buffer, uint32_t count) {
+	sd_card_t* p_sd = get_ready_card();
+	if(!p_sd)
+		return false;
+	bool absorbed = true;
+	for(uint32_t i = 0; i < count; i++) {
+		uint32_t block = lba + i;
+		const uint8_t* data = &buffer[i * BLOCK_SIZE];
+		if(window_count && block >= window_lba && block < window_lba + window_count)
+			memcpy(&window[(block - window_lba) * BLOCK_SIZE], data, BLOCK_SIZE);
+		cache_line_t* line = NULL;
+		if(is_meta(block) && !(line = find_line(block)))
+			line = alloc_line(p_sd, block);
+		if(!line) {
+			absorbed = false;
+			continue;
+		}
+		memcpy(line_ptr(line), data, BLOCK_SIZE);
+		line->dirty = true;
+		line->last_use = ++use_clock;
+		stats.absorbed++;
+	}
+	last_write_time = time_us_64();
+	return absorbed;
+}
+
+bool msc_cache_is_meta(uint32_t lba, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++)
+		if(is_meta(lba + i))
+			return true;
+	return false;
+}
+
+/* Write back every dirty block */
+uint32_t msc_cache_flush() {
+	sd_card_t* p_sd = sd_get_by_num(0);
+	if(!p_sd || !line_data)
+		return MSCC_OK;
+	bool written = true;
+	while(written) {
+		/* runs longer than WRITE_BACK_RUN leave dirty lines behind for the next pass */
+		written = false;
+		for(uint32_t i = 0; i < META_LINES; i++) {
+			if(!lines[i].valid || !lines[i].dirty)
+				continue;
+			cache_line_t* prev = find_line(lines[i].lba - 1);
+			if(prev && prev->dirty)
+				continue;	// not the first block of its run
+			uint32_t status = write_back(p_sd, &lines[i]);
+			if(status != MSCC_OK)
+				return status;
+			written = true;
+		}
+	}
+	return MSCC_OK;
+}
+
+/* Called from the main loop, writes back once the host stopped writing for MSC_WRITE_SYNC_TIMEOUT */
+uint32_t msc_cache_task() {
+	if(!line_data || time_us_64() - last_write_time < MSC_WRITE_SYNC_TIMEOUT * 1000)
+		return MSCC_OK;
+	return msc_cache_flush();
+}
+
+void msc_cache_get_stats(msc_cache_stats_t* out) {
+	*out = stats;
+}
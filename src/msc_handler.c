@@ -1,12 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
 #include "bsp/board.h"
 #include "tusb.h"
 #include "config.h"
 #include "sd_config.h"
+#include "msc_handler.h"
+#include "msc_cache.h"
 
 #define VID "PicoMC"
 #define PID "Mass Storage"
 #define REV "1.0"
 
+#define MSC_STAGED_WRITES	2	// host data buffered while the previous chunk is written to SD
+
+/* the card and the image cache use the rest of the RAM while the drive is in use */
+#if MSC_CACHE_RAM + MSC_STAGED_WRITES * CFG_TUD_MSC_EP_BUFSIZE > MSC_RAM_BUDGET
+#error "USB drive buffers exceed MSC_RAM_BUDGET"
+#endif
+
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10	0x35	// not in the TinyUSB command list
+
+/***
+ *	WRITE10 data is copied to a staging buffer and acknowledged right away, the
+ *	SD write happens in msc_task() while USB already receives the next chunk.
+ *	Staged writes are flushed before any read, so the host always reads back
+ *	what it wrote. A failed write is reported on the next command. FAT and root
+ *	directory blocks never go through staging, msc_cache holds them instead.
+ */
+typedef struct {
+	uint8_t* data;		// CFG_TUD_MSC_EP_BUFSIZE bytes, allocated on first write
+	uint32_t lba;
+	uint32_t count;		// blocks, 0 when the buffer is free
+} staged_write_t;
+
+static staged_write_t staged[MSC_STAGED_WRITES];
+static uint32_t staged_head;	// next buffer filled
+static uint32_t staged_tail;	// next buffer written to SD
+static bool write_failed = false;
+
+/*
+ *	The simulator keeps using the volume through FatFs while the host has it
+ *	mounted. Neither side sees the other's caches, so the simulator stays off
+ *	the volume while the host writes and remounts it afterwards, and the host
+ *	is told with UNIT ATTENTION whenever the simulator changed the volume.
+ */
+static uint64_t host_write_time;	// last WRITE10
+static bool host_wrote = false;		// WRITE10 since the simulator last took the volume back
+static bool media_changed = false;	// volume written through FatFs since the host last checked
+
+/*
+ *	A host that mounted the volume keeps its FAT cached and does not read it
+ *	again on UNIT ATTENTION, so while it may be mounted the simulator only
+ *	rewrites clusters already allocated. The volume counts as mounted from USB
+ *	enumeration until the host ejects it (START STOP UNIT) or unlocks it
+ *	(ALLOW MEDIUM REMOVAL after PREVENT, sent by Linux on unmount).
+ */
+static bool host_connected = false;	// enumerated by a USB host
+static bool host_ejected = false;	// medium unloaded, reported as not present until loaded again
+static bool host_locked = false;	// PREVENT MEDIUM REMOVAL in effect
+static bool host_released = false;	// unlocked or ejected, until the host uses the volume again
+
+static bool flush_one(sd_card_t* p_sd) {
+	staged_write_t* write = &staged[staged_tail % MSC_STAGED_WRITES];
+	if(staged_tail == staged_head)
+		return false;
+	if(sd_write_blocks_retry(p_sd, write->data, write->lba, write->count) != SD_BLOCK_DEVICE_ERROR_NONE)
+		write_failed = true;
+	write->count = 0;
+	staged_tail++;
+	return true;
+}
+
+static void flush_staged(sd_card_t* p_sd) {
+	while(flush_one(p_sd))
+		;
+}
+
+/* Write back every staged chunk in order, then the cached FAT/directory blocks */
+void msc_flush() {
+	sd_card_t* p_sd = sd_get_by_num(0);
+	if(!p_sd) return;
+	flush_staged(p_sd);
+	if(msc_cache_flush() != MSCC_OK)
+		write_failed = true;
+}
+
+/* Called from the main loop, writes one staged chunk to SD, cached blocks once the host is idle */
+void msc_task() {
+	sd_card_t* p_sd = sd_get_by_num(0);
+	if(!p_sd) return;
+	if(!flush_one(p_sd) && msc_cache_task() != MSCC_OK)
+		write_failed = true;
+}
+
+/* True while the host is writing, FatFs must not touch the volume meanwhile */
+bool msc_host_busy() {
+	return host_wrote && time_us_64() - host_write_time < MSC_WRITE_SYNC_TIMEOUT * 1000;
+}
+
+/***
+ *	Hand the volume back to the simulator once the host went idle. Returns true
+ *	once after host writes, with every one of them on the SD card: FatFs state
+ *	is stale from then on and the volume has to be mounted again.
+ */
+bool msc_take_host_writes() {
+	if(!host_wrote || msc_host_busy())
+		return false;
+	msc_flush();
+	host_wrote = false;
+	return true;
+}
+
+/* USB enumeration or disconnection, a new host may mount the volume */
+void msc_host_connected(bool connected) {
+	host_connected = connected;
+	host_ejected = host_locked = host_released = false;
+}
+
+/* True while a host may have the volume mounted: FatFs must not allocate or free clusters meanwhile */
+bool msc_host_mounted() {
+	return host_connected && !host_released;
+}
+
+/* The simulator wrote to the volume through FatFs, cached blocks are stale and the host has to re-read */
+void msc_volume_changed() {
+	msc_flush();
+	msc_cache_init();
+	media_changed = true;
+}
+
+/* Report a deferred write error once, on the command that follows it */
+static bool check_write_failed(uint8_t lun) {
+	if(!write_failed)
+		return false;
+	write_failed = false;
+	tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0c, 0x00);	// 0C-00 is WRITE ERROR
+	return true;
+}
+
 
 /* invoked when received SCSI_CMD_INQUIRY */
 void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
@@ -29,12 +162,19 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
 	sd_card_t* p_sd = sd_get_by_num(lun);
 	if (!p_sd) return false;
 
-	if(p_sd->m_Status != 0) {
+	if(p_sd->m_Status != 0 || host_ejected) {
 		// Additional Sense 3A-00 is NOT_FOUND
 		tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
 		return false;
 	}
 
+	if(media_changed) {
+		// Additional Sense 28-00 is MEDIUM MAY HAVE CHANGED, the host drops what it cached
+		media_changed = false;
+		tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00);
+		return false;
+	}
+
 	return true;
 }
 
@@ -55,13 +195,22 @@ void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_siz
 */
 bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
 {
+	(void) lun;
 	(void) power_condition;
 
 	if ( load_eject )
 	{
 		if(start) {
+			host_ejected = host_released = false;	// loaded again, may be mounted
 			return true;
 		}
+		msc_flush();	// ejected, data must be on the SD card
+		host_ejected = host_released = true;
+		msc_cache_stats_t stats;
+		msc_cache_get_stats(&stats);
+		printf("MSC cache: %u hits, %u misses, %u read ahead, %u metadata writes in %u SD writes\n",
+			(unsigned) stats.hits, (unsigned) stats.misses, (unsigned) stats.read_ahead,
+			(unsigned) stats.absorbed, (unsigned) stats.write_backs);
 	}
 
 	return true;
@@ -73,12 +222,15 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buff
 	sd_card_t* p_sd = sd_get_by_num(lun);
 	if (!p_sd) return -1;							// not valid drive
 
-	if(lba < 0 || lba >= p_sd->sectors) return -1;	// invalid sector
-	if(bufsize != BLOCK_SIZE) return -1;			// invalid transfer unit
+	uint32_t count = bufsize / BLOCK_SIZE;
+	if(lba + count > p_sd->sectors) return -1;		// invalid sector
+	if(!count || bufsize % BLOCK_SIZE) return -1;	// invalid transfer unit
 	if(offset != 0) return -1;						// cannot read unaligned sectors
 
-	int status = sd_read_blocks(p_sd, (uint8_t*) buffer, (uint64_t) lba, 1);
-	if(status != SD_BLOCK_DEVICE_ERROR_NONE) return -1;		// read failed
+	flush_staged(p_sd);	// read back what the host wrote
+	if(check_write_failed(lun)) return -1;
+	host_released = host_ejected;	// using the volume again
+	if(msc_cache_read(lba, (uint8_t*) buffer, count) != MSCC_OK) return -1;	// CMD18 when count > 1
 
 	return (int32_t) bufsize;
 }
@@ -97,12 +249,40 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t*
 	sd_card_t* p_sd = sd_get_by_num(lun);
 	if (!p_sd) return -1;							// not valid drive
 
-	if(lba < 0 || lba >= p_sd->sectors) return -1;	// invalid sector
-	if(bufsize != BLOCK_SIZE) return -1;			// invalid transfer unit
+	uint32_t count = bufsize / BLOCK_SIZE;
+	if(lba + count > p_sd->sectors) return -1;		// invalid sector
+	if(!count || bufsize % BLOCK_SIZE) return -1;	// invalid transfer unit
 	if(offset != 0) return -1;						// writes must be sector aligned
+	if(check_write_failed(lun)) return -1;
+	host_released = host_ejected;
+	host_write_time = time_us_64();
+	host_wrote = true;
 
-	int status = sd_write_blocks(p_sd, buffer, lba, 1);
-	if(status != SD_BLOCK_DEVICE_ERROR_NONE) return -1;		// write failed
+	if(msc_cache_write(lba, buffer, count))
+		return (int32_t) bufsize;	// FAT/directory only, written back once the host is idle
+	if(msc_cache_is_meta(lba, count)) {
+		/* partly FAT/directory, write through so that staging never holds blocks the cache may write back later */
+		flush_staged(p_sd);
+		int status = sd_write_blocks_retry(p_sd, buffer, lba, count);
+		if(status != SD_BLOCK_DEVICE_ERROR_NONE) return -1;		// write failed
+		return (int32_t) bufsize;
+	}
+
+	staged_write_t* write = &staged[staged_head % MSC_STAGED_WRITES];
+	if(!write->data)
+		write->data = malloc(CFG_TUD_MSC_EP_BUFSIZE);
+	if(!write->data) {
+		/* no RAM for staging, write through */
+		int status = sd_write_blocks_retry(p_sd, buffer, lba, count);	// CMD25 when count > 1
+		if(status != SD_BLOCK_DEVICE_ERROR_NONE) return -1;		// write failed
+		return (int32_t) bufsize;
+	}
+	if(staged_head - staged_tail == MSC_STAGED_WRITES)
+		flush_one(p_sd);	// both buffers in use, the oldest one goes to SD now
+	memcpy(write->data, buffer, bufsize);
+	write->lba = lba;
+	write->count = count;
+	staged_head++;
 
 	return (int32_t) bufsize;
 }
@@ -122,8 +302,20 @@ int32_t tud_msc_scsi_cb (uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
 
 	switch(scsi_cmd[0]) {
 		case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+			/* locked while mounted, unlocked once unmounted */
+			if(scsi_cmd[4] & 1) {
+				host_locked = true;
+				host_released = false;
+			} else if(host_locked) {
+				host_locked = false;
+				host_released = true;
+			}
 			resplen = 0;
 			break;
+		case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+			msc_flush();
+			resplen = check_write_failed(lun) ? -1 : 0;
+			break;
 		default:
 			// Set Sense = Invalid Command Operation
 			tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
@@ -1,7 +1,10 @@
 #include <string.h>
+#include <stdlib.h>
 #include "sd_config.h"
 #include "ff.h" 
 #include "diskio.h"
+#include "pico/stdlib.h"
+#include "hardware/spi.h"
 #include "config.h"
 
 void spi0_dma_isr();
@@ -44,4 +47,114 @@ spi_t *spi_get_by_num(size_t num) {
     } else {
         return NULL;
     }
-}
\ No newline at end of file
+}
+
+static const uint baud_rates[] = SD_BAUD_RATES;
+static int clock_level = -1;    // index in baud_rates of the clock in use, -1 for BAUD_RATE
+static sd_clock_stats_t clock_stats = { .baud_rate = BAUD_RATE };
+
+/* The driver also applies spi->baud_rate again whenever it initializes the card */
+static void set_clock(sd_card_t *p_sd, int level) {
+    clock_level = level;
+    p_sd->spi->baud_rate = level < 0 ? BAUD_RATE : baud_rates[level];
+    clock_stats.baud_rate = spi_set_baudrate(p_sd->spi->hw_inst, p_sd->spi->baud_rate);
+}
+
+static void count_error(int status) {
+    if(status == SD_BLOCK_DEVICE_ERROR_CRC)
+        clock_stats.crc_errors++;
+    else
+        clock_stats.io_errors++;
+}
+
+/* Failures a slower clock may cure, as opposed to bad requests or a write protected card */
+static bool clock_related(int status) {
+    return status == SD_BLOCK_DEVICE_ERROR_CRC || status == SD_BLOCK_DEVICE_ERROR_NO_RESPONSE ||
+        status == SD_BLOCK_DEVICE_ERROR_WRITE;
+}
+
+/***
+ *  Step the SPI clock up through SD_BAUD_RATES once the card is initialized.
+ *  A rate is kept when SD_CALIBRATE_PASSES reads of the probe blocks all succeed
+ *  and match the copy read at BAUD_RATE, the first one failing ends the search.
+ *  Only reads are used so calibration never puts data on the card at risk.
+ *  Returns the SPI clock in use.
+ */
+uint32_t sd_clock_calibrate(sd_card_t *p_sd) {
+    uint64_t start = time_us_64();
+    uint32_t size = SD_PROBE_BLOCKS * BLOCK_SIZE;
+    uint64_t lbas[] = { 0, p_sd->sectors / 2 };
+    set_clock(p_sd, -1);
+    uint8_t *reference = malloc((count_of(lbas) + 1) * size);
+    if(!reference)
+        return clock_stats.baud_rate;
+    uint8_t *probe = &reference[count_of(lbas) * size];
+    for(uint32_t i = 0; i < count_of(lbas); i++) {
+        int status = sd_read_blocks(p_sd, &reference[i * size], lbas[i], SD_PROBE_BLOCKS);
+        if(status != SD_BLOCK_DEVICE_ERROR_NONE) {
+            count_error(status);    // card unusable at any rate, left to the caller to report
+            free(reference);
+            return clock_stats.baud_rate;
+        }
+    }
+    for(int level = 0; level < (int) count_of(baud_rates); level++) {
+        set_clock(p_sd, level);
+        bool clean = true;
+        for(uint32_t pass = 0; pass < SD_CALIBRATE_PASSES && clean; pass++) {
+            for(uint32_t i = 0; i < count_of(lbas) && clean; i++) {
+                int status = sd_read_blocks(p_sd, probe, lbas[i], SD_PROBE_BLOCKS);
+                if(status != SD_BLOCK_DEVICE_ERROR_NONE) {
+                    count_error(status);
+                    clean = false;
+                } else if(memcmp(probe, &reference[i * size], size)) {
+                    clock_stats.crc_errors++;   // corrupted without the driver noticing
+                    clean = false;
+                }
+            }
+        }
+        if(!clean) {
+            set_clock(p_sd, level - 1);
+            break;
+        }
+    }
+    free(reference);
+    clock_stats.calibrate_us = time_us_64() - start;
+    return clock_stats.baud_rate;
+}
+
+/* Move to the next slower clock, false when already at BAUD_RATE */
+bool sd_clock_fallback(sd_card_t *p_sd) {
+    if(clock_level < 0)
+        return false;
+    set_clock(p_sd, clock_level - 1);
+    clock_stats.fallbacks++;
+    return true;
+}
+
+/***
+ *  Block transfers that step the clock down and try again when the card fails
+ *  at the negotiated rate, until they succeed or fail at BAUD_RATE too.
+ */
+int sd_read_blocks_retry(sd_card_t *p_sd, uint8_t *buffer, uint64_t lba, uint32_t count) {
+    int status;
+    while((status = sd_read_blocks(p_sd, buffer, lba, count)) != SD_BLOCK_DEVICE_ERROR_NONE) {
+        count_error(status);
+        if(!clock_related(status) || !sd_clock_fallback(p_sd))
+            break;
+    }
+    return status;
+}
+
+int sd_write_blocks_retry(sd_card_t *p_sd, const uint8_t *buffer, uint64_t lba, uint32_t count) {
+    int status;
+    while((status = sd_write_blocks(p_sd, buffer, lba, count)) != SD_BLOCK_DEVICE_ERROR_NONE) {
+        count_error(status);
+        if(!clock_related(status) || !sd_clock_fallback(p_sd))
+            break;
+    }
+    return status;
+}
+
+void sd_clock_get_stats(sd_clock_stats_t *stats) {
+    *stats = clock_stats;
+}
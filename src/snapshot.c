@@ -0,0 +1,348 @@
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "ff.h"
+
+#define SNAPSHOT_MAGIC	0x50414E53	// "SNAP"
+#define NOT_STORED		0xFFFFFFFF	// sector still blank at the point being rebuilt
+
+/* Start of the index file, rewritten after each entry appended */
+typedef struct {
+	uint32_t magic;
+	uint32_t count;				// snapshots committed
+	uint32_t data_size;			// bytes of the data file they use, the next one is appended there
+	uint32_t reserved;
+} index_header_t;
+
+typedef struct {
+	uint32_t offset;			// of the first sector stored in the data file
+	uint32_t uptime_s;
+	uint32_t writes;
+	uint16_t sectors;
+	uint8_t reason;
+	uint8_t reserved;
+	uint32_t map[MC_DIRTY_WORDS];	// sectors stored, they follow each other in sector order
+} index_entry_t;
+
+/* Image whose last snapshot matches its RAM copy except for the sectors in mc->changed */
+static struct {
+	bool valid;
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t channel;
+	uint32_t import_count;		// mc->import_count when taken
+} chain;
+
+static FIL index_file;
+static FIL data_file;
+static bool data_open;
+static index_header_t header;
+static index_entry_t entry;
+static snapshot_stats_t stats;
+
+/* "FF7/0.MCR" channel 0 gives "FF7/0.SN1" (kind 'N', index) and "FF7/0.SD1" (kind 'D', data) */
+static void snapshot_path(const uint8_t* name, uint32_t channel, char kind, uint8_t* out) {
+	const uint8_t* ext = strrchr(name, '.');
+	const uint8_t* slash = strrchr(name, '/');
+	uint32_t len = (ext && (!slash || ext > slash)) ? (uint32_t) (ext - name) : strlen(name);
+	if(len > MAX_MC_FILENAME_LEN - 4)
+		len = MAX_MC_FILENAME_LEN - 4;
+	memcpy(out, name, len);
+	sprintf(&out[len], ".S%c%u", kind, (unsigned) channel + 1);
+}
+
+/* Open the index of an image channel and read its header, an index being created starts empty */
+static uint32_t open_index(const uint8_t* name, uint32_t channel, bool create) {
+	uint8_t path[MAX_MC_FILENAME_LEN + 1];
+	UINT bytes_read;
+	snapshot_path(name, channel, 'N', path);
+	FRESULT result = f_open(&index_file, path, create ? FA_READ | FA_WRITE | FA_OPEN_ALWAYS : FA_READ);
+	if(result == FR_NO_FILE)
+		return SN_NOT_FOUND;
+	if(result != FR_OK)
+		return SN_FILE_ERR;
+	if(f_size(&index_file) < sizeof(header)) {
+		header.magic = SNAPSHOT_MAGIC;
+		header.count = header.data_size = header.reserved = 0;
+		return SN_OK;
+	}
+	if(FR_OK != f_read(&index_file, &header, sizeof(header), &bytes_read) || bytes_read != sizeof(header)) {
+		f_close(&index_file);
+		return SN_FILE_ERR;
+	}
+	if(header.magic != SNAPSHOT_MAGIC) {
+		f_close(&index_file);
+		return SN_CORRUPTED;
+	}
+	return SN_OK;
+}
+
+static uint32_t open_data(const uint8_t* name, uint32_t channel, bool create) {
+	uint8_t path[MAX_MC_FILENAME_LEN + 1];
+	snapshot_path(name, channel, 'D', path);
+	if(FR_OK != f_open(&data_file, path, create ? FA_READ | FA_WRITE | FA_OPEN_ALWAYS : FA_READ))
+		return SN_CORRUPTED;	// the index refers to it
+	data_open = true;
+	return SN_OK;
+}
+
+static void close_files() {
+	if(data_open)
+		f_close(&data_file);
+	data_open = false;
+	f_close(&index_file);
+}
+
+/***
+ *	Rebuild where each sector is found after the first count snapshots: the
+ *	offset of its latest copy in the data file, NOT_STORED if none holds it.
+ *	The index is read once, in order.
+ */
+static uint32_t locate(uint32_t count, uint32_t* where) {
+	for(sector_t sector = 0; sector < MC_SEC_COUNT; sector++)
+		where[sector] = NOT_STORED;
+	if(FR_OK != f_lseek(&index_file, sizeof(header)))
+		return SN_FILE_ERR;
+	for(uint32_t i = 0; i < count; i++) {
+		UINT bytes_read;
+		if(FR_OK != f_read(&index_file, &entry, sizeof(entry), &bytes_read) || bytes_read != sizeof(entry))
+			return SN_FILE_ERR;
+		uint32_t offset = entry.offset;
+		for(uint32_t word = 0; word < MC_DIRTY_WORDS; word++) {
+			for(uint32_t bits = entry.map[word]; bits; bits &= bits - 1) {
+				where[word * 32 + __builtin_ctz(bits)] = offset;
+				offset += MC_SEC_SIZE;
+			}
+		}
+		if(offset - entry.offset != entry.sectors * MC_SEC_SIZE || offset > header.data_size)
+			return SN_CORRUPTED;
+	}
+	return SN_OK;
+}
+
+/* Content of a sector at the point located, a freshly formatted one when never stored */
+static uint32_t read_sector(sector_t sector, uint32_t offset, uint8_t* out) {
+	UINT bytes_read;
+	if(offset == NOT_STORED) {
+		memory_card_blank_sector(sector, out);
+		return SN_OK;
+	}
+	if(FR_OK != f_lseek(&data_file, offset) ||
+		FR_OK != f_read(&data_file, out, MC_SEC_SIZE, &bytes_read) || bytes_read != MC_SEC_SIZE)
+		return SN_FILE_ERR;
+	return SN_OK;
+}
+
+/* Copy a sector core1 may be writing, false if it changed meanwhile */
+static bool copy_sector(memory_card_t* mc, sector_t sector, uint8_t* out) {
+	uint16_t generation = mc->meta[sector].generation;
+	__dmb();
+	memcpy(out, &mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE);
+	__dmb();
+	return !(generation & 1) && generation == mc->meta[sector].generation;
+}
+
+/***
+ *	Sectors of the image differing from the latest snapshot, read back from the
+ *	SD card. Only needed for the first snapshot after an image is loaded, later
+ *	ones take the sectors the sync path reported.
+ */
+static uint32_t compare_latest(memory_card_t* mc, uint32_t* map) {
+	uint8_t ram[MC_SEC_SIZE];
+	uint8_t stored[MC_SEC_SIZE];
+	uint32_t* where = malloc(MC_SEC_COUNT * sizeof(uint32_t));
+	if(!where)
+		return SN_ALLOC_FAIL;
+	uint32_t status = locate(header.count, where);
+	for(sector_t sector = 0; sector < MC_SEC_COUNT && status == SN_OK; sector++) {
+		status = read_sector(sector, where[sector], stored);
+		if(status == SN_OK && !copy_sector(mc, sector, ram))
+			status = SN_BUSY;
+		if(status == SN_OK && memcmp(ram, stored, MC_SEC_SIZE))
+			map[sector / 32] |= 1u << (sector % 32);
+	}
+	free(where);
+	return status;
+}
+
+/* Append the sectors of map to the data file, then commit them with an index entry */
+static uint32_t append(memory_card_t* mc, uint8_t reason, const uint32_t* map, uint32_t sectors) {
+	uint8_t buffer[MC_SEC_SIZE];
+	UINT bytes_written;
+	if(header.count >= SNAPSHOT_MAX_COUNT)
+		return SN_FULL;
+	if(FR_OK != f_lseek(&data_file, header.data_size))
+		return SN_FILE_ERR;
+	for(uint32_t word = 0; word < MC_DIRTY_WORDS; word++) {
+		for(uint32_t bits = map[word]; bits; bits &= bits - 1) {
+			if(!copy_sector(mc, word * 32 + __builtin_ctz(bits), buffer))
+				return SN_BUSY;	// the partial data is overwritten by the next attempt
+			if(FR_OK != f_write(&data_file, buffer, MC_SEC_SIZE, &bytes_written) || bytes_written != MC_SEC_SIZE)
+				return SN_FILE_ERR;
+		}
+	}
+	if(FR_OK != f_sync(&data_file))
+		return SN_FILE_ERR;
+
+	/* data is on the SD card before the entry referring to it, and the entry before the count */
+	entry.offset = header.data_size;
+	entry.uptime_s = time_us_64() / 1000000;
+	entry.writes = mc->write_count;
+	entry.sectors = sectors;
+	entry.reason = reason;
+	entry.reserved = 0;
+	memcpy(entry.map, map, sizeof(entry.map));
+	if(FR_OK != f_lseek(&index_file, sizeof(header) + (FSIZE_t) header.count * sizeof(entry)) ||
+		FR_OK != f_write(&index_file, &entry, sizeof(entry), &bytes_written) || bytes_written != sizeof(entry) ||
+		FR_OK != f_sync(&index_file))
+		return SN_FILE_ERR;
+	header.count++;
+	header.data_size += sectors * MC_SEC_SIZE;
+	if(FR_OK != f_lseek(&index_file, 0) ||
+		FR_OK != f_write(&index_file, &header, sizeof(header), &bytes_written) || bytes_written != sizeof(header) ||
+		FR_OK != f_sync(&index_file))
+		return SN_FILE_ERR;
+	stats.taken++;
+	stats.sectors += sectors;
+	return SN_OK;
+}
+
+void snapshot_init() {
+	chain.valid = false;
+	memset(&stats, 0, sizeof(stats));
+}
+
+/* The volume was mounted again, snapshot files may have been changed by the USB host */
+void snapshot_invalidate() {
+	chain.valid = false;
+}
+
+/***
+ *	Record the image served (mc->channel of name) as a new snapshot. Sectors
+ *	reported changed by the sync path since the last snapshot are stored; the
+ *	first snapshot after the image was loaded compares every sector with the
+ *	latest one instead, which also catches changes made on a PC. Nothing is
+ *	recorded when no sector changed, index then receives SN_NO_INDEX. Pending
+ *	writes should have been synced. Without write_transaction held, a sector
+ *	the PSX rewrites meanwhile makes it return SN_BUSY.
+ */
+uint32_t snapshot_take(memory_card_t* mc, const uint8_t* name, uint8_t reason, uint32_t* index) {
+	uint32_t map[MC_DIRTY_WORDS] = { 0 };
+	uint64_t start = time_us_64();
+	*index = SN_NO_INDEX;
+	uint32_t status = open_index(name, mc->channel, true);
+	if(status != SN_OK)
+		return status;
+	status = open_data(name, mc->channel, true);
+	bool same_image = chain.valid && chain.import_count == mc->import_count &&
+		chain.channel == mc->channel && !strcmp(chain.name, name);
+	if(status == SN_OK && same_image)
+		memcpy(map, mc->changed, sizeof(map));
+	else if(status == SN_OK)
+		status = compare_latest(mc, map);
+	map[MC_TEST_SEC / 32] &= ~(1u << (MC_TEST_SEC % 32));	// test writes are not part of the card
+	uint32_t sectors = 0;
+	for(uint32_t word = 0; word < MC_DIRTY_WORDS; word++)
+		sectors += __builtin_popcount(map[word]);
+
+	if(status == SN_OK && header.count && !sectors) {
+		stats.unchanged++;
+	} else if(status == SN_OK) {
+		status = append(mc, reason, map, sectors);
+		if(status == SN_OK)
+			*index = header.count - 1;
+	}
+	if(status == SN_OK) {
+		chain.valid = true;
+		strcpy(chain.name, name);
+		chain.channel = mc->channel;
+		chain.import_count = mc->import_count;
+		for(uint32_t word = 0; word < MC_DIRTY_WORDS; word++)
+			mc->changed[word] = 0;
+	} else if(!same_image) {
+		chain.valid = false;
+	}
+	close_files();
+	stats.last_us = time_us_64() - start;
+	return status;
+}
+
+/***
+ *	Describe up to max snapshots of a channel of name, starting from first.
+ *	count receives how many were written to out and total how many the
+ *	channel has, both 0 when it has none.
+ */
+uint32_t snapshot_list(const uint8_t* name, uint32_t channel, uint32_t first, snapshot_info_t* out, uint32_t max, uint32_t* count, uint32_t* total) {
+	*count = *total = 0;
+	uint32_t status = open_index(name, channel, false);
+	if(status == SN_NOT_FOUND)
+		return SN_OK;
+	if(status != SN_OK)
+		return status;
+	*total = header.count;
+	if(first < header.count && FR_OK != f_lseek(&index_file, sizeof(header) + (FSIZE_t) first * sizeof(entry)))
+		status = SN_FILE_ERR;
+	for(uint32_t i = first; i < header.count && *count < max && status == SN_OK; i++) {
+		UINT bytes_read;
+		if(FR_OK != f_read(&index_file, &entry, sizeof(entry), &bytes_read) || bytes_read != sizeof(entry)) {
+			status = SN_FILE_ERR;
+			break;
+		}
+		out[*count].index = i;
+		out[*count].sectors = entry.sectors;
+		out[*count].reason = entry.reason;
+		out[*count].channel = channel;
+		out[*count].uptime_s = entry.uptime_s;
+		out[*count].writes = entry.writes;
+		(*count)++;
+	}
+	close_files();
+	return status;
+}
+
+/***
+ *	Bring the image served back to snapshot index: each sector differing from
+ *	its copy at that point is replaced and written through to the image file.
+ *	The caller holds write_transaction and has synced pending writes, then
+ *	flushes the image and lets the PSX see the card reinserted. restored
+ *	receives the number of sectors replaced.
+ */
+uint32_t snapshot_restore(memory_card_t* mc, const uint8_t* name, uint32_t index, uint32_t* restored) {
+	uint8_t stored[MC_SEC_SIZE];
+	uint64_t start = time_us_64();
+	*restored = 0;
+	uint32_t status = open_index(name, mc->channel, false);
+	if(status != SN_OK)
+		return status;
+	if(index >= header.count)
+		status = SN_NOT_FOUND;
+	if(status == SN_OK)
+		status = open_data(name, mc->channel, false);
+	uint32_t* where = NULL;
+	if(status == SN_OK) {
+		where = malloc(MC_SEC_COUNT * sizeof(uint32_t));
+		status = where ? locate(index + 1, where) : SN_ALLOC_FAIL;
+	}
+	for(sector_t sector = 0; sector < MC_SEC_COUNT && status == SN_OK; sector++) {
+		if(sector == MC_TEST_SEC)
+			continue;
+		status = read_sector(sector, where[sector], stored);
+		if(status != SN_OK || !memcmp(stored, memory_card_get_sector_ptr(mc, sector), MC_SEC_SIZE))
+			continue;
+		if(memory_card_restore_sector(mc, sector, stored) != MC_OK)
+			status = SN_FILE_ERR;
+		(*restored)++;
+	}
+	free(where);
+	close_files();
+	stats.restores++;
+	stats.restored_sectors += *restored;
+	stats.last_us = time_us_64() - start;
+	return status;
+}
+
+void snapshot_get_stats(snapshot_stats_t* out) {
+	*out = stats;
+}
@@ -0,0 +1,80 @@
+#include "switch_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HISTOGRAM_BUCKETS	24	// bucket i counts samples below 2^(i+1) us, the last one everything above
+
+typedef struct {
+	uint32_t samples[SWITCH_STATS_WINDOW];
+	uint32_t next;		// where the next sample goes in samples
+	uint32_t count;
+	uint32_t histogram[HISTOGRAM_BUCKETS];
+} phase_t;
+
+static phase_t phases[SWITCH_PHASE_COUNT];
+
+static const char* const phase_names[SWITCH_PHASE_COUNT] = {
+	"pickup", "sync", "lookup", "import", "reconnect", "1st read", "total"
+};
+
+static int compare_samples(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*) a;
+	uint32_t y = *(const uint32_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+void switch_stats_reset() {
+	memset(phases, 0, sizeof(phases));
+}
+
+void switch_stats_record(uint32_t phase, uint32_t us) {
+	if(phase >= SWITCH_PHASE_COUNT)
+		return;
+	phase_t* p = &phases[phase];
+	p->samples[p->next] = us;
+	p->next = (p->next + 1) % SWITCH_STATS_WINDOW;
+	p->count++;
+	uint32_t bucket = 0;
+	while(bucket < HISTOGRAM_BUCKETS - 1 && us >= (2u << bucket))
+		bucket++;
+	p->histogram[bucket]++;
+}
+
+/* min/avg/p99/max over the window, sorting a copy: only meant for queries, not for the switch path */
+void switch_stats_get(uint32_t phase, switch_phase_stats_t* stats) {
+	static uint32_t sorted[SWITCH_STATS_WINDOW];
+	memset(stats, 0, sizeof(*stats));
+	if(phase >= SWITCH_PHASE_COUNT)
+		return;
+	phase_t* p = &phases[phase];
+	uint32_t n = p->count < SWITCH_STATS_WINDOW ? p->count : SWITCH_STATS_WINDOW;
+	stats->count = p->count;
+	if(!n)
+		return;
+	uint64_t sum = 0;
+	for(uint32_t i = 0; i < n; i++)
+		sum += sorted[i] = p->samples[i];
+	qsort(sorted, n, sizeof(uint32_t), compare_samples);
+	stats->min = sorted[0];
+	stats->avg = sum / n;
+	stats->p99 = sorted[(n * 99 + 99) / 100 - 1];	// nearest rank
+	stats->max = sorted[n - 1];
+}
+
+void switch_stats_print() {
+	printf("Card switch latency (us, last %u switches)\n", SWITCH_STATS_WINDOW);
+	printf("%-10s %6s %9s %9s %9s %9s\n", "phase", "count", "min", "avg", "p99", "max");
+	for(uint32_t phase = 0; phase < SWITCH_PHASE_COUNT; phase++) {
+		switch_phase_stats_t stats;
+		switch_stats_get(phase, &stats);
+		printf("%-10s %6u %9u %9u %9u %9u\n", phase_names[phase], (unsigned) stats.count,
+			(unsigned) stats.min, (unsigned) stats.avg, (unsigned) stats.p99, (unsigned) stats.max);
+	}
+	printf("Histogram of %s (us < bound: count)\n", phase_names[SWITCH_PHASE_TOTAL]);
+	for(uint32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+		if(phases[SWITCH_PHASE_TOTAL].histogram[bucket])
+			printf("  %s%9u: %u\n", bucket == HISTOGRAM_BUCKETS - 1 ? ">=" : "< ",
+				bucket == HISTOGRAM_BUCKETS - 1 ? (1u << bucket) : (2u << bucket),
+				(unsigned) phases[SWITCH_PHASE_TOTAL].histogram[bucket]);
+}
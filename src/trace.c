@@ -0,0 +1,52 @@
+#include "trace.h"
+#include <stdio.h>
+
+trace_ring_t trace_ring;
+
+/* Records left from a previous output are discarded, switching output starts a fresh trace */
+void trace_set_output(uint32_t output) {
+	trace_ring.output = TRACE_OFF;
+	__dmb();
+	trace_ring.tail = trace_ring.head;
+	trace_ring.dropped = 0;
+	__dmb();
+	trace_ring.output = output;
+}
+
+uint32_t trace_get_output() {
+	return trace_ring.output;
+}
+
+/* Copy up to max records out of the ring (core0), returns how many */
+uint32_t trace_pop(trace_record_t* records, uint32_t max) {
+	uint32_t tail = trace_ring.tail;
+	uint32_t count = trace_ring.head - tail;
+	if(count > max)
+		count = max;
+	__dmb();	// records read after head
+	for(uint32_t i = 0; i < count; i++)
+		records[i] = trace_ring.records[(tail + i) % TRACE_RING_SIZE];
+	__dmb();
+	trace_ring.tail = tail + count;
+	return count;
+}
+
+void trace_print(const trace_record_t* record) {
+	printf("%10u cmd %02x sector %03x status %02x bytes %u\n", (unsigned) record->time,
+		record->command, record->address, record->status, record->bytes);
+}
+
+/***
+ *	Average cost of trace_push() in ns, measured on the calling core with the
+ *	ring enabled and not full. The ring is left empty and off.
+ */
+uint32_t trace_measure_push() {
+	const uint32_t count = TRACE_RING_SIZE;
+	trace_set_output(TRACE_UART);
+	uint64_t start = time_us_64();
+	for(uint32_t i = 0; i < count; i++)
+		trace_push(0x52, i, 0x47, 128);
+	uint64_t elapsed = time_us_64() - start;
+	trace_set_output(TRACE_OFF);
+	return elapsed * 1000 / count;
+}
@@ -0,0 +1,284 @@
+#include "transfer.h"
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "ff.h"
+#include "crc32.h"
+
+static const char shadow_filename[] = "UPLOAD.TMP";
+
+/* Image being sent, from the RAM copy of the card served or from its file */
+static struct {
+	bool active;
+	memory_card_t* mc;			// NULL when reading a stored image
+	uint32_t import_count;		// mc->import_count when started
+	FIL file;
+	uint32_t channel;
+	sector_t next;
+	int32_t block;				// SD block held by buffer, -1 if none
+	uint8_t buffer[BLOCK_SIZE];
+} download = { .block = -1 };
+
+/* Image being received into the shadow file */
+static struct {
+	bool active;
+	bool verified;				// whole image checked, waiting for the simulator to swap it in
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t channel;
+	FIL shadow;
+	uint32_t received[MC_DIRTY_WORDS];	// sectors written to the shadow file
+} upload;
+
+static transfer_stats_t stats;
+
+/* Channel count of an image file, 0 if it is not one */
+static uint32_t image_channels(const uint8_t* name) {
+	FILINFO info;
+	if(FR_OK != f_stat(name, &info) || (info.fattrib & AM_DIR) || !MC_IS_IMAGE_SIZE(info.fsize))
+		return 0;
+	return info.fsize / MC_SIZE;
+}
+
+static void end_download() {
+	if(download.active && !download.mc)
+		f_close(&download.file);
+	download.active = false;
+	download.block = -1;
+}
+
+static void end_upload() {
+	if(upload.active) {
+		f_close(&upload.shadow);
+		f_unlink(shadow_filename);
+	}
+	upload.active = upload.verified = false;
+}
+
+void transfer_init() {
+	end_download();
+	end_upload();
+	memset(&stats, 0, sizeof(stats));
+}
+
+/* The volume was mounted again, open files predate what the USB host wrote */
+void transfer_invalidate() {
+	if(download.active && !download.mc)
+		download.active = false;	// not closed, its FatFs state is stale
+	download.block = -1;
+	upload.active = upload.verified = false;
+}
+
+/***
+ *	Start sending sectors first to the end of an image channel. name NULL (or
+ *	empty) sends the card served from mc, otherwise a stored image is read
+ *	from SD. Any download in progress is replaced.
+ */
+uint32_t transfer_download(memory_card_t* mc, const uint8_t* name, uint32_t channel, uint32_t first) {
+	end_download();
+	if(first >= MC_SEC_COUNT)
+		return XFER_OK;	// nothing left to send
+	if(name && name[0]) {
+		if(channel >= image_channels(name))
+			return XFER_BAD_IMAGE;
+		if(FR_OK != f_open(&download.file, name, FA_READ))
+			return XFER_FILE_ERR;
+		download.mc = NULL;
+	} else {
+		download.mc = mc;
+		download.import_count = mc->import_count;
+	}
+	download.channel = channel;
+	download.next = first;
+	download.active = true;
+	return XFER_OK;
+}
+
+bool transfer_downloading() {
+	return download.active;
+}
+
+/* Copy a sector of the card served, false if not loaded yet or being written by core1 */
+static bool copy_ram_sector(sector_t sector, uint8_t* out) {
+	memory_card_t* mc = download.mc;
+	if(!(mc->resident[sector / 32] & (1u << (sector % 32))))
+		return false;
+	uint16_t generation = mc->meta[sector].generation;
+	__dmb();
+	memcpy(out, &mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE);
+	__dmb();
+	return !(generation & 1) && generation == mc->meta[sector].generation;
+}
+
+static uint32_t copy_file_sector(sector_t sector, uint8_t* out) {
+	int32_t block = sector / MC_SEC_PER_BLOCK;
+	if(block != download.block) {
+		UINT bytes_read;
+		download.block = -1;
+		if(FR_OK != f_lseek(&download.file, (FSIZE_t) download.channel * MC_SIZE + block * BLOCK_SIZE) ||
+			FR_OK != f_read(&download.file, download.buffer, BLOCK_SIZE, &bytes_read) || bytes_read != BLOCK_SIZE)
+			return XFER_FILE_ERR;
+		download.block = block;
+	}
+	memcpy(out, &download.buffer[(sector % MC_SEC_PER_BLOCK) * MC_SEC_SIZE], MC_SEC_SIZE);
+	return XFER_OK;
+}
+
+/***
+ *	Build the next frame payload of the download into out (XFER_FRAME_SIZE
+ *	bytes): the sector data is copied there straight from the RAM copy of the
+ *	card, so the console writes it to USB without staging. built is false when
+ *	nothing could be sent now (sector still streaming in, or being written by
+ *	the PSX). On error the download ends.
+ */
+uint32_t transfer_download_frame(uint8_t* out, bool* built) {
+	*built = false;
+	if(!download.active)
+		return XFER_OK;
+	uint32_t status = XFER_OK;
+	sector_t sector = download.next;
+	if(download.mc && download.mc->import_count != download.import_count)
+		status = XFER_CHANGED;
+	else if(download.mc && !copy_ram_sector(sector, &out[2]))
+		return XFER_OK;	// sent on a later call
+	else if(!download.mc)
+		status = copy_file_sector(sector, &out[2]);
+	if(status != XFER_OK) {
+		end_download();
+		return status;
+	}
+	out[0] = sector;
+	out[1] = sector >> 8;
+	uint32_t crc = crc32(out, 2 + MC_SEC_SIZE);
+	memcpy(&out[2 + MC_SEC_SIZE], &crc, 4);
+	*built = true;
+	stats.sectors_sent++;
+	if(++download.next == MC_SEC_COUNT)
+		end_download();
+	return XFER_OK;
+}
+
+/***
+ *	Start or resume an upload to an image channel. Starting again with the same
+ *	target keeps the sectors already received, received and first_missing
+ *	(MC_SEC_COUNT once complete) tell the host where to resume.
+ */
+uint32_t transfer_upload(const uint8_t* name, uint32_t channel, uint32_t* received, uint32_t* first_missing) {
+	if(!upload.active || upload.channel != channel || strcmp(upload.name, name)) {
+		end_upload();
+		if(channel >= image_channels(name))
+			return XFER_BAD_IMAGE;
+		if(FR_OK != f_open(&upload.shadow, shadow_filename, FA_READ | FA_WRITE | FA_CREATE_ALWAYS))
+			return XFER_FILE_ERR;
+		strcpy(upload.name, name);
+		upload.channel = channel;
+		memset(upload.received, 0, sizeof(upload.received));
+		upload.active = true;
+	}
+	upload.verified = false;
+	*received = 0;
+	*first_missing = MC_SEC_COUNT;
+	for(uint32_t word = 0; word < MC_DIRTY_WORDS; word++) {
+		*received += __builtin_popcount(upload.received[word]);
+		if(*first_missing == MC_SEC_COUNT && ~upload.received[word])
+			*first_missing = word * 32 + __builtin_ctz(~upload.received[word]);
+	}
+	return XFER_OK;
+}
+
+/* Check a sector frame and write it to the shadow file as received, a bad one is resent by the host */
+uint32_t transfer_upload_sector(const uint8_t* frame) {
+	uint32_t crc;
+	UINT bytes_written;
+	if(!upload.active || upload.verified)
+		return XFER_INCOMPLETE;
+	memcpy(&crc, &frame[2 + MC_SEC_SIZE], 4);
+	sector_t sector = frame[0] | frame[1] << 8;
+	if(sector >= MC_SEC_COUNT || crc != crc32(frame, 2 + MC_SEC_SIZE)) {
+		stats.bad_crcs++;
+		return XFER_BAD_CRC;
+	}
+	if(FR_OK != f_lseek(&upload.shadow, sector * MC_SEC_SIZE) ||
+		FR_OK != f_write(&upload.shadow, &frame[2], MC_SEC_SIZE, &bytes_written) || bytes_written != MC_SEC_SIZE)
+		return XFER_FILE_ERR;
+	upload.received[sector / 32] |= 1u << (sector % 32);
+	stats.sectors_received++;
+	return XFER_OK;
+}
+
+/***
+ *	Check the shadow file, as read back from the SD card, against the CRC32 of
+ *	the whole image sent by the host. A mismatch drops every sector received,
+ *	the host starts over. Once verified, the upload waits for
+ *	transfer_swap_pending() to be picked up by the simulator.
+ */
+uint32_t transfer_commit(uint32_t crc) {
+	uint8_t buffer[BLOCK_SIZE];
+	uint32_t received, first_missing;
+	if(!upload.active)
+		return XFER_INCOMPLETE;
+	transfer_upload(upload.name, upload.channel, &received, &first_missing);
+	if(received != MC_SEC_COUNT)
+		return XFER_INCOMPLETE;
+	if(FR_OK != f_sync(&upload.shadow) || FR_OK != f_lseek(&upload.shadow, 0))
+		return XFER_FILE_ERR;
+	uint32_t shadow_crc = 0;
+	for(uint32_t block = 0; block < MC_BLOCK_COUNT; block++) {
+		UINT bytes_read;
+		if(FR_OK != f_read(&upload.shadow, buffer, BLOCK_SIZE, &bytes_read) || bytes_read != BLOCK_SIZE)
+			return XFER_FILE_ERR;
+		shadow_crc = crc32_update(shadow_crc, buffer, BLOCK_SIZE);
+	}
+	if(shadow_crc != crc) {
+		memset(upload.received, 0, sizeof(upload.received));
+		return XFER_BAD_CRC;
+	}
+	upload.verified = true;
+	return XFER_OK;
+}
+
+/* A verified upload is waiting to be swapped in, name and channel receive its target */
+bool transfer_swap_pending(uint8_t* name, uint32_t* channel) {
+	if(!upload.active || !upload.verified)
+		return false;
+	strcpy(name, upload.name);
+	*channel = upload.channel;
+	return true;
+}
+
+/***
+ *	Copy the verified upload over its target channel and remove the shadow
+ *	file, which is dropped even if the copy failed. The image must not be open as the card served: the simulator holds
+ *	write_transaction, closes it, and imports it again afterwards.
+ */
+uint32_t transfer_apply() {
+	uint8_t buffer[BLOCK_SIZE];
+	FIL target;
+	uint32_t status = XFER_OK;
+	uint64_t start = time_us_64();
+	if(!upload.active || !upload.verified)
+		return XFER_INCOMPLETE;
+	if(FR_OK != f_open(&target, upload.name, FA_WRITE) ||
+		FR_OK != f_lseek(&target, (FSIZE_t) upload.channel * MC_SIZE)) {
+		end_upload();
+		return XFER_FILE_ERR;
+	}
+	if(FR_OK != f_lseek(&upload.shadow, 0))
+		status = XFER_FILE_ERR;
+	for(uint32_t block = 0; block < MC_BLOCK_COUNT && status == XFER_OK; block++) {
+		UINT bytes;
+		if(FR_OK != f_read(&upload.shadow, buffer, BLOCK_SIZE, &bytes) || bytes != BLOCK_SIZE ||
+			FR_OK != f_write(&target, buffer, BLOCK_SIZE, &bytes) || bytes != BLOCK_SIZE)
+			status = XFER_FILE_ERR;
+	}
+	if(FR_OK != f_close(&target))
+		status = XFER_FILE_ERR;
+	end_upload();	// also on error, the simulator would keep retrying it
+	if(status == XFER_OK)
+		stats.swaps++;
+	stats.swap_us = time_us_64() - start;
+	return status;
+}
+
+void transfer_get_stats(transfer_stats_t* out) {
+	*out = stats;
+}
@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+"""Talk to the PicoMemcard USB CDC console (see inc/console.h).
+
+usage: console.py <port> [counters|image|stream [period ms] [seconds]|trace [seconds]|snapshots|restore <snapshot>
+                          |download <file> [image] [channel]|upload <file> [image] [channel]]
+
+Needs pyserial. stream prints one line per sample, e.g. at 100 Hz with the
+default 10 ms period. snapshots and restore apply to the card being served.
+download and upload move a 128 KB channel image, of the card being served
+unless an image on the SD card (e.g. FF7/0.MCR) and a channel (from 1) are
+given; an upload to the card being served swaps it in on the PSX.
+"""
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+SOF = 0xA5
+REPLY = 0x80
+PING, COUNTERS, IMAGE, STREAM, TRACE, TRACE_DATA, ERROR = 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0xFF
+SNAPSHOTS, RESTORE = 0x07, 0x08
+DOWNLOAD, SECTOR_DATA, UPLOAD, COMMIT = 0x09, 0x0A, 0x0B, 0x0C
+BAD_CRC = 7
+SECTOR_SIZE, SECTOR_COUNT = 128, 1024
+COUNTER_FIELDS = ("uptime_ms", "reads", "writes", "ids", "bad_checksums", "pending", "max_pending",
+                  "sector_syncs", "sd_write_last_us", "sd_write_max_us", "free_heap", "channel", "dropped",
+                  "trace_dropped", "sd_baud_rate", "sd_crc_errors", "sd_fallbacks",
+                  "first_ack_us")
+TRACE_RECORD = struct.Struct("<IHHBBxx")    # time, address, bytes, command, status
+SNAPSHOT_INFO = struct.Struct("<HHBBII")    # index, sectors, reason, channel, uptime, writes
+SNAPSHOT_REASONS = ("boot", "switch", "writes", "usb", "before restore", "restored", "before upload", "uploaded")
+
+
+def send(port, command, payload=b""):
+    checksum = command ^ len(payload)
+    for byte in payload:
+        checksum ^= byte
+    port.write(bytes([SOF, command, len(payload)]) + payload + bytes([checksum]))
+
+
+def receive(port):
+    """Next valid frame as (command, payload), None on timeout."""
+    while True:
+        byte = port.read(1)
+        if not byte:
+            return None
+        if byte[0] != SOF:
+            continue
+        header = port.read(2)
+        if len(header) < 2:
+            return None
+        command, length = header
+        body = port.read(length + 1)
+        if len(body) < length + 1:
+            return None
+        checksum = command ^ length
+        for byte in body[:-1]:
+            checksum ^= byte
+        if checksum == body[-1]:
+            return command, body[:-1]
+
+
+def request(port, command, payload=b"", errors=()):
+    """Reply payload, None for an error listed in errors, other errors exit."""
+    send(port, command, payload)
+    while True:
+        frame = receive(port)
+        if frame is None:
+            sys.exit("no reply")
+        if frame[0] == ERROR and frame[1][0] == command:
+            if frame[1][1] in errors:
+                return None
+            sys.exit("error %d on command %02x" % (frame[1][1], frame[1][0]))
+        if frame[0] == command | REPLY:
+            return frame[1]
+
+
+def download(port, target):
+    """Image sent as SECTOR_DATA frames, asked again from the first one lost or damaged."""
+    image = bytearray(SECTOR_COUNT * SECTOR_SIZE)
+    sector = 0
+    while sector < SECTOR_COUNT:
+        request(port, DOWNLOAD, struct.pack("<H", sector) + target)
+        while sector < SECTOR_COUNT:
+            frame = receive(port)
+            if frame is None or frame[0] != SECTOR_DATA:
+                if frame is None or frame[0] == ERROR:
+                    break
+                continue
+            number, data, crc = struct.unpack("<H%dsI" % SECTOR_SIZE, frame[1])
+            if number != sector or crc != zlib.crc32(frame[1][:-4]):
+                break
+            image[sector * SECTOR_SIZE:(sector + 1) * SECTOR_SIZE] = data
+            sector += 1
+    return bytes(image)
+
+
+def upload(port, target, image):
+    """Sectors sent back to back from the first one missing, then checked as a whole."""
+    for _ in range(4):
+        received, first = struct.unpack("<HH", request(port, UPLOAD, target))
+        if first == SECTOR_COUNT:
+            if request(port, COMMIT, struct.pack("<I", zlib.crc32(image)), (BAD_CRC,)) is not None:
+                return True
+            continue    # damaged on the SD card, all sectors are sent again
+        for sector in range(first, SECTOR_COUNT):
+            payload = struct.pack("<H", sector) + image[sector * SECTOR_SIZE:(sector + 1) * SECTOR_SIZE]
+            send(port, SECTOR_DATA, payload + struct.pack("<I", zlib.crc32(payload)))
+    return False
+
+
+def counters(payload):
+    return dict(zip(COUNTER_FIELDS, struct.unpack("<%dI" % len(COUNTER_FIELDS), payload)))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    port = serial.Serial(sys.argv[1], timeout=1)
+    action = sys.argv[2] if len(sys.argv) > 2 else "counters"
+    print("protocol version %d" % request(port, PING)[0])
+    if action == "counters":
+        for name, value in counters(request(port, COUNTERS)).items():
+            print("%-18s %u" % (name, value))
+    elif action == "image":
+        print(request(port, IMAGE).decode())
+    elif action == "stream":
+        period = int(sys.argv[3]) if len(sys.argv) > 3 else 10
+        seconds = float(sys.argv[4]) if len(sys.argv) > 4 else 5
+        request(port, STREAM, struct.pack("<H", period))
+        end = time.time() + seconds
+        try:
+            while time.time() < end:
+                frame = receive(port)
+                if frame and frame[0] == COUNTERS | REPLY:
+                    print(" ".join("%s=%u" % item for item in counters(frame[1]).items()))
+        finally:
+            send(port, STREAM, struct.pack("<H", 0))
+    elif action == "trace":
+        seconds = float(sys.argv[3]) if len(sys.argv) > 3 else 5
+        request(port, TRACE, b"\x01")
+        end = time.time() + seconds
+        try:
+            while time.time() < end:
+                frame = receive(port)
+                if frame and frame[0] == TRACE_DATA:
+                    for record in TRACE_RECORD.iter_unpack(frame[1]):
+                        print("%10u cmd %02x sector %03x status %02x bytes %u"
+                              % (record[0], record[3], record[1], record[4], record[2]))
+        finally:
+            send(port, TRACE, b"\x00")
+    elif action == "snapshots":
+        first, total = 0, 1
+        while first < total:
+            payload = request(port, SNAPSHOTS, struct.pack("<H", first))
+            total = struct.unpack_from("<H", payload)[0]
+            infos = list(SNAPSHOT_INFO.iter_unpack(payload[2:]))
+            if not infos:
+                break
+            for index, sectors, reason, channel, uptime, writes in infos:
+                reason = SNAPSHOT_REASONS[reason] if reason < len(SNAPSHOT_REASONS) else str(reason)
+                print("%4u channel %u %-14s %4u sectors  uptime %6u s  writes %u"
+                      % (index, channel + 1, reason, sectors, uptime, writes))
+            first = infos[-1][0] + 1
+        print("%u snapshots of %s" % (total, request(port, IMAGE).decode()))
+    elif action in ("download", "upload") and len(sys.argv) > 3:
+        name = sys.argv[4].encode() if len(sys.argv) > 4 else b""
+        channel = int(sys.argv[5]) - 1 if len(sys.argv) > 5 else 0
+        target = struct.pack("<B", channel) + name
+        start = time.time()
+        if action == "download":
+            with open(sys.argv[3], "wb") as file:
+                file.write(download(port, target))
+        else:
+            with open(sys.argv[3], "rb") as file:
+                image = file.read()
+            if len(image) != SECTOR_COUNT * SECTOR_SIZE:
+                sys.exit("%s is not a single channel image" % sys.argv[3])
+            if not upload(port, target, image):
+                sys.exit("upload not verified")
+        elapsed = time.time() - start
+        print("%s %s in %.2f s (%.0f KB/s)" % (action, name.decode() or request(port, IMAGE).decode(),
+                                               elapsed, SECTOR_COUNT * SECTOR_SIZE / 1024 / elapsed))
+    elif action == "restore" and len(sys.argv) > 3:
+        request(port, RESTORE, struct.pack("<H", int(sys.argv[3])))
+        print("restoring snapshot %s of %s" % (sys.argv[3], request(port, IMAGE).decode()))
+    else:
+        sys.exit(__doc__)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""Throughput of PicoMemcard in USB mass storage mode.
+
+usage: msc_bench.py <mount point> [size MB] [random ops]
+
+Writes and reads back a test file on the mounted drive: sequential in 64 KB
+requests, then random 4 KB reads and writes within the file. The page cache is
+bypassed with O_DIRECT where available, otherwise dropped with fsync and
+posix_fadvise. The test file is removed at the end.
+"""
+import mmap
+import os
+import random
+import sys
+import time
+
+SEQ_REQUEST = 64 * 1024
+RANDOM_REQUEST = 4 * 1024
+
+
+def open_file(path, flags):
+    direct = getattr(os, "O_DIRECT", 0)
+    try:
+        return os.open(path, flags | direct, 0o644), bool(direct)
+    except OSError:
+        return os.open(path, flags, 0o644), False
+
+
+def drop_cache(fd, direct):
+    os.fsync(fd)
+    if not direct and hasattr(os, "posix_fadvise"):
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+
+
+def report(name, size, elapsed, ops=None):
+    line = "%-14s %8.1f KB/s" % (name, size / 1024 / elapsed)
+    if ops:
+        line += " %8.1f IOPS %8.2f ms/op" % (ops / elapsed, elapsed * 1000 / ops)
+    print(line)
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    path = os.path.join(sys.argv[1], "MSCBENCH.BIN")
+    size = int(float(sys.argv[2]) * 1024 * 1024) if len(sys.argv) > 2 else 4 * 1024 * 1024
+    size -= size % SEQ_REQUEST
+    ops = int(sys.argv[3]) if len(sys.argv) > 3 else 256
+    buffer = mmap.mmap(-1, SEQ_REQUEST)     # page aligned, as O_DIRECT requires
+    buffer.write(os.urandom(SEQ_REQUEST))
+    small = mmap.mmap(-1, RANDOM_REQUEST)
+    small.write(os.urandom(RANDOM_REQUEST))
+    try:
+        fd, direct = open_file(path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC)
+        start = time.time()
+        for _ in range(size // SEQ_REQUEST):
+            os.write(fd, buffer)
+        drop_cache(fd, direct)
+        report("seq write", size, time.time() - start)
+        os.close(fd)
+
+        fd, direct = open_file(path, os.O_RDONLY)
+        drop_cache(fd, direct)
+        start = time.time()
+        while os.readv(fd, [buffer]):
+            pass
+        report("seq read", size, time.time() - start)
+
+        offsets = [random.randrange(size // RANDOM_REQUEST) * RANDOM_REQUEST for _ in range(ops)]
+        start = time.time()
+        for offset in offsets:
+            os.preadv(fd, [small], offset)
+        report("4K rand read", ops * RANDOM_REQUEST, time.time() - start, ops)
+        os.close(fd)
+
+        fd, direct = open_file(path, os.O_WRONLY)
+        start = time.time()
+        for offset in offsets:
+            os.pwrite(fd, small, offset)
+        drop_cache(fd, direct)
+        report("4K rand write", ops * RANDOM_REQUEST, time.time() - start, ops)
+        os.close(fd)
+    finally:
+        if os.path.exists(path):
+            os.remove(path)
+
+
+if __name__ == "__main__":
+    main()